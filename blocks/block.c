@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "libp2p/crypto/sha256.h"
+#include "varint.h"
 #include "ipfs/blocks/block.h"
 #include "ipfs/cid/cid.h"
 
@@ -57,9 +58,10 @@ int ipfs_blocks_block_protobuf_encode(const struct Block* block, unsigned char*
  * @param buffer the buffer to pull from
  * @param buffer_length the length of the buffer
  * @param block the block to fill
+ * @param borrow true(1) to point the data into the buffer, false(0) to copy it
  * @returns true(1) on success
  */
-int ipfs_blocks_block_protobuf_decode(const unsigned char* buffer, const size_t buffer_length, struct Block** block) {
+int ipfs_blocks_block_protobuf_decode_internal(const unsigned char* buffer, const size_t buffer_length, struct Block** block, int borrow) {
 	size_t pos = 0;
 	int retVal = 0;
 	unsigned char* temp_buffer = NULL;
@@ -79,6 +81,16 @@ int ipfs_blocks_block_protobuf_decode(const unsigned char* buffer, const size_t
 		pos += bytes_read;
 		switch(field_no) {
 			case (1): // data
+				if (borrow) {
+					// point into the buffer rather than copying it
+					size_t data_length = varint_decode(&buffer[pos], buffer_length - pos, &bytes_read);
+					if (bytes_read == 0 || data_length > buffer_length - pos - bytes_read)
+						goto exit;
+					(*block)->data = (unsigned char*)&buffer[pos + bytes_read];
+					(*block)->data_length = data_length;
+					pos += bytes_read + data_length;
+					break;
+				}
 				if (protobuf_decode_length_delimited(&buffer[pos], buffer_length - pos, (char**)&((*block)->data), &((*block)->data_length), &bytes_read) == 0)
 					goto exit;
 				pos += bytes_read;
@@ -99,6 +111,9 @@ int ipfs_blocks_block_protobuf_decode(const unsigned char* buffer, const size_t
 
 exit:
 	if (retVal == 0) {
+		// what was borrowed is not the block's to free
+		if (borrow && *block != NULL)
+			(*block)->data = NULL;
 		ipfs_block_free(*block);
 	}
 	if (temp_buffer != NULL)
@@ -107,6 +122,30 @@ exit:
 	return retVal;
 }
 
+/***
+ * Decode from a protobuf stream into a Block struct
+ * @param buffer the buffer to pull from
+ * @param buffer_length the length of the buffer
+ * @param block the block to fill
+ * @returns true(1) on success
+ */
+int ipfs_blocks_block_protobuf_decode(const unsigned char* buffer, const size_t buffer_length, struct Block** block) {
+	return ipfs_blocks_block_protobuf_decode_internal(buffer, buffer_length, block, 0);
+}
+
+/***
+ * Decode from a protobuf stream into a Block struct, with the data of the block
+ * pointing into the buffer rather than copied
+ * NOTE: the buffer must outlive the block. Set the view of the block to free them together.
+ * @param buffer the buffer to pull from
+ * @param buffer_length the length of the buffer
+ * @param block the block to fill
+ * @returns true(1) on success
+ */
+int ipfs_blocks_block_protobuf_decode_view(const unsigned char* buffer, const size_t buffer_length, struct Block** block) {
+	return ipfs_blocks_block_protobuf_decode_internal(buffer, buffer_length, block, 1);
+}
+
 
 /***
  * Create a new block based on the incoming data
@@ -121,8 +160,10 @@ struct Block* ipfs_block_new() {
 	struct Block* block = (struct Block*)malloc(sizeof(struct Block));
 	if ( block == NULL)
 		return 0;
+	block->cid = NULL;
 	block->data = NULL;
 	block->data_length = 0;
+	block->view = NULL;
 
 	return block;
 }
@@ -159,8 +200,12 @@ int ipfs_blocks_block_add_data(const unsigned char* data, size_t data_size, stru
 int ipfs_block_free(struct Block* block) {
 	if (block != NULL) {
 		ipfs_cid_free(block->cid);
-		if (block->data != NULL)
+		if (block->view != NULL) {
+			ipfs_block_view_release(block->view);
+			free(block->view);
+		} else if (block->data != NULL) {
 			free(block->data);
+		}
 		free(block);
 	}
 	return 1;
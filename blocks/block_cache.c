@@ -0,0 +1,413 @@
+/***
+ * Keeps the bytes of recently read blocks in memory. See block_cache.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipfs/blocks/block_cache.h"
+
+// the list an entry is in
+#define BLOCK_CACHE_IN_FIFO 1
+#define BLOCK_CACHE_IN_LRU 2
+#define BLOCK_CACHE_IN_GHOSTS 3
+
+// a shard always remembers at least this many keys pushed out of its fifo
+#define BLOCK_CACHE_MIN_GHOSTS 16
+
+struct BlockCacheEntry {
+	char* key;
+	uint32_t hash;
+	unsigned char* bytes; // NULL for a ghost
+	size_t bytes_size;
+	int list;
+	struct BlockCacheEntry* prev; // toward the head of the list
+	struct BlockCacheEntry* next; // toward the tail of the list
+	struct BlockCacheEntry* chain; // the next entry in the bucket
+};
+
+/***
+ * Hash a key (FNV-1a)
+ * @param key the key
+ * @returns the hash
+ */
+uint32_t ipfs_block_cache_hash(const char* key) {
+	uint32_t hash = 2166136261u;
+	for(const unsigned char* c = (const unsigned char*)key; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/***
+ * Create a new BlockCache
+ * @param max_bytes the most bytes of blocks to keep (more than 0)
+ * @returns the BlockCache, or NULL on error
+ */
+struct BlockCache* ipfs_block_cache_new(size_t max_bytes) {
+	if (max_bytes == 0)
+		return NULL;
+	struct BlockCache* cache = (struct BlockCache*)malloc(sizeof(struct BlockCache));
+	if (cache == NULL)
+		return NULL;
+	cache->max_bytes = max_bytes;
+	for(int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+		struct BlockCacheShard* shard = &cache->shards[i];
+		shard->bucket_count = 64;
+		shard->buckets = (struct BlockCacheEntry**)calloc(shard->bucket_count, sizeof(struct BlockCacheEntry*));
+		if (shard->buckets == NULL) {
+			for(int j = 0; j < i; j++) {
+				free(cache->shards[j].buckets);
+				pthread_mutex_destroy(&cache->shards[j].lock);
+			}
+			free(cache);
+			return NULL;
+		}
+		shard->entry_count = 0;
+		shard->max_bytes = max_bytes / BLOCK_CACHE_SHARDS;
+		if (shard->max_bytes == 0)
+			shard->max_bytes = 1;
+		memset(&shard->fifo, 0, sizeof(struct BlockCacheList));
+		memset(&shard->lru, 0, sizeof(struct BlockCacheList));
+		memset(&shard->ghosts, 0, sizeof(struct BlockCacheList));
+		shard->hits = 0;
+		shard->misses = 0;
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+	return cache;
+}
+
+/***
+ * Free the resources of a BlockCache
+ * @param cache the BlockCache
+ * @returns true(1)
+ */
+int ipfs_block_cache_free(struct BlockCache* cache) {
+	if (cache != NULL) {
+		for(int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+			struct BlockCacheShard* shard = &cache->shards[i];
+			for(size_t j = 0; j < shard->bucket_count; j++) {
+				struct BlockCacheEntry* entry = shard->buckets[j];
+				while (entry != NULL) {
+					struct BlockCacheEntry* next = entry->chain;
+					free(entry->key);
+					free(entry->bytes);
+					free(entry);
+					entry = next;
+				}
+			}
+			free(shard->buckets);
+			pthread_mutex_destroy(&shard->lock);
+		}
+		free(cache);
+	}
+	return 1;
+}
+
+/***
+ * The list an entry is in
+ * @param shard the shard
+ * @param entry the entry
+ * @returns the list
+ */
+struct BlockCacheList* ipfs_block_cache_list(struct BlockCacheShard* shard, const struct BlockCacheEntry* entry) {
+	if (entry->list == BLOCK_CACHE_IN_FIFO)
+		return &shard->fifo;
+	if (entry->list == BLOCK_CACHE_IN_LRU)
+		return &shard->lru;
+	return &shard->ghosts;
+}
+
+/***
+ * Put an entry at the head of a list
+ * @param shard the shard
+ * @param entry the entry
+ * @param list BLOCK_CACHE_IN_FIFO, BLOCK_CACHE_IN_LRU or BLOCK_CACHE_IN_GHOSTS
+ */
+void ipfs_block_cache_list_push(struct BlockCacheShard* shard, struct BlockCacheEntry* entry, int list) {
+	entry->list = list;
+	struct BlockCacheList* to = ipfs_block_cache_list(shard, entry);
+	entry->prev = NULL;
+	entry->next = to->head;
+	if (to->head != NULL)
+		to->head->prev = entry;
+	to->head = entry;
+	if (to->tail == NULL)
+		to->tail = entry;
+	to->bytes += entry->bytes_size;
+	to->count++;
+}
+
+/***
+ * Take an entry out of its list
+ * @param shard the shard
+ * @param entry the entry
+ */
+void ipfs_block_cache_list_unlink(struct BlockCacheShard* shard, struct BlockCacheEntry* entry) {
+	struct BlockCacheList* from = ipfs_block_cache_list(shard, entry);
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		from->head = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		from->tail = entry->prev;
+	from->bytes -= entry->bytes_size;
+	from->count--;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+/***
+ * Find the entry of a key
+ * NOTE: the lock must be held
+ * @param shard the shard
+ * @param key the key
+ * @param hash the hash of the key
+ * @returns the entry, or NULL
+ */
+struct BlockCacheEntry* ipfs_block_cache_find(struct BlockCacheShard* shard, const char* key, uint32_t hash) {
+	struct BlockCacheEntry* entry = shard->buckets[(hash >> 4) & (shard->bucket_count - 1)];
+	while (entry != NULL) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+			return entry;
+		entry = entry->chain;
+	}
+	return NULL;
+}
+
+/***
+ * Take an entry out of its list and the table, and free it
+ * NOTE: the lock must be held
+ * @param shard the shard
+ * @param entry the entry
+ */
+void ipfs_block_cache_drop(struct BlockCacheShard* shard, struct BlockCacheEntry* entry) {
+	ipfs_block_cache_list_unlink(shard, entry);
+	struct BlockCacheEntry** current = &shard->buckets[(entry->hash >> 4) & (shard->bucket_count - 1)];
+	while (*current != entry)
+		current = &(*current)->chain;
+	*current = entry->chain;
+	shard->entry_count--;
+	free(entry->key);
+	free(entry->bytes);
+	free(entry);
+}
+
+/***
+ * Add an entry to the table, making the table bigger if it is getting full
+ * NOTE: the lock must be held
+ * @param shard the shard
+ * @param entry the entry
+ */
+void ipfs_block_cache_insert(struct BlockCacheShard* shard, struct BlockCacheEntry* entry) {
+	if (shard->entry_count >= shard->bucket_count) {
+		size_t bucket_count = shard->bucket_count * 2;
+		struct BlockCacheEntry** buckets = (struct BlockCacheEntry**)calloc(bucket_count, sizeof(struct BlockCacheEntry*));
+		// if there is no memory, the chains just get longer
+		if (buckets != NULL) {
+			for(size_t i = 0; i < shard->bucket_count; i++) {
+				struct BlockCacheEntry* current = shard->buckets[i];
+				while (current != NULL) {
+					struct BlockCacheEntry* next = current->chain;
+					size_t bucket = (current->hash >> 4) & (bucket_count - 1);
+					current->chain = buckets[bucket];
+					buckets[bucket] = current;
+					current = next;
+				}
+			}
+			free(shard->buckets);
+			shard->buckets = buckets;
+			shard->bucket_count = bucket_count;
+		}
+	}
+	size_t bucket = (entry->hash >> 4) & (shard->bucket_count - 1);
+	entry->chain = shard->buckets[bucket];
+	shard->buckets[bucket] = entry;
+	shard->entry_count++;
+}
+
+/***
+ * Push blocks out until the shard fits in its bytes. Blocks seen once leave the fifo
+ * and are remembered as ghosts, the rest leave the lru.
+ * NOTE: the lock must be held
+ * @param shard the shard
+ */
+void ipfs_block_cache_evict(struct BlockCacheShard* shard) {
+	size_t fifo_max = shard->max_bytes / 100 * BLOCK_CACHE_FIFO_PERCENT;
+	while (shard->fifo.bytes + shard->lru.bytes > shard->max_bytes) {
+		if (shard->fifo.tail != NULL && (shard->fifo.bytes > fifo_max || shard->lru.tail == NULL)) {
+			struct BlockCacheEntry* entry = shard->fifo.tail;
+			ipfs_block_cache_list_unlink(shard, entry);
+			free(entry->bytes);
+			entry->bytes = NULL;
+			entry->bytes_size = 0;
+			ipfs_block_cache_list_push(shard, entry, BLOCK_CACHE_IN_GHOSTS);
+		} else {
+			ipfs_block_cache_drop(shard, shard->lru.tail);
+		}
+	}
+	size_t max_ghosts = shard->fifo.count + shard->lru.count;
+	if (max_ghosts < BLOCK_CACHE_MIN_GHOSTS)
+		max_ghosts = BLOCK_CACHE_MIN_GHOSTS;
+	while (shard->ghosts.count > max_ghosts)
+		ipfs_block_cache_drop(shard, shard->ghosts.tail);
+}
+
+/***
+ * Get a copy of the bytes of a block
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @param bytes where to put the copy
+ * @param bytes_size the number of bytes
+ * @returns true(1) if the block was in the cache
+ */
+int ipfs_block_cache_get(struct BlockCache* cache, const char* key, unsigned char** bytes, size_t* bytes_size) {
+	int retVal = 0;
+	uint32_t hash = ipfs_block_cache_hash(key);
+	struct BlockCacheShard* shard = &cache->shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+	*bytes = NULL;
+	*bytes_size = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	struct BlockCacheEntry* entry = ipfs_block_cache_find(shard, key, hash);
+	if (entry != NULL && entry->list != BLOCK_CACHE_IN_GHOSTS) {
+		// malloc(0) may return NULL, so always ask for at least a byte
+		*bytes = (unsigned char*)malloc(entry->bytes_size + 1);
+		if (*bytes != NULL) {
+			memcpy(*bytes, entry->bytes, entry->bytes_size);
+			*bytes_size = entry->bytes_size;
+			retVal = 1;
+			// a hit in the fifo does not count as being used again, or a scan would fill the lru
+			if (entry->list == BLOCK_CACHE_IN_LRU) {
+				ipfs_block_cache_list_unlink(shard, entry);
+				ipfs_block_cache_list_push(shard, entry, BLOCK_CACHE_IN_LRU);
+			}
+		}
+	}
+	if (retVal)
+		shard->hits++;
+	else
+		shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+	return retVal;
+}
+
+/***
+ * Find out if the bytes of a block are in the cache, without counting it as a read
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @returns true(1) if the block is in the cache
+ */
+int ipfs_block_cache_has(struct BlockCache* cache, const char* key) {
+	uint32_t hash = ipfs_block_cache_hash(key);
+	struct BlockCacheShard* shard = &cache->shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+	pthread_mutex_lock(&shard->lock);
+	struct BlockCacheEntry* entry = ipfs_block_cache_find(shard, key, hash);
+	int retVal = (entry != NULL && entry->list != BLOCK_CACHE_IN_GHOSTS);
+	pthread_mutex_unlock(&shard->lock);
+	return retVal;
+}
+
+/***
+ * Keep the bytes of a block that was read from the disk
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @param bytes the bytes (they are copied)
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success, false(0) if the block is too big to keep
+ */
+int ipfs_block_cache_put(struct BlockCache* cache, const char* key, const unsigned char* bytes, size_t bytes_size) {
+	int retVal = 0;
+	uint32_t hash = ipfs_block_cache_hash(key);
+	struct BlockCacheShard* shard = &cache->shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+	if (bytes_size > shard->max_bytes)
+		return 0;
+	unsigned char* copy = (unsigned char*)malloc(bytes_size + 1);
+	if (copy == NULL)
+		return 0;
+	memcpy(copy, bytes, bytes_size);
+
+	pthread_mutex_lock(&shard->lock);
+	struct BlockCacheEntry* entry = ipfs_block_cache_find(shard, key, hash);
+	if (entry != NULL && entry->list != BLOCK_CACHE_IN_GHOSTS) {
+		// already here, and the key says what is in it
+		free(copy);
+		retVal = 1;
+	} else if (entry != NULL) {
+		// read again after it left the fifo, so it is used more than once
+		ipfs_block_cache_list_unlink(shard, entry);
+		entry->bytes = copy;
+		entry->bytes_size = bytes_size;
+		ipfs_block_cache_list_push(shard, entry, BLOCK_CACHE_IN_LRU);
+		ipfs_block_cache_evict(shard);
+		retVal = 1;
+	} else {
+		entry = (struct BlockCacheEntry*)malloc(sizeof(struct BlockCacheEntry));
+		if (entry != NULL) {
+			entry->key = (char*)malloc(strlen(key) + 1);
+			if (entry->key == NULL) {
+				free(entry);
+				entry = NULL;
+			}
+		}
+		if (entry == NULL) {
+			free(copy);
+		} else {
+			strcpy(entry->key, key);
+			entry->hash = hash;
+			entry->bytes = copy;
+			entry->bytes_size = bytes_size;
+			ipfs_block_cache_insert(shard, entry);
+			ipfs_block_cache_list_push(shard, entry, BLOCK_CACHE_IN_FIFO);
+			ipfs_block_cache_evict(shard);
+			retVal = 1;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return retVal;
+}
+
+/***
+ * Forget a block
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_block_cache_remove(struct BlockCache* cache, const char* key) {
+	uint32_t hash = ipfs_block_cache_hash(key);
+	struct BlockCacheShard* shard = &cache->shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+	pthread_mutex_lock(&shard->lock);
+	struct BlockCacheEntry* entry = ipfs_block_cache_find(shard, key, hash);
+	if (entry != NULL)
+		ipfs_block_cache_drop(shard, entry);
+	pthread_mutex_unlock(&shard->lock);
+	return 1;
+}
+
+/***
+ * How well the cache is doing
+ * @param cache the BlockCache
+ * @param hits the reads that were in the cache
+ * @param misses the reads that were not
+ * @param bytes the bytes of blocks in the cache (can be NULL)
+ * @returns true(1)
+ */
+int ipfs_block_cache_stats(struct BlockCache* cache, unsigned long long* hits, unsigned long long* misses, size_t* bytes) {
+	*hits = 0;
+	*misses = 0;
+	if (bytes != NULL)
+		*bytes = 0;
+	for(int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+		struct BlockCacheShard* shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		*hits += shard->hits;
+		*misses += shard->misses;
+		if (bytes != NULL)
+			*bytes += shard->fifo.bytes + shard->lru.bytes;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return 1;
+}
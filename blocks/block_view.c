@@ -0,0 +1,98 @@
+/***
+ * Looking at the bytes of a block in place. See block_view.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include "ipfs/blocks/block_view.h"
+
+/***
+ * Read part of a file into memory
+ * @param fd the file
+ * @param offset where the block starts in the file
+ * @param size the size of the block
+ * @param view where to put the results
+ * @returns true(1) on success
+ */
+int ipfs_block_view_read(int fd, uint64_t offset, size_t size, struct BlockView* view) {
+	// malloc(0) may return NULL, so always ask for at least a byte
+	unsigned char* bytes = (unsigned char*)malloc(size + 1);
+	if (bytes == NULL)
+		return 0;
+	size_t pos = 0;
+	while (pos < size) {
+		ssize_t bytes_read = pread(fd, &bytes[pos], size - pos, offset + pos);
+		if (bytes_read <= 0) {
+			free(bytes);
+			return 0;
+		}
+		pos += bytes_read;
+	}
+	return ipfs_block_view_take(bytes, size, view);
+}
+
+/***
+ * Look at part of a file. It is mapped if it is large enough, otherwise read.
+ * @param fd the file
+ * @param offset where the block starts in the file
+ * @param size the size of the block
+ * @param view where to put the results
+ * @returns true(1) on success. Only call ipfs_block_view_release on success.
+ */
+int ipfs_block_view_load(int fd, uint64_t offset, size_t size, struct BlockView* view) {
+	memset(view, 0, sizeof(struct BlockView));
+#ifndef __MINGW32__
+	if (size >= BLOCK_VIEW_MAP_MIN) {
+		// a mapping starts on a page
+		uint64_t page_size = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset - (offset % page_size);
+		size_t mapping_size = size + (offset - start);
+		void* mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, start);
+		if (mapping != MAP_FAILED) {
+			// large blocks are read from start to end, to be sent somewhere
+			madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+			view->mapping = mapping;
+			view->mapping_size = mapping_size;
+			view->data = (unsigned char*)mapping + (offset - start);
+			view->size = size;
+			return 1;
+		}
+	}
+#endif
+	return ipfs_block_view_read(fd, offset, size, view);
+}
+
+/***
+ * Look at bytes that were already read into memory
+ * @param bytes the bytes. The view now owns them, and they are freed on release
+ * @param size the number of bytes
+ * @param view where to put the results
+ * @returns true(1)
+ */
+int ipfs_block_view_take(unsigned char* bytes, size_t size, struct BlockView* view) {
+	view->data = bytes;
+	view->size = size;
+	view->mapping = NULL;
+	view->mapping_size = 0;
+	return 1;
+}
+
+/***
+ * Release a view. The data is no longer valid after this.
+ * @param view the view
+ * @returns true(1)
+ */
+int ipfs_block_view_release(struct BlockView* view) {
+#ifndef __MINGW32__
+	if (view->mapping != NULL)
+		munmap(view->mapping, view->mapping_size);
+	else
+#endif
+		free(view->data);
+	memset(view, 0, sizeof(struct BlockView));
+	return 1;
+}
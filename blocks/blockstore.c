@@ -1,12 +1,20 @@
 /***
  * a thin wrapper over a datastore for getting and putting block objects
  */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "libp2p/crypto/encoding/base32.h"
 #include "ipfs/cid/cid.h"
 #include "ipfs/blocks/block.h"
 #include "ipfs/blocks/blockstore.h"
 #include "ipfs/datastore/ds_helper.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
+#include "ipfs/flatfs/flatfs.h"
 #include "libp2p/os/utils.h"
 
 
@@ -26,6 +34,7 @@ struct Blockstore* ipfs_blockstore_new(const struct FSRepo* fs_repo) {
 		blockstore->blockstoreContext->fs_repo = fs_repo;
 		blockstore->Delete = ipfs_blockstore_delete;
 		blockstore->Get = ipfs_blockstore_get;
+		blockstore->GetView = ipfs_blockstore_get_view;
 		blockstore->Has = ipfs_blockstore_has;
 		blockstore->Put = ipfs_blockstore_put;
 	}
@@ -46,24 +55,6 @@ int ipfs_blockstore_free(struct Blockstore* blockstore) {
 	return 1;
 }
 
-/**
- * Delete a block based on its Cid
- * @param cid the Cid to look for
- * @param returns true(1) on success
- */
-int ipfs_blockstore_delete(const struct BlockstoreContext* context, struct Cid* cid) {
-	return 0;
-}
-
-/***
- * Determine if the Cid can be found
- * @param cid the Cid to look for
- * @returns true(1) if found
- */
-int ipfs_blockstore_has(const struct BlockstoreContext* context, struct Cid* cid) {
-	return 0;
-}
-
 unsigned char* ipfs_blockstore_cid_to_base32(const struct Cid* cid) {
 	size_t key_length = libp2p_crypto_encoding_base32_encode_size(cid->hash_length);
 	unsigned char* buffer = (unsigned char*)malloc(key_length + 1);
@@ -92,56 +83,337 @@ unsigned char* ipfs_blockstore_hash_to_base32(const unsigned char* hash, size_t
 	return buffer;
 }
 
+/***
+ * Get the full path of a file in the blockstore, taking the shard function into account
+ * NOTE: This allocates memory that must be freed
+ * @param fs_repo the repo
+ * @param filename the key (base32 multihash)
+ * @returns the full path, or NULL on error
+ */
 char* ipfs_blockstore_path_get(const struct FSRepo* fs_repo, const char* filename) {
 	int filepath_size = strlen(fs_repo->path) +  12;
 	char filepath[filepath_size];
 	int retVal = os_utils_filepath_join(fs_repo->path, "blockstore", filepath, filepath_size);
 	if (retVal == 0) {
-		free(filepath);
-		return 0;
+		return NULL;
 	}
-	int complete_filename_size = strlen(filepath) + strlen(filename) + 2;
+	// directory, 2 slashes, ".data" and the terminating null
+	int complete_filename_size = strlen(filepath) + strlen(filename) + FLATFS_MAX_PREFIX_LENGTH + 8;
 	char* complete_filename = (char*)malloc(complete_filename_size);
-	retVal = os_utils_filepath_join(filepath, filename, complete_filename, complete_filename_size);
+	if (complete_filename == NULL)
+		return NULL;
+	retVal = ipfs_flatfs_get_sharded_full_filename(filepath, &fs_repo->blockstore_shard, filename, complete_filename, complete_filename_size);
+	if (retVal == 0) {
+		free(complete_filename);
+		return NULL;
+	}
 	return complete_filename;
 }
 
 /***
- * Find a block based on its Cid
- * @param cid the Cid to look for
- * @param block where to put the data to be returned
+ * Get the full path of a file in the blockstore, creating its shard directory if needed
+ * NOTE: This allocates memory that must be freed
+ * @param fs_repo the repo
+ * @param filename the key (base32 multihash)
+ * @returns the full path, or NULL on error
+ */
+char* ipfs_blockstore_path_create(const struct FSRepo* fs_repo, const char* filename) {
+	if (fs_repo->blockstore_shard.type != FLATFS_SHARD_NONE) {
+		int filepath_size = strlen(fs_repo->path) +  12;
+		char filepath[filepath_size];
+		if (!os_utils_filepath_join(fs_repo->path, "blockstore", filepath, filepath_size))
+			return NULL;
+		int directory_size = filepath_size + FLATFS_MAX_PREFIX_LENGTH + 2;
+		char directory[directory_size];
+		if (!ipfs_flatfs_get_sharded_directory(filepath, &fs_repo->blockstore_shard, filename, directory, directory_size))
+			return NULL;
+		if (!ipfs_flatfs_create_directory(directory))
+			return NULL;
+	}
+	return ipfs_blockstore_path_get(fs_repo, filename);
+}
+
+/***
+ * Write bytes to the file of a key in the blockstore
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param bytes the bytes to write
+ * @param bytes_size the number of bytes
+ * @param bytes_written the number of bytes written (can be NULL)
  * @returns true(1) on success
  */
-int ipfs_blockstore_get(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block) {
+int ipfs_blockstore_write_file(const struct FSRepo* fs_repo, const char* key, const unsigned char* bytes, size_t bytes_size, size_t* bytes_written) {
+	// the node and the UnixFS of a hash are written to the same key, so what is cached may be stale
+	if (fs_repo->block_cache != NULL)
+		ipfs_block_cache_remove(fs_repo->block_cache, key);
+	if (fs_repo->pack_store != NULL) {
+		if (fs_repo->blockstore_filter != NULL)
+			ipfs_blockstore_filter_add(fs_repo->blockstore_filter, key);
+		int retVal = ipfs_pack_store_put(fs_repo->pack_store, key, bytes, bytes_size);
+		if (retVal && fs_repo->blockstore_filter != NULL)
+			ipfs_blockstore_filter_log_add(fs_repo->blockstore_filter, key);
+		if (bytes_written != NULL)
+			*bytes_written = (retVal ? bytes_size : 0);
+		return retVal;
+	}
+	char* filename = ipfs_blockstore_path_create(fs_repo, key);
+	if (filename == NULL)
+		return 0;
+	// the block is written beside the old file, then renamed over it. A crash leaves one or
+	// the other, never part of one, and a reader with the old file mapped keeps it.
+	size_t temporary_length = strlen(filename) + 12;
+	char temporary[temporary_length];
+	snprintf(temporary, temporary_length, "%s.XXXXXX.tmp", filename);
+	int fd = mkstemps(temporary, 4);
+	if (fd < 0) {
+		free(filename);
+		return 0;
+	}
+	// before the file is there, so Has never says no to a block that can be read
+	if (fs_repo->blockstore_filter != NULL)
+		ipfs_blockstore_filter_add(fs_repo->blockstore_filter, key);
+	size_t written = 0;
+	while (written < bytes_size) {
+		ssize_t result = write(fd, &bytes[written], bytes_size - written);
+		if (result <= 0)
+			break;
+		written += result;
+	}
 	int retVal = 0;
-	// get datastore key, which is a base32 key of the multihash
-	unsigned char* key = ipfs_blockstore_hash_to_base32(cid->hash, cid->hash_length);
+	if (written == bytes_size) {
+		// this returns once the block is on the disk, so it can be indexed
+		retVal = ipfs_blockstore_sync_commit(fs_repo->blockstore_sync, fd, temporary, filename);
+		// so the other processes that have the repo open know it is there
+		if (retVal && fs_repo->blockstore_filter != NULL)
+			ipfs_blockstore_filter_log_add(fs_repo->blockstore_filter, key);
+	} else {
+		close(fd);
+		unlink(temporary);
+	}
+	free(filename);
+	if (bytes_written != NULL)
+		*bytes_written = (retVal ? written : 0);
+	return retVal;
+}
 
-	char* filename = ipfs_blockstore_path_get(context->fs_repo, (char*)key);
+/***
+ * Read the file of a key in the blockstore
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param bytes where to put the contents
+ * @param bytes_size the number of bytes read
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_read_file(const struct FSRepo* fs_repo, const char* key, unsigned char** bytes, size_t* bytes_size) {
+	int retVal = 0;
+	FILE* file = NULL;
+	*bytes = NULL;
+	*bytes_size = 0;
 
-	size_t file_size = os_utils_file_size(filename);
-	unsigned char buffer[file_size];
+	// most of the blocks peers ask for are not here. Another process may have written it, though.
+	if (fs_repo->blockstore_filter != NULL && !ipfs_blockstore_filter_contains_logged(fs_repo->blockstore_filter, key))
+		return 0;
+	if (fs_repo->block_cache != NULL && ipfs_block_cache_get(fs_repo->block_cache, key, bytes, bytes_size))
+		return 1;
+	// blocks written before the repo was switched to packs are still in their own files
+	if (fs_repo->pack_store != NULL && ipfs_pack_store_get(fs_repo->pack_store, key, bytes, bytes_size)) {
+		if (fs_repo->block_cache != NULL)
+			ipfs_block_cache_put(fs_repo->block_cache, key, *bytes, *bytes_size);
+		return 1;
+	}
 
-	FILE* file = fopen(filename, "rb");
+	char* filename = ipfs_blockstore_path_get(fs_repo, key);
+	if (filename == NULL)
+		goto exit;
+	file = fopen(filename, "rb");
 	if (file == NULL)
 		goto exit;
-
-	size_t bytes_read = fread(buffer, 1, file_size, file);
-	fclose(file);
-
-	if (!ipfs_blocks_block_protobuf_decode(buffer, bytes_read, block))
+	size_t file_size = os_utils_file_size(filename);
+	// malloc(0) may return NULL, so always ask for at least a byte
+	*bytes = (unsigned char*)malloc(file_size + 1);
+	if (*bytes == NULL)
 		goto exit;
-
-	(*block)->cid = ipfs_cid_copy(cid);
+	*bytes_size = fread(*bytes, 1, file_size, file);
+	if (*bytes_size != file_size)
+		goto exit;
+	if (fs_repo->block_cache != NULL)
+		ipfs_block_cache_put(fs_repo->block_cache, key, *bytes, *bytes_size);
 
 	retVal = 1;
 	exit:
+	if (file != NULL)
+		fclose(file);
+	if (filename != NULL)
+		free(filename);
+	if (retVal == 0 && *bytes != NULL) {
+		free(*bytes);
+		*bytes = NULL;
+		*bytes_size = 0;
+	}
+	return retVal;
+}
+
+/***
+ * Look at the file of a key in the blockstore. Large blocks are not copied.
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param view where to put the results
+ * @returns true(1) on success. Only call ipfs_block_view_release on success.
+ */
+int ipfs_blockstore_read_view(const struct FSRepo* fs_repo, const char* key, struct BlockView* view) {
+	unsigned char* bytes = NULL;
+	size_t bytes_size = 0;
+
+	if (fs_repo->blockstore_filter != NULL && !ipfs_blockstore_filter_contains_logged(fs_repo->blockstore_filter, key))
+		return 0;
+	if (fs_repo->block_cache != NULL && ipfs_block_cache_get(fs_repo->block_cache, key, &bytes, &bytes_size))
+		return ipfs_block_view_take(bytes, bytes_size, view);
+	int retVal = 0;
+	if (fs_repo->pack_store != NULL)
+		retVal = ipfs_pack_store_get_view(fs_repo->pack_store, key, view);
+	if (!retVal) {
+		char* filename = ipfs_blockstore_path_get(fs_repo, key);
+		if (filename == NULL)
+			return 0;
+		int fd = open(filename, O_RDONLY);
+		free(filename);
+		if (fd < 0)
+			return 0;
+		struct stat file_stat;
+		retVal = (fstat(fd, &file_stat) == 0 && ipfs_block_view_load(fd, 0, file_stat.st_size, view));
+		// a mapping does not need the file to stay open
+		close(fd);
+	}
+	// mapped blocks are in the page cache already
+	if (retVal && view->mapping == NULL && fs_repo->block_cache != NULL)
+		ipfs_block_cache_put(fs_repo->block_cache, key, view->data, view->size);
+	return retVal;
+}
+
+/**
+ * Delete a block based on its Cid
+ * @param cid the Cid to look for
+ * @param returns true(1) on success
+ */
+int ipfs_blockstore_delete(const struct BlockstoreContext* context, struct Cid* cid) {
+	unsigned char* key = ipfs_blockstore_hash_to_base32(cid->hash, cid->hash_length);
+	if (key == NULL)
+		return 0;
+	if (context->fs_repo->block_cache != NULL)
+		ipfs_block_cache_remove(context->fs_repo->block_cache, (char*)key);
+	int retVal = 0;
+	if (context->fs_repo->pack_store != NULL)
+		retVal = ipfs_pack_store_delete(context->fs_repo->pack_store, (char*)key);
+	char* filename = ipfs_blockstore_path_get(context->fs_repo, (char*)key);
+	if (filename != NULL) {
+		if (unlink(filename) == 0)
+			retVal = 1;
+		free(filename);
+	}
+	// only what was there comes out of the filter. What another process wrote was never put in.
+	if (retVal && context->fs_repo->blockstore_filter != NULL && !ipfs_repo_fsrepo_shared(context->fs_repo))
+		ipfs_blockstore_filter_remove(context->fs_repo->blockstore_filter, (char*)key);
 	free(key);
-	free(filename);
+	return retVal;
+}
 
+/***
+ * Determine if the Cid can be found
+ * @param cid the Cid to look for
+ * @returns true(1) if found
+ */
+int ipfs_blockstore_has(const struct BlockstoreContext* context, struct Cid* cid) {
+	unsigned char* key = ipfs_blockstore_hash_to_base32(cid->hash, cid->hash_length);
+	if (key == NULL)
+		return 0;
+	int retVal = 0;
+	if (context->fs_repo->blockstore_filter != NULL && !ipfs_blockstore_filter_contains_logged(context->fs_repo->blockstore_filter, (char*)key)) {
+		retVal = 0;
+	} else if (context->fs_repo->block_cache != NULL && ipfs_block_cache_has(context->fs_repo->block_cache, (char*)key)) {
+		retVal = 1;
+	} else if (context->fs_repo->pack_store != NULL && ipfs_pack_store_has(context->fs_repo->pack_store, (char*)key)) {
+		retVal = 1;
+	} else {
+		char* filename = ipfs_blockstore_path_get(context->fs_repo, (char*)key);
+		if (filename != NULL) {
+			struct stat file_stat;
+			retVal = (stat(filename, &file_stat) == 0);
+			free(filename);
+		}
+	}
+	free(key);
 	return retVal;
 }
 
+/***
+ * Find a block based on its Cid
+ * @param cid the Cid to look for
+ * @param block where to put the data to be returned
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_get(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block) {
+	struct BlockView view;
+	// get datastore key, which is a base32 key of the multihash
+	unsigned char* key = ipfs_blockstore_hash_to_base32(cid->hash, cid->hash_length);
+	if (key == NULL)
+		return 0;
+
+	// the decode copies the data, so the file does not have to be copied first
+	int retVal = ipfs_blockstore_read_view(context->fs_repo, (char*)key, &view);
+	free(key);
+	if (!retVal)
+		return 0;
+	retVal = ipfs_blocks_block_protobuf_decode(view.data, view.size, block);
+	ipfs_block_view_release(&view);
+	if (!retVal)
+		return 0;
+
+	(*block)->cid = ipfs_cid_copy(cid);
+	return 1;
+}
+
+/***
+ * Find a block based on its Cid, with its data in a view of the file rather than
+ * copied. Large blocks are mapped. Free it with ipfs_block_free, as usual.
+ * @param context the context
+ * @param cid the Cid to look for
+ * @param block where to put the block
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_get_view(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block) {
+	*block = NULL;
+	unsigned char* key = ipfs_blockstore_hash_to_base32(cid->hash, cid->hash_length);
+	if (key == NULL)
+		return 0;
+	struct BlockView* view = (struct BlockView*)malloc(sizeof(struct BlockView));
+	if (view == NULL) {
+		free(key);
+		return 0;
+	}
+	int retVal = ipfs_blockstore_read_view(context->fs_repo, (char*)key, view);
+	free(key);
+	if (!retVal) {
+		free(view);
+		return 0;
+	}
+	if (!ipfs_blocks_block_protobuf_decode_view(view->data, view->size, block)) {
+		*block = NULL;
+		ipfs_block_view_release(view);
+		free(view);
+		return 0;
+	}
+	// the block now lets go of the view when it is freed
+	(*block)->view = view;
+	(*block)->cid = ipfs_cid_copy(cid);
+	if ((*block)->cid == NULL) {
+		ipfs_block_free(*block);
+		*block = NULL;
+		return 0;
+	}
+	return 1;
+}
+
 /***
  * Put a block in the blockstore
  * @param block the block to store
@@ -150,47 +422,34 @@ int ipfs_blockstore_get(const struct BlockstoreContext* context, struct Cid* cid
 int ipfs_blockstore_put(const struct BlockstoreContext* context, struct Block* block) {
 	// from blockstore.go line 118
 	int retVal = 0;
+	unsigned char* protobuf = NULL;
 
 	// Get Datastore key, which is a base32 key of the multihash,
 	unsigned char* key = ipfs_blockstore_cid_to_base32(block->cid);
-	if (key == NULL) {
-		free(key);
+	if (key == NULL)
 		return 0;
-	}
-
-	//TODO: put this in subdirectories
 
 	// turn the block into a binary array
 	size_t protobuf_len = ipfs_blocks_block_protobuf_encode_size(block);
-	unsigned char protobuf[protobuf_len];
-	retVal = ipfs_blocks_block_protobuf_encode(block, protobuf, protobuf_len, &protobuf_len);
-	if (retVal == 0) {
-		free(key);
-		return 0;
-	}
+	protobuf = (unsigned char*)malloc(protobuf_len);
+	if (protobuf == NULL)
+		goto exit;
+	if (!ipfs_blocks_block_protobuf_encode(block, protobuf, protobuf_len, &protobuf_len))
+		goto exit;
 
 	// now write byte array to file
-	char* filename = ipfs_blockstore_path_get(context->fs_repo, (char*)key);
-	if (filename == NULL) {
-		free(key);
-		return 0;
-	}
-
-	FILE* file = fopen(filename, "wb");
-	int bytes_written = fwrite(protobuf, 1, protobuf_len, file);
-	fclose(file);
-	if (bytes_written != protobuf_len) {
-		free(key);
-		free(filename);
-		return 0;
-	}
+	if (!ipfs_blockstore_write_file(context->fs_repo, (char*)key, protobuf, protobuf_len, NULL))
+		goto exit;
 
 	// send to Put with key (this is now done separately)
 	//fs_repo->config->datastore->datastore_put(key, key_length, block->data, block->data_length, fs_repo->config->datastore);
 
+	retVal = 1;
+	exit:
 	free(key);
-	free(filename);
-	return 1;
+	if (protobuf != NULL)
+		free(protobuf);
+	return retVal;
 }
 
 /***
@@ -203,47 +462,31 @@ int ipfs_blockstore_put(const struct BlockstoreContext* context, struct Block* b
 int ipfs_blockstore_put_unixfs(const struct UnixFS* unix_fs, const struct FSRepo* fs_repo, size_t* bytes_written) {
 	// from blockstore.go line 118
 	int retVal = 0;
+	unsigned char* protobuf = NULL;
 
 	// Get Datastore key, which is a base32 key of the multihash,
 	unsigned char* key = ipfs_blockstore_hash_to_base32(unix_fs->hash, unix_fs->hash_length);
-	if (key == NULL) {
-		free(key);
+	if (key == NULL)
 		return 0;
-	}
-
-	//TODO: put this in subdirectories
 
 	// turn the block into a binary array
 	size_t protobuf_len = ipfs_unixfs_protobuf_encode_size(unix_fs);
-	unsigned char protobuf[protobuf_len];
-	retVal = ipfs_unixfs_protobuf_encode(unix_fs, protobuf, protobuf_len, &protobuf_len);
-	if (retVal == 0) {
-		free(key);
-		return 0;
-	}
+	protobuf = (unsigned char*)malloc(protobuf_len);
+	if (protobuf == NULL)
+		goto exit;
+	if (!ipfs_unixfs_protobuf_encode(unix_fs, protobuf, protobuf_len, &protobuf_len))
+		goto exit;
 
 	// now write byte array to file
-	char* filename = ipfs_blockstore_path_get(fs_repo, (char*)key);
-	if (filename == NULL) {
-		free(key);
-		return 0;
-	}
-
-	FILE* file = fopen(filename, "wb");
-	*bytes_written = fwrite(protobuf, 1, protobuf_len, file);
-	fclose(file);
-	if (*bytes_written != protobuf_len) {
-		free(key);
-		free(filename);
-		return 0;
-	}
-
-	// send to Put with key (this is now done separately)
-	//fs_repo->config->datastore->datastore_put(key, key_length, block->data, block->data_length, fs_repo->config->datastore);
+	if (!ipfs_blockstore_write_file(fs_repo, (char*)key, protobuf, protobuf_len, bytes_written))
+		goto exit;
 
+	retVal = 1;
+	exit:
 	free(key);
-	free(filename);
-	return 1;
+	if (protobuf != NULL)
+		free(protobuf);
+	return retVal;
 }
 
 /***
@@ -255,23 +498,20 @@ int ipfs_blockstore_put_unixfs(const struct UnixFS* unix_fs, const struct FSRepo
  * @returns true(1) on success
  */
 int ipfs_blockstore_get_unixfs(const unsigned char* hash, size_t hash_length, struct UnixFS** block, const struct FSRepo* fs_repo) {
+	struct BlockView view;
 	// get datastore key, which is a base32 key of the multihash
 	unsigned char* key = ipfs_blockstore_hash_to_base32(hash, hash_length);
+	if (key == NULL)
+		return 0;
 
-	char* filename = ipfs_blockstore_path_get(fs_repo, (char*)key);
-
-	size_t file_size = os_utils_file_size(filename);
-	unsigned char buffer[file_size];
-
-	FILE* file = fopen(filename, "rb");
-	size_t bytes_read = fread(buffer, 1, file_size, file);
-	fclose(file);
-
-	int retVal = ipfs_unixfs_protobuf_decode(buffer, bytes_read, block);
+	// the decode copies what it keeps, so the file does not have to be copied first
+	int retVal = ipfs_blockstore_read_view(fs_repo, (char*)key, &view);
+	if (retVal) {
+		retVal = ipfs_unixfs_protobuf_decode(view.data, view.size, block);
+		ipfs_block_view_release(&view);
+	}
 
 	free(key);
-	free(filename);
-
 	return retVal;
 }
 
@@ -285,44 +525,31 @@ int ipfs_blockstore_get_unixfs(const unsigned char* hash, size_t hash_length, st
 int ipfs_blockstore_put_node(const struct HashtableNode* node, const struct FSRepo* fs_repo, size_t* bytes_written) {
 	// from blockstore.go line 118
 	int retVal = 0;
+	unsigned char* protobuf = NULL;
 
 	// Get Datastore key, which is a base32 key of the multihash,
 	unsigned char* key = ipfs_blockstore_hash_to_base32(node->hash, node->hash_size);
-	if (key == NULL) {
-		free(key);
+	if (key == NULL)
 		return 0;
-	}
-
-	//TODO: put this in subdirectories
 
 	// turn the block into a binary array
 	size_t protobuf_len = ipfs_hashtable_node_protobuf_encode_size(node);
-	unsigned char protobuf[protobuf_len];
-	retVal = ipfs_hashtable_node_protobuf_encode(node, protobuf, protobuf_len, &protobuf_len);
-	if (retVal == 0) {
-		free(key);
-		return 0;
-	}
+	protobuf = (unsigned char*)malloc(protobuf_len);
+	if (protobuf == NULL)
+		goto exit;
+	if (!ipfs_hashtable_node_protobuf_encode(node, protobuf, protobuf_len, &protobuf_len))
+		goto exit;
 
 	// now write byte array to file
-	char* filename = ipfs_blockstore_path_get(fs_repo, (char*)key);
-	if (filename == NULL) {
-		free(key);
-		return 0;
-	}
-
-	FILE* file = fopen(filename, "wb");
-	*bytes_written = fwrite(protobuf, 1, protobuf_len, file);
-	fclose(file);
-	if (*bytes_written != protobuf_len) {
-		free(key);
-		free(filename);
-		return 0;
-	}
+	if (!ipfs_blockstore_write_file(fs_repo, (char*)key, protobuf, protobuf_len, bytes_written))
+		goto exit;
 
+	retVal = 1;
+	exit:
 	free(key);
-	free(filename);
-	return 1;
+	if (protobuf != NULL)
+		free(protobuf);
+	return retVal;
 }
 
 /***
@@ -334,23 +561,54 @@ int ipfs_blockstore_put_node(const struct HashtableNode* node, const struct FSRe
  * @returns true(1) on success
  */
 int ipfs_blockstore_get_node(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, const struct FSRepo* fs_repo) {
+	struct BlockView view;
 	// get datastore key, which is a base32 key of the multihash
 	unsigned char* key = ipfs_blockstore_hash_to_base32(hash, hash_length);
+	if (key == NULL)
+		return 0;
 
-	char* filename = ipfs_blockstore_path_get(fs_repo, (char*)key);
-
-	size_t file_size = os_utils_file_size(filename);
-	unsigned char buffer[file_size];
+	// the decode copies what it keeps, so the file does not have to be copied first
+	int retVal = ipfs_blockstore_read_view(fs_repo, (char*)key, &view);
+	if (retVal) {
+		retVal = ipfs_hashtable_node_protobuf_decode(view.data, view.size, node);
+		ipfs_block_view_release(&view);
+	}
 
-	FILE* file = fopen(filename, "rb");
-	size_t bytes_read = fread(buffer, 1, file_size, file);
-	fclose(file);
+	free(key);
+	return retVal;
+}
 
-	int retVal = ipfs_hashtable_node_protobuf_decode(buffer, bytes_read, node);
+/***
+ * Find a node based on its hash, with its data pointing into the block rather than copied
+ * NOTE: free the node with ipfs_hashtable_node_view_free, then release the view
+ * @param hash the hash to look for
+ * @param hash_length the length of the hash
+ * @param node where to put the node
+ * @param view where to put the block the node points into
+ * @param fs_repo where to look for the data
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_get_node_view(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, struct BlockView* view, const struct FSRepo* fs_repo) {
+	*node = NULL;
+	unsigned char* key = ipfs_blockstore_hash_to_base32(hash, hash_length);
+	if (key == NULL)
+		return 0;
 
+	int retVal = ipfs_blockstore_read_view(fs_repo, (char*)key, view);
 	free(key);
-	free(filename);
-
-	return retVal;
+	if (!retVal)
+		return 0;
+	if (!ipfs_hashtable_node_protobuf_decode_view(view->data, view->size, node)) {
+		*node = NULL;
+		ipfs_block_view_release(view);
+		return 0;
+	}
+	if (!ipfs_hashtable_node_set_hash(*node, hash, hash_length)) {
+		ipfs_hashtable_node_view_free(*node);
+		*node = NULL;
+		ipfs_block_view_release(view);
+		return 0;
+	}
+	return 1;
 }
 
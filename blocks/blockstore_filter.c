@@ -0,0 +1,363 @@
+/***
+ * A counting Bloom filter of the keys in the blockstore. See blockstore_filter.h
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libp2p/os/utils.h"
+#include "ipfs/blocks/blockstore_filter.h"
+#include "ipfs/flatfs/flatfs.h"
+
+// the first bytes of a saved filter
+#define BLOCKSTORE_FILTER_MAGIC "IPFSBF1\n"
+#define BLOCKSTORE_FILTER_MAGIC_LENGTH 8
+// how much of the log is read at a time. Each key is a line, far shorter than this.
+#define BLOCKSTORE_FILTER_LOG_CHUNK 4096
+
+/***
+ * Create a new, empty BlockstoreFilter
+ * @param size the number of counters (rounded up to a power of 2)
+ * @returns the BlockstoreFilter, or NULL on error
+ */
+struct BlockstoreFilter* ipfs_blockstore_filter_new(size_t size) {
+	struct BlockstoreFilter* filter = (struct BlockstoreFilter*)malloc(sizeof(struct BlockstoreFilter));
+	if (filter == NULL)
+		return NULL;
+	filter->size = 1024;
+	while (filter->size < size)
+		filter->size *= 2;
+	filter->counters = (unsigned char*)calloc(filter->size, 1);
+	if (filter->counters == NULL) {
+		free(filter);
+		return NULL;
+	}
+	pthread_mutex_init(&filter->lock, NULL);
+	pthread_mutex_init(&filter->log_lock, NULL);
+	filter->log_fd = -1;
+	filter->log_offset = 0;
+	return filter;
+}
+
+/***
+ * Free the resources of a BlockstoreFilter
+ * @param filter the BlockstoreFilter
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_free(struct BlockstoreFilter* filter) {
+	if (filter != NULL) {
+		free(filter->counters);
+		if (filter->log_fd >= 0)
+			close(filter->log_fd);
+		pthread_mutex_destroy(&filter->log_lock);
+		pthread_mutex_destroy(&filter->lock);
+		free(filter);
+	}
+	return 1;
+}
+
+/***
+ * Find the counters of a key
+ * @param filter the BlockstoreFilter
+ * @param key the key
+ * @param positions where to put the BLOCKSTORE_FILTER_PROBES positions
+ */
+void ipfs_blockstore_filter_positions(const struct BlockstoreFilter* filter, const char* key, size_t* positions) {
+	// FNV-1a, split in two for double hashing
+	uint64_t hash = 14695981039346656037ull;
+	for(const unsigned char* c = (const unsigned char*)key; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 1099511628211ull;
+	}
+	uint64_t first = hash & 0xffffffff;
+	uint64_t second = (hash >> 32) | 1;
+	for(int i = 0; i < BLOCKSTORE_FILTER_PROBES; i++)
+		positions[i] = (size_t)((first + i * second) & (filter->size - 1));
+}
+
+/***
+ * Record that a key is in the blockstore
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_add(struct BlockstoreFilter* filter, const char* key) {
+	size_t positions[BLOCKSTORE_FILTER_PROBES];
+	ipfs_blockstore_filter_positions(filter, key, positions);
+	pthread_mutex_lock(&filter->lock);
+	for(int i = 0; i < BLOCKSTORE_FILTER_PROBES; i++) {
+		if (filter->counters[positions[i]] < 255)
+			filter->counters[positions[i]]++;
+	}
+	pthread_mutex_unlock(&filter->lock);
+	return 1;
+}
+
+/***
+ * Record that a key is no longer in the blockstore
+ * NOTE: only call this for keys that were added, or keys that are there could be missed
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_remove(struct BlockstoreFilter* filter, const char* key) {
+	size_t positions[BLOCKSTORE_FILTER_PROBES];
+	ipfs_blockstore_filter_positions(filter, key, positions);
+	pthread_mutex_lock(&filter->lock);
+	int present = 1;
+	for(int i = 0; i < BLOCKSTORE_FILTER_PROBES; i++) {
+		if (filter->counters[positions[i]] == 0)
+			present = 0;
+	}
+	// a counter that got to 255 may count more keys than that, so it stays
+	for(int i = 0; present && i < BLOCKSTORE_FILTER_PROBES; i++) {
+		if (filter->counters[positions[i]] < 255)
+			filter->counters[positions[i]]--;
+	}
+	pthread_mutex_unlock(&filter->lock);
+	return 1;
+}
+
+/***
+ * Find out if a key may be in the blockstore
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it may be there, false(0) if it is certainly not
+ */
+int ipfs_blockstore_filter_contains(struct BlockstoreFilter* filter, const char* key) {
+	size_t positions[BLOCKSTORE_FILTER_PROBES];
+	ipfs_blockstore_filter_positions(filter, key, positions);
+	int retVal = 1;
+	pthread_mutex_lock(&filter->lock);
+	for(int i = 0; i < BLOCKSTORE_FILTER_PROBES; i++) {
+		if (filter->counters[positions[i]] == 0) {
+			retVal = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&filter->lock);
+	return retVal;
+}
+
+/***
+ * Open the log of the keys every process writes. What is in it already is taken to be
+ * in the blockstore, so open it before the filter is filled.
+ * @param filter the BlockstoreFilter
+ * @param filename the log
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_open(struct BlockstoreFilter* filter, const char* filename) {
+	int fd = open(filename, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return 0;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0) {
+		close(fd);
+		return 0;
+	}
+	pthread_mutex_lock(&filter->log_lock);
+	filter->log_fd = fd;
+	filter->log_offset = file_stat.st_size;
+	pthread_mutex_unlock(&filter->log_lock);
+	return 1;
+}
+
+/***
+ * Empty the log
+ * NOTE: only call this when no other process has the repo open
+ * @param filter the BlockstoreFilter
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_reset(struct BlockstoreFilter* filter) {
+	pthread_mutex_lock(&filter->log_lock);
+	int retVal = (filter->log_fd < 0 || ftruncate(filter->log_fd, 0) == 0);
+	if (retVal)
+		filter->log_offset = 0;
+	pthread_mutex_unlock(&filter->log_lock);
+	return retVal;
+}
+
+/***
+ * Tell the other processes about a key that was written
+ * NOTE: call this once the block is in the blockstore, so a process that lists the
+ * blockstore after it read the log does not miss it
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_add(struct BlockstoreFilter* filter, const char* key) {
+	size_t key_length = strlen(key);
+	char line[key_length + 1];
+	memcpy(line, key, key_length);
+	line[key_length] = '\n';
+	pthread_mutex_lock(&filter->log_lock);
+	if (filter->log_fd < 0) {
+		pthread_mutex_unlock(&filter->log_lock);
+		return 1;
+	}
+	// one write, so the lines of processes writing at once do not mix
+	int retVal = (write(filter->log_fd, line, key_length + 1) == (ssize_t)(key_length + 1));
+	// the filter has the key already, so if nobody else wrote in between, it need not be read
+	struct stat file_stat;
+	if (retVal && fstat(filter->log_fd, &file_stat) == 0 && file_stat.st_size == filter->log_offset + (off_t)(key_length + 1))
+		filter->log_offset = file_stat.st_size;
+	pthread_mutex_unlock(&filter->log_lock);
+	return retVal;
+}
+
+/***
+ * Add the keys that were added to the log since it was last read
+ * @param filter the BlockstoreFilter
+ * @returns true(1) if any were added
+ */
+int ipfs_blockstore_filter_log_read(struct BlockstoreFilter* filter) {
+	int retVal = 0;
+	char buffer[BLOCKSTORE_FILTER_LOG_CHUNK + 1];
+	struct stat file_stat;
+	pthread_mutex_lock(&filter->log_lock);
+	if (filter->log_fd < 0 || fstat(filter->log_fd, &file_stat) != 0)
+		goto exit;
+	// emptied by a process that had the repo to itself, so nothing was missed
+	if (file_stat.st_size < filter->log_offset)
+		filter->log_offset = file_stat.st_size;
+	while (filter->log_offset < file_stat.st_size) {
+		ssize_t bytes_read = pread(filter->log_fd, buffer, BLOCKSTORE_FILTER_LOG_CHUNK, filter->log_offset);
+		if (bytes_read <= 0)
+			break;
+		// only whole lines. The rest may still be being written.
+		ssize_t end = bytes_read;
+		while (end > 0 && buffer[end - 1] != '\n')
+			end--;
+		if (end == 0) {
+			// no line is this long, so it is not a key
+			if (bytes_read == BLOCKSTORE_FILTER_LOG_CHUNK)
+				filter->log_offset += bytes_read;
+			break;
+		}
+		char* line = buffer;
+		for(ssize_t i = 0; i < end; i++) {
+			if (buffer[i] != '\n')
+				continue;
+			buffer[i] = 0;
+			if (*line != 0)
+				ipfs_blockstore_filter_add(filter, line);
+			line = &buffer[i + 1];
+			retVal = 1;
+		}
+		filter->log_offset += end;
+	}
+	exit:
+	pthread_mutex_unlock(&filter->log_lock);
+	return retVal;
+}
+
+/***
+ * Find out if a key may be in the blockstore, reading what other processes wrote if the
+ * filter does not have it
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it may be there, false(0) if it is certainly not
+ */
+int ipfs_blockstore_filter_contains_logged(struct BlockstoreFilter* filter, const char* key) {
+	if (ipfs_blockstore_filter_contains(filter, key))
+		return 1;
+	return ipfs_blockstore_filter_log_read(filter) && ipfs_blockstore_filter_contains(filter, key);
+}
+
+/***
+ * Used by ipfs_blockstore_filter_fill to add each key
+ * @param key the key
+ * @param arg the BlockstoreFilter
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_fill_key(const char* key, void* arg) {
+	return ipfs_blockstore_filter_add((struct BlockstoreFilter*)arg, key);
+}
+
+/***
+ * Add every key in a blockstore directory
+ * @param filter the BlockstoreFilter
+ * @param blockstore_path the blockstore directory
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_fill(struct BlockstoreFilter* filter, const char* blockstore_path) {
+	return ipfs_flatfs_walk(blockstore_path, ipfs_blockstore_filter_fill_key, filter);
+}
+
+/***
+ * Read a saved filter into this one, adding up the counters. Only a filter of the same size can be read.
+ * @param filter the BlockstoreFilter
+ * @param filename the file
+ * @returns true(1) if it was read
+ */
+int ipfs_blockstore_filter_load(struct BlockstoreFilter* filter, const char* filename) {
+	int retVal = 0;
+	char magic[BLOCKSTORE_FILTER_MAGIC_LENGTH];
+	uint64_t size = 0;
+	unsigned char* counters = NULL;
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL)
+		return 0;
+	if (fread(magic, 1, BLOCKSTORE_FILTER_MAGIC_LENGTH, file) != BLOCKSTORE_FILTER_MAGIC_LENGTH
+			|| memcmp(magic, BLOCKSTORE_FILTER_MAGIC, BLOCKSTORE_FILTER_MAGIC_LENGTH) != 0)
+		goto exit;
+	if (fread(&size, sizeof(uint64_t), 1, file) != 1 || size != filter->size)
+		goto exit;
+	counters = (unsigned char*)malloc(filter->size);
+	if (counters == NULL)
+		goto exit;
+	if (fread(counters, 1, filter->size, file) != filter->size)
+		goto exit;
+	// keep the keys of both. Each counter counts the keys of both, or a key taken out of
+	// one would take down a counter that a key of the other still needs.
+	pthread_mutex_lock(&filter->lock);
+	for(size_t i = 0; i < filter->size; i++) {
+		unsigned int sum = (unsigned int)filter->counters[i] + counters[i];
+		filter->counters[i] = (sum < 255 ? sum : 255);
+	}
+	pthread_mutex_unlock(&filter->lock);
+
+	retVal = 1;
+	exit:
+	fclose(file);
+	free(counters);
+	return retVal;
+}
+
+/***
+ * Save a filter. If another process saved its filter there since this one was read,
+ * the keys of both are kept.
+ * @param filter the BlockstoreFilter
+ * @param filename the file
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_save(struct BlockstoreFilter* filter, const char* filename) {
+	if (os_utils_file_exists(filename))
+		ipfs_blockstore_filter_load(filter, filename);
+
+	// write it beside, so a reader never sees half a filter
+	size_t temp_length = strlen(filename) + 5;
+	char temp[temp_length];
+	snprintf(temp, temp_length, "%s.tmp", filename);
+	FILE* file = fopen(temp, "wb");
+	if (file == NULL)
+		return 0;
+	uint64_t size = filter->size;
+	pthread_mutex_lock(&filter->lock);
+	int retVal = (fwrite(BLOCKSTORE_FILTER_MAGIC, 1, BLOCKSTORE_FILTER_MAGIC_LENGTH, file) == BLOCKSTORE_FILTER_MAGIC_LENGTH
+			&& fwrite(&size, sizeof(uint64_t), 1, file) == 1
+			&& fwrite(filter->counters, 1, filter->size, file) == filter->size);
+	pthread_mutex_unlock(&filter->lock);
+	if (fclose(file) != 0)
+		retVal = 0;
+	if (retVal)
+		retVal = (rename(temp, filename) == 0);
+	if (!retVal)
+		remove(temp);
+	return retVal;
+}
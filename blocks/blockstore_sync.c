@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+/***
+ * Makes blockstore files durable, a group of writers at a time. See blockstore_sync.h
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/utsname.h>
+#endif
+
+#include "ipfs/blocks/blockstore_sync.h"
+
+/**
+ * Helper (private) methods
+ */
+
+/***
+ * The length of the directory part of a filename
+ * @param filename the filename
+ * @returns the length, or 0 if the filename has no directory
+ */
+size_t ipfs_blockstore_sync_directory_length(const char* filename) {
+	const char* slash = strrchr(filename, '/');
+	if (slash == NULL)
+		return 0;
+	// keep the slash of the root directory
+	if (slash == filename)
+		return 1;
+	return slash - filename;
+}
+
+/***
+ * Find out if syncfs tells about a file that could not be written. Before Linux 5.8,
+ * it returned 0 even then, so the batch would be taken as durable when it is not.
+ * @returns true(1) if a failed syncfs means the data may not be on the disk
+ */
+int ipfs_blockstore_sync_syncfs_reports_errors() {
+#ifdef __linux__
+	struct utsname name;
+	int major = 0;
+	int minor = 0;
+	if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+		return 0;
+	return major > 5 || (major == 5 && minor >= 8);
+#else
+	return 0;
+#endif
+}
+
+/***
+ * Sync the directory of every renamed file of a batch, once each
+ * @param batch the first entry of the batch
+ * @param syncs incremented for each directory synced
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_sync_directories(struct BlockstoreSyncEntry* batch, unsigned long long* syncs) {
+#ifdef __MINGW32__
+	// directories cannot be opened, and renames are written through
+	return 1;
+#else
+	for(struct BlockstoreSyncEntry* entry = batch; entry != NULL; entry = entry->next) {
+		if (!entry->result || entry->temporary == NULL)
+			continue;
+		size_t length = ipfs_blockstore_sync_directory_length(entry->filename);
+		int seen = 0;
+		for(struct BlockstoreSyncEntry* before = batch; before != entry && !seen; before = before->next) {
+			seen = (before->result && before->temporary != NULL && ipfs_blockstore_sync_directory_length(before->filename) == length
+					&& strncmp(before->filename, entry->filename, length) == 0);
+		}
+		if (seen)
+			continue;
+		char directory[length + 2];
+		if (length == 0) {
+			strcpy(directory, ".");
+		} else {
+			memcpy(directory, entry->filename, length);
+			directory[length] = 0;
+		}
+		int fd = open(directory, O_RDONLY);
+		if (fd < 0)
+			return 0;
+		(*syncs)++;
+		int retVal = (fsync(fd) == 0);
+		close(fd);
+		if (!retVal)
+			return 0;
+	}
+	return 1;
+#endif
+}
+
+/***
+ * Find an earlier entry of a batch that syncs the same open file
+ * @param batch the first entry of the batch
+ * @param entry the entry
+ * @returns the earlier entry, or NULL if there is none
+ */
+struct BlockstoreSyncEntry* ipfs_blockstore_sync_same_file(struct BlockstoreSyncEntry* batch, struct BlockstoreSyncEntry* entry) {
+	for(struct BlockstoreSyncEntry* before = batch; before != entry; before = before->next) {
+		if (before->temporary == NULL && before->fd == entry->fd)
+			return before;
+	}
+	return NULL;
+}
+
+/***
+ * Sync, rename and close the files of a batch, setting the result of each entry.
+ * An entry without a temporary name is a file that stays open, such as a pack segment,
+ * and is only synced, once however many writers appended to it.
+ * @param batch the first entry of the batch
+ * @param count the number of entries
+ * @param use_syncfs true(1) if syncfs reports errors, so a large batch can use it
+ * @param syncs incremented for each fsync or syncfs
+ */
+void ipfs_blockstore_sync_batch(struct BlockstoreSyncEntry* batch, size_t count, int use_syncfs, unsigned long long* syncs) {
+	int whole = 0;
+#ifdef __linux__
+	// one call writes out every file of the batch
+	if (use_syncfs && count >= BLOCKSTORE_SYNC_SYNCFS_MIN) {
+		(*syncs)++;
+		whole = (syncfs(batch->fd) == 0);
+	}
+#endif
+	for(struct BlockstoreSyncEntry* entry = batch; entry != NULL; entry = entry->next) {
+		entry->result = 1;
+		if (entry->temporary == NULL) {
+			struct BlockstoreSyncEntry* same = ipfs_blockstore_sync_same_file(batch, entry);
+			if (same != NULL) {
+				entry->result = same->result;
+			} else if (!whole) {
+				(*syncs)++;
+				entry->result = (fdatasync(entry->fd) == 0);
+			}
+			continue;
+		}
+		if (!whole) {
+			(*syncs)++;
+			entry->result = (fdatasync(entry->fd) == 0);
+		}
+		// the contents must be on the disk before the name is
+		if (entry->result && rename(entry->temporary, entry->filename) != 0)
+			entry->result = 0;
+		if (!entry->result)
+			unlink(entry->temporary);
+	}
+	// now the names
+	int named = 0;
+#ifdef __linux__
+	if (whole) {
+		(*syncs)++;
+		named = (syncfs(batch->fd) == 0);
+	}
+#endif
+	if (!named)
+		named = ipfs_blockstore_sync_directories(batch, syncs);
+	for(struct BlockstoreSyncEntry* entry = batch; entry != NULL; entry = entry->next) {
+		if (entry->temporary == NULL)
+			continue;
+		close(entry->fd);
+		// the file is there, but may not be after a crash, so it should not be indexed
+		if (!named)
+			entry->result = 0;
+	}
+}
+
+/***
+ * Queue an entry, then wait until its batch is done, leading the batch if nobody is syncing
+ * @param sync the BlockstoreSync
+ * @param entry the entry, which must stay until this returns
+ * @returns the result of the entry
+ */
+int ipfs_blockstore_sync_join(struct BlockstoreSync* sync, struct BlockstoreSyncEntry* entry) {
+	entry->done = 0;
+	entry->result = 0;
+	entry->next = NULL;
+
+	pthread_mutex_lock(&sync->lock);
+	if (sync->last == NULL)
+		sync->first = entry;
+	else
+		sync->last->next = entry;
+	sync->last = entry;
+	while (!entry->done) {
+		if (sync->syncing) {
+			pthread_cond_wait(&sync->done, &sync->lock);
+			continue;
+		}
+		// nobody is syncing, so lead everything that is waiting
+		struct BlockstoreSyncEntry* batch = sync->first;
+		sync->first = NULL;
+		sync->last = NULL;
+		sync->syncing = 1;
+		size_t count = 0;
+		for(struct BlockstoreSyncEntry* current = batch; current != NULL; current = current->next)
+			count++;
+		pthread_mutex_unlock(&sync->lock);
+
+		unsigned long long syncs = 0;
+		ipfs_blockstore_sync_batch(batch, count, sync->use_syncfs, &syncs);
+
+		pthread_mutex_lock(&sync->lock);
+		// an entry may go away as soon as it is done, so move on before marking it
+		while (batch != NULL) {
+			struct BlockstoreSyncEntry* next = batch->next;
+			batch->done = 1;
+			batch = next;
+		}
+		sync->syncing = 0;
+		sync->batches++;
+		sync->files += count;
+		sync->syncs += syncs;
+		pthread_cond_broadcast(&sync->done);
+	}
+	pthread_mutex_unlock(&sync->lock);
+	return entry->result;
+}
+
+/**
+ * Public methods
+ */
+
+/***
+ * Create a new BlockstoreSync
+ * @param no_sync true(1) to skip syncing, so files are only renamed
+ * @returns the struct, or NULL on error
+ */
+struct BlockstoreSync* ipfs_blockstore_sync_new(int no_sync) {
+	struct BlockstoreSync* sync = (struct BlockstoreSync*)malloc(sizeof(struct BlockstoreSync));
+	if (sync == NULL)
+		return NULL;
+	memset(sync, 0, sizeof(struct BlockstoreSync));
+	pthread_mutex_init(&sync->lock, NULL);
+	pthread_cond_init(&sync->done, NULL);
+	sync->no_sync = no_sync;
+	sync->use_syncfs = ipfs_blockstore_sync_syncfs_reports_errors();
+	return sync;
+}
+
+/***
+ * Free a BlockstoreSync. Nothing may be committing.
+ * @param sync the struct
+ * @returns true(1)
+ */
+int ipfs_blockstore_sync_free(struct BlockstoreSync* sync) {
+	if (sync != NULL) {
+		pthread_cond_destroy(&sync->done);
+		pthread_mutex_destroy(&sync->lock);
+		free(sync);
+	}
+	return 1;
+}
+
+/***
+ * Make a written temporary file durable under its final name. This waits until the
+ * batch it joins is on the disk.
+ * @param sync the BlockstoreSync (NULL to rename without syncing)
+ * @param fd the temporary file. It is closed, whatever happens.
+ * @param temporary the name of the temporary file. It is removed if anything fails.
+ * @param filename the final name
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_sync_commit(struct BlockstoreSync* sync, int fd, const char* temporary, const char* filename) {
+	if (sync == NULL || sync->no_sync) {
+		int retVal = (close(fd) == 0 && rename(temporary, filename) == 0);
+		if (!retVal)
+			unlink(temporary);
+		return retVal;
+	}
+
+	// the entry lives here until its batch is done
+	struct BlockstoreSyncEntry entry;
+	entry.fd = fd;
+	entry.temporary = temporary;
+	entry.filename = filename;
+	return ipfs_blockstore_sync_join(sync, &entry);
+}
+
+/***
+ * Make what was appended to a file that stays open durable. This waits until the batch
+ * it joins is on the disk, and the file is synced once for the whole batch.
+ * @param sync the BlockstoreSync (NULL to not wait)
+ * @param fd the file. It stays open.
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_sync_data(struct BlockstoreSync* sync, int fd) {
+	if (sync == NULL || sync->no_sync)
+		return 1;
+	struct BlockstoreSyncEntry entry;
+	entry.fd = fd;
+	entry.temporary = NULL;
+	entry.filename = NULL;
+	return ipfs_blockstore_sync_join(sync, &entry);
+}
+
+/***
+ * How much batching there has been
+ * @param sync the struct
+ * @param batches the number of batches (can be NULL)
+ * @param files the number of files committed (can be NULL)
+ * @param syncs the number of fsync or syncfs calls (can be NULL)
+ * @returns true(1)
+ */
+int ipfs_blockstore_sync_stats(struct BlockstoreSync* sync, unsigned long long* batches, unsigned long long* files, unsigned long long* syncs) {
+	pthread_mutex_lock(&sync->lock);
+	if (batches != NULL)
+		*batches = sync->batches;
+	if (files != NULL)
+		*files = sync->files;
+	if (syncs != NULL)
+		*syncs = sync->syncs;
+	pthread_mutex_unlock(&sync->lock);
+	return 1;
+}
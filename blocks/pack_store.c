@@ -0,0 +1,1060 @@
+/***
+ * A blockstore that appends blocks to large segment files. See pack_store.h
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "libp2p/os/utils.h"
+#include "ipfs/blocks/pack_store.h"
+#include "ipfs/repo/fsrepo/lmdb_datastore.h"
+
+// the key length and data length in front of each record
+#define PACK_STORE_HEADER_LENGTH 8
+// what is kept in the index for each key
+#define PACK_STORE_LOCATION_LENGTH 16
+// no key is longer than this, so anything longer is a torn record
+#define PACK_STORE_MAX_KEY_LENGTH 1024
+// in front of the number of a segment, the key of how far it is indexed. Block keys are
+// base32, so none starts with it.
+#define PACK_STORE_INDEXED_PREFIX "/indexed/"
+// the length of such a key
+#define PACK_STORE_INDEXED_KEY_LENGTH 18
+
+/**
+ * Helper (private) methods
+ */
+
+void ipfs_pack_store_put_uint32(unsigned char* buffer, uint32_t value) {
+	for(int i = 0; i < 4; i++)
+		buffer[i] = (value >> (8 * i)) & 0xff;
+}
+
+uint32_t ipfs_pack_store_get_uint32(const unsigned char* buffer) {
+	uint32_t value = 0;
+	for(int i = 3; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+	return value;
+}
+
+void ipfs_pack_store_put_uint64(unsigned char* buffer, uint64_t value) {
+	for(int i = 0; i < 8; i++)
+		buffer[i] = (value >> (8 * i)) & 0xff;
+}
+
+uint64_t ipfs_pack_store_get_uint64(const unsigned char* buffer) {
+	uint64_t value = 0;
+	for(int i = 7; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+	return value;
+}
+
+/***
+ * The bytes a record takes in its segment
+ * @param key_length the length of the key
+ * @param data_length the length of the data, or PACK_STORE_TOMBSTONE
+ * @returns the size of the record
+ */
+uint64_t ipfs_pack_store_record_size(size_t key_length, uint32_t data_length) {
+	return PACK_STORE_HEADER_LENGTH + key_length + (data_length == PACK_STORE_TOMBSTONE ? 0 : data_length);
+}
+
+/***
+ * The key in the index of how far a segment is indexed
+ * @param number the segment
+ * @param key where to put the key, of PACK_STORE_INDEXED_KEY_LENGTH + 1 bytes
+ */
+void ipfs_pack_store_indexed_key(uint32_t number, char* key) {
+	snprintf(key, PACK_STORE_INDEXED_KEY_LENGTH + 1, "%s%08x", PACK_STORE_INDEXED_PREFIX, number);
+}
+
+/***
+ * Build the path of a segment
+ * @param store the PackStore
+ * @param number the segment
+ * @param filename where to put the path
+ * @param filename_length the size of filename
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_segment_filename(const struct PackStore* store, uint32_t number, char* filename, size_t filename_length) {
+	char name[20];
+	sprintf(name, "%08u.pack", number);
+	return os_utils_filepath_join(store->path, name, filename, filename_length);
+}
+
+/***
+ * Open the file of a segment
+ * @param store the PackStore
+ * @param number the segment
+ * @param create true(1) to create it if it is not there
+ * @param segment where to put the file and its size
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_segment_file_open(const struct PackStore* store, uint32_t number, int create, struct PackSegment* segment) {
+	size_t filename_length = strlen(store->path) + 16;
+	char filename[filename_length];
+	if (!ipfs_pack_store_segment_filename(store, number, filename, filename_length))
+		return 0;
+	int fd = open(filename, O_RDWR | O_APPEND | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return 0;
+	// a put is durable once the segment is synced, so its name must be on the disk first
+	if (create) {
+		int directory = open(store->path, O_RDONLY);
+		if (directory < 0 || fsync(directory) != 0) {
+			if (directory >= 0)
+				close(directory);
+			close(fd);
+			return 0;
+		}
+		close(directory);
+	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0) {
+		close(fd);
+		return 0;
+	}
+	segment->fd = fd;
+	segment->size = file_stat.st_size;
+	segment->live_bytes = 0;
+	segment->indexed = 0;
+	segment->appended = 0;
+	segment->shared = 0;
+	return 1;
+}
+
+/***
+ * Make room for segments up to a number
+ * NOTE: call this with the segments lock held for writing
+ * @param store the PackStore
+ * @param number the highest segment
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_segments_grow(struct PackStore* store, uint32_t number) {
+	if (number < store->segment_count)
+		return 1;
+	struct PackSegment* segments = (struct PackSegment*)realloc(store->segments, sizeof(struct PackSegment) * (number + 1));
+	if (segments == NULL)
+		return 0;
+	for(uint32_t i = store->segment_count; i <= number; i++) {
+		segments[i].fd = -1;
+		segments[i].size = 0;
+		segments[i].live_bytes = 0;
+		segments[i].indexed = 0;
+		segments[i].appended = 0;
+		segments[i].shared = 0;
+	}
+	store->segments = segments;
+	store->segment_count = number + 1;
+	return 1;
+}
+
+/***
+ * Open a segment another process started after this one looked
+ * @param store the PackStore
+ * @param number the segment
+ * @returns true(1) if it is open
+ */
+int ipfs_pack_store_segment_load(struct PackStore* store, uint32_t number) {
+	int retVal = 0;
+	pthread_mutex_lock(&store->write_lock);
+	pthread_rwlock_wrlock(&store->segments_lock);
+	if (!ipfs_pack_store_segments_grow(store, number))
+		goto exit;
+	if (store->segments[number].fd < 0) {
+		struct PackSegment segment;
+		if (!ipfs_pack_store_segment_file_open(store, number, 0, &segment))
+			goto exit;
+		store->segments[number] = segment;
+	}
+	retVal = 1;
+	exit:
+	pthread_rwlock_unlock(&store->segments_lock);
+	pthread_mutex_unlock(&store->write_lock);
+	return retVal;
+}
+
+size_t ipfs_pack_store_pending_bucket(const char* key) {
+	uint32_t hash = 2166136261u;
+	for(const unsigned char* c = (const unsigned char*)key; *c != 0; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash & (PACK_STORE_PENDING_BUCKETS - 1);
+}
+
+/***
+ * Remember an index change until it is flushed
+ * @param store the PackStore
+ * @param key the key
+ * @param deleted true(1) if the key was deleted
+ * @param location where the record is (ignored if deleted)
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_pending_set(struct PackStore* store, const char* key, int deleted, const struct PackLocation* location) {
+	size_t bucket = ipfs_pack_store_pending_bucket(key);
+	pthread_mutex_lock(&store->pending_lock);
+	struct PackPending* pending = store->pending[bucket];
+	while (pending != NULL && strcmp(pending->key, key) != 0)
+		pending = pending->next;
+	if (pending == NULL) {
+		pending = (struct PackPending*)malloc(sizeof(struct PackPending));
+		if (pending == NULL) {
+			pthread_mutex_unlock(&store->pending_lock);
+			return 0;
+		}
+		pending->key = (char*)malloc(strlen(key) + 1);
+		if (pending->key == NULL) {
+			free(pending);
+			pthread_mutex_unlock(&store->pending_lock);
+			return 0;
+		}
+		strcpy(pending->key, key);
+		pending->next = store->pending[bucket];
+		store->pending[bucket] = pending;
+		if (store->pending_count == 0)
+			store->pending_since = time(NULL);
+		store->pending_count++;
+	}
+	pending->deleted = deleted;
+	if (!deleted)
+		pending->location = *location;
+	pthread_mutex_unlock(&store->pending_lock);
+	return 1;
+}
+
+/***
+ * Find where the newest record of a key is
+ * @param store the PackStore
+ * @param key the key
+ * @param location where to put the location
+ * @returns true(1) if the key is there
+ */
+int ipfs_pack_store_lookup(struct PackStore* store, const char* key, struct PackLocation* location) {
+	size_t bucket = ipfs_pack_store_pending_bucket(key);
+	pthread_mutex_lock(&store->pending_lock);
+	for(struct PackPending* pending = store->pending[bucket]; pending != NULL; pending = pending->next) {
+		if (strcmp(pending->key, key) == 0) {
+			int found = !pending->deleted;
+			if (found)
+				*location = pending->location;
+			pthread_mutex_unlock(&store->pending_lock);
+			return found;
+		}
+	}
+	pthread_mutex_unlock(&store->pending_lock);
+
+	struct LmdbView view;
+	if (!repo_fsrepo_lmdb_get_view((const unsigned char*)key, strlen(key), &view, store->index))
+		return 0;
+	int retVal = (view.data_size == PACK_STORE_LOCATION_LENGTH);
+	if (retVal) {
+		location->segment = ipfs_pack_store_get_uint32(&view.data[0]);
+		location->data_length = ipfs_pack_store_get_uint32(&view.data[4]);
+		location->offset = ipfs_pack_store_get_uint64(&view.data[8]);
+	}
+	repo_fsrepo_lmdb_release_view(&view, store->index);
+	return retVal;
+}
+
+/***
+ * Write the index changes kept in memory
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_flush_locked(struct PackStore* store) {
+	int retVal = 0;
+	pthread_mutex_lock(&store->pending_lock);
+	// the segments that are indexed further once the changes are written
+	size_t advanced = 0;
+	for(uint32_t number = 0; number < store->segment_count; number++) {
+		struct PackSegment* segment = &store->segments[number];
+		if (segment->fd >= 0 && !segment->shared && segment->appended > segment->indexed)
+			advanced++;
+	}
+	size_t count = store->pending_count + advanced;
+	if (count == 0) {
+		pthread_mutex_unlock(&store->pending_lock);
+		return 1;
+	}
+	unsigned char** keys = (unsigned char**)malloc(sizeof(unsigned char*) * count);
+	size_t* key_sizes = (size_t*)malloc(sizeof(size_t) * count);
+	unsigned char** data = (unsigned char**)malloc(sizeof(unsigned char*) * count);
+	size_t* data_sizes = (size_t*)malloc(sizeof(size_t) * count);
+	unsigned char* locations = (unsigned char*)malloc(PACK_STORE_LOCATION_LENGTH * count);
+	char* indexed_keys = (char*)malloc((PACK_STORE_INDEXED_KEY_LENGTH + 1) * (advanced + 1));
+	if (keys == NULL || key_sizes == NULL || data == NULL || data_sizes == NULL || locations == NULL || indexed_keys == NULL)
+		goto exit;
+
+	size_t pos = 0;
+	for(int i = 0; i < PACK_STORE_PENDING_BUCKETS; i++) {
+		for(struct PackPending* pending = store->pending[i]; pending != NULL; pending = pending->next) {
+			keys[pos] = (unsigned char*)pending->key;
+			key_sizes[pos] = strlen(pending->key);
+			if (pending->deleted) {
+				data[pos] = NULL;
+				data_sizes[pos] = 0;
+			} else {
+				unsigned char* location = &locations[pos * PACK_STORE_LOCATION_LENGTH];
+				ipfs_pack_store_put_uint32(&location[0], pending->location.segment);
+				ipfs_pack_store_put_uint32(&location[4], pending->location.data_length);
+				ipfs_pack_store_put_uint64(&location[8], pending->location.offset);
+				data[pos] = location;
+				data_sizes[pos] = PACK_STORE_LOCATION_LENGTH;
+			}
+			pos++;
+		}
+	}
+	// in the same write, so a replay starts from where the changes above end
+	for(uint32_t number = 0, i = 0; number < store->segment_count; number++) {
+		struct PackSegment* segment = &store->segments[number];
+		if (segment->fd < 0 || segment->shared || segment->appended <= segment->indexed)
+			continue;
+		char* key = &indexed_keys[i * (PACK_STORE_INDEXED_KEY_LENGTH + 1)];
+		ipfs_pack_store_indexed_key(number, key);
+		unsigned char* offset = &locations[pos * PACK_STORE_LOCATION_LENGTH];
+		ipfs_pack_store_put_uint64(offset, segment->appended);
+		keys[pos] = (unsigned char*)key;
+		key_sizes[pos] = PACK_STORE_INDEXED_KEY_LENGTH;
+		data[pos] = offset;
+		data_sizes[pos] = 8;
+		pos++;
+		i++;
+	}
+	// the index must never point at bytes that are not on the disk yet
+	if (store->segments[store->current].fd >= 0)
+		fdatasync(store->segments[store->current].fd);
+	if (!repo_fsrepo_lmdb_replace_many(keys, key_sizes, data, data_sizes, count, store->index))
+		goto exit;
+	for(uint32_t number = 0; number < store->segment_count; number++) {
+		struct PackSegment* segment = &store->segments[number];
+		if (segment->fd >= 0 && !segment->shared)
+			segment->indexed = segment->appended;
+	}
+
+	for(int i = 0; i < PACK_STORE_PENDING_BUCKETS; i++) {
+		while (store->pending[i] != NULL) {
+			struct PackPending* next = store->pending[i]->next;
+			free(store->pending[i]->key);
+			free(store->pending[i]);
+			store->pending[i] = next;
+		}
+	}
+	store->pending_count = 0;
+	retVal = 1;
+	exit:
+	pthread_mutex_unlock(&store->pending_lock);
+	free(keys);
+	free(key_sizes);
+	free(data);
+	free(data_sizes);
+	free(locations);
+	free(indexed_keys);
+	return retVal;
+}
+
+/***
+ * Start a new segment, once the current one is full
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_seal(struct PackStore* store) {
+	// the sealed segment is never appended to again, so it should be indexed to its end now
+	if (!ipfs_pack_store_flush_locked(store))
+		return 0;
+	uint32_t number = store->current + 1;
+	while (number < store->segment_count && store->segments[number].fd >= 0)
+		number++;
+	struct PackSegment segment;
+	if (!ipfs_pack_store_segment_file_open(store, number, 1, &segment))
+		return 0;
+	pthread_rwlock_wrlock(&store->segments_lock);
+	if (!ipfs_pack_store_segments_grow(store, number)) {
+		pthread_rwlock_unlock(&store->segments_lock);
+		close(segment.fd);
+		return 0;
+	}
+	store->segments[number] = segment;
+	store->current = number;
+	pthread_rwlock_unlock(&store->segments_lock);
+	return 1;
+}
+
+/***
+ * Append a record to the current segment
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ * @param key the key
+ * @param bytes the data (NULL for a tombstone)
+ * @param data_length the length of the data, or PACK_STORE_TOMBSTONE
+ * @param location where the record was written
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_append(struct PackStore* store, const char* key, const unsigned char* bytes, uint32_t data_length, struct PackLocation* location) {
+	struct PackSegment* segment = &store->segments[store->current];
+	size_t key_length = strlen(key);
+	size_t record_size = ipfs_pack_store_record_size(key_length, data_length);
+	unsigned char header[PACK_STORE_HEADER_LENGTH];
+	ipfs_pack_store_put_uint32(&header[0], key_length);
+	ipfs_pack_store_put_uint32(&header[4], data_length);
+	struct iovec parts[3];
+	parts[0].iov_base = header;
+	parts[0].iov_len = PACK_STORE_HEADER_LENGTH;
+	parts[1].iov_base = (void*)key;
+	parts[1].iov_len = key_length;
+	parts[2].iov_base = (void*)bytes;
+	parts[2].iov_len = (data_length == PACK_STORE_TOMBSTONE ? 0 : data_length);
+
+	// another process may be appending too, so the end of the file is where this record goes
+	if (flock(segment->fd, LOCK_EX) != 0)
+		return 0;
+	int retVal = 0;
+	struct stat file_stat;
+	if (fstat(segment->fd, &file_stat) != 0)
+		goto exit;
+	ssize_t written = writev(segment->fd, parts, 3);
+	if (written != (ssize_t)record_size) {
+		// a record that is not whole would stop the replay of the segment
+		if (written > 0 && ftruncate(segment->fd, file_stat.st_size) != 0)
+			fprintf(stderr, "Unable to take back a partial record from a pack segment.\n");
+		goto exit;
+	}
+	location->segment = store->current;
+	location->data_length = data_length;
+	location->offset = file_stat.st_size;
+	segment->size = file_stat.st_size + record_size;
+	// the records another process put in between may only be in its memory
+	if ((uint64_t)file_stat.st_size != segment->appended)
+		segment->shared = 1;
+	segment->appended = segment->size;
+	retVal = 1;
+	exit:
+	flock(segment->fd, LOCK_UN);
+	return retVal;
+}
+
+/***
+ * A record is no longer used
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ * @param key the key of the record
+ * @param location where it is
+ */
+void ipfs_pack_store_release(struct PackStore* store, const char* key, const struct PackLocation* location) {
+	if (location->segment < store->segment_count) {
+		uint64_t size = ipfs_pack_store_record_size(strlen(key), location->data_length);
+		struct PackSegment* segment = &store->segments[location->segment];
+		segment->live_bytes = (segment->live_bytes > size ? segment->live_bytes - size : 0);
+	}
+}
+
+/***
+ * After an append, write the index if enough is pending, and seal the segment if it is full
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ */
+void ipfs_pack_store_after_append(struct PackStore* store) {
+	if (store->pending_count >= PACK_STORE_PENDING_MAX
+			|| (store->pending_count > 0 && time(NULL) - store->pending_since >= PACK_STORE_PENDING_SECONDS))
+		ipfs_pack_store_flush_locked(store);
+	if (store->segments[store->current].size >= store->segment_bytes && !ipfs_pack_store_seal(store))
+		fprintf(stderr, "Unable to start a new pack segment.\n");
+}
+
+/***
+ * Find out if the index already has a newer record of a key than one being read again.
+ * Segments are numbered in the order they are started, so a higher one is newer.
+ * @param store the PackStore
+ * @param key the key
+ * @param location where the record being read again is
+ * @returns true(1) if the index points past it
+ */
+int ipfs_pack_store_replay_stale(struct PackStore* store, const char* key, const struct PackLocation* location) {
+	struct PackLocation newest;
+	if (!ipfs_pack_store_lookup(store, key, &newest))
+		return 0;
+	return newest.segment > location->segment
+			|| (newest.segment == location->segment && newest.offset > location->offset);
+}
+
+/***
+ * Read the records of a segment that are not in the index yet into it, in case the
+ * process stopped before they were written there. A torn record at the end is cut off.
+ * @param store the PackStore
+ * @param number the segment
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_replay_segment(struct PackStore* store, uint32_t number) {
+	struct PackSegment* segment = &store->segments[number];
+	uint64_t offset = 0;
+	unsigned char header[PACK_STORE_HEADER_LENGTH];
+	char key[PACK_STORE_MAX_KEY_LENGTH + 1];
+	// another process appends under this lock, so what is at the end is only torn if nobody holds it
+	if (flock(segment->fd, LOCK_EX) != 0)
+		return 0;
+	int retVal = 0;
+	struct stat file_stat;
+	if (fstat(segment->fd, &file_stat) != 0)
+		goto exit;
+	segment->size = file_stat.st_size;
+	char indexed_key[PACK_STORE_INDEXED_KEY_LENGTH + 1];
+	ipfs_pack_store_indexed_key(number, indexed_key);
+	struct LmdbView view;
+	if (repo_fsrepo_lmdb_get_view((unsigned char*)indexed_key, PACK_STORE_INDEXED_KEY_LENGTH, &view, store->index)) {
+		if (view.data_size == 8)
+			offset = ipfs_pack_store_get_uint64(view.data);
+		repo_fsrepo_lmdb_release_view(&view, store->index);
+	}
+	// past the end, it is of an older segment of the same number
+	if (offset > segment->size)
+		offset = 0;
+	segment->indexed = offset;
+	segment->appended = offset;
+	while (offset < segment->size) {
+		if (pread(segment->fd, header, PACK_STORE_HEADER_LENGTH, offset) != PACK_STORE_HEADER_LENGTH)
+			break;
+		uint32_t key_length = ipfs_pack_store_get_uint32(&header[0]);
+		uint32_t data_length = ipfs_pack_store_get_uint32(&header[4]);
+		uint64_t record_size = ipfs_pack_store_record_size(key_length, data_length);
+		if (key_length == 0 || key_length > PACK_STORE_MAX_KEY_LENGTH || offset + record_size > segment->size)
+			break;
+		if (pread(segment->fd, key, key_length, offset + PACK_STORE_HEADER_LENGTH) != (ssize_t)key_length)
+			break;
+		key[key_length] = 0;
+		struct PackLocation location;
+		location.segment = number;
+		location.data_length = data_length;
+		location.offset = offset;
+		if (!ipfs_pack_store_replay_stale(store, key, &location)
+				&& !ipfs_pack_store_pending_set(store, key, data_length == PACK_STORE_TOMBSTONE, &location))
+			goto exit;
+		offset += record_size;
+		segment->appended = offset;
+		if (store->pending_count >= PACK_STORE_PENDING_MAX && !ipfs_pack_store_flush_locked(store))
+			goto exit;
+	}
+	if (offset < segment->size) {
+		fprintf(stderr, "Cutting a torn record of %lu bytes from pack segment %u.\n", (unsigned long)(segment->size - offset), number);
+		if (ftruncate(segment->fd, offset) != 0)
+			goto exit;
+		segment->size = offset;
+	}
+	retVal = ipfs_pack_store_flush_locked(store);
+	exit:
+	flock(segment->fd, LOCK_UN);
+	return retVal;
+}
+
+/***
+ * Read the records that are not in the index yet into it, from where each segment was
+ * last indexed, oldest segment first so the newest record of a key wins
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_replay(struct PackStore* store) {
+	for(uint32_t number = 0; number < store->segment_count; number++) {
+		if (store->segments[number].fd >= 0 && !ipfs_pack_store_replay_segment(store, number))
+			return 0;
+	}
+	return 1;
+}
+
+/***
+ * Write the index changes that have waited PACK_STORE_PENDING_SECONDS, when no
+ * more blocks come to write them. Runs as a thread until the store is closed.
+ * @param arg the PackStore
+ * @returns NULL
+ */
+void* ipfs_pack_store_flusher(void* arg) {
+	struct PackStore* store = (struct PackStore*)arg;
+	pthread_mutex_lock(&store->write_lock);
+	while (!store->closing) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += PACK_STORE_PENDING_SECONDS;
+		pthread_cond_timedwait(&store->flusher_wake, &store->write_lock, &deadline);
+		if (!store->closing && store->pending_count > 0 && time(NULL) - store->pending_since >= PACK_STORE_PENDING_SECONDS
+				&& !ipfs_pack_store_flush_locked(store))
+			fprintf(stderr, "Unable to write the pack index.\n");
+	}
+	pthread_mutex_unlock(&store->write_lock);
+	return NULL;
+}
+
+/***
+ * Count the bytes each segment has of the records in the index
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_count_live(struct PackStore* store) {
+	struct Datastore* index = store->index;
+	unsigned char* key = NULL;
+	int key_length = 0;
+	unsigned char* value = NULL;
+	int value_length = 0;
+	if (!index->datastore_cursor_open(index))
+		return 0;
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (index->datastore_cursor_get(&key, &key_length, &value, &value_length, op, index)) {
+		if (value_length == PACK_STORE_LOCATION_LENGTH) {
+			uint32_t number = ipfs_pack_store_get_uint32(&value[0]);
+			uint32_t data_length = ipfs_pack_store_get_uint32(&value[4]);
+			if (number < store->segment_count)
+				store->segments[number].live_bytes += ipfs_pack_store_record_size(key_length, data_length);
+		}
+		free(key);
+		free(value);
+		op = CURSOR_NEXT;
+	}
+	index->datastore_cursor_close(index);
+	return 1;
+}
+
+/***
+ * Open the index of a pack store
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_index_open(struct PackStore* store) {
+	if (!libp2p_datastore_new(&store->index))
+		return 0;
+	size_t path_length = strlen(store->path) + 7;
+	store->index->path = (char*)malloc(path_length);
+	if (store->index->path == NULL)
+		return 0;
+	if (!os_utils_filepath_join(store->path, "index", store->index->path, path_length))
+		return 0;
+	if (!os_utils_directory_exists(store->index->path) && !repo_fsrepo_lmdb_create_directory(store->index))
+		return 0;
+	if (!repo_fsrepo_lmdb_cast(store->index))
+		return 0;
+	return store->index->datastore_open(0, NULL, store->index);
+}
+
+/***
+ * Wait until what was appended to a segment is on the disk, together with the other
+ * writers that appended to it at the same time
+ * NOTE: call this without the write lock, so the writers behind this one join the same sync
+ * @param store the PackStore
+ * @param number the segment
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_sync(struct PackStore* store, uint32_t number) {
+	if (store->sync == NULL)
+		return 1;
+	int retVal = 1;
+	pthread_rwlock_rdlock(&store->segments_lock);
+	// a segment that was compacted away was synced where its records were copied to
+	if (number < store->segment_count && store->segments[number].fd >= 0)
+		retVal = ipfs_blockstore_sync_data(store->sync, store->segments[number].fd);
+	pthread_rwlock_unlock(&store->segments_lock);
+	return retVal;
+}
+
+/***
+ * Open a pack store, creating it if needed
+ * @param repo_path the repo directory
+ * @param segment_bytes the size at which a segment is sealed (0 for PACK_STORE_SEGMENT_BYTES)
+ * @param store where to put the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_open(const char* repo_path, uint64_t segment_bytes, struct PackStore** store) {
+	struct PackStore* out = (struct PackStore*)malloc(sizeof(struct PackStore));
+	*store = NULL;
+	if (out == NULL)
+		return 0;
+	memset(out, 0, sizeof(struct PackStore));
+	pthread_mutex_init(&out->write_lock, NULL);
+	pthread_rwlock_init(&out->segments_lock, NULL);
+	pthread_mutex_init(&out->pending_lock, NULL);
+	pthread_cond_init(&out->flusher_wake, NULL);
+	out->segment_bytes = (segment_bytes > 0 ? segment_bytes : PACK_STORE_SEGMENT_BYTES);
+
+	size_t path_length = strlen(repo_path) + strlen(PACK_STORE_DIRECTORY) + 2;
+	out->path = (char*)malloc(path_length);
+	if (out->path == NULL || !os_utils_filepath_join(repo_path, PACK_STORE_DIRECTORY, out->path, path_length))
+		goto error;
+	if (!os_utils_directory_exists(out->path)) {
+#ifdef __MINGW32__
+		if (mkdir(out->path) != 0 && errno != EEXIST)
+#else
+		if (mkdir(out->path, S_IRWXU) != 0 && errno != EEXIST)
+#endif
+			goto error;
+	}
+	if (!ipfs_pack_store_index_open(out))
+		goto error;
+
+	// open the segments that are there
+	struct FileList* first = os_utils_list_directory(out->path);
+	for(struct FileList* current = first; current != NULL; current = current->next) {
+		unsigned int number = 0;
+		char extension[6] = { 0 };
+		if (strlen(current->file_name) != 13 || sscanf(current->file_name, "%8u.%5s", &number, extension) != 2
+				|| strcmp(extension, "pack") != 0)
+			continue;
+		if (!ipfs_pack_store_segments_grow(out, number)
+				|| !ipfs_pack_store_segment_file_open(out, number, 0, &out->segments[number])) {
+			os_utils_free_file_list(first);
+			goto error;
+		}
+		if (number > out->current)
+			out->current = number;
+	}
+	os_utils_free_file_list(first);
+	if (out->segment_count == 0) {
+		if (!ipfs_pack_store_segments_grow(out, 0) || !ipfs_pack_store_segment_file_open(out, 0, 1, &out->segments[0]))
+			goto error;
+	}
+
+	if (!ipfs_pack_store_replay(out) || !ipfs_pack_store_count_live(out))
+		goto error;
+	if (pthread_create(&out->flusher, NULL, ipfs_pack_store_flusher, out) != 0)
+		goto error;
+	out->flusher_started = 1;
+	*store = out;
+	return 1;
+	error:
+	ipfs_pack_store_close(out);
+	return 0;
+}
+
+/***
+ * Write what is pending to the index, and free the resources of a PackStore
+ * @param store the PackStore
+ * @returns true(1) if everything was written
+ */
+int ipfs_pack_store_close(struct PackStore* store) {
+	int retVal = 1;
+	if (store == NULL)
+		return 1;
+	if (store->flusher_started) {
+		pthread_mutex_lock(&store->write_lock);
+		store->closing = 1;
+		pthread_cond_signal(&store->flusher_wake);
+		pthread_mutex_unlock(&store->write_lock);
+		pthread_join(store->flusher, NULL);
+	}
+	if (store->index != NULL) {
+		if (store->index->handle != NULL) {
+			if (store->segments != NULL)
+				retVal = ipfs_pack_store_flush_locked(store);
+			store->index->datastore_close(store->index);
+		}
+		libp2p_datastore_free(store->index);
+	}
+	for(uint32_t i = 0; i < store->segment_count; i++) {
+		if (store->segments[i].fd >= 0)
+			close(store->segments[i].fd);
+	}
+	free(store->segments);
+	for(int i = 0; i < PACK_STORE_PENDING_BUCKETS; i++) {
+		while (store->pending[i] != NULL) {
+			struct PackPending* next = store->pending[i]->next;
+			free(store->pending[i]->key);
+			free(store->pending[i]);
+			store->pending[i] = next;
+		}
+	}
+	free(store->path);
+	pthread_mutex_destroy(&store->write_lock);
+	pthread_rwlock_destroy(&store->segments_lock);
+	pthread_mutex_destroy(&store->pending_lock);
+	pthread_cond_destroy(&store->flusher_wake);
+	free(store);
+	return retVal;
+}
+
+/***
+ * Write the index changes kept in memory
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_flush(struct PackStore* store) {
+	pthread_mutex_lock(&store->write_lock);
+	int retVal = ipfs_pack_store_flush_locked(store);
+	pthread_mutex_unlock(&store->write_lock);
+	return retVal;
+}
+
+/***
+ * Append a block. A block that is already there is replaced.
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param bytes the bytes of the block
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_put(struct PackStore* store, const char* key, const unsigned char* bytes, size_t bytes_size) {
+	if (bytes_size >= PACK_STORE_TOMBSTONE || strlen(key) == 0 || strlen(key) > PACK_STORE_MAX_KEY_LENGTH)
+		return 0;
+	struct PackLocation old_location;
+	struct PackLocation location;
+	pthread_mutex_lock(&store->write_lock);
+	int replaced = ipfs_pack_store_lookup(store, key, &old_location);
+	int retVal = ipfs_pack_store_append(store, key, bytes, bytes_size, &location)
+			&& ipfs_pack_store_pending_set(store, key, 0, &location);
+	if (retVal) {
+		if (replaced)
+			ipfs_pack_store_release(store, key, &old_location);
+		store->segments[location.segment].live_bytes += ipfs_pack_store_record_size(strlen(key), location.data_length);
+		ipfs_pack_store_after_append(store);
+	}
+	pthread_mutex_unlock(&store->write_lock);
+	if (retVal)
+		retVal = ipfs_pack_store_sync(store, location.segment);
+	return retVal;
+}
+
+/***
+ * Read a block
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param bytes where to put the bytes
+ * @param bytes_size the number of bytes
+ * @returns true(1) if the block was found
+ */
+int ipfs_pack_store_get(struct PackStore* store, const char* key, unsigned char** bytes, size_t* bytes_size) {
+	int retVal = 0;
+	struct PackLocation location;
+	*bytes = NULL;
+	*bytes_size = 0;
+
+	// held from the lookup to the read, so compaction cannot take the segment away in between
+	pthread_rwlock_rdlock(&store->segments_lock);
+	if (!ipfs_pack_store_lookup(store, key, &location))
+		goto exit;
+	if (location.segment >= store->segment_count || store->segments[location.segment].fd < 0) {
+		pthread_rwlock_unlock(&store->segments_lock);
+		if (!ipfs_pack_store_segment_load(store, location.segment))
+			return 0;
+		pthread_rwlock_rdlock(&store->segments_lock);
+		if (!ipfs_pack_store_lookup(store, key, &location)
+				|| location.segment >= store->segment_count || store->segments[location.segment].fd < 0)
+			goto exit;
+	}
+	// malloc(0) may return NULL, so always ask for at least a byte
+	*bytes = (unsigned char*)malloc(location.data_length + 1);
+	if (*bytes == NULL)
+		goto exit;
+	ssize_t bytes_read = pread(store->segments[location.segment].fd, *bytes, location.data_length,
+			location.offset + PACK_STORE_HEADER_LENGTH + strlen(key));
+	if (bytes_read != (ssize_t)location.data_length) {
+		free(*bytes);
+		*bytes = NULL;
+		goto exit;
+	}
+	*bytes_size = location.data_length;
+	retVal = 1;
+	exit:
+	pthread_rwlock_unlock(&store->segments_lock);
+	return retVal;
+}
+
+/***
+ * Look at a block in its segment, without copying it if it is large
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param view where to put the results
+ * @returns true(1) if the block was found. Only call ipfs_block_view_release if it was.
+ */
+int ipfs_pack_store_get_view(struct PackStore* store, const char* key, struct BlockView* view) {
+	int retVal = 0;
+	struct PackLocation location;
+
+	// a mapping outlives the segment file, so the lock is only needed until it is made
+	pthread_rwlock_rdlock(&store->segments_lock);
+	if (!ipfs_pack_store_lookup(store, key, &location))
+		goto exit;
+	if (location.segment >= store->segment_count || store->segments[location.segment].fd < 0) {
+		pthread_rwlock_unlock(&store->segments_lock);
+		if (!ipfs_pack_store_segment_load(store, location.segment))
+			return 0;
+		pthread_rwlock_rdlock(&store->segments_lock);
+		if (!ipfs_pack_store_lookup(store, key, &location)
+				|| location.segment >= store->segment_count || store->segments[location.segment].fd < 0)
+			goto exit;
+	}
+	// a mapping past the end of the file faults when it is read, rather than failing here
+	struct stat file_stat;
+	uint64_t data_offset = location.offset + PACK_STORE_HEADER_LENGTH + strlen(key);
+	if (fstat(store->segments[location.segment].fd, &file_stat) != 0
+			|| data_offset + location.data_length > (uint64_t)file_stat.st_size)
+		goto exit;
+	retVal = ipfs_block_view_load(store->segments[location.segment].fd, data_offset, location.data_length, view);
+	exit:
+	pthread_rwlock_unlock(&store->segments_lock);
+	return retVal;
+}
+
+/***
+ * Find out if a block is there
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it is
+ */
+int ipfs_pack_store_has(struct PackStore* store, const char* key) {
+	struct PackLocation location;
+	return ipfs_pack_store_lookup(store, key, &location);
+}
+
+/***
+ * Delete a block
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it was there and was deleted
+ */
+int ipfs_pack_store_delete(struct PackStore* store, const char* key) {
+	struct PackLocation old_location;
+	struct PackLocation location;
+	pthread_mutex_lock(&store->write_lock);
+	int retVal = ipfs_pack_store_lookup(store, key, &old_location);
+	// the delete has to be in the segment too, or a replay would bring the block back
+	if (retVal)
+		retVal = ipfs_pack_store_append(store, key, NULL, PACK_STORE_TOMBSTONE, &location)
+				&& ipfs_pack_store_pending_set(store, key, 1, NULL);
+	if (retVal) {
+		ipfs_pack_store_release(store, key, &old_location);
+		ipfs_pack_store_after_append(store);
+	}
+	pthread_mutex_unlock(&store->write_lock);
+	if (retVal)
+		retVal = ipfs_pack_store_sync(store, location.segment);
+	return retVal;
+}
+
+/***
+ * Call a function with the key of each block
+ * @param store the PackStore
+ * @param func the function. Returning false(0) stops the walk
+ * @param arg passed to func
+ * @returns true(1) if every key was walked
+ */
+int ipfs_pack_store_walk(struct PackStore* store, int (*func)(const char* key, void* arg), void* arg) {
+	struct Datastore* index = store->index;
+	unsigned char* key = NULL;
+	int key_length = 0;
+	if (!ipfs_pack_store_flush(store))
+		return 0;
+	if (!index->datastore_cursor_open(index))
+		return 0;
+	int retVal = 1;
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (index->datastore_cursor_get(&key, &key_length, NULL, NULL, op, index)) {
+		char key_string[key_length + 1];
+		memcpy(key_string, key, key_length);
+		key_string[key_length] = 0;
+		free(key);
+		op = CURSOR_NEXT;
+		// how far a segment is indexed, not a block
+		if (strncmp(key_string, PACK_STORE_INDEXED_PREFIX, strlen(PACK_STORE_INDEXED_PREFIX)) == 0)
+			continue;
+		if (!func(key_string, arg)) {
+			retVal = 0;
+			break;
+		}
+	}
+	index->datastore_cursor_close(index);
+	return retVal;
+}
+
+/***
+ * Copy the records of a segment that are still used to the current segment
+ * NOTE: call this with the write lock held
+ * @param store the PackStore
+ * @param number the segment
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_compact_segment(struct PackStore* store, uint32_t number) {
+	uint64_t offset = 0;
+	unsigned char header[PACK_STORE_HEADER_LENGTH];
+	char key[PACK_STORE_MAX_KEY_LENGTH + 1];
+	while (offset < store->segments[number].size) {
+		int fd = store->segments[number].fd;
+		if (pread(fd, header, PACK_STORE_HEADER_LENGTH, offset) != PACK_STORE_HEADER_LENGTH)
+			return 0;
+		uint32_t key_length = ipfs_pack_store_get_uint32(&header[0]);
+		uint32_t data_length = ipfs_pack_store_get_uint32(&header[4]);
+		if (key_length == 0 || key_length > PACK_STORE_MAX_KEY_LENGTH)
+			return 0;
+		if (pread(fd, key, key_length, offset + PACK_STORE_HEADER_LENGTH) != (ssize_t)key_length)
+			return 0;
+		key[key_length] = 0;
+		struct PackLocation location;
+		// deletes only matter for the newest segment, and a replaced record is not copied
+		if (data_length != PACK_STORE_TOMBSTONE && ipfs_pack_store_lookup(store, key, &location)
+				&& location.segment == number && location.offset == offset) {
+			unsigned char* bytes = (unsigned char*)malloc(data_length + 1);
+			if (bytes == NULL)
+				return 0;
+			int copied = (pread(fd, bytes, data_length, offset + PACK_STORE_HEADER_LENGTH + key_length) == (ssize_t)data_length
+					&& ipfs_pack_store_append(store, key, bytes, data_length, &location)
+					&& ipfs_pack_store_pending_set(store, key, 0, &location));
+			free(bytes);
+			if (!copied)
+				return 0;
+			store->segments[location.segment].live_bytes += ipfs_pack_store_record_size(key_length, data_length);
+			ipfs_pack_store_after_append(store);
+		}
+		offset += ipfs_pack_store_record_size(key_length, data_length);
+	}
+	return 1;
+}
+
+/***
+ * Copy the blocks that are still used out of the sealed segments with at least
+ * percent of dead space, and remove those segments
+ * @param store the PackStore
+ * @param percent the least dead space of a segment to compact, in percent
+ * @param bytes_freed the bytes of the removed segments (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_compact(struct PackStore* store, int percent, uint64_t* bytes_freed) {
+	int retVal = 0;
+	if (bytes_freed != NULL)
+		*bytes_freed = 0;
+	pthread_mutex_lock(&store->write_lock);
+	// the segments copied to are never compacted in the same pass
+	uint32_t last = store->current;
+	for(uint32_t number = 0; number < last; number++) {
+		struct PackSegment* segment = &store->segments[number];
+		if (segment->fd < 0)
+			continue;
+		uint64_t dead = segment->size - (segment->live_bytes < segment->size ? segment->live_bytes : segment->size);
+		if (segment->size > 0 && dead * 100 < segment->size * (uint64_t)percent)
+			continue;
+		uint64_t size = segment->size;
+		if (!ipfs_pack_store_compact_segment(store, number))
+			goto exit;
+		// nothing can point at the segment any more before it is removed
+		if (!ipfs_pack_store_flush_locked(store))
+			goto exit;
+		size_t filename_length = strlen(store->path) + 16;
+		char filename[filename_length];
+		if (!ipfs_pack_store_segment_filename(store, number, filename, filename_length))
+			goto exit;
+		pthread_rwlock_wrlock(&store->segments_lock);
+		close(store->segments[number].fd);
+		store->segments[number].fd = -1;
+		store->segments[number].size = 0;
+		store->segments[number].live_bytes = 0;
+		pthread_rwlock_unlock(&store->segments_lock);
+		if (unlink(filename) != 0)
+			goto exit;
+		if (bytes_freed != NULL)
+			*bytes_freed += size;
+	}
+	retVal = 1;
+	exit:
+	pthread_mutex_unlock(&store->write_lock);
+	return retVal;
+}
@@ -51,6 +51,9 @@ int ipfs_node_online_new(const char* repo_path, struct IpfsNode** node) {
 	local_node->repo = NULL;
 	local_node->routing = NULL;
 	local_node->exchange =  NULL;
+	local_node->export_pool = NULL;
+	pthread_mutex_init(&local_node->export_pool_lock, NULL);
+	pthread_mutex_init(&local_node->routing_lock, NULL);
 
 	// build the struct
 	if (!ipfs_repo_fsrepo_new(repo_path, NULL, &fs_repo)) {
@@ -79,6 +82,21 @@ int ipfs_node_online_new(const char* repo_path, struct IpfsNode** node) {
 	return 1;
 }
 
+/***
+ * Get the pool that fetches blocks for the exporter, starting it the first time
+ * @param node the node
+ * @param num_threads the number of threads, if the pool has to be started
+ * @returns the pool, or NULL on error
+ */
+threadpool ipfs_node_export_pool(struct IpfsNode* node, int num_threads) {
+	pthread_mutex_lock(&node->export_pool_lock);
+	if (node->export_pool == NULL)
+		node->export_pool = thpool_init(num_threads < 1 ? 1 : num_threads);
+	threadpool pool = node->export_pool;
+	pthread_mutex_unlock(&node->export_pool_lock);
+	return pool;
+}
+
 /***
  * Free resources from the creation of an IpfsNode
  * @param node the node to free
@@ -86,9 +104,20 @@ int ipfs_node_online_new(const char* repo_path, struct IpfsNode** node) {
  */
 int ipfs_node_free(struct IpfsNode* node) {
 	if (node != NULL) {
+		// the exports still running use the exchange, the routing and the repo
+		if (node->export_pool != NULL) {
+			thpool_wait(node->export_pool);
+			thpool_destroy(node->export_pool);
+		}
+		pthread_mutex_destroy(&node->export_pool_lock);
+		pthread_mutex_destroy(&node->routing_lock);
 		if (node->exchange != NULL) {
 			node->exchange->Close(node->exchange);
 		}
+		// the routing may still be asking peers, so it goes before the peerstore
+		if (node->mode == MODE_ONLINE) {
+			ipfs_routing_online_free(node->routing);
+		}
 		if (node->providerstore != NULL)
 			libp2p_providerstore_free(node->providerstore);
 		if (node->peerstore != NULL)
@@ -97,9 +126,6 @@ int ipfs_node_free(struct IpfsNode* node) {
 			ipfs_repo_fsrepo_free(node->repo);
 		if (node->protocol_handlers != NULL)
 			ipfs_node_online_protocol_handlers_free(node->protocol_handlers);
-		if (node->mode == MODE_ONLINE) {
-			ipfs_routing_online_free(node->routing);
-		}
 		if (node->blockstore != NULL) {
 			ipfs_blockstore_free(node->blockstore);
 		}
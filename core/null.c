@@ -3,7 +3,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -28,21 +33,295 @@
 
 // this should be set to 5 for normal operation, perhaps higher for debugging purposes
 #define DEFAULT_NETWORK_TIMEOUT 5
+// the threads that negotiate with new connections, and read the frames of the others
+#define NULL_WORKERS 25
+// the most events handled for each epoll_wait
+#define NULL_MAX_EVENTS 64
+// the most frames read from a connection before the others get a turn
+#define NULL_MAX_FRAMES 16
+// how often (in seconds) a connected peer is pinged, when there is time
+#define NULL_MAINTENANCE_SECONDS 2
+// the longest (in seconds) one read or write on a connection may hold a worker
+#define NULL_IO_TIMEOUT_SECONDS DEFAULT_NETWORK_TIMEOUT
+// the longest (in seconds) a worker may spend on a connection, over all its reads and writes,
+// before the connection is cut off. A peer that sends a byte at a time gets no longer than this.
+#define NULL_JOB_SECONDS DEFAULT_NETWORK_TIMEOUT
+// the longest (in seconds) a worker keeps reading frames from one connection before the others get a turn
+#define NULL_MAX_READ_SECONDS 1
+// how long (in seconds) a connection may say nothing before it is closed
+#define NULL_IDLE_SECONDS 300
 
 static int null_shutting_down = 0;
+// protects the count, the list of connections, the busy flags and null_pinging
+static pthread_mutex_t null_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct null_connection_params* null_connections = NULL;
+static int null_pinging = 0;
+
+struct null_ping_params {
+	struct IpfsNode* local_node;
+	struct Libp2pPeer* peer;
+};
+
+/***
+ * Take a connection out of the list
+ * NOTE: null_count_lock must be held
+ * @param connection_param the connection
+ */
+void ipfs_null_connection_unlink(struct null_connection_params* connection_param) {
+	if (connection_param->prior == NULL)
+		null_connections = connection_param->next;
+	else
+		connection_param->prior->next = connection_param->next;
+	if (connection_param->next != NULL)
+		connection_param->next->prior = connection_param->prior;
+	connection_param->prior = NULL;
+	connection_param->next = NULL;
+	(*(connection_param->count))--; // update counter.
+}
+
+/***
+ * Free the parameters of a connection that is out of the list
+ * NOTE: the session is not freed, as a protocol handler may still be using it
+ * @param connection_param the connection
+ * @param hang_up true(1) to close the socket, false(0) if a protocol handler has taken it
+ */
+void ipfs_null_connection_free(struct null_connection_params* connection_param, int hang_up) {
+	if (hang_up)
+		close(connection_param->file_descriptor);
+	if (connection_param->ip != NULL)
+		free(connection_param->ip);
+	free(connection_param);
+}
+
+/***
+ * Stop watching a connection, and free its parameters
+ * @param connection_param the connection
+ * @param hang_up true(1) to close the socket, false(0) if a protocol handler has taken it
+ */
+void ipfs_null_connection_end(struct null_connection_params* connection_param, int hang_up) {
+	pthread_mutex_lock(&null_count_lock);
+	epoll_ctl(connection_param->epoll_descriptor, EPOLL_CTL_DEL, connection_param->file_descriptor, NULL);
+	ipfs_null_connection_unlink(connection_param);
+	pthread_mutex_unlock(&null_count_lock);
+	ipfs_null_connection_free(connection_param, hang_up);
+}
+
+/***
+ * Ask epoll to tell us about the next frame of a connection. Only one thread at a time
+ * gets the event, as it has to be asked for again.
+ * @param connection_param the connection
+ * @param operation EPOLL_CTL_ADD for a new connection, EPOLL_CTL_MOD otherwise
+ * @returns true(1) on success
+ */
+int ipfs_null_connection_watch(struct null_connection_params* connection_param, int operation) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = connection_param;
+	// under the lock, so the listener does not close it between here and not being busy
+	pthread_mutex_lock(&null_count_lock);
+	int retVal = epoll_ctl(connection_param->epoll_descriptor, operation, connection_param->file_descriptor, &event) == 0;
+	if (retVal) {
+		connection_param->busy = 0;
+		connection_param->job_started = 0;
+	}
+	pthread_mutex_unlock(&null_count_lock);
+	return retVal;
+}
+
+/***
+ * Record when a worker started on a connection, or stopped without handing it back to epoll
+ * @param connection_param the connection
+ * @param started true(1) when a worker starts on it, false(0) when it goes back in the workers' queue
+ */
+void ipfs_null_connection_job(struct null_connection_params* connection_param, int started) {
+	pthread_mutex_lock(&null_count_lock);
+	connection_param->job_started = (started ? time(NULL) : 0);
+	pthread_mutex_unlock(&null_count_lock);
+}
+
+/***
+ * Cut off the connections a worker has been on for NULL_JOB_SECONDS. What the worker is
+ * waiting for fails at once, and it lets the connection go.
+ * NOTE: only the listener thread calls this
+ */
+void ipfs_null_connection_cut_slow() {
+	time_t now = time(NULL);
+	pthread_mutex_lock(&null_count_lock);
+	for(struct null_connection_params* current = null_connections; current != NULL; current = current->next) {
+		if (current->job_started != 0 && now - current->job_started >= NULL_JOB_SECONDS) {
+			libp2p_logger_debug("null", "Connection %d held a worker for too long. Cutting it off.\n", current->file_descriptor);
+			// the worker still has the descriptor, so it is not closed here
+			shutdown(current->file_descriptor, SHUT_RDWR);
+			current->job_started = 0;
+		}
+	}
+	pthread_mutex_unlock(&null_count_lock);
+}
+
+/***
+ * Close the connections that have said nothing for NULL_IDLE_SECONDS, or all of them
+ * NOTE: only the listener thread calls this, and the workers are not using what it closes
+ * @param all true(1) to close every connection that no worker has
+ */
+void ipfs_null_connection_close_idle(int all) {
+	struct null_connection_params* closing = NULL;
+	time_t now = time(NULL);
+	pthread_mutex_lock(&null_count_lock);
+	struct null_connection_params* current = null_connections;
+	while (current != NULL) {
+		struct null_connection_params* next = current->next;
+		if (!current->busy && (all || now - current->last_read >= NULL_IDLE_SECONDS)) {
+			epoll_ctl(current->epoll_descriptor, EPOLL_CTL_DEL, current->file_descriptor, NULL);
+			ipfs_null_connection_unlink(current);
+			current->next = closing;
+			closing = current;
+		}
+		current = next;
+	}
+	pthread_mutex_unlock(&null_count_lock);
+	while (closing != NULL) {
+		struct null_connection_params* next = closing->next;
+		libp2p_logger_debug("null", "Closing idle connection %d.\n", closing->file_descriptor);
+		ipfs_null_connection_free(closing, 1);
+		closing = next;
+	}
+}
+
+/***
+ * The job run by a worker to ping a peer, so the listener does not wait on it
+ * @param ptr a pointer to a null_ping_params struct
+ */
+void ipfs_null_ping(void* ptr) {
+	struct null_ping_params* ping_param = (struct null_ping_params*)ptr;
+	libp2p_logger_debug("null", "Attempting to ping %s.\n", ping_param->peer->id);
+	if (!ping_param->local_node->routing->Ping(ping_param->local_node->routing, ping_param->peer)) {
+		ping_param->peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
+	}
+	pthread_mutex_lock(&null_count_lock);
+	null_pinging = 0;
+	pthread_mutex_unlock(&null_count_lock);
+	free(ping_param);
+}
+
+/***
+ * Ping a peer on a worker, unless the last ping is still going
+ * @param local_node the context
+ * @param peer the peer
+ * @param thpool the workers
+ * @returns true(1) if the ping was started, false(0) if it has to wait
+ */
+int ipfs_null_ping_start(struct IpfsNode* local_node, struct Libp2pPeer* peer, threadpool thpool) {
+	pthread_mutex_lock(&null_count_lock);
+	int busy = null_pinging;
+	null_pinging = 1;
+	pthread_mutex_unlock(&null_count_lock);
+	if (busy)
+		return 0;
+	struct null_ping_params* ping_param = (struct null_ping_params*)malloc(sizeof(struct null_ping_params));
+	if (ping_param != NULL) {
+		ping_param->local_node = local_node;
+		ping_param->peer = peer;
+		if (thpool_add_work(thpool, ipfs_null_ping, ping_param) == 0)
+			return 1;
+		free(ping_param);
+	}
+	pthread_mutex_lock(&null_count_lock);
+	null_pinging = 0;
+	pthread_mutex_unlock(&null_count_lock);
+	return 1;
+}
 
 /**
- * We've received a connection. Find out what they want.
+ * The job run by the workers when a connection has something to read. Reads what is
+ * there, hands it to the protocol handlers, and goes back to waiting without a thread.
+ * If it read its share and more is there, it goes to the back of the workers' queue instead.
+ *
+ * @param ptr a pointer to a null_connection_params struct
+ */
+void ipfs_null_connection_read(void* ptr) {
+	struct null_connection_params *connection_param = (struct null_connection_params*) ptr;
+	struct SessionContext* session = connection_param->session;
+	int retVal = 1;
+	int more = 0;
+	time_t started = time(NULL);
+	ipfs_null_connection_job(connection_param, 1);
+
+	for(int frames = 0; ; frames++) {
+		unsigned char* results = NULL;
+		size_t bytes_read = 0;
+		if (null_shutting_down) {
+			libp2p_logger_debug("null", "%s null shutting down before read.\n", connection_param->local_node->identity->peer->id);
+			// this service is shutting down. Ignore the request and exit the loop
+			retVal = -1;
+			break;
+		}
+		// the first frame is there, as epoll said so. The secure stream may have more.
+		if (frames > 0) {
+			int waiting = session->default_stream->peek(session);
+			if (waiting < 0) {
+				libp2p_logger_debug("null", "Peer returned %d. Exiting loop\n", waiting);
+				retVal = -1;
+				break;
+			}
+			if (waiting == 0)
+				break;
+			// what the secure stream already took off the socket would never wake epoll
+			if (frames >= NULL_MAX_FRAMES || time(NULL) - started >= NULL_MAX_READ_SECONDS) {
+				more = 1;
+				break;
+			}
+		}
+		if (!session->default_stream->read(session, &results, &bytes_read, DEFAULT_NETWORK_TIMEOUT)) {
+			// the peer hung up, or something happened
+			libp2p_logger_debug("null", "Unable to read from connection %d. Exiting.\n", connection_param->file_descriptor);
+			retVal = -1;
+			break;
+		}
+
+		// We actually got something. Process the request...
+		libp2p_logger_debug("null", "Read %lu bytes from a stream tranaction\n", bytes_read);
+		retVal = libp2p_protocol_marshal(results, bytes_read, session, connection_param->local_node->protocol_handlers);
+		free(results);
+		if (retVal == -1) {
+			libp2p_logger_debug("null", "protocol_marshal returned error.\n");
+			break;
+		} else if (retVal == 0) {
+			// clean up, but let someone else handle this from now on
+			libp2p_logger_debug("null", "protocol_marshal returned 0. The daemon will no longer handle this.\n");
+			break;
+		}
+	}
+
+	if (retVal == 0) {
+		// a protocol handler has the socket now
+		ipfs_null_connection_end(connection_param, 0);
+		return;
+	}
+	connection_param->last_read = time(NULL);
+	if (retVal == 1 && more) {
+		ipfs_null_connection_job(connection_param, 0);
+		if (thpool_add_work(connection_param->thpool, ipfs_null_connection_read, connection_param) != 0)
+			ipfs_null_connection_end(connection_param, 1);
+		return;
+	}
+	if (retVal != 1 || !ipfs_null_connection_watch(connection_param, EPOLL_CTL_MOD))
+		ipfs_null_connection_end(connection_param, 1);
+}
+
+/**
+ * We've received a connection. Negotiate multistream, then let epoll tell us when they ask something.
  *
  * @param ptr a pointer to a null_connection_params struct
  */
 void ipfs_null_connection (void *ptr) {
     struct null_connection_params *connection_param = (struct null_connection_params*) ptr;
-    int retVal = 0;
+    ipfs_null_connection_job(connection_param, 1);
 
     struct SessionContext* session = libp2p_session_context_new();
     if (session == NULL) {
 		libp2p_logger_error("null", "Unable to allocate SessionContext. Out of memory?\n");
+		ipfs_null_connection_end(connection_param, 1);
 		return;
     }
 
@@ -50,81 +329,90 @@ void ipfs_null_connection (void *ptr) {
     session->default_stream = session->insecure_stream;
     session->datastore = connection_param->local_node->repo->config->datastore;
     session->filestore = connection_param->local_node->repo->config->filestore;
+    connection_param->session = session;
 
-    libp2p_logger_info("null", "Connection %d, count %d\n", connection_param->file_descriptor, *(connection_param->count));
-
-	if (libp2p_net_multistream_negotiate(session)) {
-		// Someone has connected and successfully negotiated multistream. Now talk to them...
-		int unsuccessful_max = 30;
-		int unsuccessful_counter = 0;
-		for(;;) {
-			// Wait for them to ask something...
-			unsigned char* results = NULL;
-			size_t bytes_read = 0;
-			if (null_shutting_down) {
-				libp2p_logger_debug("null", "%s null shutting down before read.\n", connection_param->local_node->identity->peer->id);
-				// this service is shutting down. Ignore the request and exit the loop
-				break;
-			}
-			// see if we have something to read
-			retVal = session->default_stream->peek(session);
-			if (retVal < 0) { // error
-				libp2p_logger_debug("null", "Peer returned %d. Exiting loop\n", retVal);
-				retVal = -1;
-				break;
-			}
-			if (retVal == 0) { // nothing to read
-				sleep(1);
-				unsuccessful_counter++;
-				if (unsuccessful_counter >= unsuccessful_max) {
-					libp2p_logger_debug("null", "We've tried %d times in the daemon loop. Exiting.\n", unsuccessful_counter);
-					retVal = -1;
-					break;
-				}
-				continue;
-			}
-			if (retVal > 0 && !session->default_stream->read(session, &results, &bytes_read, DEFAULT_NETWORK_TIMEOUT) ) {
-				// it said it was ready, but something happened
-				libp2p_logger_debug("null", "Peek said there was something there, but there was not. Exiting.\n");
-				retVal = -1;
-				break;
-			}
-			if (null_shutting_down) {
-				libp2p_logger_debug("null", "%s null shutting down after read.\n", connection_param->local_node->identity->peer->id);
-				// this service is shutting down. Ignore the request and exit the loop
-				retVal = -1;
-				break;
-			}
+    pthread_mutex_lock(&null_count_lock);
+    int count = *(connection_param->count);
+    pthread_mutex_unlock(&null_count_lock);
+    libp2p_logger_info("null", "Connection %d, count %d\n", connection_param->file_descriptor, count);
 
-			// We actually got something. Process the request...
-			unsuccessful_counter = 0;
-			libp2p_logger_debug("null", "Read %lu bytes from a stream tranaction\n", bytes_read);
-			retVal = libp2p_protocol_marshal(results, bytes_read, session, connection_param->local_node->protocol_handlers);
-			free(results);
-			if (retVal == -1) {
-				libp2p_logger_debug("null", "protocol_marshal returned error.\n");
-				break;
-			} else if (retVal == 0) {
-				// clean up, but let someone else handle this from now on
-				libp2p_logger_debug("null", "protocol_marshal returned 0. The daemon will no longer handle this.\n");
-				break;
-			} else {
-				libp2p_logger_debug("null", "protocol_marshal returned 1. Looping again.\n");
-			}
-		}
-   	} else {
+	if (!libp2p_net_multistream_negotiate(session)) {
    		libp2p_logger_log("null", LOGLEVEL_DEBUG, "Multistream negotiation failed\n");
-   	}
+		ipfs_null_connection_end(connection_param, 1);
+		return;
+	}
+	// Someone has connected and successfully negotiated multistream. Wait for them to ask something...
+	connection_param->last_read = time(NULL);
+	if (!ipfs_null_connection_watch(connection_param, EPOLL_CTL_ADD))
+		ipfs_null_connection_end(connection_param, 1);
+}
 
-	(*(connection_param->count))--; // update counter.
-	if (connection_param->ip != NULL)
-		free(connection_param->ip);
-	free (connection_param);
-	if (retVal != 0) {
-		libp2p_logger_debug("null", "%s Freeing session context.\n", connection_param->local_node->identity->peer->id);
-		//libp2p_session_context_free(session);
+/***
+ * Accept the connections that are waiting, and negotiate with them on the workers
+ * @param listen_param the listen parameters
+ * @param socketfd the listening socket
+ * @param epoll_descriptor where the connections are watched
+ * @param count the number of connections
+ * @param thpool the workers
+ */
+void ipfs_null_accept(struct IpfsNodeListenParams* listen_param, int socketfd, int epoll_descriptor, int* count, threadpool thpool) {
+	for(;;) {
+		// the socket does not block, so this stops when there are no more
+		int s = socket_accept4(socketfd, &(listen_param->ipv4), &(listen_param->port));
+		if (s < 0)
+			return;
+		pthread_mutex_lock(&null_count_lock);
+		int full = (*count >= CONNECTIONS);
+		if (!full)
+			(*count)++;
+		pthread_mutex_unlock(&null_count_lock);
+		if (full) { // limit reached.
+			close (s);
+			continue;
+		}
+
+		struct null_connection_params* connection_param = malloc (sizeof (struct null_connection_params));
+		if (connection_param == NULL) {
+			close(s);
+			pthread_mutex_lock(&null_count_lock);
+			(*count)--;
+			pthread_mutex_unlock(&null_count_lock);
+			continue;
+		}
+		// a peer that is slow to send or to take what it is sent only holds a worker for so long
+		struct timeval timeout;
+		timeout.tv_sec = NULL_IO_TIMEOUT_SECONDS;
+		timeout.tv_usec = 0;
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval));
+		connection_param->file_descriptor = s;
+		connection_param->count = count;
+		connection_param->local_node = listen_param->local_node;
+		connection_param->port = listen_param->port;
+		connection_param->epoll_descriptor = epoll_descriptor;
+		connection_param->thpool = thpool;
+		connection_param->session = NULL;
+		connection_param->last_read = time(NULL);
+		connection_param->job_started = 0;
+		connection_param->ip = malloc(INET_ADDRSTRLEN);
+		if (connection_param->ip == NULL || inet_ntop(AF_INET, &(listen_param->ipv4), connection_param->ip, INET_ADDRSTRLEN) == NULL) {
+			free(connection_param->ip);
+			connection_param->ip = NULL;
+			connection_param->port = 0;
+		}
+		// the worker has it until it is watched
+		connection_param->busy = 1;
+		pthread_mutex_lock(&null_count_lock);
+		connection_param->prior = NULL;
+		connection_param->next = null_connections;
+		if (null_connections != NULL)
+			null_connections->prior = connection_param;
+		null_connections = connection_param;
+		pthread_mutex_unlock(&null_count_lock);
+		// negotiation can take a while, so it is done by a worker
+		if (thpool_add_work(thpool, ipfs_null_connection, connection_param) != 0)
+			ipfs_null_connection_end(connection_param, 1);
 	}
-    return;
 }
 
 /***
@@ -134,17 +422,35 @@ void ipfs_null_connection (void *ptr) {
  */
 void* ipfs_null_listen (void *ptr)
 {
-    int socketfd, s, count = 0;
-    threadpool thpool = thpool_init(25);
+    int socketfd, count = 0;
     struct IpfsNodeListenParams *listen_param;
-    struct null_connection_params *connection_param;
+    struct epoll_event events[NULL_MAX_EVENTS];
 
     listen_param = (struct IpfsNodeListenParams*) ptr;
+    // a daemon that was stopped in this process can be started again
+    null_shutting_down = 0;
 
     if ((socketfd = socket_listen(socket_tcp4(), &(listen_param->ipv4), &(listen_param->port))) <= 0) {
         libp2p_logger_error("null", "Failed to init null router. Address: %d, Port: %d\n", listen_param->ipv4, listen_param->port);
         return (void*) 2;
     }
+    // new connections are accepted until there are no more
+    fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL, 0) | O_NONBLOCK);
+
+    // the listening socket, and every connection that is waiting for its next frame
+    int epoll_descriptor = epoll_create1(0);
+    if (epoll_descriptor < 0) {
+        libp2p_logger_error("null", "Unable to create epoll descriptor.\n");
+        close(socketfd);
+        return (void*) 2;
+    }
+    struct epoll_event listen_event;
+    memset(&listen_event, 0, sizeof(struct epoll_event));
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = NULL;
+    epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, socketfd, &listen_event);
+
+    threadpool thpool = thpool_init(NULL_WORKERS);
 
     libp2p_logger_error("null", "Ipfs listening on %d\n", listen_param->port);
 
@@ -152,56 +458,52 @@ void* ipfs_null_listen (void *ptr)
     struct Libp2pLinkedList* current_peer_entry = NULL;
     if (listen_param->local_node->peerstore->head_entry != NULL)
     		current_peer_entry = listen_param->local_node->peerstore->head_entry;
+    time_t last_maintenance = time(NULL);
 
-    // the main loop, listening for new connections
+    // the main loop, listening for new connections and for frames on the ones we have
     for (;;) {
-		//libp2p_logger_debug("null", "%s Attempting socket read with fd %d.\n", listen_param->local_node->identity->peer->id, socketfd);
-		int numDescriptors = socket_read_select4(socketfd, 2);
+		int numDescriptors = epoll_wait(epoll_descriptor, events, NULL_MAX_EVENTS, NULL_MAINTENANCE_SECONDS * 1000);
 		if (null_shutting_down) {
 			libp2p_logger_debug("null", "%s null_listen shutting down.\n", listen_param->local_node->identity->peer->id);
 			break;
 		}
-		if (numDescriptors > 0) {
-			s = socket_accept4(socketfd, &(listen_param->ipv4), &(listen_param->port));
-			if (count >= CONNECTIONS) { // limit reached.
-				close (s);
-				continue;
+		for(int i = 0; i < numDescriptors; i++) {
+			if (events[i].data.ptr == NULL) {
+				ipfs_null_accept(listen_param, socketfd, epoll_descriptor, &count, thpool);
+			} else {
+				// the connection is not watched again until the worker is done with it
+				struct null_connection_params* connection_param = (struct null_connection_params*)events[i].data.ptr;
+				pthread_mutex_lock(&null_count_lock);
+				connection_param->busy = 1;
+				pthread_mutex_unlock(&null_count_lock);
+				if (thpool_add_work(thpool, ipfs_null_connection_read, connection_param) != 0)
+					ipfs_null_connection_end(connection_param, 1);
 			}
-
-			count++;
-			connection_param = malloc (sizeof (struct null_connection_params));
-			if (connection_param) {
-				connection_param->file_descriptor = s;
-				connection_param->count = &count;
-				connection_param->local_node = listen_param->local_node;
-				connection_param->port = listen_param->port;
-				connection_param->ip = malloc(INET_ADDRSTRLEN);
-				if (inet_ntop(AF_INET, &(listen_param->ipv4), connection_param->ip, INET_ADDRSTRLEN) == NULL) {
-					free(connection_param->ip);
-					connection_param->ip = NULL;
-					connection_param->port = 0;
-				}
-				// Create pthread for ipfs_null_connection.
-				thpool_add_work(thpool, ipfs_null_connection, connection_param);
+		}
+		if (time(NULL) - last_maintenance >= NULL_MAINTENANCE_SECONDS) {
+			// do maintenance
+			last_maintenance = time(NULL);
+			ipfs_null_connection_cut_slow();
+			ipfs_null_connection_close_idle(0);
+			if (current_peer_entry != NULL) {
+				struct PeerEntry* entry = current_peer_entry->item;
+				int started = 1;
+				// the ping waits on the peer, so it is done by a worker
+				if (!entry->peer->is_local && entry->peer->connection_type == CONNECTION_TYPE_CONNECTED)
+					started = ipfs_null_ping_start(listen_param->local_node, entry->peer, thpool);
+				if (started)
+					current_peer_entry = current_peer_entry->next;
 			}
-    		} else {
-    			// timeout... do maintenance
-    			struct PeerEntry* entry = current_peer_entry->item;
-    			if (current_peer_entry != NULL && !entry->peer->is_local && entry->peer->connection_type == CONNECTION_TYPE_CONNECTED) {
-    				libp2p_logger_debug("null", "Attempting to ping %s.\n", entry->peer->id);
-    				if (!listen_param->local_node->routing->Ping(listen_param->local_node->routing, entry->peer)) {
-    					entry->peer->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
-    				}
-    			}
-    			if (current_peer_entry != NULL)
-    				current_peer_entry = current_peer_entry->next;
-    			if (current_peer_entry == NULL)
-    				current_peer_entry = listen_param->local_node->peerstore->head_entry;
-    		}
+			if (current_peer_entry == NULL)
+				current_peer_entry = listen_param->local_node->peerstore->head_entry;
+		}
     }
 
+    // the workers are done with the connections after this
     thpool_destroy(thpool);
+    ipfs_null_connection_close_idle(1);
 
+    close(epoll_descriptor);
     close(socketfd);
 
     return (void*) 2;
@@ -1,8 +1,9 @@
 /**
  * Methods for the Bitswap exchange
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
-#include <unistd.h> // for sleep()
+#include <time.h>
 #include "libp2p/utils/logger.h"
 #include "ipfs/core/ipfs_node.h"
 #include "ipfs/exchange/exchange.h"
@@ -10,6 +11,8 @@
 #include "ipfs/exchange/bitswap/message.h"
 #include "ipfs/exchange/bitswap/network.h"
 #include "ipfs/exchange/bitswap/peer_request_queue.h"
+#include "ipfs/exchange/bitswap/session.h"
+#include "ipfs/exchange/bitswap/verify.h"
 #include "ipfs/exchange/bitswap/want_manager.h"
 
 int ipfs_bitswap_can_handle(const uint8_t* incoming, size_t incoming_size) {
@@ -60,6 +63,13 @@ struct Exchange* ipfs_bitswap_new(struct IpfsNode* ipfs_node) {
 			free(exchange);
 			return NULL;
 		}
+		bitswapContext->verifier = ipfs_bitswap_verifier_new(ipfs_node->repo->config->bitswap.verify_workers);
+		if (bitswapContext->verifier == NULL) {
+			ipfs_bitswap_engine_free(bitswapContext->bitswap_engine);
+			free(bitswapContext);
+			free(exchange);
+			return NULL;
+		}
 		bitswapContext->localWantlist = ipfs_bitswap_wantlist_queue_new();
 		bitswapContext->peerRequestQueue = ipfs_bitswap_peer_request_queue_new();
 		bitswapContext->ipfsNode = ipfs_node;
@@ -70,6 +80,9 @@ struct Exchange* ipfs_bitswap_new(struct IpfsNode* ipfs_node) {
 		exchange->HasBlock = ipfs_bitswap_has_block;
 		exchange->GetBlock = ipfs_bitswap_get_block;
 		exchange->GetBlocks = ipfs_bitswap_get_blocks;
+		exchange->GetBlocksStream = ipfs_bitswap_get_blocks_stream;
+		exchange->NewSession = ipfs_bitswap_new_session;
+		exchange->CloseSession = ipfs_bitswap_close_session;
 
 		// Start the threads for the network
 		ipfs_bitswap_engine_start(bitswapContext);
@@ -89,6 +102,9 @@ int ipfs_bitswap_free(struct Exchange* exchange) {
 			struct BitswapContext* bitswapContext = (struct BitswapContext*) exchange->exchangeContext;
 			if (bitswapContext != NULL)
 				ipfs_bitswap_engine_stop(bitswapContext);
+			// the blocks still being checked go to the wantlist
+			ipfs_bitswap_verifier_free(bitswapContext->verifier);
+			bitswapContext->verifier = NULL;
 			if (bitswapContext->localWantlist != NULL) {
 				ipfs_bitswap_wantlist_queue_free(bitswapContext->localWantlist);
 				bitswapContext->localWantlist = NULL;
@@ -127,22 +143,37 @@ int ipfs_bitswap_close(struct Exchange* exchange) {
  * adds the block to the blockstore. This still has to be sorted.
  */
 int ipfs_bitswap_has_block(struct Exchange* exchange, struct Block* block) {
+	ipfs_bitswap_receive_block((struct BitswapContext*)exchange->exchangeContext, block, NULL);
+	// TODO: Announce to world that we now have the block
+	return 0;
+}
+
+/***
+ * Handle a block that arrived: store it, and hand it to whoever wanted it
+ * @param context the BitswapContext
+ * @param block the block (this takes it)
+ * @param from the peer that sent it, or NULL
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_receive_block(struct BitswapContext* context, struct Block* block, struct Libp2pPeer* from) {
 	// add the block to the blockstore
-	struct BitswapContext* context = exchange->exchangeContext;
 	context->ipfsNode->blockstore->Put(context->ipfsNode->blockstore->blockstoreContext, block);
-	// update requests
-	struct WantListQueueEntry* queueEntry = ipfs_bitswap_wantlist_queue_find(context->localWantlist, block->cid);
-	if (queueEntry != NULL) {
-		queueEntry->block = block;
+	// the peers that wanted it before it was here get another look
+	struct Cid* cid = ipfs_cid_copy(block->cid);
+	// update requests, and wake whoever is waiting for it. The sessions that wanted it remember who sent it.
+	ipfs_bitswap_wantlist_queue_entry_set_block(context->localWantlist, NULL, block, from);
+	if (cid != NULL) {
+		if (ipfs_bitswap_peer_request_queue_has_block(context->peerRequestQueue, cid))
+			ipfs_bitswap_engine_peer_requests_changed(context->bitswap_engine);
+		ipfs_cid_free(cid);
 	}
-	// TODO: Announce to world that we now have the block
-	return 0;
+	return 1;
 }
 
 /**
  * Implements the Exchange->GetBlock method
- * We're asking for this method to get the block from peers. Perhaps this should be
- * taking in a pointer to a callback, as this could take a while (or fail).
+ * We're asking for this method to get the block from peers. This waits until the block
+ * arrives, or until Bitswap.TimeoutSeconds in the config have passed.
  * @param exchangeContext a BitswapContext
  * @param cid the Cid to look for
  * @param block a pointer to where to put the result
@@ -152,47 +183,171 @@ int ipfs_bitswap_get_block(struct Exchange* exchange, struct Cid* cid, struct Bl
 	struct BitswapContext* bitswapContext = (struct BitswapContext*)exchange->exchangeContext;
 	if (bitswapContext != NULL) {
 		// check locally first
-		if (bitswapContext->ipfsNode->blockstore->Get(bitswapContext->ipfsNode->blockstore->blockstoreContext, cid, block))
+		if (ipfs_bitswap_wantlist_get_block_locally(bitswapContext, cid, block))
 			return 1;
 		// now ask the network
-		//NOTE: this timeout should be configurable
-		int timeout = 60;
-		int waitSecs = 1;
-		int timeTaken = 0;
+		struct WantListQueue* wantlist = bitswapContext->localWantlist;
 		struct WantListSession wantlist_session;
 		wantlist_session.type = WANTLIST_SESSION_TYPE_LOCAL;
 		wantlist_session.context = (void*)bitswapContext->ipfsNode;
+		wantlist_session.bitswap_session = NULL;
 		struct WantListQueueEntry* want_entry = ipfs_bitswap_want_manager_add(bitswapContext, cid, &wantlist_session);
 		if (want_entry != NULL) {
-			// loop waiting for it to fill
-			while(1) {
-				if (want_entry->block != NULL) {
-					*block = want_entry->block;
-					// error or not, we no longer need the block (decrement reference count)
-					ipfs_bitswap_want_manager_remove(bitswapContext, cid);
-					if (*block == NULL) {
-						return 0;
-					}
-					return 1;
-				}
-				//TODO: This is a busy-loop. Find another way.
-				timeTaken += waitSecs;
-				if (timeTaken >= timeout) {
-					// It took too long. Stop looking.
-					ipfs_bitswap_want_manager_remove(bitswapContext, cid);
-					break;
-				}
-				sleep(waitSecs);
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += bitswapContext->ipfsNode->repo->config->bitswap.timeout_seconds;
+			// wait for it to fill
+			pthread_mutex_lock(&wantlist->wantlist_mutex);
+			while (want_entry->block == NULL) {
+				if (pthread_cond_timedwait(&want_entry->block_arrived, &wantlist->wantlist_mutex, &deadline) != 0)
+					break; // It took too long. Stop looking.
 			}
+			// the entry (and its block) is freed once nobody wants it, so keep a copy
+			*block = (want_entry->block == NULL ? NULL : ipfs_block_copy(want_entry->block));
+			pthread_mutex_unlock(&wantlist->wantlist_mutex);
+			// error or not, we no longer need the block (decrement reference count)
+			ipfs_bitswap_wantlist_queue_remove(wantlist, cid, &wantlist_session);
+			return *block != NULL;
 		}
 	}
 	return 0;
 }
 
+/***
+ * Implements the Exchange->GetBlocksStream method
+ * @param exchange the exchange
+ * @param session a BitswapSession from ipfs_bitswap_new_session, or NULL
+ * @param cids the Cids to look for
+ * @param block_received called with each block. It owns the block, and returns false(0) to stop.
+ * @param arg passed to block_received
+ * @returns true(1) if all blocks were found, false(0) otherwise
+ */
+int ipfs_bitswap_get_blocks_stream(struct Exchange* exchange, void* session, struct Libp2pVector* cids, int (*block_received)(struct Block* block, void* arg), void* arg) {
+	struct BitswapContext* bitswapContext = (struct BitswapContext*)exchange->exchangeContext;
+	struct WantListQueue* wantlist = bitswapContext->localWantlist;
+	struct Cid** wanted = NULL;
+	struct WantListQueueEntry** entries = NULL;
+	struct WantListWaiter* waiter = NULL;
+	struct WantListSession wantlist_session;
+	size_t wanted_size = 0;
+	size_t remaining = 0;
+	int stopped = 0;
+	int added = 0;
+	int retVal = 0;
+
+	wanted = (struct Cid**)malloc(sizeof(struct Cid*) * (cids->total + 1));
+	entries = (struct WantListQueueEntry**)malloc(sizeof(struct WantListQueueEntry*) * (cids->total + 1));
+	waiter = ipfs_bitswap_wantlist_waiter_new();
+	if (wanted == NULL || entries == NULL || waiter == NULL)
+		goto exit;
+
+	// check locally first
+	for(int i = 0; i < cids->total && !stopped; i++) {
+		struct Cid* cid = (struct Cid*)libp2p_utils_vector_get(cids, i);
+		struct Block* block = NULL;
+		if (ipfs_bitswap_wantlist_get_block_locally(bitswapContext, cid, &block))
+			stopped = !block_received(block, arg);
+		else
+			wanted[wanted_size++] = cid;
+	}
+	if (stopped)
+		goto exit;
+	if (wanted_size == 0) {
+		retVal = 1;
+		goto exit;
+	}
+
+	// now ask the network for all of them at once
+	wantlist_session.type = WANTLIST_SESSION_TYPE_LOCAL;
+	wantlist_session.context = (void*)bitswapContext->ipfsNode;
+	wantlist_session.bitswap_session = (struct BitswapSession*)session;
+	if (!ipfs_bitswap_wantlist_queue_add_many(wantlist, wanted, wanted_size, &wantlist_session, entries))
+		goto exit;
+	added = 1;
+	ipfs_bitswap_engine_wantlist_changed(bitswapContext->bitswap_engine);
+
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	for(size_t i = 0; i < wanted_size; i++)
+		ipfs_bitswap_wantlist_queue_entry_watch(entries[i], waiter);
+	remaining = wanted_size;
+	while (remaining > 0 && !stopped) {
+		if (waiter->arrived->total == 0) {
+			// give up when nothing has arrived for a while
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += bitswapContext->ipfsNode->repo->config->bitswap.timeout_seconds;
+			while (waiter->arrived->total == 0) {
+				if (pthread_cond_timedwait(&waiter->block_arrived, &wantlist->wantlist_mutex, &deadline) != 0)
+					break;
+			}
+			if (waiter->arrived->total == 0)
+				break;
+		}
+		struct WantListQueueEntry* entry = (struct WantListQueueEntry*)libp2p_utils_vector_get(waiter->arrived, waiter->arrived->total - 1);
+		libp2p_utils_vector_delete(waiter->arrived, waiter->arrived->total - 1);
+		remaining--;
+		// the entry is freed once nobody wants it, so hand over a copy
+		struct Block* block = ipfs_block_copy(entry->block);
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
+		stopped = (block == NULL || !block_received(block, arg));
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
+	}
+	for(size_t i = 0; i < wanted_size; i++)
+		ipfs_bitswap_wantlist_queue_entry_unwatch(entries[i], waiter);
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	retVal = (remaining == 0 && !stopped);
+
+	exit:
+	if (added) {
+		// error or not, we no longer need the blocks (decrement reference count)
+		for(size_t i = 0; i < wanted_size; i++)
+			ipfs_bitswap_wantlist_queue_remove(wantlist, wanted[i], &wantlist_session);
+	}
+	ipfs_bitswap_wantlist_waiter_free(waiter);
+	if (entries != NULL)
+		free(entries);
+	if (wanted != NULL)
+		free(wanted);
+	return retVal;
+}
+
+/***
+ * Used by ipfs_bitswap_get_blocks to collect the blocks
+ * @param block the block that arrived
+ * @param arg the vector of blocks
+ * @returns true(1)
+ */
+int ipfs_bitswap_get_blocks_collect(struct Block* block, void* arg) {
+	libp2p_utils_vector_add((struct Libp2pVector*)arg, block);
+	return 1;
+}
+
 /**
  * Implements the Exchange->GetBlocks method
  */
-int ipfs_bitswap_get_blocks(struct Exchange* exchange, struct Libp2pVector* Cids, struct Libp2pVector** blocks) {
-	// TODO: Implement this method
-	return 0;
+int ipfs_bitswap_get_blocks(struct Exchange* exchange, struct Libp2pVector* cids, struct Libp2pVector** blocks) {
+	*blocks = libp2p_utils_vector_new(1);
+	if (*blocks == NULL)
+		return 0;
+	return ipfs_bitswap_get_blocks_stream(exchange, NULL, cids, ipfs_bitswap_get_blocks_collect, *blocks);
+}
+
+/***
+ * Implements the Exchange->NewSession method
+ * @param exchange the exchange
+ * @returns a BitswapSession, or NULL on error
+ */
+void* ipfs_bitswap_new_session(struct Exchange* exchange) {
+	struct BitswapContext* bitswapContext = (struct BitswapContext*)exchange->exchangeContext;
+	return ipfs_bitswap_session_new(bitswapContext->ipfsNode->repo->config->bitswap.provider_delay_milliseconds);
+}
+
+/***
+ * Implements the Exchange->CloseSession method
+ * @param exchange the exchange
+ * @param session the BitswapSession
+ * @returns true(1)
+ */
+int ipfs_bitswap_close_session(struct Exchange* exchange, void* session) {
+	return ipfs_bitswap_session_free((struct BitswapSession*)session);
 }
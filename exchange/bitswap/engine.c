@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
 #include <unistd.h>
+#include <time.h>
 #include "libp2p/utils/logger.h"
 #include "ipfs/core/null.h"
 #include "ipfs/exchange/bitswap/engine.h"
@@ -17,6 +19,11 @@ struct BitswapEngine* ipfs_bitswap_engine_new() {
 	struct BitswapEngine* engine = (struct BitswapEngine*) malloc(sizeof(struct BitswapEngine));
 	if (engine != NULL) {
 		engine->shutting_down = 0;
+		pthread_mutex_init(&engine->lock, NULL);
+		pthread_cond_init(&engine->wantlist_changed, NULL);
+		pthread_cond_init(&engine->peer_requests_changed, NULL);
+		engine->wantlist_version = 0;
+		engine->peer_requests_version = 0;
 	}
 	return engine;
 }
@@ -27,27 +34,140 @@ struct BitswapEngine* ipfs_bitswap_engine_new() {
  * @returns true(1)
  */
 int ipfs_bitswap_engine_free(struct BitswapEngine* engine) {
-	free(engine);
+	if (engine != NULL) {
+		pthread_mutex_destroy(&engine->lock);
+		pthread_cond_destroy(&engine->wantlist_changed);
+		pthread_cond_destroy(&engine->peer_requests_changed);
+		free(engine);
+	}
 	return 1;
 }
 
+/***
+ * Wake the thread that processes the local wantlist
+ * @param engine the engine
+ */
+void ipfs_bitswap_engine_wantlist_changed(struct BitswapEngine* engine) {
+	pthread_mutex_lock(&engine->lock);
+	engine->wantlist_version++;
+	pthread_cond_signal(&engine->wantlist_changed);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+/***
+ * Wake the thread that processes the requests to and from peers
+ * @param engine the engine
+ */
+void ipfs_bitswap_engine_peer_requests_changed(struct BitswapEngine* engine) {
+	pthread_mutex_lock(&engine->lock);
+	engine->peer_requests_version++;
+	pthread_cond_signal(&engine->peer_requests_changed);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+/***
+ * The current version of something that changes
+ * @param engine the engine
+ * @param version the version to read
+ * @returns the version
+ */
+unsigned long ipfs_bitswap_engine_get_version(struct BitswapEngine* engine, const unsigned long* version) {
+	pthread_mutex_lock(&engine->lock);
+	unsigned long retVal = *version;
+	pthread_mutex_unlock(&engine->lock);
+	return retVal;
+}
+
+/***
+ * Sleep until there is a change that has not been seen, the engine shuts down, or some time passes
+ * @param engine the engine
+ * @param changed the condition that is signalled by a change
+ * @param version the version that is incremented by a change
+ * @param seen the version when the caller last looked for work
+ * @param milliseconds the most time to wait, or 0 to wait for a change
+ */
+void ipfs_bitswap_engine_wait(struct BitswapEngine* engine, pthread_cond_t* changed, const unsigned long* version, unsigned long seen, int milliseconds) {
+	struct timespec deadline;
+	if (milliseconds > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += milliseconds / 1000;
+		deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&engine->lock);
+	while (*version == seen && !engine->shutting_down) {
+		if (milliseconds > 0) {
+			if (pthread_cond_timedwait(changed, &engine->lock, &deadline) != 0)
+				break;
+		} else {
+			pthread_cond_wait(changed, &engine->lock);
+		}
+	}
+	pthread_mutex_unlock(&engine->lock);
+}
+
+/***
+ * How long the peer request processor waits next time it has nothing to do. Right after
+ * a request or a message, an answer is likely soon, so the network is looked at again
+ * quickly. Each quiet pass doubles the wait, up to Bitswap.PollMilliseconds.
+ * @param engine the engine
+ * @param seen the version of the peer requests last seen, which is brought up to date
+ * @param did_some_processing true(1) if the last pass handled a message or a request
+ * @param milliseconds the last wait
+ * @param max_milliseconds the longest wait
+ * @returns the next wait, in milliseconds
+ */
+int ipfs_bitswap_engine_next_poll(struct BitswapEngine* engine, unsigned long* seen, int did_some_processing, int milliseconds, int max_milliseconds) {
+	unsigned long version = ipfs_bitswap_engine_get_version(engine, &engine->peer_requests_version);
+	int changed = (version != *seen);
+	*seen = version;
+	if (changed || did_some_processing)
+		return BITSWAP_ENGINE_POLL_MIN_MILLISECONDS;
+	if (milliseconds >= max_milliseconds / 2)
+		return max_milliseconds;
+	return milliseconds * 2;
+}
+
 /***
  * A separate thread that processes the queue of local requests
  * @param context the context
  */
 void* ipfs_bitswap_engine_wantlist_processor_start(void* ctx) {
 	struct BitswapContext* context = (struct BitswapContext*)ctx;
+	struct BitswapEngine* engine = context->bitswap_engine;
+	struct WantListQueueEntry* batch[BITSWAP_WANTLIST_BATCH_SIZE];
+	// the peers that have new wants, so each gets one message per batch
+	struct Libp2pVector* peer_requests = libp2p_utils_vector_new(1);
+	if (peer_requests == NULL)
+		return NULL;
 	// the loop
-	while (!context->bitswap_engine->shutting_down) {
-		struct WantListQueueEntry* item = ipfs_bitswap_wantlist_queue_pop(context->localWantlist);
-		if (item != NULL) {
-			// if there is something on the queue process it.
-			ipfs_bitswap_wantlist_process_entry(context, item);
-		} else {
-			// if there is nothing on the queue, wait...
-			sleep(2);
+	while (!engine->shutting_down) {
+		unsigned long seen = ipfs_bitswap_engine_get_version(engine, &engine->wantlist_version);
+		int popped = 0;
+		while (popped < BITSWAP_WANTLIST_BATCH_SIZE && (batch[popped] = ipfs_bitswap_wantlist_queue_pop(context->localWantlist)) != NULL) {
+			ipfs_bitswap_wantlist_process_entry(context, batch[popped], peer_requests);
+			popped++;
+		}
+		// released after the batch, so one that failed is not popped again in the same batch
+		for(int i = 0; i < popped; i++)
+			ipfs_bitswap_wantlist_queue_release(context->localWantlist, batch[i]);
+		for(int i = 0; i < peer_requests->total; i++)
+			ipfs_bitswap_peer_request_process_entry(context, (struct PeerRequest*)libp2p_utils_vector_get(peer_requests, i));
+		while (peer_requests->total > 0)
+			libp2p_utils_vector_delete(peer_requests, peer_requests->total - 1);
+
+		if (popped < BITSWAP_WANTLIST_BATCH_SIZE) {
+			// the rest have to wait (for a retry, or for the peers of their session).
+			// Wait until the first one is due, or until something is added.
+			long due = ipfs_bitswap_wantlist_queue_next_due(context->localWantlist);
+			if (due != 0)
+				ipfs_bitswap_engine_wait(engine, &engine->wantlist_changed, &engine->wantlist_version, seen, (due < 0 ? 0 : (int)due));
 		}
 	}
+	libp2p_utils_vector_free(peer_requests);
 	return NULL;
 }
 
@@ -57,16 +177,25 @@ void* ipfs_bitswap_engine_wantlist_processor_start(void* ctx) {
  */
 void* ipfs_bitswap_engine_peer_request_processor_start(void* ctx) {
 	struct BitswapContext* context = (struct BitswapContext*)ctx;
+	struct BitswapEngine* engine = context->bitswap_engine;
+	// how often to look for messages from peers when there is nothing else to do
+	int poll_max = context->ipfsNode->repo->config->bitswap.poll_milliseconds;
+	if (poll_max < BITSWAP_ENGINE_POLL_MIN_MILLISECONDS)
+		poll_max = BITSWAP_ENGINE_POLL_MIN_MILLISECONDS;
+	int poll_milliseconds = BITSWAP_ENGINE_POLL_MIN_MILLISECONDS;
 	// the loop
 	struct Libp2pLinkedList* current = context->ipfsNode->peerstore->head_entry;
 	int did_some_processing = 0;
+	unsigned long seen = ipfs_bitswap_engine_get_version(engine, &engine->peer_requests_version);
 	while (1) {
-		if (context->bitswap_engine->shutting_down) // system shutting down
+		if (engine->shutting_down) // system shutting down
 			break;
 
 		if (current == NULL) { // the PeerStore is empty
 			libp2p_logger_debug("bitswap_engine", "Peerstore is empty. Pausing.\n");
-			sleep(1);
+			ipfs_bitswap_engine_wait(engine, &engine->peer_requests_changed, &engine->peer_requests_version, seen, poll_milliseconds);
+			poll_milliseconds = ipfs_bitswap_engine_next_poll(engine, &seen, 0, poll_milliseconds, poll_max);
+			current = context->ipfsNode->peerstore->head_entry;
 			continue;
 		}
 		if (current->item == NULL) {
@@ -117,25 +246,20 @@ void* ipfs_bitswap_engine_peer_request_processor_start(void* ctx) {
 				//libp2p_logger_debug("bitswap_engine", "We are not connected to this peer %s.\n", current_peer_entry->id);
 			}
 		}
-		// attempt to get queue and process
-		struct PeerRequestEntry* entry = ipfs_bitswap_peer_request_queue_find_entry(context->peerRequestQueue, current_peer_entry);
-		if (entry != NULL) {
-			//libp2p_logger_debug("bitswap_engine", "Processing queue for peer %s.\n", current_peer_entry->id);
-			// we have a queue. Do some queue processing
-			struct PeerRequest* item = entry->current;
-			if (item != NULL) {
-				// if there is something on the queue process it.
-				if (ipfs_bitswap_peer_request_process_entry(context, item))
-					did_some_processing = 1;
-			}
+		// serve the next peer in line, so a peer that wants a lot can not hold up the others
+		struct PeerRequest* item = ipfs_bitswap_peer_request_queue_pop(context->peerRequestQueue);
+		if (item != NULL) {
+			if (ipfs_bitswap_peer_request_process_entry(context, item))
+				did_some_processing = 1;
 		}
 		// get next peer (or reset to head entry)
 		if (current->next == NULL) {
 			current = context->ipfsNode->peerstore->head_entry;
 			if (!did_some_processing) {
-				// we did nothing in this run through the peerstore. sleep for a sec
-				sleep(1);
+				// we did nothing in this run through the peerstore. Wait for a request, or until it is time to look at the network again
+				ipfs_bitswap_engine_wait(engine, &engine->peer_requests_changed, &engine->peer_requests_version, seen, poll_milliseconds);
 			}
+			poll_milliseconds = ipfs_bitswap_engine_next_poll(engine, &seen, did_some_processing, poll_milliseconds, poll_max);
 			did_some_processing = 0;
 		}
 		else {
@@ -173,7 +297,12 @@ int ipfs_bitswap_engine_start(const struct BitswapContext* context) {
  * @returns true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_engine_stop(const struct BitswapContext* context) {
-	context->bitswap_engine->shutting_down = 1;
+	struct BitswapEngine* engine = context->bitswap_engine;
+	pthread_mutex_lock(&engine->lock);
+	engine->shutting_down = 1;
+	pthread_cond_broadcast(&engine->wantlist_changed);
+	pthread_cond_broadcast(&engine->peer_requests_changed);
+	pthread_mutex_unlock(&engine->lock);
 
 	int error1 = pthread_join(context->bitswap_engine->wantlist_processor_thread, NULL);
 	int error2 = pthread_join(context->bitswap_engine->peer_request_processor_thread, NULL);
@@ -0,0 +1,60 @@
+/***
+ * The accounts of what was exchanged with a peer. See ledger.h
+ */
+#include "ipfs/exchange/bitswap/ledger.h"
+
+/***
+ * Set all the counters of a ledger to 0
+ * @param ledger the ledger
+ */
+void ipfs_bitswap_ledger_init(struct BitswapLedger* ledger) {
+	ledger->bytes_sent = 0;
+	ledger->bytes_received = 0;
+	ledger->blocks_sent = 0;
+	ledger->blocks_received = 0;
+}
+
+/***
+ * Record blocks that were sent to the peer
+ * @param ledger the ledger
+ * @param blocks the number of blocks
+ * @param bytes the size of the blocks
+ */
+void ipfs_bitswap_ledger_sent(struct BitswapLedger* ledger, unsigned long blocks, unsigned long long bytes) {
+	ledger->bytes_sent += bytes;
+	ledger->blocks_sent += blocks;
+}
+
+/***
+ * Record blocks that the peer sent us
+ * @param ledger the ledger
+ * @param blocks the number of blocks
+ * @param bytes the size of the blocks
+ */
+void ipfs_bitswap_ledger_received(struct BitswapLedger* ledger, unsigned long blocks, unsigned long long bytes) {
+	ledger->bytes_received += bytes;
+	ledger->blocks_received += blocks;
+}
+
+/***
+ * How much more we sent the peer than it sent us
+ * @param ledger the ledger
+ * @returns the bytes sent divided by the bytes received (plus one)
+ */
+double ipfs_bitswap_ledger_debt_ratio(const struct BitswapLedger* ledger) {
+	return (double)ledger->bytes_sent / (double)(ledger->bytes_received + 1);
+}
+
+/***
+ * The share of a round the peer gets
+ * @param ledger the ledger
+ * @returns from 1 (a peer deep in debt) to BITSWAP_LEDGER_MAX_WEIGHT
+ */
+int ipfs_bitswap_ledger_weight(const struct BitswapLedger* ledger) {
+	// a peer that has taken twice what it gave gets half the full share, and so on
+	double ratio = ipfs_bitswap_ledger_debt_ratio(ledger);
+	if (ratio <= 1.0)
+		return BITSWAP_LEDGER_MAX_WEIGHT;
+	int weight = (int)(BITSWAP_LEDGER_MAX_WEIGHT / ratio);
+	return (weight < 1 ? 1 : weight);
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "protobuf.h"
 #include "varint.h"
 #include "libp2p/utils/vector.h"
@@ -477,7 +478,7 @@ size_t ipfs_bitswap_message_protobuf_encode_size(const struct BitswapMessage* me
 		if (message->payload != NULL) {
 			for(int i = 0; i < message->payload->total; i++) {
 				struct Block* entry = (struct Block*) libp2p_utils_vector_get(message->payload, i);
-				total += 11 + ipfs_blocks_block_protobuf_encode_size(entry);
+				total += ipfs_bitswap_message_payload_encode_size(entry);
 			}
 		}
 		if (message->wantlist != NULL) {
@@ -488,6 +489,87 @@ size_t ipfs_bitswap_message_protobuf_encode_size(const struct BitswapMessage* me
 	return total;
 }
 
+/***
+ * The number of bytes a number takes as a varint
+ * @param value the number
+ * @returns the number of bytes
+ */
+size_t ipfs_bitswap_message_varint_size(unsigned long long value) {
+	unsigned char temp[10];
+	size_t bytes = 0;
+	varint_encode(value, temp, sizeof(temp), &bytes);
+	return bytes;
+}
+
+/***
+ * Write the key and length of a length delimited field, so the field itself can be written after it
+ * @param field the field number
+ * @param length the length of the field
+ * @param buffer where to write
+ * @param buffer_length the room in the buffer
+ * @param bytes_written the number of bytes written
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_message_encode_header(int field, unsigned long long length, unsigned char* buffer, size_t buffer_length, size_t* bytes_written) {
+	size_t length_size = ipfs_bitswap_message_varint_size(length);
+	if (buffer_length < 1 + length_size)
+		return 0;
+	buffer[0] = (unsigned char)((field << 3) | WIRETYPE_LENGTH_DELIMITED);
+	varint_encode(length, &buffer[1], length_size, &length_size);
+	*bytes_written = 1 + length_size;
+	return 1;
+}
+
+/***
+ * The number of bytes a Block takes as a payload entry of a BitswapMessage
+ * @param block the block
+ * @returns the number of bytes ipfs_bitswap_message_payload_encode writes for it
+ */
+size_t ipfs_bitswap_message_payload_encode_size(const struct Block* block) {
+	size_t cid_size = ipfs_cid_protobuf_encode_size(block->cid);
+	// the same fields as ipfs_bitswap_message_payload_encode
+	size_t block_size = 1 + ipfs_bitswap_message_varint_size(block->data_length) + block->data_length
+			+ 1 + ipfs_bitswap_message_varint_size(cid_size) + cid_size;
+	return 1 + ipfs_bitswap_message_varint_size(block_size) + block_size;
+}
+
+/***
+ * Encode a Block as a payload entry of a BitswapMessage, straight into the buffer,
+ * so the data of the block is only copied once
+ * @param block the block
+ * @param buffer where to write
+ * @param buffer_length the room in the buffer
+ * @param bytes_written the number of bytes written
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_message_payload_encode(const struct Block* block, unsigned char* buffer, size_t buffer_length, size_t* bytes_written) {
+	size_t bytes_used = 0;
+	*bytes_written = 0;
+	size_t cid_size = ipfs_cid_protobuf_encode_size(block->cid);
+	unsigned char cid[cid_size];
+	if (!ipfs_cid_protobuf_encode(block->cid, cid, cid_size, &cid_size))
+		return 0;
+	// the same fields as ipfs_blocks_block_protobuf_encode: the data, then the cid
+	size_t block_size = 1 + ipfs_bitswap_message_varint_size(block->data_length) + block->data_length
+			+ 1 + ipfs_bitswap_message_varint_size(cid_size) + cid_size;
+	if (!ipfs_bitswap_message_encode_header(2, block_size, buffer, buffer_length, &bytes_used))
+		return 0;
+	*bytes_written += bytes_used;
+	if (!ipfs_bitswap_message_encode_header(1, block->data_length, &buffer[*bytes_written], buffer_length - *bytes_written, &bytes_used)
+			|| buffer_length - *bytes_written - bytes_used < block->data_length)
+		return 0;
+	*bytes_written += bytes_used;
+	memcpy(&buffer[*bytes_written], block->data, block->data_length);
+	*bytes_written += block->data_length;
+	if (!ipfs_bitswap_message_encode_header(2, cid_size, &buffer[*bytes_written], buffer_length - *bytes_written, &bytes_used)
+			|| buffer_length - *bytes_written - bytes_used < cid_size)
+		return 0;
+	*bytes_written += bytes_used;
+	memcpy(&buffer[*bytes_written], cid, cid_size);
+	*bytes_written += cid_size;
+	return 1;
+}
+
 /***
  * Encode a BitswapMessage into a protobuf buffer
  * @param message the message to encode
@@ -516,20 +598,9 @@ int ipfs_bitswap_message_protobuf_encode(const struct BitswapMessage* message, u
 		if (message->payload != NULL) {
 			for(int i = 0; i < message->payload->total; i++) {
 				struct Block* entry = (struct Block*) libp2p_utils_vector_get(message->payload, i);
-				// protobuf it
-				size_t temp_size = ipfs_blocks_block_protobuf_encode_size(entry);
-				uint8_t* temp = (uint8_t*) malloc(temp_size);
-				if (!ipfs_blocks_block_protobuf_encode(entry, temp, temp_size, &temp_size)) {
-					free(temp);
-					return 0;
-				}
-				// put it in the buffer
-				if (!protobuf_encode_length_delimited(2, WIRETYPE_LENGTH_DELIMITED, (char*)temp, temp_size, &buffer[*bytes_written], buffer_length - (*bytes_written), &bytes_used)) {
-					free(temp);
+				if (!ipfs_bitswap_message_payload_encode(entry, &buffer[*bytes_written], buffer_length - (*bytes_written), &bytes_used))
 					return 0;
-				}
 				*bytes_written += bytes_used;
-				free(temp);
 			}
 		}
 		// the WantList
@@ -552,6 +623,28 @@ int ipfs_bitswap_message_protobuf_encode(const struct BitswapMessage* message, u
 	return 1;
 }
 
+/***
+ * Find a length delimited field in a buffer, without copying it
+ * @param buffer where the length of the field starts
+ * @param buffer_length the bytes left in the buffer
+ * @param slice where to put a pointer to the field, within the buffer
+ * @param slice_length where to put the length of the field
+ * @param bytes_read the bytes used by the length and the field
+ * @returns true(1) on success, false(0) if the field runs past the end of the buffer
+ */
+int ipfs_bitswap_message_decode_slice(const uint8_t* buffer, size_t buffer_length, const uint8_t** slice, size_t* slice_length, size_t* bytes_read) {
+	unsigned long long length = 0;
+	size_t length_size = 0;
+	if (buffer_length == 0 || !protobuf_decode_varint(buffer, buffer_length, &length, &length_size) || length_size == 0)
+		return 0;
+	if (length_size > buffer_length || length > buffer_length - length_size)
+		return 0;
+	*slice = &buffer[length_size];
+	*slice_length = length;
+	*bytes_read = length_size + length;
+	return 1;
+}
+
 /***
  * Decode a BitswapMessage from a protobuf
  * @param buffer the protobuf
@@ -597,19 +690,17 @@ int ipfs_bitswap_message_protobuf_decode(const uint8_t* buffer, size_t buffer_le
 				break;
 			}
 			case (2): {
-				// a block entry that is a real block struct
-				size_t temp_size = 0;
-				uint8_t* temp = NULL;
-				if (!protobuf_decode_length_delimited(&buffer[pos], buffer_length - pos, (char**)&temp, &temp_size, &bytes_read)) {
+				// a block entry that is a real block struct. It is decoded where it is, so the
+				// data of the block is copied once, into the Block
+				size_t slice_size = 0;
+				const uint8_t* slice = NULL;
+				if (!ipfs_bitswap_message_decode_slice(&buffer[pos], buffer_length - pos, &slice, &slice_size, &bytes_read)) {
 					return 0;
 				}
-				// we have the bytes, turn it into a Block struct
 				struct Block* block = NULL;
-				if (!ipfs_blocks_block_protobuf_decode(temp, temp_size, &block)) {
-					free(temp);
+				if (!ipfs_blocks_block_protobuf_decode(slice, slice_size, &block)) {
 					return 0;
 				}
-				free(temp);
 				if (message->payload == NULL) {
 					message->payload = libp2p_utils_vector_new(1);
 				}
@@ -619,17 +710,15 @@ int ipfs_bitswap_message_protobuf_decode(const uint8_t* buffer, size_t buffer_le
 			}
 			case(3): {
 				// a Wantlist
-				size_t temp_size = 0;
-				uint8_t* temp = NULL;
-				if (!protobuf_decode_length_delimited(&buffer[pos], buffer_length - pos, (char**)&temp, &temp_size, &bytes_read)) {
+				size_t slice_size = 0;
+				const uint8_t* slice = NULL;
+				if (!ipfs_bitswap_message_decode_slice(&buffer[pos], buffer_length - pos, &slice, &slice_size, &bytes_read)) {
 					return 0;
 				}
 				// we have the protobuf'd wantlist, now turn it into a Wantlist struct.
-				if (!ipfs_bitswap_wantlist_protobuf_decode(temp, temp_size, &message->wantlist)) {
-					free(temp);
+				if (!ipfs_bitswap_wantlist_protobuf_decode((unsigned char*)slice, slice_size, &message->wantlist)) {
 					return 0;
 				}
-				free(temp);
 				pos += bytes_read;
 				break;
 			}
@@ -701,6 +790,7 @@ int ipfs_bitswap_message_cancel_cid(struct Libp2pVector* vector, struct Cid* inc
  * Add the blocks to the BitswapMessage
  * @param message the message
  * @param blocks the requested blocks
+ * @param cids_they_want the CidEntries to cancel the blocks in (can be NULL)
  * @returns true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_message_add_blocks(struct BitswapMessage* message, struct Libp2pVector* blocks, struct Libp2pVector* cids_they_want) {
@@ -719,7 +809,8 @@ int ipfs_bitswap_message_add_blocks(struct BitswapMessage* message, struct Libp2
 	for(int i = 0; i < tot_blocks; i++) {
 		const struct Block* current = (const struct Block*) libp2p_utils_vector_get(blocks, i);
 		libp2p_utils_vector_add(message->payload, current);
-		ipfs_bitswap_message_cancel_cid(cids_they_want, current->cid);
+		if (cids_they_want != NULL)
+			ipfs_bitswap_message_cancel_cid(cids_they_want, current->cid);
 	}
 
 	for (int i = 0; i < tot_blocks; i++) {
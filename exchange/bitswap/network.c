@@ -8,6 +8,7 @@
 #include "libp2p/utils/logger.h"
 #include "ipfs/exchange/bitswap/network.h"
 #include "ipfs/exchange/bitswap/peer_request_queue.h"
+#include "ipfs/exchange/bitswap/verify.h"
 
 /****
  * send a message to a particular peer
@@ -44,36 +45,6 @@ int ipfs_bitswap_network_send_message(const struct BitswapContext* context, stru
 	return 1;
 }
 
-/***
- * Remove a cid from the queue
- * @param cids the vector of cids
- * @param cid the cid to remove
- * @returns true(1) on success, false(0) otherwise
- */
-int ipfs_bitswap_network_adjust_cid_queue(struct Libp2pVector* collection, struct Cid* cid, int cancel) {
-	if (collection == NULL || cid == NULL)
-		return 0;
-
-	for(int i = 0; i < collection->total; collection++) {
-		const struct CidEntry* current = (const struct CidEntry*)libp2p_utils_vector_get(collection, i);
-		if (ipfs_cid_compare(current->cid, cid) == 0) {
-			if (cancel)
-				libp2p_utils_vector_delete(collection, i);
-			return 1;
-		}
-	}
-
-	// not found. Add it if we're not cancelling
-	if (!cancel) {
-		struct CidEntry* cidEntry = ipfs_bitswap_peer_request_cid_entry_new();
-		cidEntry->cid = cid;
-		cidEntry->cancel = 0;
-		libp2p_utils_vector_add(collection, cidEntry);
-	}
-
-	return 0;
-}
-
 /***
  * Handle a raw incoming bitswap message from the network
  * @param node us
@@ -101,11 +72,13 @@ int ipfs_bitswap_network_handle_message(const struct IpfsNode* node, const struc
 	// process the message
 	// payload - what we want
 	if (message->payload != NULL) {
-		for(int i = 0; i < message->payload->total; i++) {
-			struct Block* blk = (struct Block*)libp2p_utils_vector_get(message->payload, i);
-			// we need a copy of the block so it survives the destruction of the message
-			node->exchange->HasBlock(node->exchange, ipfs_block_copy(blk));
-		}
+		// who sent it, so the sessions that wanted the blocks ask them first next time
+		struct Libp2pPeer* from = NULL;
+		if (sessionContext->remote_peer_id != NULL)
+			from = libp2p_peerstore_get_or_add_peer_by_id(node->peerstore, (unsigned char*)sessionContext->remote_peer_id, strlen(sessionContext->remote_peer_id));
+		// the blocks are checked against their Cids before anything uses them. They are handed over, not copied.
+		ipfs_bitswap_verifier_add(bitswapContext, message->payload, from);
+		message->payload = NULL;
 	}
 	// wantlist - what they want
 	if (message->wantlist != NULL && message->wantlist->entries != NULL && message->wantlist->entries->total > 0) {
@@ -122,18 +95,32 @@ int ipfs_bitswap_network_handle_message(const struct IpfsNode* node, const struc
 		}
 		// find the queue (adds it if it is not there)
 		struct PeerRequest* peerRequest = ipfs_peer_request_queue_find_peer(bitswapContext->peerRequestQueue, peer);
+		if (peerRequest == NULL) {
+			libp2p_logger_error("bitswap_network", "Unable to add a request for peer %s.\n", sessionContext->remote_peer_id);
+			ipfs_bitswap_message_free(message);
+			return 0;
+		}
+		pthread_mutex_lock(&peerRequest->request_mutex);
 		for(int i = 0; i < message->wantlist->entries->total; i++) {
 			struct WantlistEntry* entry = (struct WantlistEntry*) libp2p_utils_vector_get(message->wantlist->entries, i);
 			// turn the "block" back into a cid
 			struct Cid* cid = NULL;
 			if (!ipfs_cid_protobuf_decode(entry->block, entry->block_size, &cid) || cid->hash_length == 0) {
 				libp2p_logger_error("bitswap_network", "Message had invalid CID\n");
+				pthread_mutex_unlock(&peerRequest->request_mutex);
 				ipfs_cid_free(cid);
 				ipfs_bitswap_message_free(message);
 				return 0;
 			}
-			ipfs_bitswap_network_adjust_cid_queue(peerRequest->cids_they_want, cid, entry->cancel);
+			if (entry->cancel) {
+				ipfs_bitswap_peer_request_they_want_cancel(peerRequest, cid);
+				ipfs_cid_free(cid);
+			} else {
+				ipfs_bitswap_peer_request_they_want_add(peerRequest, cid);
+			}
 		}
+		pthread_mutex_unlock(&peerRequest->request_mutex);
+		ipfs_bitswap_engine_peer_requests_changed(bitswapContext->bitswap_engine);
 	}
 	ipfs_bitswap_message_free(message);
 	return 1;
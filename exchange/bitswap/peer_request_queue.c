@@ -4,12 +4,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "libp2p/conn/session.h"
 #include "libp2p/utils/logger.h"
 #include "ipfs/cid/cid.h"
 #include "ipfs/exchange/bitswap/peer_request_queue.h"
 #include "ipfs/exchange/bitswap/message.h"
 #include "ipfs/exchange/bitswap/network.h"
+#include "ipfs/exchange/bitswap/wantlist_queue.h"
 
 /***
  * Allocate memory for CidEntry
@@ -22,6 +24,8 @@ struct CidEntry* ipfs_bitswap_peer_request_cid_entry_new() {
 		entry->cancel = 0;
 		entry->cancel_has_been_sent = 0;
 		entry->request_has_been_sent = 0;
+		entry->not_here = 0;
+		entry->next_in_bucket = NULL;
 	}
 	return entry;
 }
@@ -33,6 +37,9 @@ struct PeerRequest* ipfs_bitswap_peer_request_new() {
 	int retVal = 0;
 	struct PeerRequest* request = (struct PeerRequest*) malloc(sizeof(struct PeerRequest));
 	if (request != NULL) {
+		request->cids_we_want = NULL;
+		request->blocks_we_want_to_send = NULL;
+		request->they_want_buckets = NULL;
 		request->cids_they_want = libp2p_utils_vector_new(1);
 		if (request->cids_they_want == NULL)
 			goto exit;
@@ -42,7 +49,20 @@ struct PeerRequest* ipfs_bitswap_peer_request_new() {
 		request->blocks_we_want_to_send = libp2p_utils_vector_new(1);
 		if (request->blocks_we_want_to_send == NULL)
 			goto exit;
+		request->they_want_bucket_count = 16;
+		request->they_want_buckets = (struct CidEntry**)calloc(request->they_want_bucket_count, sizeof(struct CidEntry*));
+		if (request->they_want_buckets == NULL)
+			goto exit;
+		request->they_want_cancelled = 0;
+		request->they_want_not_here = 0;
 		request->peer = NULL;
+		pthread_mutex_init(&request->request_mutex, NULL);
+		pthread_mutex_init(&request->turn_mutex, NULL);
+		ipfs_bitswap_ledger_init(&request->ledger);
+		request->deficit = 0;
+		request->outgoing = NULL;
+		request->outgoing_size = 0;
+		request->outgoing_since = 0;
 	}
 	retVal = 1;
 	exit:
@@ -53,6 +73,7 @@ struct PeerRequest* ipfs_bitswap_peer_request_new() {
 			libp2p_utils_vector_free(request->cids_they_want);
 		if (request->cids_we_want != NULL)
 			libp2p_utils_vector_free(request->cids_we_want);
+		free(request->they_want_buckets);
 		free(request);
 		request = NULL;
 	}
@@ -95,6 +116,11 @@ int ipfs_bitswap_peer_request_free(struct PeerRequest* request) {
 		}
 		libp2p_utils_vector_free(request->blocks_we_want_to_send);
 		request->blocks_we_want_to_send = NULL;
+		free(request->they_want_buckets);
+		if (request->outgoing != NULL)
+			ipfs_bitswap_message_free(request->outgoing);
+		pthread_mutex_destroy(&request->request_mutex);
+		pthread_mutex_destroy(&request->turn_mutex);
 		free(request);
 
 	}
@@ -110,6 +136,22 @@ struct PeerRequestQueue* ipfs_bitswap_peer_request_queue_new() {
 		pthread_mutex_init(&queue->queue_mutex, NULL);
 		queue->first = NULL;
 		queue->last = NULL;
+		for(int i = 0; i < BITSWAP_PEER_REQUEST_QUEUE_STRIPES; i++) {
+			struct PeerRequestStripe* stripe = &queue->stripes[i];
+			pthread_mutex_init(&stripe->lock, NULL);
+			stripe->bucket_count = 16;
+			stripe->buckets = (struct PeerRequestEntry**)calloc(stripe->bucket_count, sizeof(struct PeerRequestEntry*));
+			stripe->total = 0;
+			if (stripe->buckets == NULL) {
+				for(int j = 0; j <= i; j++) {
+					free(queue->stripes[j].buckets);
+					pthread_mutex_destroy(&queue->stripes[j].lock);
+				}
+				pthread_mutex_destroy(&queue->queue_mutex);
+				free(queue);
+				return NULL;
+			}
+		}
 	}
 	return queue;
 }
@@ -128,10 +170,104 @@ int ipfs_bitswap_peer_request_queue_free(struct PeerRequestQueue* queue) {
 		current = prior;
 	}
 	pthread_mutex_unlock(&queue->queue_mutex);
+	pthread_mutex_destroy(&queue->queue_mutex);
+	for(int i = 0; i < BITSWAP_PEER_REQUEST_QUEUE_STRIPES; i++) {
+		free(queue->stripes[i].buckets);
+		pthread_mutex_destroy(&queue->stripes[i].lock);
+	}
 	free(queue);
 	return 1;
 }
 
+/***
+ * The hash of a peer id, to find the peer in the index
+ * @param peer the peer
+ * @returns the hash
+ */
+unsigned long ipfs_bitswap_peer_request_queue_hash(const struct Libp2pPeer* peer) {
+	// FNV-1a
+	unsigned long hash = 2166136261UL;
+	for(size_t i = 0; peer->id != NULL && i < peer->id_size; i++) {
+		hash ^= (unsigned char)peer->id[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/***
+ * The part of the index a peer is in
+ * @param queue the queue
+ * @param hash the hash of the peer id
+ * @returns the stripe
+ */
+struct PeerRequestStripe* ipfs_bitswap_peer_request_queue_stripe(struct PeerRequestQueue* queue, unsigned long hash) {
+	return &queue->stripes[hash % BITSWAP_PEER_REQUEST_QUEUE_STRIPES];
+}
+
+/***
+ * The bucket of a peer within its stripe
+ * @param stripe the stripe
+ * @param hash the hash of the peer id
+ * @returns the index of the bucket
+ */
+size_t ipfs_bitswap_peer_request_queue_bucket(const struct PeerRequestStripe* stripe, unsigned long hash) {
+	return (hash / BITSWAP_PEER_REQUEST_QUEUE_STRIPES) % stripe->bucket_count;
+}
+
+/***
+ * Put an entry in the index
+ * NOTE: the lock of the stripe must be held
+ * @param stripe the stripe of the entry's peer
+ * @param entry the entry
+ * @param hash the hash of the entry's peer id
+ */
+void ipfs_bitswap_peer_request_queue_index(struct PeerRequestStripe* stripe, struct PeerRequestEntry* entry, unsigned long hash) {
+	if (stripe->total >= stripe->bucket_count) {
+		// make the stripe bigger, so the chains stay short
+		size_t bucket_count = stripe->bucket_count * 2;
+		struct PeerRequestEntry** buckets = (struct PeerRequestEntry**)calloc(bucket_count, sizeof(struct PeerRequestEntry*));
+		if (buckets != NULL) {
+			struct PeerRequestEntry** old_buckets = stripe->buckets;
+			size_t old_count = stripe->bucket_count;
+			stripe->buckets = buckets;
+			stripe->bucket_count = bucket_count;
+			for(size_t i = 0; i < old_count; i++) {
+				struct PeerRequestEntry* current = old_buckets[i];
+				while (current != NULL) {
+					struct PeerRequestEntry* next = current->next_in_bucket;
+					size_t bucket = ipfs_bitswap_peer_request_queue_bucket(stripe, ipfs_bitswap_peer_request_queue_hash(current->current->peer));
+					current->next_in_bucket = buckets[bucket];
+					buckets[bucket] = current;
+					current = next;
+				}
+			}
+			free(old_buckets);
+		}
+	}
+	size_t bucket = ipfs_bitswap_peer_request_queue_bucket(stripe, hash);
+	entry->next_in_bucket = stripe->buckets[bucket];
+	stripe->buckets[bucket] = entry;
+	stripe->total++;
+}
+
+/***
+ * Find the entry of a peer in the index
+ * NOTE: the lock of the stripe must be held
+ * @param stripe the stripe of the peer
+ * @param peer the peer
+ * @param hash the hash of the peer id
+ * @returns the entry, or NULL if it is not there
+ */
+struct PeerRequestEntry* ipfs_bitswap_peer_request_queue_lookup(struct PeerRequestStripe* stripe, struct Libp2pPeer* peer, unsigned long hash) {
+	struct PeerRequestEntry* current = stripe->buckets[ipfs_bitswap_peer_request_queue_bucket(stripe, hash)];
+	while (current != NULL) {
+		if (libp2p_peer_compare(current->current->peer, peer) == 0)
+			return current;
+		current = current->next_in_bucket;
+	}
+	return NULL;
+}
+
 /**
  * Adds a peer request to the end of the queue
  * @param queue the queue
@@ -141,14 +277,28 @@ int ipfs_bitswap_peer_request_queue_free(struct PeerRequestQueue* queue) {
 int ipfs_bitswap_peer_request_queue_add(struct PeerRequestQueue* queue, struct PeerRequest* request) {
 	if (request != NULL) {
 		struct PeerRequestEntry* entry = ipfs_bitswap_peer_request_entry_new();
+		if (entry == NULL)
+			return 0;
 		entry->current = request;
+		// a request without a peer can not be looked up
+		struct PeerRequestStripe* stripe = NULL;
+		if (request->peer != NULL) {
+			unsigned long hash = ipfs_bitswap_peer_request_queue_hash(request->peer);
+			stripe = ipfs_bitswap_peer_request_queue_stripe(queue, hash);
+			pthread_mutex_lock(&stripe->lock);
+			ipfs_bitswap_peer_request_queue_index(stripe, entry, hash);
+		}
 		pthread_mutex_lock(&queue->queue_mutex);
 		entry->prior = queue->last;
+		if (queue->last != NULL)
+			queue->last->next = entry;
 		queue->last = entry;
 		if (queue->first == NULL) {
 			queue->first = entry;
 		}
 		pthread_mutex_unlock(&queue->queue_mutex);
+		if (stripe != NULL)
+			pthread_mutex_unlock(&stripe->lock);
 		return 1;
 	}
 	return 0;
@@ -161,20 +311,35 @@ int ipfs_bitswap_peer_request_queue_add(struct PeerRequestQueue* queue, struct P
  * @returns true(1) on success, otherwise false(0)
  */
 int ipfs_bitswap_peer_request_queue_remove(struct PeerRequestQueue* queue, struct PeerRequest* request) {
-	if (request != NULL) {
-		struct PeerRequestEntry* entry = ipfs_bitswap_peer_request_queue_find_entry(queue, request->peer);
-		if (entry != NULL) {
-			pthread_mutex_lock(&queue->queue_mutex);
-			// remove the entry's link, and hook prior and next together
-			entry->prior->next = entry->next;
-			entry->prior = NULL;
-			entry->next = NULL;
-			ipfs_bitswap_peer_request_entry_free(entry);
-			pthread_mutex_unlock(&queue->queue_mutex);
-			return 1;
-		}
+	if (request == NULL || request->peer == NULL)
+		return 0;
+	unsigned long hash = ipfs_bitswap_peer_request_queue_hash(request->peer);
+	struct PeerRequestStripe* stripe = ipfs_bitswap_peer_request_queue_stripe(queue, hash);
+	pthread_mutex_lock(&stripe->lock);
+	struct PeerRequestEntry** link = &stripe->buckets[ipfs_bitswap_peer_request_queue_bucket(stripe, hash)];
+	while (*link != NULL && (*link)->current != request)
+		link = &(*link)->next_in_bucket;
+	struct PeerRequestEntry* entry = *link;
+	if (entry == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return 0;
 	}
-	return 0;
+	*link = entry->next_in_bucket;
+	stripe->total--;
+	pthread_mutex_lock(&queue->queue_mutex);
+	// remove the entry's link, and hook prior and next together
+	if (entry->prior == NULL)
+		queue->first = entry->next;
+	else
+		entry->prior->next = entry->next;
+	if (entry->next == NULL)
+		queue->last = entry->prior;
+	else
+		entry->next->prior = entry->prior;
+	pthread_mutex_unlock(&queue->queue_mutex);
+	pthread_mutex_unlock(&stripe->lock);
+	ipfs_bitswap_peer_request_entry_free(entry);
+	return 1;
 }
 
 /**
@@ -184,28 +349,206 @@ int ipfs_bitswap_peer_request_queue_remove(struct PeerRequestQueue* queue, struc
  * @returns the PeerRequestEntry or NULL if not found
  */
 struct PeerRequestEntry* ipfs_bitswap_peer_request_queue_find_entry(struct PeerRequestQueue* queue, struct Libp2pPeer* peer) {
+	struct PeerRequestEntry* entry = NULL;
 	if (peer != NULL) {
-		struct PeerRequestEntry* current = queue->first;
-		while (current != NULL) {
-			if (libp2p_peer_compare(current->current->peer, peer) == 0)
-				return current;
-			current = current->next;
-		}
+		unsigned long hash = ipfs_bitswap_peer_request_queue_hash(peer);
+		struct PeerRequestStripe* stripe = ipfs_bitswap_peer_request_queue_stripe(queue, hash);
+		pthread_mutex_lock(&stripe->lock);
+		entry = ipfs_bitswap_peer_request_queue_lookup(stripe, peer, hash);
+		pthread_mutex_unlock(&stripe->lock);
+	}
+	return entry;
+}
+
+/***
+ * The bucket of a cid in the index of what they want
+ * @param request the request
+ * @param cid the cid
+ * @returns the index of the bucket
+ */
+size_t ipfs_bitswap_peer_request_they_want_bucket(const struct PeerRequest* request, const struct Cid* cid) {
+	// FNV-1a, over all of the multihash, as the first bytes are the type and length
+	unsigned long hash = 2166136261UL;
+	for(size_t i = 0; i < cid->hash_length; i++) {
+		hash ^= cid->hash[i];
+		hash *= 16777619UL;
+	}
+	return hash % request->they_want_bucket_count;
+}
+
+/***
+ * Find a cid they want
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid
+ * @returns the CidEntry (that may be cancelled), or NULL if they did not ask for it
+ */
+struct CidEntry* ipfs_bitswap_peer_request_they_want_find(struct PeerRequest* request, const struct Cid* cid) {
+	struct CidEntry* current = request->they_want_buckets[ipfs_bitswap_peer_request_they_want_bucket(request, cid)];
+	while (current != NULL) {
+		if (ipfs_cid_compare(current->cid, cid) == 0)
+			return current;
+		current = current->next_in_bucket;
 	}
 	return NULL;
 }
 
 /***
- * Determine if any of the cids in the list are waiting to be filled
- * @param cidEntries a Vector of CidEntry objects
+ * Rebuild the index of what they want from cids_they_want
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param bucket_count the number of buckets
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_peer_request_they_want_reindex(struct PeerRequest* request, size_t bucket_count) {
+	struct CidEntry** buckets = (struct CidEntry**)calloc(bucket_count, sizeof(struct CidEntry*));
+	if (buckets == NULL)
+		return 0;
+	free(request->they_want_buckets);
+	request->they_want_buckets = buckets;
+	request->they_want_bucket_count = bucket_count;
+	for(int i = 0; i < request->cids_they_want->total; i++) {
+		struct CidEntry* entry = (struct CidEntry*)libp2p_utils_vector_get(request->cids_they_want, i);
+		size_t bucket = ipfs_bitswap_peer_request_they_want_bucket(request, entry->cid);
+		entry->next_in_bucket = buckets[bucket];
+		buckets[bucket] = entry;
+	}
+	return 1;
+}
+
+/***
+ * Free the cancelled entries of cids_they_want, once there are a lot of them
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ */
+void ipfs_bitswap_peer_request_they_want_compact(struct PeerRequest* request) {
+	if (request->they_want_cancelled <= BITSWAP_PEER_REQUEST_MAX_CANCELLED || request->they_want_cancelled * 2 < (size_t)request->cids_they_want->total)
+		return;
+	struct Libp2pVector* waiting = libp2p_utils_vector_new(1);
+	if (waiting == NULL)
+		return;
+	for(int i = 0; i < request->cids_they_want->total; i++) {
+		struct CidEntry* entry = (struct CidEntry*)libp2p_utils_vector_get(request->cids_they_want, i);
+		if (entry->cancel)
+			ipfs_bitswap_cid_entry_free(entry);
+		else
+			libp2p_utils_vector_add(waiting, entry);
+	}
+	libp2p_utils_vector_free(request->cids_they_want);
+	request->cids_they_want = waiting;
+	request->they_want_cancelled = 0;
+	// the freed entries were in the index too
+	size_t bucket_count = 16;
+	while (bucket_count < (size_t)waiting->total)
+		bucket_count *= 2;
+	if (!ipfs_bitswap_peer_request_they_want_reindex(request, bucket_count)) {
+		// keep the old buckets, but without the freed entries
+		memset(request->they_want_buckets, 0, request->they_want_bucket_count * sizeof(struct CidEntry*));
+		for(int i = 0; i < waiting->total; i++) {
+			struct CidEntry* entry = (struct CidEntry*)libp2p_utils_vector_get(waiting, i);
+			size_t bucket = ipfs_bitswap_peer_request_they_want_bucket(request, entry->cid);
+			entry->next_in_bucket = request->they_want_buckets[bucket];
+			request->they_want_buckets[bucket] = entry;
+		}
+	}
+}
+
+/***
+ * Look for a block they want again, the next time it is their turn
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param entry the entry of cids_they_want
+ */
+void ipfs_bitswap_peer_request_they_want_look_again(struct PeerRequest* request, struct CidEntry* entry) {
+	if (entry->not_here) {
+		entry->not_here = 0;
+		request->they_want_not_here--;
+	}
+}
+
+/***
+ * Add a cid they want, or ask for it again if it was cancelled
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid (the request takes it)
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_peer_request_they_want_add(struct PeerRequest* request, struct Cid* cid) {
+	struct CidEntry* entry = ipfs_bitswap_peer_request_they_want_find(request, cid);
+	if (entry != NULL) {
+		// asking again is a reason to look again
+		ipfs_bitswap_peer_request_they_want_look_again(request, entry);
+		if (entry->cancel) {
+			entry->cancel = 0;
+			request->they_want_cancelled--;
+		}
+		ipfs_cid_free(cid);
+		return 1;
+	}
+	entry = ipfs_bitswap_peer_request_cid_entry_new();
+	if (entry == NULL) {
+		ipfs_cid_free(cid);
+		return 0;
+	}
+	entry->cid = cid;
+	libp2p_utils_vector_add(request->cids_they_want, entry);
+	if ((size_t)request->cids_they_want->total > request->they_want_bucket_count) {
+		// make the index bigger, so the chains stay short. This also indexes the new entry.
+		if (ipfs_bitswap_peer_request_they_want_reindex(request, request->they_want_bucket_count * 2))
+			return 1;
+	}
+	size_t bucket = ipfs_bitswap_peer_request_they_want_bucket(request, cid);
+	entry->next_in_bucket = request->they_want_buckets[bucket];
+	request->they_want_buckets[bucket] = entry;
+	return 1;
+}
+
+/***
+ * Cancel a cid they want, because they cancelled it or it is being sent
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid
+ * @returns true(1) if they wanted it, false(0) otherwise
+ */
+int ipfs_bitswap_peer_request_they_want_cancel(struct PeerRequest* request, const struct Cid* cid) {
+	struct CidEntry* entry = ipfs_bitswap_peer_request_they_want_find(request, cid);
+	if (entry == NULL)
+		return 0;
+	ipfs_bitswap_peer_request_they_want_look_again(request, entry);
+	if (!entry->cancel) {
+		entry->cancel = 1;
+		request->they_want_cancelled++;
+	}
+	return 1;
+}
+
+/***
+ * Determine if any of the cids they want are waiting to be filled. The ones that
+ * were not here when we looked do not count until the block arrives, so a peer that
+ * only wants blocks we do not have does not keep taking turns.
+ * NOTE: the request_mutex must be held
+ * @param request the request
  * @returns true(1) if we have some waiting, false(0) otherwise
  */
-int ipfs_bitswap_peer_request_cids_waiting(struct Libp2pVector* cidEntries) {
-	if (cidEntries == NULL)
+int ipfs_bitswap_peer_request_cids_waiting(const struct PeerRequest* request) {
+	return (size_t)request->cids_they_want->total > request->they_want_cancelled + request->they_want_not_here;
+}
+
+/***
+ * Determine if we have anything we want (that we haven't sent already)
+ * @param cid_entries the list of CidEntries that are in our queue to be sent
+ * @returns true(1) if we have something to send, false(0) otherwise
+ */
+int ipfs_bitswap_peer_request_we_want_cids(struct Libp2pVector* cid_entries) {
+	if (cid_entries == NULL)
+		return 0;
+	if (cid_entries->total == 0)
 		return 0;
-	for(int i = 0; i < cidEntries->total; i++) {
-		const struct CidEntry* entry = (const struct CidEntry*)libp2p_utils_vector_get(cidEntries, i);
-		if (entry != NULL && !entry->cancel)
+	for(int i = 0; i < cid_entries->total; i++) {
+		const struct CidEntry* entry = (const struct CidEntry*) libp2p_utils_vector_get(cid_entries, i);
+		if (entry->cancel && !entry->cancel_has_been_sent)
+			return 1;
+		if (!entry->cancel && !entry->request_has_been_sent)
 			return 1;
 	}
 	return 0;
@@ -213,64 +556,56 @@ int ipfs_bitswap_peer_request_cids_waiting(struct Libp2pVector* cidEntries) {
 
 /***
  * Determine if there is something to process in this request
+ * NOTE: the engine reads what the peers send, this only looks at what is waiting to go out
  * @param entry the entry to look at
  * @returns true(1) if there is something to do
  */
 int ipfs_bitswap_peer_request_something_to_do(struct PeerRequestEntry* entry) {
+	int retVal = 0;
 	if (entry != NULL) {
 		struct PeerRequest* request = entry->current;
-		// do we have something in the queue?
-		if (request->blocks_we_want_to_send->total > 0)
-			return 1;
-		if (request->cids_we_want->total > 0)
-			return 1;
-		if (ipfs_bitswap_peer_request_cids_waiting(request->cids_they_want))
-			return 1;
-		// is there something waiting for us on the network?
-		if (request->peer->connection_type == CONNECTION_TYPE_CONNECTED) {
-			int retVal = request->peer->sessionContext->default_stream->peek(request->peer->sessionContext);
-			if (retVal < 0) {
-				libp2p_logger_debug("peer_request_queue", "Connection returned %d. Marking connection NOT CONNECTED.\n", retVal);
-				libp2p_peer_handle_connection_error(request->peer);
-				return 0;
-			}
-			if (retVal > 0) {
-				libp2p_logger_debug("peer_request_queue", "We have something to read. %d bytes.\n", retVal);
-			}
-			return retVal;
-		}
+		pthread_mutex_lock(&request->request_mutex);
+		retVal = request->blocks_we_want_to_send->total > 0
+				|| request->outgoing != NULL
+				|| ipfs_bitswap_peer_request_we_want_cids(request->cids_we_want)
+				|| ipfs_bitswap_peer_request_cids_waiting(request);
+		pthread_mutex_unlock(&request->request_mutex);
 	}
-	return 0;
+	return retVal;
 }
 
 /**
- * Pull a PeerRequest off the queue
+ * Pull a PeerRequest off the queue. The requests take turns, and each turn adds
+ * the peer's share of a round (see ledger.h) to the bytes it may be sent.
  * @param queue the queue
- * @returns the PeerRequest that should be handled next, or NULL if the queue is empty
+ * @returns the PeerRequest that should be handled next, or NULL if none have something to do
  */
 struct PeerRequest* ipfs_bitswap_peer_request_queue_pop(struct PeerRequestQueue* queue) {
 	struct PeerRequest* retVal = NULL;
 	if (queue != NULL) {
 		pthread_mutex_lock(&queue->queue_mutex);
 		struct PeerRequestEntry* entry = queue->first;
+		while (entry != NULL && !ipfs_bitswap_peer_request_something_to_do(entry))
+			entry = entry->next;
 		if (entry != NULL) {
-			if (ipfs_bitswap_peer_request_something_to_do(entry)) {
-				retVal = entry->current;
-				// move to the end of the queue
-				if (queue->first->next != NULL) {
-					queue->first = queue->first->next;
-					queue->last->next = entry;
-					queue->last = entry;
-				}
+			retVal = entry->current;
+			pthread_mutex_lock(&retVal->request_mutex);
+			retVal->deficit += (unsigned long long)BITSWAP_LEDGER_QUANTUM_BYTES * ipfs_bitswap_ledger_weight(&retVal->ledger);
+			pthread_mutex_unlock(&retVal->request_mutex);
+			// move to the end of the queue, so the others go first next time
+			if (entry != queue->last) {
+				if (entry->prior == NULL)
+					queue->first = entry->next;
+				else
+					entry->prior->next = entry->next;
+				entry->next->prior = entry->prior;
+				entry->prior = queue->last;
+				entry->next = NULL;
+				queue->last->next = entry;
+				queue->last = entry;
 			}
 		}
 		pthread_mutex_unlock(&queue->queue_mutex);
-		// disable temporarily
-		// JMJ Debugging
-		/*
-		if (entry != NULL)
-			ipfs_bitswap_peer_request_entry_free(entry);
-		*/
 	}
 	return retVal;
 }
@@ -285,6 +620,7 @@ struct PeerRequestEntry* ipfs_bitswap_peer_request_entry_new() {
 		entry->current = NULL;
 		entry->next = NULL;
 		entry->prior = NULL;
+		entry->next_in_bucket = NULL;
 	}
 	return entry;
 }
@@ -316,56 +652,144 @@ int ipfs_bitswap_peer_request_queue_fill(struct PeerRequestQueue* queue, struct
 	if (entry != NULL)
 	{
 		// add to the block array
+		pthread_mutex_lock(&entry->request_mutex);
 		libp2p_utils_vector_add(entry->blocks_we_want_to_send, block);
+		pthread_mutex_unlock(&entry->request_mutex);
 	}
 	return 0;
 }
 
+/***
+ * A block is here now, so the peers that want it are looked at again
+ * @param queue the queue
+ * @param cid the cid of the block
+ * @returns true(1) if a peer wants it, false(0) otherwise
+ */
+int ipfs_bitswap_peer_request_queue_has_block(struct PeerRequestQueue* queue, const struct Cid* cid) {
+	int retVal = 0;
+	if (queue == NULL)
+		return 0;
+	pthread_mutex_lock(&queue->queue_mutex);
+	for(struct PeerRequestEntry* entry = queue->first; entry != NULL; entry = entry->next) {
+		struct PeerRequest* request = entry->current;
+		pthread_mutex_lock(&request->request_mutex);
+		struct CidEntry* cidEntry = ipfs_bitswap_peer_request_they_want_find(request, cid);
+		if (cidEntry != NULL && !cidEntry->cancel) {
+			ipfs_bitswap_peer_request_they_want_look_again(request, cidEntry);
+			retVal = 1;
+		}
+		pthread_mutex_unlock(&request->request_mutex);
+	}
+	pthread_mutex_unlock(&queue->queue_mutex);
+	return retVal;
+}
+
 /****
- * Find blocks they want, and put them in the request
+ * Find blocks they want, and put them in the request. Only what can be sent this round is loaded.
+ * NOTE: the request_mutex must be held. It is released while each block is read.
+ * NOTE: the turn_mutex must be held, so cids_they_want is not compacted meanwhile
  */
 int ipfs_bitswap_peer_request_get_blocks_they_want(const struct BitswapContext* context, struct PeerRequest* request) {
-	for(int i = 0; i < request->cids_they_want->total; i++) {
+	unsigned long long queued = 0;
+	for(int i = 0; i < request->blocks_we_want_to_send->total; i++)
+		queued += ((struct Block*)libp2p_utils_vector_get(request->blocks_we_want_to_send, i))->data_length;
+	for(int i = 0; i < request->cids_they_want->total && queued < request->deficit; i++) {
 		struct CidEntry* cidEntry = (struct CidEntry*)libp2p_utils_vector_get(request->cids_they_want, i);
-		if (cidEntry != NULL && !cidEntry->cancel) {
-			struct Block* block = NULL;
-			context->ipfsNode->blockstore->Get(context->ipfsNode->blockstore->blockstoreContext, cidEntry->cid, &block);
-			if (block != NULL) {
+		if (cidEntry == NULL || cidEntry->cancel || cidEntry->not_here)
+			continue;
+		struct Cid* cid = ipfs_cid_copy(cidEntry->cid);
+		if (cid == NULL)
+			break;
+		pthread_mutex_unlock(&request->request_mutex);
+		struct Block* block = NULL;
+		// the block waits for the message in its file's pages, and is copied once, into the message
+		context->ipfsNode->blockstore->GetView(context->ipfsNode->blockstore->blockstoreContext, cid, &block);
+		pthread_mutex_lock(&request->request_mutex);
+		if (block != NULL) {
+			// they may have cancelled it while it was read
+			cidEntry = ipfs_bitswap_peer_request_they_want_find(request, cid);
+			if (cidEntry != NULL && !cidEntry->cancel) {
 				libp2p_utils_vector_add(request->blocks_we_want_to_send, block);
 				cidEntry->cancel = 1;
+				request->they_want_cancelled++;
+				queued += block->data_length;
+			} else {
+				ipfs_block_free(block);
+			}
+		} else {
+			// not looked for again until it arrives, or they ask again
+			cidEntry = ipfs_bitswap_peer_request_they_want_find(request, cid);
+			if (cidEntry != NULL && !cidEntry->cancel && !cidEntry->not_here) {
+				cidEntry->not_here = 1;
+				request->they_want_not_here++;
 			}
 		}
+		ipfs_cid_free(cid);
 	}
 	return 0;
 }
 
 /***
- * Determine if we have anything we want (that we haven't sent already)
- * @param cid_entries the list of CidEntries that are in our queue to be sent
- * @returns true(1) if we have something to send, false(0) otherwise
+ * Start a message to the peer, if one is not started already
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @returns true(1) on success
  */
-int ipfs_bitswap_peer_request_we_want_cids(struct Libp2pVector* cid_entries) {
-	if (cid_entries == NULL)
+int ipfs_bitswap_peer_request_outgoing_start(struct PeerRequest* request) {
+	if (request->outgoing != NULL)
+		return 1;
+	request->outgoing = ipfs_bitswap_message_new();
+	if (request->outgoing == NULL)
 		return 0;
-	if (cid_entries->total == 0)
+	request->outgoing->payload = libp2p_utils_vector_new(1);
+	if (request->outgoing->payload == NULL) {
+		ipfs_bitswap_message_free(request->outgoing);
+		request->outgoing = NULL;
 		return 0;
-	for(int i = 0; i < cid_entries->total; i++) {
-		const struct CidEntry* entry = (const struct CidEntry*) libp2p_utils_vector_get(cid_entries, i);
-		if (entry->cancel && !entry->cancel_has_been_sent)
-			return 1;
-		if (!entry->cancel && !entry->request_has_been_sent)
-			return 1;
 	}
-	return 0;
+	request->outgoing_size = 0;
+	request->outgoing_since = ipfs_bitswap_wantlist_queue_now();
+	return 1;
+}
+
+/***
+ * Send the message that is being filled for the peer
+ * NOTE: the request_mutex must be held. It is released while the message is sent.
+ * @param context the BitswapContext
+ * @param request the request
+ * @returns true(1) if it was sent
+ */
+int ipfs_bitswap_peer_request_outgoing_flush(const struct BitswapContext* context, struct PeerRequest* request) {
+	struct BitswapMessage* message = request->outgoing;
+	if (message == NULL)
+		return 0;
+	request->outgoing = NULL;
+	request->outgoing_size = 0;
+	unsigned long long bytes = 0;
+	for(int i = 0; i < message->payload->total; i++)
+		bytes += ((struct Block*)libp2p_utils_vector_get(message->payload, i))->data_length;
+	pthread_mutex_unlock(&request->request_mutex);
+	int retVal = ipfs_bitswap_network_send_message(context, request->peer, message);
+	pthread_mutex_lock(&request->request_mutex);
+	if (retVal)
+		ipfs_bitswap_ledger_sent(&request->ledger, message->payload->total, bytes);
+	ipfs_bitswap_message_free(message);
+	return retVal;
 }
 
 /****
- * Handle a PeerRequest
+ * Handle a PeerRequest. Our wants are always sent, but their blocks only as far as the deficit allows.
+ * Their blocks are put in messages of up to BITSWAP_MESSAGE_TARGET_SIZE. A message that is not full
+ * waits for their next turn if more of their blocks are waiting, but not longer than
+ * BITSWAP_MESSAGE_FLUSH_MILLISECONDS.
+ * NOTE: the request_mutex must not be held. It is released while connecting, reading blocks and sending,
+ * so the queue (and the peer's messages) are not held up by the disk or the network.
  * @param context the BitswapContext
  * @param request the request to process
  * @returns true(1) if something was done, otherwise false(0)
  */
 int ipfs_bitswap_peer_request_process_entry(const struct BitswapContext* context, struct PeerRequest* request) {
+	int retVal = 0;
 	// determine if we have enough information to continue
 	if (request == NULL)
 		return 0;
@@ -376,33 +800,66 @@ int ipfs_bitswap_peer_request_process_entry(const struct BitswapContext* context
 			if (request->peer->addr_head == NULL || request->peer->addr_head->item == NULL)
 				return 0;
 	}
+	pthread_mutex_lock(&request->turn_mutex);
+	pthread_mutex_lock(&request->request_mutex);
 	// determine if we're connected
 	int connected = request->peer->is_local || request->peer->connection_type == CONNECTION_TYPE_CONNECTED;
-	int need_to_connect = ipfs_bitswap_peer_request_we_want_cids(request->cids_we_want) || ipfs_bitswap_peer_request_cids_waiting(request->cids_they_want) || request->blocks_we_want_to_send->total != 0;
+	// their blocks only go out when it is their turn
+	int can_send = request->deficit > 0 && (ipfs_bitswap_peer_request_cids_waiting(request) || request->blocks_we_want_to_send->total != 0);
+	int we_want = ipfs_bitswap_peer_request_we_want_cids(request->cids_we_want);
+	int need_to_connect = we_want || can_send || request->outgoing != NULL;
 
 	// determine if we need to connect
-	if (need_to_connect) {
-		if (!connected) {
-			// connect
-			connected = libp2p_peer_connect(&context->ipfsNode->identity->private_key, request->peer, context->ipfsNode->peerstore, 0);
+	if (need_to_connect && !connected) {
+		pthread_mutex_unlock(&request->request_mutex);
+		connected = libp2p_peer_connect(&context->ipfsNode->identity->private_key, request->peer, context->ipfsNode->peerstore, 0);
+		pthread_mutex_lock(&request->request_mutex);
+	}
+	if (need_to_connect && connected) {
+		// see if we can fulfill any of their requests
+		ipfs_bitswap_peer_request_get_blocks_they_want(context, request);
+		// add what fits in this round, the rest waits for their next turn
+		while (request->blocks_we_want_to_send->total > 0) {
+			struct Block* block = (struct Block*)libp2p_utils_vector_get(request->blocks_we_want_to_send, 0);
+			if (block->data_length > request->deficit)
+				break;
+			size_t block_size = ipfs_bitswap_message_payload_encode_size(block);
+			if (request->outgoing != NULL && request->outgoing->payload->total > 0 && request->outgoing_size + block_size > BITSWAP_MESSAGE_TARGET_SIZE) {
+				// the lock is let go while it is sent, so look at the blocks again after
+				if (ipfs_bitswap_peer_request_outgoing_flush(context, request))
+					retVal = 1;
+				continue;
+			}
+			if (!ipfs_bitswap_peer_request_outgoing_start(request))
+				break;
+			request->deficit -= block->data_length;
+			ipfs_bitswap_peer_request_they_want_cancel(request, block->cid);
+			libp2p_utils_vector_add(request->outgoing->payload, block);
+			libp2p_utils_vector_delete(request->blocks_we_want_to_send, 0);
+			request->outgoing_size += block_size;
+			retVal = 1;
 		}
-		if (connected) {
-			// build a message
-			struct BitswapMessage* msg = ipfs_bitswap_message_new();
-			// see if we can fulfill any of their requests. If so, fill in msg->payload
-			ipfs_bitswap_peer_request_get_blocks_they_want(context, request);
-			ipfs_bitswap_message_add_blocks(msg, request->blocks_we_want_to_send, request->cids_they_want);
-			// add requests that we would like
-			ipfs_bitswap_message_add_wantlist_items(msg, request->cids_we_want);
-			// send message
-			if (ipfs_bitswap_network_send_message(context, request->peer, msg)) {
-				ipfs_bitswap_message_free(msg);
-				return 1;
+		// add requests that we would like
+		we_want = ipfs_bitswap_peer_request_we_want_cids(request->cids_we_want);
+		if (we_want && ipfs_bitswap_peer_request_outgoing_start(request))
+			ipfs_bitswap_message_add_wantlist_items(request->outgoing, request->cids_we_want);
+		// our wants are never held back, and neither is a full or old message
+		if (request->outgoing != NULL) {
+			if (we_want || request->blocks_we_want_to_send->total == 0
+					|| request->outgoing_size >= BITSWAP_MESSAGE_TARGET_SIZE
+					|| ipfs_bitswap_wantlist_queue_now() - request->outgoing_since >= BITSWAP_MESSAGE_FLUSH_MILLISECONDS) {
+				if (ipfs_bitswap_peer_request_outgoing_flush(context, request))
+					retVal = 1;
 			}
-			ipfs_bitswap_message_free(msg);
 		}
 	}
-	return 0;
+	ipfs_bitswap_peer_request_they_want_compact(request);
+	// a peer that we have nothing for does not save up its turns
+	if (request->blocks_we_want_to_send->total == 0)
+		request->deficit = 0;
+	pthread_mutex_unlock(&request->request_mutex);
+	pthread_mutex_unlock(&request->turn_mutex);
+	return retVal;
 }
 
 /***
@@ -413,20 +870,28 @@ int ipfs_bitswap_peer_request_process_entry(const struct BitswapContext* context
  * @returns a PeerRequestEntry or NULL on error
  */
 struct PeerRequest* ipfs_peer_request_queue_find_peer(struct PeerRequestQueue* queue, struct Libp2pPeer* peer) {
-
-	struct PeerRequestEntry* entry = queue->first;
-	while (entry != NULL) {
-		if (libp2p_peer_compare(entry->current->peer, peer) == 0) {
-			return entry->current;
-		}
-		entry = entry->next;
+	unsigned long hash = ipfs_bitswap_peer_request_queue_hash(peer);
+	struct PeerRequestStripe* stripe = ipfs_bitswap_peer_request_queue_stripe(queue, hash);
+	pthread_mutex_lock(&stripe->lock);
+	struct PeerRequestEntry* entry = ipfs_bitswap_peer_request_queue_lookup(stripe, peer, hash);
+	if (entry != NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return entry->current;
 	}
 
 	// we didn't find one, so create one
 	entry = ipfs_bitswap_peer_request_entry_new();
-	entry->current = ipfs_bitswap_peer_request_new();
+	if (entry != NULL)
+		entry->current = ipfs_bitswap_peer_request_new();
+	if (entry == NULL || entry->current == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		free(entry);
+		return NULL;
+	}
 	entry->current->peer = peer;
+	ipfs_bitswap_peer_request_queue_index(stripe, entry, hash);
 	// attach it to the queue
+	pthread_mutex_lock(&queue->queue_mutex);
 	if (queue->first == NULL) {
 		queue->first = entry;
 		queue->last = entry;
@@ -435,13 +900,8 @@ struct PeerRequest* ipfs_peer_request_queue_find_peer(struct PeerRequestQueue* q
 		entry->prior = queue->last;
 		queue->last = entry;
 	}
+	pthread_mutex_unlock(&queue->queue_mutex);
+	pthread_mutex_unlock(&stripe->lock);
 
 	return entry->current;
 }
-
-
-
-
-
-
-
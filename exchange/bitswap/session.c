@@ -0,0 +1,84 @@
+/***
+ * Groups of blocks that are fetched together. See session.h
+ */
+#include <stdlib.h>
+#include "ipfs/exchange/bitswap/session.h"
+
+/***
+ * Create a new BitswapSession
+ * @param provider_delay milliseconds to wait for the peers of the session before asking the routing
+ * @returns the BitswapSession, or NULL on error
+ */
+struct BitswapSession* ipfs_bitswap_session_new(int provider_delay) {
+	struct BitswapSession* session = (struct BitswapSession*)malloc(sizeof(struct BitswapSession));
+	if (session != NULL) {
+		session->peers = libp2p_utils_vector_new(1);
+		if (session->peers == NULL) {
+			free(session);
+			return NULL;
+		}
+		pthread_mutex_init(&session->lock, NULL);
+		session->provider_delay = provider_delay;
+	}
+	return session;
+}
+
+/***
+ * Free the resources of a BitswapSession
+ * @param session the session
+ * @returns true(1)
+ */
+int ipfs_bitswap_session_free(struct BitswapSession* session) {
+	if (session != NULL) {
+		// the peers belong to the peerstore
+		libp2p_utils_vector_free(session->peers);
+		pthread_mutex_destroy(&session->lock);
+		free(session);
+	}
+	return 1;
+}
+
+/***
+ * Remember a peer that sent a block of the session
+ * @param session the session
+ * @param peer the peer (it must outlive the session, like the ones in the peerstore)
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_session_add_peer(struct BitswapSession* session, struct Libp2pPeer* peer) {
+	// the latest goes to the front, dropping the one heard from the longest ago if there are too many
+	struct Libp2pVector* peers = libp2p_utils_vector_new(1);
+	if (peers == NULL)
+		return 0;
+	libp2p_utils_vector_add(peers, peer);
+	pthread_mutex_lock(&session->lock);
+	for(int i = 0; i < session->peers->total && peers->total < BITSWAP_SESSION_MAX_PEERS; i++) {
+		const void* current = libp2p_utils_vector_get(session->peers, i);
+		if (current != peer)
+			libp2p_utils_vector_add(peers, current);
+	}
+	libp2p_utils_vector_free(session->peers);
+	session->peers = peers;
+	pthread_mutex_unlock(&session->lock);
+	return 1;
+}
+
+/***
+ * Add the peers of the session to a vector, if they are not in it already
+ * @param session the session
+ * @param peers the vector of Libp2pPeers
+ * @returns the number of peers the session has
+ */
+int ipfs_bitswap_session_get_peers(struct BitswapSession* session, struct Libp2pVector* peers) {
+	pthread_mutex_lock(&session->lock);
+	int total = session->peers->total;
+	for(int i = 0; i < total; i++) {
+		const void* peer = libp2p_utils_vector_get(session->peers, i);
+		int found = 0;
+		for(int j = 0; j < peers->total && !found; j++)
+			found = (libp2p_utils_vector_get(peers, j) == peer);
+		if (!found)
+			libp2p_utils_vector_add(peers, peer);
+	}
+	pthread_mutex_unlock(&session->lock);
+	return total;
+}
@@ -0,0 +1,232 @@
+/***
+ * Checks that the blocks from the network match their Cids. See verify.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libp2p/crypto/sha256.h"
+#include "libp2p/utils/logger.h"
+#include "ipfs/exchange/bitswap/bitswap.h"
+#include "ipfs/exchange/bitswap/peer_request_queue.h"
+#include "ipfs/exchange/bitswap/verify.h"
+
+// the multihash code of sha2-256
+#define BITSWAP_VERIFY_SHA2_256 0x12
+
+/***
+ * Blocks for a worker to check
+ */
+struct BitswapVerifyJob {
+	struct BitswapContext* context;
+	struct Libp2pPeer* from;
+	struct Libp2pVector* blocks;
+	size_t bytes; // counted in the queued bytes of the verifier, or 0
+};
+
+/***
+ * Find the sha2-256 digest in a Cid
+ * @param cid the Cid
+ * @returns the 32 bytes of the digest, or NULL if the Cid is not a sha2-256 hash
+ */
+const unsigned char* ipfs_bitswap_verify_digest(const struct Cid* cid) {
+	if (cid == NULL || cid->hash == NULL)
+		return NULL;
+	// the sha256 itself, as ipfs_blocks_block_add_data makes them
+	if (cid->hash_length == 32)
+		return cid->hash;
+	// a sha2-256 multihash
+	if (cid->hash_length == 34 && cid->hash[0] == BITSWAP_VERIFY_SHA2_256 && cid->hash[1] == 32)
+		return &cid->hash[2];
+	return NULL;
+}
+
+/***
+ * Find out if the hash of a Cid is one that blocks can be checked against
+ * @param cid the Cid
+ * @returns true(1) if it is a sha2-256 hash, false(0) otherwise
+ */
+int ipfs_bitswap_verify_supported(const struct Cid* cid) {
+	return ipfs_bitswap_verify_digest(cid) != NULL;
+}
+
+/***
+ * Find out if the data of a block hashes to its Cid
+ * @param block the block
+ * @returns true(1) if it does, false(0) if it does not, or the hash can not be checked
+ */
+int ipfs_bitswap_verify_block(const struct Block* block) {
+	unsigned char hash[32];
+	const unsigned char* digest = ipfs_bitswap_verify_digest(block->cid);
+	if (digest == NULL)
+		return 0;
+	if (libp2p_crypto_hashing_sha256(block->data, block->data_length, &hash[0]) == 0)
+		return 0;
+	return memcmp(hash, digest, 32) == 0;
+}
+
+/***
+ * Create a new BitswapVerifier
+ * @param workers the number of threads that hash (0 for one per processor, 1 to hash on the calling thread)
+ * @returns the BitswapVerifier, or NULL on error
+ */
+struct BitswapVerifier* ipfs_bitswap_verifier_new(int workers) {
+	struct BitswapVerifier* verifier = (struct BitswapVerifier*)malloc(sizeof(struct BitswapVerifier));
+	if (verifier == NULL)
+		return NULL;
+	if (workers < 1) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = (processors < 1 ? 1 : (int)processors);
+	}
+	verifier->workers = workers;
+	verifier->pool = NULL;
+	verifier->queued_bytes = 0;
+	verifier->max_bytes = BITSWAP_VERIFY_MAX_BYTES;
+	if (workers > 1) {
+		verifier->pool = thpool_init(workers);
+		if (verifier->pool == NULL) {
+			free(verifier);
+			return NULL;
+		}
+	}
+	pthread_mutex_init(&verifier->lock, NULL);
+	return verifier;
+}
+
+/***
+ * Wait for the blocks that are being checked, and free the resources of a BitswapVerifier
+ * @param verifier the BitswapVerifier
+ * @returns true(1)
+ */
+int ipfs_bitswap_verifier_free(struct BitswapVerifier* verifier) {
+	if (verifier != NULL) {
+		if (verifier->pool != NULL) {
+			// the jobs hand blocks to the exchange, so they must be done before it goes away
+			thpool_wait(verifier->pool);
+			thpool_destroy(verifier->pool);
+		}
+		pthread_mutex_destroy(&verifier->lock);
+		free(verifier);
+	}
+	return 1;
+}
+
+/***
+ * The job run by the workers: check a group of blocks, and hand over the good ones
+ * @param arg the BitswapVerifyJob
+ */
+void ipfs_bitswap_verifier_run(void* arg) {
+	struct BitswapVerifyJob* job = (struct BitswapVerifyJob*)arg;
+	unsigned long blocks = 0;
+	unsigned long long bytes = 0;
+
+	for(int i = 0; i < job->blocks->total; i++) {
+		struct Block* block = (struct Block*)libp2p_utils_vector_get(job->blocks, i);
+		if (!ipfs_bitswap_verify_supported(block->cid)) {
+			libp2p_logger_error("bitswap_verify", "A block has a Cid whose hash type is not supported, and was thrown away.\n");
+			ipfs_block_free(block);
+			continue;
+		}
+		if (!ipfs_bitswap_verify_block(block)) {
+			libp2p_logger_error("bitswap_verify", "A block did not match its Cid, and was thrown away.\n");
+			ipfs_block_free(block);
+			continue;
+		}
+		blocks++;
+		bytes += block->data_length;
+		ipfs_bitswap_receive_block(job->context, block, job->from);
+	}
+	// what they give counts toward what they get
+	if (job->from != NULL && blocks > 0) {
+		struct PeerRequest* peerRequest = ipfs_peer_request_queue_find_peer(job->context->peerRequestQueue, job->from);
+		if (peerRequest != NULL) {
+			pthread_mutex_lock(&peerRequest->request_mutex);
+			ipfs_bitswap_ledger_received(&peerRequest->ledger, blocks, bytes);
+			pthread_mutex_unlock(&peerRequest->request_mutex);
+		}
+	}
+	// room for more
+	if (job->bytes > 0) {
+		struct BitswapVerifier* verifier = job->context->verifier;
+		pthread_mutex_lock(&verifier->lock);
+		verifier->queued_bytes -= job->bytes;
+		pthread_mutex_unlock(&verifier->lock);
+	}
+	libp2p_utils_vector_free(job->blocks);
+	free(job);
+}
+
+/***
+ * Give a job to the workers, or run it here if there are none, or they have too much waiting
+ * @param verifier the BitswapVerifier (can be NULL)
+ * @param job the job (this takes it)
+ * @param bytes the bytes of the blocks of the job
+ */
+void ipfs_bitswap_verifier_start(struct BitswapVerifier* verifier, struct BitswapVerifyJob* job, size_t bytes) {
+	job->bytes = 0;
+	if (verifier != NULL && verifier->pool != NULL) {
+		pthread_mutex_lock(&verifier->lock);
+		// a job bigger than all of it still goes to the workers when nothing else is waiting
+		if (verifier->queued_bytes == 0 || verifier->queued_bytes + bytes <= verifier->max_bytes) {
+			verifier->queued_bytes += bytes;
+			job->bytes = bytes;
+		}
+		pthread_mutex_unlock(&verifier->lock);
+		if (job->bytes > 0 && thpool_add_work(verifier->pool, ipfs_bitswap_verifier_run, job) == 0)
+			return;
+		if (job->bytes > 0) {
+			pthread_mutex_lock(&verifier->lock);
+			verifier->queued_bytes -= job->bytes;
+			pthread_mutex_unlock(&verifier->lock);
+			job->bytes = 0;
+		}
+	}
+	ipfs_bitswap_verifier_run(job);
+}
+
+/***
+ * Check blocks that arrived, and hand the good ones to ipfs_bitswap_receive_block.
+ * The blocks that do not match their Cid are thrown away, and do not count toward the ledger of the peer.
+ * @param context the BitswapContext
+ * @param blocks the Blocks (this takes the vector and the blocks)
+ * @param from the peer that sent them, or NULL
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_verifier_add(struct BitswapContext* context, struct Libp2pVector* blocks, struct Libp2pPeer* from) {
+	struct BitswapVerifyJob* job = NULL;
+	size_t job_bytes = 0;
+	int retVal = 1;
+
+	for(int i = 0; i < blocks->total; i++) {
+		struct Block* block = (struct Block*)libp2p_utils_vector_get(blocks, i);
+		if (job == NULL) {
+			job = (struct BitswapVerifyJob*)malloc(sizeof(struct BitswapVerifyJob));
+			if (job != NULL) {
+				job->blocks = libp2p_utils_vector_new(1);
+				if (job->blocks == NULL) {
+					free(job);
+					job = NULL;
+				}
+			}
+			if (job == NULL) {
+				ipfs_block_free(block);
+				retVal = 0;
+				continue;
+			}
+			job->context = context;
+			job->from = from;
+			job_bytes = 0;
+		}
+		libp2p_utils_vector_add(job->blocks, block);
+		job_bytes += block->data_length;
+		// small blocks are hashed together, big ones get a worker each
+		if (job_bytes >= BITSWAP_VERIFY_BATCH_BYTES) {
+			ipfs_bitswap_verifier_start(context->verifier, job, job_bytes);
+			job = NULL;
+		}
+	}
+	if (job != NULL)
+		ipfs_bitswap_verifier_start(context->verifier, job, job_bytes);
+	libp2p_utils_vector_free(blocks);
+	return retVal;
+}
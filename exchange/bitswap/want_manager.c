@@ -1,5 +1,6 @@
 #include "ipfs/exchange/bitswap/want_manager.h"
 #include "ipfs/exchange/bitswap/wantlist_queue.h"
+#include "ipfs/exchange/bitswap/engine.h"
 
 /***
  * Add a Cid to the wantlist
@@ -9,7 +10,10 @@
  */
 struct WantListQueueEntry* ipfs_bitswap_want_manager_add(const struct BitswapContext* context, const struct Cid* cid, const struct WantListSession* session) {
 	// add if not there, and increment reference count
-	return ipfs_bitswap_wantlist_queue_add(context->localWantlist, cid, session);
+	struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_add(context->localWantlist, cid, session);
+	if (entry != NULL)
+		ipfs_bitswap_engine_wantlist_changed(context->bitswap_engine);
+	return entry;
 }
 
 /***
@@ -19,13 +23,16 @@ struct WantListQueueEntry* ipfs_bitswap_want_manager_add(const struct BitswapCon
  * @returns true(1) if it has been received, false(0) otherwise
  */
 int ipfs_bitswap_want_manager_received(const struct BitswapContext* context, const struct Cid* cid) {
+	int retVal = 0;
+	pthread_mutex_lock(&context->localWantlist->wantlist_mutex);
 	// find the entry
 	struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(context->localWantlist, cid);
 	// check the status
 	if (entry != NULL && entry->block != NULL) {
-		return 1;
+		retVal = 1;
 	}
-	return 0;
+	pthread_mutex_unlock(&context->localWantlist->wantlist_mutex);
+	return retVal;
 }
 
 /***
@@ -36,15 +43,15 @@ int ipfs_bitswap_want_manager_received(const struct BitswapContext* context, con
  * @returns true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_want_manager_get_block(const struct BitswapContext* context, const struct Cid* cid, struct Block** block) {
+	*block = NULL;
+	pthread_mutex_lock(&context->localWantlist->wantlist_mutex);
 	struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(context->localWantlist, cid);
 	if (entry != NULL && entry->block != NULL) {
 		// return a copy of the block
 		*block = ipfs_block_copy(entry->block);
-		if ( (*block) != NULL) {
-			return 1;
-		}
 	}
-	return 0;
+	pthread_mutex_unlock(&context->localWantlist->wantlist_mutex);
+	return *block != NULL;
 }
 
 /***
@@ -60,5 +67,6 @@ int ipfs_bitswap_want_manager_remove(const struct BitswapContext* context, const
 	struct WantListSession session;
 	session.type = WANTLIST_SESSION_TYPE_LOCAL;
 	session.context = (void*) context->ipfsNode;
+	session.bitswap_session = NULL;
 	return ipfs_bitswap_wantlist_queue_remove(context->localWantlist, cid, &session);
 }
@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
+#include <time.h>
 #include "libp2p/conn/session.h"
 #include "libp2p/utils/vector.h"
 #include "ipfs/exchange/bitswap/wantlist_queue.h"
 #include "ipfs/exchange/bitswap/peer_request_queue.h"
+#include "ipfs/exchange/bitswap/engine.h"
 
 /**
  * Implementation of the WantlistQueue
@@ -15,6 +18,13 @@
  * @returns true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_wantlist_queue_entry_decrement(struct WantListQueueEntry* entry, const struct WantListSession* session) {
+	// the same session first, as equal sessions can belong to different callers
+	for(size_t i = 0; i < entry->sessionsRequesting->total; i++) {
+		if (libp2p_utils_vector_get(entry->sessionsRequesting, i) == session) {
+			libp2p_utils_vector_delete(entry->sessionsRequesting, i);
+			return 1;
+		}
+	}
 	for(size_t i = 0; i < entry->sessionsRequesting->total; i++) {
 		const struct WantListSession* current = (const struct WantListSession*)libp2p_utils_vector_get(entry->sessionsRequesting, i);
 		if (ipfs_bitswap_wantlist_session_compare(session, current) == 0) {
@@ -25,6 +35,159 @@ int ipfs_bitswap_wantlist_queue_entry_decrement(struct WantListQueueEntry* entry
 	return 0;
 }
 
+/***
+ * The bucket of a Cid in the hash table. The multihash is already a hash, but not all of
+ * its bytes vary (the first ones are the type and length), so all of them are mixed.
+ * @param wantlist the WantList
+ * @param cid the Cid
+ * @returns the index of the bucket
+ */
+size_t ipfs_bitswap_wantlist_queue_bucket(const struct WantListQueue* wantlist, const struct Cid* cid) {
+	// FNV-1a
+	unsigned long hash = 2166136261UL;
+	for(size_t i = 0; i < cid->hash_length; i++) {
+		hash ^= cid->hash[i];
+		hash *= 16777619UL;
+	}
+	return hash % wantlist->bucket_count;
+}
+
+/***
+ * Make the hash table bigger, so the chains stay short
+ * @param wantlist the WantList
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_wantlist_queue_grow(struct WantListQueue* wantlist) {
+	struct WantListQueueEntry** old_buckets = wantlist->buckets;
+	size_t old_count = wantlist->bucket_count;
+	struct WantListQueueEntry** buckets = (struct WantListQueueEntry**)calloc(old_count * 2, sizeof(struct WantListQueueEntry*));
+	if (buckets == NULL)
+		return 0;
+	wantlist->buckets = buckets;
+	wantlist->bucket_count = old_count * 2;
+	for(size_t i = 0; i < old_count; i++) {
+		struct WantListQueueEntry* entry = old_buckets[i];
+		while (entry != NULL) {
+			struct WantListQueueEntry* next = entry->next_in_bucket;
+			size_t bucket = ipfs_bitswap_wantlist_queue_bucket(wantlist, entry->cid);
+			entry->next_in_bucket = buckets[bucket];
+			buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+	free(old_buckets);
+	return 1;
+}
+
+/***
+ * The time used for WantListQueueEntry.not_before
+ * @returns milliseconds since some time in the past
+ */
+long long ipfs_bitswap_wantlist_queue_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/***
+ * Which of 2 entries should be looked for first. The ones that can be looked for
+ * soonest go first. Then the ones tried the least, so one that cannot be found does
+ * not hold up the rest. Then the highest priority, then the one added first.
+ * @param a one entry
+ * @param b the other entry
+ * @returns true(1) if a goes before b
+ */
+int ipfs_bitswap_wantlist_queue_ready_before(const struct WantListQueueEntry* a, const struct WantListQueueEntry* b) {
+	if (a->not_before != b->not_before)
+		return a->not_before < b->not_before;
+	if (a->attempts != b->attempts)
+		return a->attempts < b->attempts;
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	return a->sequence < b->sequence;
+}
+
+/***
+ * Put an entry at a place in the ready queue
+ * @param wantlist the WantList
+ * @param entry the entry
+ * @param index where it goes
+ */
+void ipfs_bitswap_wantlist_queue_ready_set(struct WantListQueue* wantlist, struct WantListQueueEntry* entry, size_t index) {
+	wantlist->ready[index] = entry;
+	entry->ready_index = (int)index;
+}
+
+/***
+ * Move an entry in the ready queue (a binary heap) until it is in order
+ * @param wantlist the WantList
+ * @param index where the entry is
+ */
+void ipfs_bitswap_wantlist_queue_ready_sift(struct WantListQueue* wantlist, size_t index) {
+	struct WantListQueueEntry* entry = wantlist->ready[index];
+	// up
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (!ipfs_bitswap_wantlist_queue_ready_before(entry, wantlist->ready[parent]))
+			break;
+		ipfs_bitswap_wantlist_queue_ready_set(wantlist, wantlist->ready[parent], index);
+		index = parent;
+	}
+	// down
+	while (1) {
+		size_t child = index * 2 + 1;
+		if (child >= wantlist->ready_total)
+			break;
+		if (child + 1 < wantlist->ready_total && ipfs_bitswap_wantlist_queue_ready_before(wantlist->ready[child + 1], wantlist->ready[child]))
+			child++;
+		if (!ipfs_bitswap_wantlist_queue_ready_before(wantlist->ready[child], entry))
+			break;
+		ipfs_bitswap_wantlist_queue_ready_set(wantlist, wantlist->ready[child], index);
+		index = child;
+	}
+	ipfs_bitswap_wantlist_queue_ready_set(wantlist, entry, index);
+}
+
+/***
+ * Add an entry to the ready queue
+ * @param wantlist the WantList
+ * @param entry the entry
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_wantlist_queue_ready_push(struct WantListQueue* wantlist, struct WantListQueueEntry* entry) {
+	if (entry->ready_index >= 0)
+		return 1;
+	if (wantlist->ready_total == wantlist->ready_size) {
+		size_t size = (wantlist->ready_size == 0 ? 16 : wantlist->ready_size * 2);
+		struct WantListQueueEntry** ready = (struct WantListQueueEntry**)realloc(wantlist->ready, size * sizeof(struct WantListQueueEntry*));
+		if (ready == NULL)
+			return 0;
+		wantlist->ready = ready;
+		wantlist->ready_size = size;
+	}
+	ipfs_bitswap_wantlist_queue_ready_set(wantlist, entry, wantlist->ready_total);
+	wantlist->ready_total++;
+	ipfs_bitswap_wantlist_queue_ready_sift(wantlist, wantlist->ready_total - 1);
+	return 1;
+}
+
+/***
+ * Take an entry out of the ready queue, if it is there
+ * @param wantlist the WantList
+ * @param entry the entry
+ */
+void ipfs_bitswap_wantlist_queue_ready_delete(struct WantListQueue* wantlist, struct WantListQueueEntry* entry) {
+	if (entry->ready_index < 0)
+		return;
+	size_t index = (size_t)entry->ready_index;
+	entry->ready_index = -1;
+	wantlist->ready_total--;
+	if (index < wantlist->ready_total) {
+		// the last one fills the hole
+		ipfs_bitswap_wantlist_queue_ready_set(wantlist, wantlist->ready[wantlist->ready_total], index);
+		ipfs_bitswap_wantlist_queue_ready_sift(wantlist, index);
+	}
+}
 
 /***
  * Initialize a new Wantlist (there should only be 1 per instance)
@@ -33,8 +196,18 @@ int ipfs_bitswap_wantlist_queue_entry_decrement(struct WantListQueueEntry* entry
 struct WantListQueue* ipfs_bitswap_wantlist_queue_new() {
 	struct WantListQueue* wantlist = (struct WantListQueue*) malloc(sizeof(struct WantListQueue));
 	if (wantlist != NULL) {
+		wantlist->bucket_count = 64;
+		wantlist->buckets = (struct WantListQueueEntry**)calloc(wantlist->bucket_count, sizeof(struct WantListQueueEntry*));
+		if (wantlist->buckets == NULL) {
+			free(wantlist);
+			return NULL;
+		}
 		pthread_mutex_init(&wantlist->wantlist_mutex, NULL);
-		wantlist->queue = NULL;
+		wantlist->total = 0;
+		wantlist->ready = NULL;
+		wantlist->ready_total = 0;
+		wantlist->ready_size = 0;
+		wantlist->next_sequence = 0;
 	}
 	return wantlist;
 }
@@ -46,19 +219,56 @@ struct WantListQueue* ipfs_bitswap_wantlist_queue_new() {
  */
 int ipfs_bitswap_wantlist_queue_free(struct WantListQueue* wantlist) {
 	if (wantlist != NULL) {
-		if (wantlist->queue != NULL) {
-			for(int i = 0; i < wantlist->queue->total; i++) {
-				struct WantListQueueEntry* entry = (struct WantListQueueEntry*)libp2p_utils_vector_get(wantlist->queue, i);
+		for(size_t i = 0; i < wantlist->bucket_count; i++) {
+			struct WantListQueueEntry* entry = wantlist->buckets[i];
+			while (entry != NULL) {
+				struct WantListQueueEntry* next = entry->next_in_bucket;
 				ipfs_bitswap_wantlist_queue_entry_free(entry);
+				entry = next;
 			}
-			libp2p_utils_vector_free(wantlist->queue);
-			wantlist->queue = NULL;
 		}
+		free(wantlist->buckets);
+		if (wantlist->ready != NULL)
+			free(wantlist->ready);
+		pthread_mutex_destroy(&wantlist->wantlist_mutex);
 		free(wantlist);
 	}
 	return 1;
 }
 
+/***
+ * Add a Cid to the WantList
+ * NOTE: the caller must hold the wantlist_mutex
+ * @param wantlist the WantList to add to
+ * @param cid the Cid to add
+ * @param session who wants it
+ * @returns the correct WantListEntry or NULL if error
+ */
+struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_add_locked(struct WantListQueue* wantlist, const struct Cid* cid, const struct WantListSession* session) {
+	struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(wantlist, cid);
+	if (entry == NULL) {
+		// create a new one
+		entry = ipfs_bitswap_wantlist_queue_entry_new();
+		if (entry != NULL) {
+			entry->cid = ipfs_cid_copy(cid);
+			entry->priority = 1;
+			entry->sequence = wantlist->next_sequence++;
+		}
+		if (entry == NULL || entry->cid == NULL || !ipfs_bitswap_wantlist_queue_ready_push(wantlist, entry)) {
+			ipfs_bitswap_wantlist_queue_entry_free(entry);
+			return NULL;
+		}
+		if (wantlist->total >= wantlist->bucket_count)
+			ipfs_bitswap_wantlist_queue_grow(wantlist);
+		size_t bucket = ipfs_bitswap_wantlist_queue_bucket(wantlist, entry->cid);
+		entry->next_in_bucket = wantlist->buckets[bucket];
+		wantlist->buckets[bucket] = entry;
+		wantlist->total++;
+	}
+	libp2p_utils_vector_add(entry->sessionsRequesting, session);
+	return entry;
+}
+
 /***
  * Add a Cid to the WantList
  * @param wantlist the WantList to add to
@@ -69,87 +279,262 @@ struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_add(struct WantListQueue*
 	struct WantListQueueEntry* entry = NULL;
 	if (wantlist != NULL) {
 		pthread_mutex_lock(&wantlist->wantlist_mutex);
-		if (wantlist->queue == NULL) {
-			wantlist->queue = libp2p_utils_vector_new(1);
-		}
-		entry = ipfs_bitswap_wantlist_queue_find(wantlist, cid);
-		if (entry == NULL) {
-			// create a new one
-			entry = ipfs_bitswap_wantlist_queue_entry_new();
-			entry->cid = ipfs_cid_copy(cid);
-			entry->priority = 1;
-			libp2p_utils_vector_add(wantlist->queue, entry);
-		}
-		libp2p_utils_vector_add(entry->sessionsRequesting, session);
+		entry = ipfs_bitswap_wantlist_queue_add_locked(wantlist, cid, session);
 		pthread_mutex_unlock(&wantlist->wantlist_mutex);
 	}
 	return entry;
 }
 
 /***
- * Remove (decrement the counter) a Cid from the WantList
+ * Add several Cids to the WantList at once
+ * @param wantlist the WantList to add to
+ * @param cids the Cids to add
+ * @param cids_size the number of Cids
+ * @param session who wants them
+ * @param entries where to put the entries, in the same order as the Cids
+ * @returns true(1) on success. On error, none of them are added.
+ */
+int ipfs_bitswap_wantlist_queue_add_many(struct WantListQueue* wantlist, struct Cid** cids, size_t cids_size, const struct WantListSession* session, struct WantListQueueEntry** entries) {
+	if (wantlist == NULL)
+		return 0;
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	for(size_t i = 0; i < cids_size; i++) {
+		entries[i] = ipfs_bitswap_wantlist_queue_add_locked(wantlist, cids[i], session);
+		if (entries[i] == NULL) {
+			pthread_mutex_unlock(&wantlist->wantlist_mutex);
+			for(size_t j = 0; j < i; j++)
+				ipfs_bitswap_wantlist_queue_remove(wantlist, cids[j], session);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	return 1;
+}
+
+/***
+ * Take an entry out of the hash table and the ready queue
+ * @param wantlist the WantList
+ * @param entry the entry
+ */
+void ipfs_bitswap_wantlist_queue_unlink(struct WantListQueue* wantlist, struct WantListQueueEntry* entry) {
+	struct WantListQueueEntry** link = &wantlist->buckets[ipfs_bitswap_wantlist_queue_bucket(wantlist, entry->cid)];
+	while (*link != NULL) {
+		if (*link == entry) {
+			*link = entry->next_in_bucket;
+			wantlist->total--;
+			break;
+		}
+		link = &(*link)->next_in_bucket;
+	}
+	entry->next_in_bucket = NULL;
+	ipfs_bitswap_wantlist_queue_ready_delete(wantlist, entry);
+}
+
+/***
+ * Remove (decrement the counter) a Cid from the WantList. When nobody wants it
+ * any more, the entry is freed.
  * @param wantlist the WantList
  * @param cid the Cid
  * @returns true(1) on success, otherwise false(0)
  */
 int ipfs_bitswap_wantlist_queue_remove(struct WantListQueue* wantlist, const struct Cid* cid, const struct WantListSession* session) {
-	//TODO: remove if counter is <= 0
+	int retVal = 0;
 	if (wantlist != NULL) {
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
 		struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(wantlist, cid);
 		if (entry != NULL) {
 			ipfs_bitswap_wantlist_queue_entry_decrement(entry, session);
-			return 1;
+			if (entry->sessionsRequesting->total == 0) {
+				ipfs_bitswap_wantlist_queue_unlink(wantlist, entry);
+				// the engine frees it when it is done with it
+				if (entry->processing)
+					entry->removed = 1;
+				else
+					ipfs_bitswap_wantlist_queue_entry_free(entry);
+			}
+			retVal = 1;
 		}
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
 	}
-	return 0;
+	return retVal;
 }
 
 /***
  * Find a Cid in the WantList
+ * NOTE: the caller must hold the wantlist_mutex
  * @param wantlist the list
  * @param cid the Cid
  * @returns the WantListQueueEntry
  */
 struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_find(struct WantListQueue* wantlist, const struct Cid* cid) {
-	for (size_t i = 0; i < wantlist->queue->total; i++) {
-		struct WantListQueueEntry* entry = (struct WantListQueueEntry*) libp2p_utils_vector_get(wantlist->queue, i);
-		if (entry == NULL) {
-			//TODO: something went wrong. This should be logged.
-			return NULL;
-		}
-		if (ipfs_cid_compare(cid, entry->cid) == 0) {
+	struct WantListQueueEntry* entry = wantlist->buckets[ipfs_bitswap_wantlist_queue_bucket(wantlist, cid)];
+	while (entry != NULL) {
+		if (ipfs_cid_compare(cid, entry->cid) == 0)
 			return entry;
-		}
+		entry = entry->next_in_bucket;
 	}
 	return NULL;
 }
 
 /***
- * Pops the top one off the queue
+ * Pops the top one off the queue, if it is time to look for it. The entry stays in
+ * the WantList, but is not popped again until it is released.
  *
  * @param wantlist the list
- * @returns the WantListQueueEntry
+ * @returns the WantListQueueEntry, or NULL if nothing needs to be looked for
  */
 struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_pop(struct WantListQueue* wantlist) {
 	struct WantListQueueEntry* entry = NULL;
 
-	if (wantlist == NULL || wantlist->queue == NULL || wantlist->queue->total == 0)
+	if (wantlist == NULL)
 		return entry;
 
-	//TODO: This should be a linked list, not an array
 	pthread_mutex_lock(&wantlist->wantlist_mutex);
-	for(int i = 0; i < wantlist->queue->total; i++) {
-		struct WantListQueueEntry* current = (struct WantListQueueEntry*)libp2p_utils_vector_get(wantlist->queue, i);
-		if (current->block == NULL && !current->asked_network) {
-			entry = current;
-			break;
-		}
+	if (wantlist->ready_total > 0 && wantlist->ready[0]->not_before <= ipfs_bitswap_wantlist_queue_now()) {
+		entry = wantlist->ready[0];
+		ipfs_bitswap_wantlist_queue_ready_delete(wantlist, entry);
+		entry->processing = 1;
 	}
-	//libp2p_utils_vector_delete(wantlist->queue, 0);
 	pthread_mutex_unlock(&wantlist->wantlist_mutex);
 	return entry;
 }
 
+/***
+ * How long until the next entry can be popped
+ * @param wantlist the list
+ * @returns milliseconds (0 if one can be popped now), or -1 if nothing needs to be looked for
+ */
+long ipfs_bitswap_wantlist_queue_next_due(struct WantListQueue* wantlist) {
+	long retVal = -1;
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	if (wantlist->ready_total > 0) {
+		long long wait = wantlist->ready[0]->not_before - ipfs_bitswap_wantlist_queue_now();
+		retVal = (wait > 0 ? (long)wait : 0);
+	}
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	return retVal;
+}
+
+/***
+ * Give back an entry that was popped. If it still has to be looked for, it goes back
+ * in the queue. If it was removed in the meantime, it is freed.
+ * @param wantlist the list
+ * @param entry the entry that was popped
+ */
+void ipfs_bitswap_wantlist_queue_release(struct WantListQueue* wantlist, struct WantListQueueEntry* entry) {
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	entry->processing = 0;
+	if (entry->removed)
+		ipfs_bitswap_wantlist_queue_entry_free(entry);
+	else if (entry->block == NULL && !entry->asked_network)
+		ipfs_bitswap_wantlist_queue_ready_push(wantlist, entry);
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+}
+
+/***
+ * Fill in the block of an entry, and wake everyone waiting for it
+ * @param wantlist the WantList that has the entry
+ * @param entry the entry, or NULL to look for the entry of the block's Cid
+ * @param block the block. The entry takes it, or it is freed if the entry already has one (or there is no entry).
+ * @param from the peer that sent the block, remembered by the sessions of the entry (NULL if it did not come from a peer)
+ * @returns true(1) if the entry took the block
+ */
+int ipfs_bitswap_wantlist_queue_entry_set_block(struct WantListQueue* wantlist, struct WantListQueueEntry* entry, struct Block* block, struct Libp2pPeer* from) {
+	int retVal = 0;
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	if (entry == NULL)
+		entry = ipfs_bitswap_wantlist_queue_find(wantlist, block->cid);
+	if (entry != NULL && entry->block == NULL) {
+		entry->block = block;
+		retVal = 1;
+		// no need to look for it any more
+		ipfs_bitswap_wantlist_queue_ready_delete(wantlist, entry);
+		pthread_cond_broadcast(&entry->block_arrived);
+		for(int i = 0; from != NULL && i < entry->sessionsRequesting->total; i++) {
+			const struct WantListSession* session = (const struct WantListSession*)libp2p_utils_vector_get(entry->sessionsRequesting, i);
+			if (session->bitswap_session != NULL)
+				ipfs_bitswap_session_add_peer(session->bitswap_session, from);
+		}
+		for(int i = 0; entry->waiters != NULL && i < entry->waiters->total; i++) {
+			struct WantListWaiter* waiter = (struct WantListWaiter*)libp2p_utils_vector_get(entry->waiters, i);
+			libp2p_utils_vector_add(waiter->arrived, entry);
+			pthread_cond_signal(&waiter->block_arrived);
+		}
+	}
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	if (!retVal)
+		ipfs_block_free(block);
+	return retVal;
+}
+
+/***
+ * Create a WantListWaiter, to wait for any of several blocks
+ * @returns the WantListWaiter, or NULL on error
+ */
+struct WantListWaiter* ipfs_bitswap_wantlist_waiter_new() {
+	struct WantListWaiter* waiter = (struct WantListWaiter*)malloc(sizeof(struct WantListWaiter));
+	if (waiter != NULL) {
+		waiter->arrived = libp2p_utils_vector_new(1);
+		if (waiter->arrived == NULL) {
+			free(waiter);
+			return NULL;
+		}
+		pthread_cond_init(&waiter->block_arrived, NULL);
+	}
+	return waiter;
+}
+
+/***
+ * Free a WantListWaiter. It must not be watching any entries.
+ * @param waiter the WantListWaiter
+ * @returns true(1)
+ */
+int ipfs_bitswap_wantlist_waiter_free(struct WantListWaiter* waiter) {
+	if (waiter != NULL) {
+		libp2p_utils_vector_free(waiter->arrived);
+		pthread_cond_destroy(&waiter->block_arrived);
+		free(waiter);
+	}
+	return 1;
+}
+
+/***
+ * Be told when the block of an entry arrives. If it is already there, it is
+ * put in the waiter's arrived list now.
+ * NOTE: the caller must hold the wantlist_mutex
+ * @param entry the entry
+ * @param waiter who to tell
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_wantlist_queue_entry_watch(struct WantListQueueEntry* entry, struct WantListWaiter* waiter) {
+	if (entry->block != NULL) {
+		libp2p_utils_vector_add(waiter->arrived, entry);
+		return 1;
+	}
+	if (entry->waiters == NULL) {
+		entry->waiters = libp2p_utils_vector_new(1);
+		if (entry->waiters == NULL)
+			return 0;
+	}
+	libp2p_utils_vector_add(entry->waiters, waiter);
+	return 1;
+}
+
+/***
+ * Stop being told about an entry
+ * NOTE: the caller must hold the wantlist_mutex
+ * @param entry the entry
+ * @param waiter who was being told
+ */
+void ipfs_bitswap_wantlist_queue_entry_unwatch(struct WantListQueueEntry* entry, struct WantListWaiter* waiter) {
+	for(int i = 0; entry->waiters != NULL && i < entry->waiters->total; i++) {
+		if (libp2p_utils_vector_get(entry->waiters, i) == waiter) {
+			libp2p_utils_vector_delete(entry->waiters, i);
+			return;
+		}
+	}
+}
+
 /***
  * Initialize a WantListQueueEntry
  * @returns a new WantListQueueEntry
@@ -163,10 +548,19 @@ struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_entry_new() {
 			return NULL;
 		}
 		entry->block = NULL;
+		pthread_cond_init(&entry->block_arrived, NULL);
 		entry->cid = NULL;
 		entry->priority = 0;
 		entry->attempts = 0;
 		entry->asked_network = 0;
+		entry->asked_session = 0;
+		entry->not_before = 0;
+		entry->sequence = 0;
+		entry->ready_index = -1;
+		entry->processing = 0;
+		entry->removed = 0;
+		entry->next_in_bucket = NULL;
+		entry->waiters = NULL;
 	}
 	return entry;
 }
@@ -190,6 +584,9 @@ int ipfs_bitswap_wantlist_queue_entry_free(struct WantListQueueEntry* entry) {
 			libp2p_utils_vector_free(entry->sessionsRequesting);
 			entry->sessionsRequesting = NULL;
 		}
+		if (entry->waiters != NULL)
+			libp2p_utils_vector_free(entry->waiters);
+		pthread_cond_destroy(&entry->block_arrived);
 		free(entry);
 	}
 	return 1;
@@ -230,44 +627,87 @@ int ipfs_bitswap_wantlist_local_request(struct Libp2pVector* sessions)
 }
 
 /***
- * Attempt to retrieve a block from the local blockstore
+ * Attempt to retrieve a block from the local blockstore. The block is a view of its file
+ * when the blockstore can make one, so it is not copied on its way to the peers.
  *
  * @param context the BitswapContext
  * @param cid the id to look for
- * @param block where to put the results
+ * @param block where to put the results. Free it with ipfs_block_free, as usual.
  * @returns true(1) if found, false(0) otherwise
  */
 int ipfs_bitswap_wantlist_get_block_locally(struct BitswapContext* context, struct Cid* cid, struct Block** block) {
-	return context->ipfsNode->blockstore->Get(context->ipfsNode->blockstore->blockstoreContext, cid, block);
+	struct Blockstore* blockstore = context->ipfsNode->blockstore;
+	if (blockstore->GetView != NULL)
+		return blockstore->GetView(blockstore->blockstoreContext, cid, block);
+	return blockstore->Get(blockstore->blockstoreContext, cid, block);
+}
+
+/***
+ * Ask some peers for a block
+ * @param context the BitswapContext
+ * @param cid the id of the block
+ * @param peers the Libp2pPeers to ask
+ * @param peer_requests where to collect the PeerRequests that now have something to send, so
+ * several wants go to a peer in one message. If NULL, the messages are sent now.
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_wantlist_ask_peers(struct BitswapContext* context, struct Cid* cid, struct Libp2pVector* peers, struct Libp2pVector* peer_requests) {
+	for(int i = 0; i < peers->total; i++) {
+		struct Libp2pPeer* current = (struct Libp2pPeer*) libp2p_utils_vector_get(peers, i);
+		// add this to their queue, unless they were asked already
+		struct PeerRequest* queueEntry = ipfs_peer_request_queue_find_peer(context->peerRequestQueue, current);
+		// out of memory. The block is asked for again if the others do not have it.
+		if (queueEntry == NULL)
+			continue;
+		pthread_mutex_lock(&queueEntry->request_mutex);
+		int asked = 0;
+		for(int j = 0; j < queueEntry->cids_we_want->total && !asked; j++) {
+			const struct CidEntry* entry = (const struct CidEntry*)libp2p_utils_vector_get(queueEntry->cids_we_want, j);
+			asked = (!entry->cancel && ipfs_cid_compare(entry->cid, cid) == 0);
+		}
+		if (!asked) {
+			struct CidEntry* entry = ipfs_bitswap_peer_request_cid_entry_new();
+			entry->cid = ipfs_cid_copy(cid);
+			libp2p_utils_vector_add(queueEntry->cids_we_want, entry);
+		}
+		pthread_mutex_unlock(&queueEntry->request_mutex);
+		if (asked)
+			continue;
+		if (peer_requests == NULL) {
+			// process this queue via bitswap protocol
+			ipfs_bitswap_peer_request_process_entry(context, queueEntry);
+		} else {
+			int found = 0;
+			for(int j = 0; j < peer_requests->total && !found; j++)
+				found = (libp2p_utils_vector_get(peer_requests, j) == queueEntry);
+			if (!found)
+				libp2p_utils_vector_add(peer_requests, queueEntry);
+		}
+	}
+	return 1;
 }
 
 /***
  * Retrieve a block. The only information we have is the cid
  *
  * This will ask the network for who has the file, using the router.
- * It will then ask the specific nodes for the file. This method
- * does not queue anything. It actually does the work. The remotes
+ * It will then ask the specific nodes for the file. The remotes
  * will queue the file, but we'll return before they respond.
  *
  * @param context the BitswapContext
  * @param cid the id of the file
+ * @param peer_requests where to collect the PeerRequests that now have something to send, so
+ * several wants go to a peer in one message. If NULL, the messages are sent now.
+ * @param found where to add the providers that were asked (can be NULL)
  * @returns true(1) if we found some providers to ask, false(0) otherwise
  */
-int ipfs_bitswap_wantlist_get_block_remote(struct BitswapContext* context, struct Cid* cid) {
+int ipfs_bitswap_wantlist_get_block_remote(struct BitswapContext* context, struct Cid* cid, struct Libp2pVector* peer_requests, struct Libp2pVector* found) {
 	// find out who may have the file
 	struct Libp2pVector* providers = NULL;
 	if (context->ipfsNode->routing->FindProviders(context->ipfsNode->routing, cid->hash, cid->hash_length, &providers)) {
-		for(int i = 0; i < providers->total; i++) {
-			struct Libp2pPeer* current = (struct Libp2pPeer*) libp2p_utils_vector_get(providers, i);
-			// add this to their queue
-			struct PeerRequest* queueEntry = ipfs_peer_request_queue_find_peer(context->peerRequestQueue, current);
-			struct CidEntry* entry = ipfs_bitswap_peer_request_cid_entry_new();
-			entry->cid = ipfs_cid_copy(cid);
-			libp2p_utils_vector_add(queueEntry->cids_we_want, entry);
-			// process this queue via bitswap protocol
-			ipfs_bitswap_peer_request_process_entry(context, queueEntry);
-			//libp2p_peer_free(current);
-		}
+		ipfs_bitswap_wantlist_ask_peers(context, cid, providers, peer_requests);
+		for(int i = 0; found != NULL && i < providers->total; i++)
+			libp2p_utils_vector_add(found, libp2p_utils_vector_get(providers, i));
 		libp2p_utils_vector_free(providers);
 		return 1;
 	}
@@ -281,26 +721,82 @@ int ipfs_bitswap_wantlist_get_block_remote(struct BitswapContext* context, struc
  *
  * @param context the context
  * @param entry the WantListQueueEntry
+ * @param peer_requests where to collect the PeerRequests that have something to send, or NULL to send now
  * @returns true(1) on success, false(0) if not.
  */
-int ipfs_bitswap_wantlist_process_entry(struct BitswapContext* context, struct WantListQueueEntry* entry) {
+int ipfs_bitswap_wantlist_process_entry(struct BitswapContext* context, struct WantListQueueEntry* entry, struct Libp2pVector* peer_requests) {
+	struct WantListQueue* wantlist = context->localWantlist;
+	struct Libp2pVector* session_peers = NULL;
+	int provider_delay = 0;
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
 	int local_request = ipfs_bitswap_wantlist_local_request(entry->sessionsRequesting);
-	int have_local = ipfs_bitswap_wantlist_get_block_locally(context, entry->cid, &entry->block);
+	if (local_request && !entry->asked_session) {
+		// the peers that sent other blocks of its sessions
+		for(int i = 0; i < entry->sessionsRequesting->total; i++) {
+			const struct WantListSession* session = (const struct WantListSession*)libp2p_utils_vector_get(entry->sessionsRequesting, i);
+			if (session->bitswap_session == NULL)
+				continue;
+			if (session_peers == NULL)
+				session_peers = libp2p_utils_vector_new(1);
+			if (session_peers != NULL)
+				ipfs_bitswap_session_get_peers(session->bitswap_session, session_peers);
+			if (session->bitswap_session->provider_delay > provider_delay)
+				provider_delay = session->bitswap_session->provider_delay;
+		}
+	}
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	struct Block* block = NULL;
+	int have_local = ipfs_bitswap_wantlist_get_block_locally(context, entry->cid, &block);
+	if (have_local)
+		ipfs_bitswap_wantlist_queue_entry_set_block(wantlist, entry, block, NULL);
 	// should we go get it?
 	if (!local_request && !have_local) {
+		if (session_peers != NULL)
+			libp2p_utils_vector_free(session_peers);
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
+		entry->attempts++;
+		entry->not_before = ipfs_bitswap_wantlist_queue_now() + BITSWAP_WANTLIST_RETRY_MILLISECONDS;
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
 		return 0;
 	}
+	if (session_peers != NULL && session_peers->total > 0 && !have_local) {
+		// they probably have it. Only look for providers if they do not send it in time.
+		ipfs_bitswap_wantlist_ask_peers(context, entry->cid, session_peers, peer_requests);
+		libp2p_utils_vector_free(session_peers);
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
+		entry->asked_session = 1;
+		entry->not_before = ipfs_bitswap_wantlist_queue_now() + provider_delay;
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
+		return 1;
+	}
 	if (local_request && !have_local) {
-		if (!ipfs_bitswap_wantlist_get_block_remote(context, entry->cid)) {
-			// if we were unsuccessful in retrieving it, put it back in the queue?
-			// I don't think so. But I'm keeping this counter here until we have
-			// a final decision. Maybe lower the priority?
+		int asked = ipfs_bitswap_wantlist_get_block_remote(context, entry->cid, peer_requests, session_peers);
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
+		if (asked) {
+			entry->asked_network = 1;
+			// the providers of one block of a session probably have the others
+			for(int i = 0; session_peers != NULL && i < entry->sessionsRequesting->total; i++) {
+				const struct WantListSession* session = (const struct WantListSession*)libp2p_utils_vector_get(entry->sessionsRequesting, i);
+				for(int j = 0; session->bitswap_session != NULL && j < session_peers->total; j++)
+					ipfs_bitswap_session_add_peer(session->bitswap_session, (struct Libp2pPeer*)libp2p_utils_vector_get(session_peers, j));
+			}
+		} else {
+			// nobody to ask yet. Count the attempt, so the entries that
+			// can be found go first, and try again later.
 			entry->attempts++;
+			entry->not_before = ipfs_bitswap_wantlist_queue_now() + BITSWAP_WANTLIST_RETRY_MILLISECONDS;
+		}
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
+		if (!asked) {
+			if (session_peers != NULL)
+				libp2p_utils_vector_free(session_peers);
 			return 0;
-		} else {
-			entry->asked_network = 1;
 		}
 	}
+	if (session_peers != NULL)
+		libp2p_utils_vector_free(session_peers);
+	pthread_mutex_lock(&wantlist->wantlist_mutex);
+	int asked_network = entry->asked_network;
 	if (entry->block != NULL) {
 		// okay we have the block.
 		// fulfill the requests
@@ -311,10 +807,13 @@ int ipfs_bitswap_wantlist_process_entry(struct BitswapContext* context, struct W
 				//context->ipfsNode->exchange->HasBlock(context->ipfsNode->exchange, entry->block);
 			} else {
 				struct Libp2pPeer* peer = (struct Libp2pPeer*) session->context;
-				ipfs_bitswap_peer_request_queue_fill(context->peerRequestQueue, peer, entry->block);
+				// the request frees what it sends, and the entry frees its own
+				ipfs_bitswap_peer_request_queue_fill(context->peerRequestQueue, peer, ipfs_block_copy(entry->block));
 			}
 		}
+		ipfs_bitswap_engine_peer_requests_changed(context->bitswap_engine);
 
 	}
-	return 0;
+	pthread_mutex_unlock(&wantlist->wantlist_mutex);
+	return have_local || asked_network;
 }
@@ -5,13 +5,15 @@
  * hierarchy of the keys. Modeled after go-ds-flatfs
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "libp2p/os/utils.h"
-
-#define FLATFS_MAX_PREFIX_LENGTH 16
+#include "ipfs/flatfs/flatfs.h"
 
 /**
  * Helper (private) methods
@@ -51,12 +53,14 @@ int ipfs_flatfs_create_directory(const char* full_directory) {
 	}
 	// it is not there, create it
 #ifdef __MINGW32__
-	if (mkdir(full_directory) == -1)
-		return 0;
+	int mkdir_result = mkdir(full_directory);
 #else
-	if (mkdir(full_directory, S_IRWXU) == -1)
-		return 0;
+	int mkdir_result = mkdir(full_directory, S_IRWXU);
 #endif
+	if (mkdir_result == -1) {
+		// another thread may have just created it
+		return (errno == EEXIST && os_utils_directory_writeable(full_directory));
+	}
 
 	return 1;
 }
@@ -161,6 +165,465 @@ int ipfs_flatfs_get_full_filename(const char* datastore_path, const char* propos
 }
 
 
+/***
+ * Shard functions
+ */
+
+/***
+ * Parse a shard function string such as "/repo/flatfs/shard/v1/next-to-last/2".
+ * The "/repo/flatfs/shard/v1/" prefix is optional, so "prefix/4" also works.
+ * @param in the string
+ * @param shard the struct to fill
+ * @returns true(1) on success, false(0) if the string was not understood
+ */
+int ipfs_flatfs_shard_parse(const char* in, struct FlatfsShard* shard) {
+	if (in == NULL || shard == NULL)
+		return 0;
+	const char* pos = in;
+	if (strncmp(pos, FLATFS_SHARD_PREFIX_V1, strlen(FLATFS_SHARD_PREFIX_V1)) == 0)
+		pos += strlen(FLATFS_SHARD_PREFIX_V1);
+	enum FlatfsShardType type;
+	if (strncmp(pos, "prefix/", 7) == 0) {
+		type = FLATFS_SHARD_PREFIX;
+		pos += 7;
+	} else if (strncmp(pos, "suffix/", 7) == 0) {
+		type = FLATFS_SHARD_SUFFIX;
+		pos += 7;
+	} else if (strncmp(pos, "next-to-last/", 13) == 0) {
+		type = FLATFS_SHARD_NEXT_TO_LAST;
+		pos += 13;
+	} else {
+		return 0;
+	}
+	char* end = NULL;
+	long length = strtol(pos, &end, 10);
+	if (end == pos || length < 1 || length > FLATFS_MAX_PREFIX_LENGTH)
+		return 0;
+	// allow trailing whitespace (the SHARDING file ends with a newline)
+	while (*end == '\n' || *end == '\r' || *end == ' ' || *end == '\t')
+		end++;
+	if (*end != 0)
+		return 0;
+	shard->type = type;
+	shard->length = (int)length;
+	return 1;
+}
+
+/***
+ * Turn a shard into its string representation
+ * @param shard the shard
+ * @param out where to put the results
+ * @param max_out_length the size of the out buffer
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_to_string(const struct FlatfsShard* shard, char* out, size_t max_out_length) {
+	const char* name = NULL;
+	switch (shard->type) {
+		case (FLATFS_SHARD_PREFIX):
+			name = "prefix";
+			break;
+		case (FLATFS_SHARD_SUFFIX):
+			name = "suffix";
+			break;
+		case (FLATFS_SHARD_NEXT_TO_LAST):
+			name = "next-to-last";
+			break;
+		default:
+			return 0;
+	}
+	int written = snprintf(out, max_out_length, "%s%s/%d", FLATFS_SHARD_PREFIX_V1, name, shard->length);
+	if (written < 0 || (size_t)written >= max_out_length)
+		return 0;
+	return 1;
+}
+
+/***
+ * Get the subdirectory name (not the full path) that a key belongs in
+ * @param shard the shard function
+ * @param key the key (without preceeding slash)
+ * @param out where to put the results. Must be at least shard->length + 1 in size
+ * @param max_out_length the size of the out buffer
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_directory_name(const struct FlatfsShard* shard, const char* key, char* out, size_t max_out_length) {
+	if (shard->type == FLATFS_SHARD_NONE) {
+		if (max_out_length < 1)
+			return 0;
+		out[0] = 0;
+		return 1;
+	}
+	size_t length = shard->length;
+	if (length < 1 || length > FLATFS_MAX_PREFIX_LENGTH || max_out_length < length + 1)
+		return 0;
+	size_t key_length = strlen(key);
+	size_t i;
+	switch (shard->type) {
+		case (FLATFS_SHARD_PREFIX):
+			// first n characters, padded at the end with '_'
+			for(i = 0; i < length; i++)
+				out[i] = (i < key_length ? key[i] : '_');
+			break;
+		case (FLATFS_SHARD_SUFFIX):
+			// last n characters, padded at the front with '_'
+			for(i = 0; i < length; i++) {
+				size_t padded_pos = key_length + i; // position within ("_" * n) + key
+				out[i] = (padded_pos < length ? '_' : key[padded_pos - length]);
+			}
+			break;
+		case (FLATFS_SHARD_NEXT_TO_LAST): {
+			// n characters before the last character of ("_" * (n + 1)) + key
+			size_t total = key_length + length + 1;
+			for(i = 0; i < length; i++) {
+				size_t padded_pos = total - length - 1 + i;
+				out[i] = (padded_pos < length + 1 ? '_' : key[padded_pos - length - 1]);
+			}
+			break;
+		}
+		default:
+			return 0;
+	}
+	out[length] = 0;
+	return 1;
+}
+
+/**
+ * Given a filename (usually a long hash), derive the subdirectory using a shard function
+ * @param datastore_path the path to the datastore
+ * @param shard the shard function
+ * @param proposed_filename the filename to use
+ * @param derived_path the complete pathname to the directory that should contain the proposed_filename
+ * @param max_derived_path_length the maximum memory allocated for derived_path
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_get_sharded_directory(const char* datastore_path, const struct FlatfsShard* shard, const char* proposed_filename,
+		char* derived_path, size_t max_derived_path_length) {
+	if (shard->type == FLATFS_SHARD_NONE) {
+		if (max_derived_path_length < strlen(datastore_path) + 1)
+			return 0;
+		strcpy(derived_path, datastore_path);
+		return 1;
+	}
+	size_t key_length = strlen(proposed_filename) + 1;
+	char key[key_length];
+	if (!ipfs_flatfs_remove_preceeding_slash(proposed_filename, key, key_length))
+		return 0;
+	char directory[FLATFS_MAX_PREFIX_LENGTH + 1];
+	if (!ipfs_flatfs_shard_directory_name(shard, key, directory, FLATFS_MAX_PREFIX_LENGTH + 1))
+		return 0;
+	return os_utils_filepath_join(datastore_path, directory, derived_path, max_derived_path_length);
+}
+
+/**
+ * Build the complete filename on disk of a key using a shard function
+ * NOTE: FLATFS_SHARD_NONE gives [datastore_path]/[key], all others [datastore_path]/[dir]/[key].data
+ * @param datastore_path where the datastore is
+ * @param shard the shard function
+ * @param proposed_filename the filename we want to use
+ * @param derived_full_filename where the results will be put
+ * @param max_derived_filename_length the size of memory allocated for "derived_full_filename"
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_get_sharded_full_filename(const char* datastore_path, const struct FlatfsShard* shard, const char* proposed_filename,
+		char* derived_full_filename, size_t max_derived_filename_length) {
+	size_t key_length = strlen(proposed_filename) + 1;
+	char key[key_length];
+	if (!ipfs_flatfs_remove_preceeding_slash(proposed_filename, key, key_length))
+		return 0;
+	if (shard->type == FLATFS_SHARD_NONE)
+		return os_utils_filepath_join(datastore_path, key, derived_full_filename, max_derived_filename_length);
+
+	char directory[max_derived_filename_length];
+	if (!ipfs_flatfs_get_sharded_directory(datastore_path, shard, key, directory, max_derived_filename_length))
+		return 0;
+	char actual_filename[key_length + 5];
+	if (!ipfs_flatfs_get_filename(key, actual_filename, key_length + 5))
+		return 0;
+	return os_utils_filepath_join(directory, actual_filename, derived_full_filename, max_derived_filename_length);
+}
+
+/***
+ * Read the SHARDING file of a datastore
+ * @param datastore_path the root of the datastore
+ * @param shard where to put the results
+ * @returns true(1) on success, false(0) if the file is missing or not understood
+ */
+int ipfs_flatfs_shard_read(const char* datastore_path, struct FlatfsShard* shard) {
+	size_t filename_length = strlen(datastore_path) + strlen(FLATFS_SHARDING_FILENAME) + 2;
+	char filename[filename_length];
+	if (!os_utils_filepath_join(datastore_path, FLATFS_SHARDING_FILENAME, filename, filename_length))
+		return 0;
+	FILE* in = fopen(filename, "r");
+	if (in == NULL)
+		return 0;
+	char buffer[128];
+	size_t bytes_read = fread(buffer, 1, sizeof(buffer) - 1, in);
+	fclose(in);
+	buffer[bytes_read] = 0;
+	return ipfs_flatfs_shard_parse(buffer, shard);
+}
+
+/***
+ * Write the SHARDING file of a datastore
+ * @param datastore_path the root of the datastore
+ * @param shard the shard function in use
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_write(const char* datastore_path, const struct FlatfsShard* shard) {
+	char contents[128];
+	if (!ipfs_flatfs_shard_to_string(shard, contents, sizeof(contents) - 1))
+		return 0;
+	strcat(contents, "\n");
+
+	size_t filename_length = strlen(datastore_path) + strlen(FLATFS_SHARDING_FILENAME) + 2;
+	char filename[filename_length];
+	if (!os_utils_filepath_join(datastore_path, FLATFS_SHARDING_FILENAME, filename, filename_length))
+		return 0;
+	char temp_filename[filename_length + 4];
+	sprintf(temp_filename, "%s.tmp", filename);
+	FILE* out = fopen(temp_filename, "w");
+	if (out == NULL)
+		return 0;
+	size_t bytes_written = fwrite(contents, 1, strlen(contents), out);
+	fclose(out);
+	if (bytes_written != strlen(contents) || rename(temp_filename, filename) != 0) {
+		unlink(temp_filename);
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Determine if a directory entry should be left alone by the reshard
+ * @param name the name of the entry
+ * @returns true(1) if it is not part of the data
+ */
+int ipfs_flatfs_reshard_skip(const char* name) {
+	size_t len = strlen(name);
+	if (len == 0 || name[0] == '.')
+		return 1;
+	if (strcmp(name, FLATFS_SHARDING_FILENAME) == 0)
+		return 1;
+	if (len > 4 && strcmp(&name[len - 4], ".tmp") == 0)
+		return 1;
+	return 0;
+}
+
+/***
+ * Move one file to where the new shard function says it should be
+ * @param datastore_path the root of the datastore
+ * @param new_shard the shard function
+ * @param current_filename the full path of the file now
+ * @param name the filename (without directory)
+ * @param files_moved incremented if the file was moved
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_reshard_file(const char* datastore_path, const struct FlatfsShard* new_shard,
+		const char* current_filename, const char* name, size_t* files_moved) {
+	// the key is the filename without the .data suffix
+	size_t key_length = strlen(name);
+	char key[key_length + 1];
+	strcpy(key, name);
+	if (key_length > 5 && strcmp(&key[key_length - 5], ".data") == 0)
+		key[key_length - 5] = 0;
+
+	size_t new_filename_length = strlen(datastore_path) + strlen(key) + FLATFS_MAX_PREFIX_LENGTH + 8;
+	char new_directory[new_filename_length];
+	char new_filename[new_filename_length];
+	if (!ipfs_flatfs_get_sharded_full_filename(datastore_path, new_shard, key, new_filename, new_filename_length))
+		return 0;
+	if (strcmp(new_filename, current_filename) == 0)
+		return 1;
+	if (!ipfs_flatfs_get_sharded_directory(datastore_path, new_shard, key, new_directory, new_filename_length))
+		return 0;
+	if (!ipfs_flatfs_create_directory(new_directory))
+		return 0;
+	if (rename(current_filename, new_filename) != 0)
+		return 0;
+	(*files_moved)++;
+	return 1;
+}
+
+/***
+ * Move every file of a datastore into the layout of a new shard function, then
+ * rewrite the SHARDING file. This works from any layout (including a partially
+ * completed reshard), so it can be run again if interrupted.
+ * NOTE: This is an offline operation. Nothing else should be using the datastore.
+ * @param datastore_path the root of the datastore
+ * @param new_shard the shard function to move to
+ * @param files_moved the number of files that were moved (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_reshard(const char* datastore_path, const struct FlatfsShard* new_shard, size_t* files_moved) {
+	int retVal = 0;
+	size_t moved = 0;
+	// NOTE: the list is taken before anything moves, so new shard directories are not in it.
+	struct FileList* first = os_utils_list_directory(datastore_path);
+	struct FileList* current = first;
+
+	while (current != NULL) {
+		if (!ipfs_flatfs_reshard_skip(current->file_name)) {
+			size_t path_length = strlen(datastore_path) + strlen(current->file_name) + 2;
+			char path[path_length];
+			if (!os_utils_filepath_join(datastore_path, current->file_name, path, path_length))
+				goto exit;
+			if (os_utils_is_directory(path)) {
+				// an existing shard directory
+				struct FileList* inner_first = os_utils_list_directory(path);
+				struct FileList* inner = inner_first;
+				while (inner != NULL) {
+					if (!ipfs_flatfs_reshard_skip(inner->file_name)) {
+						size_t file_length = path_length + strlen(inner->file_name) + 1;
+						char file[file_length];
+						if (!os_utils_filepath_join(path, inner->file_name, file, file_length)
+								|| !ipfs_flatfs_reshard_file(datastore_path, new_shard, file, inner->file_name, &moved)) {
+							os_utils_free_file_list(inner_first);
+							goto exit;
+						}
+					}
+					inner = inner->next;
+				}
+				os_utils_free_file_list(inner_first);
+				// remove the directory if it is now empty. Failure means it is still in use.
+				rmdir(path);
+			} else {
+				if (!ipfs_flatfs_reshard_file(datastore_path, new_shard, path, current->file_name, &moved))
+					goto exit;
+			}
+		}
+		current = current->next;
+	}
+
+	// the layout is now complete, so record it
+	if (new_shard->type == FLATFS_SHARD_NONE) {
+		size_t filename_length = strlen(datastore_path) + strlen(FLATFS_SHARDING_FILENAME) + 2;
+		char filename[filename_length];
+		os_utils_filepath_join(datastore_path, FLATFS_SHARDING_FILENAME, filename, filename_length);
+		if (os_utils_file_exists(filename) && unlink(filename) != 0)
+			goto exit;
+	} else if (!ipfs_flatfs_shard_write(datastore_path, new_shard)) {
+		goto exit;
+	}
+	retVal = 1;
+	exit:
+	if (first != NULL)
+		os_utils_free_file_list(first);
+	if (files_moved != NULL)
+		*files_moved = moved;
+	return retVal;
+}
+
+/***
+ * Call a function with the key of a file
+ * @param name the filename (without directory)
+ * @param func the function
+ * @param arg passed to the function
+ * @returns what the function returns
+ */
+int ipfs_flatfs_walk_file(const char* name, int (*func)(const char* key, void* arg), void* arg) {
+	// the key is the filename without the .data suffix
+	size_t key_length = strlen(name);
+	char key[key_length + 1];
+	strcpy(key, name);
+	if (key_length > 5 && strcmp(&key[key_length - 5], ".data") == 0)
+		key[key_length - 5] = 0;
+	return func(key, arg);
+}
+
+/***
+ * Call a function with the key of every file of a datastore, whatever its layout
+ * @param datastore_path the root of the datastore
+ * @param func the function. Returning false(0) stops the walk.
+ * @param arg passed to the function
+ * @returns true(1) if every file was seen
+ */
+int ipfs_flatfs_walk(const char* datastore_path, int (*func)(const char* key, void* arg), void* arg) {
+	int retVal = 0;
+	struct FileList* first = os_utils_list_directory(datastore_path);
+	struct FileList* current = first;
+
+	while (current != NULL) {
+		if (!ipfs_flatfs_reshard_skip(current->file_name)) {
+			size_t path_length = strlen(datastore_path) + strlen(current->file_name) + 2;
+			char path[path_length];
+			if (!os_utils_filepath_join(datastore_path, current->file_name, path, path_length))
+				goto exit;
+			if (os_utils_is_directory(path)) {
+				// a shard directory
+				struct FileList* inner_first = os_utils_list_directory(path);
+				struct FileList* inner = inner_first;
+				while (inner != NULL) {
+					if (!ipfs_flatfs_reshard_skip(inner->file_name) && !ipfs_flatfs_walk_file(inner->file_name, func, arg)) {
+						os_utils_free_file_list(inner_first);
+						goto exit;
+					}
+					inner = inner->next;
+				}
+				os_utils_free_file_list(inner_first);
+			} else if (!ipfs_flatfs_walk_file(current->file_name, func, arg)) {
+				goto exit;
+			}
+		}
+		current = current->next;
+	}
+	retVal = 1;
+	exit:
+	if (first != NULL)
+		os_utils_free_file_list(first);
+	return retVal;
+}
+
+/***
+ * Remove a file if it is a temporary file that was never renamed
+ * @param directory the directory the file is in
+ * @param name the filename (without directory)
+ * @param files_removed incremented if the file was removed
+ */
+void ipfs_flatfs_remove_temporary_file(const char* directory, const char* name, size_t* files_removed) {
+	size_t len = strlen(name);
+	if (len <= 4 || strcmp(&name[len - 4], ".tmp") != 0)
+		return;
+	size_t path_length = strlen(directory) + len + 2;
+	char path[path_length];
+	if (os_utils_filepath_join(directory, name, path, path_length) && unlink(path) == 0)
+		(*files_removed)++;
+}
+
+/***
+ * Remove the temporary files a crash left behind, in a datastore of any layout
+ * NOTE: Nothing else should be writing to the datastore.
+ * @param datastore_path the root of the datastore
+ * @param files_removed the number of files removed (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_remove_temporary(const char* datastore_path, size_t* files_removed) {
+	size_t removed = 0;
+	struct FileList* first = os_utils_list_directory(datastore_path);
+
+	for(struct FileList* current = first; current != NULL; current = current->next) {
+		if (current->file_name[0] == '.')
+			continue;
+		size_t path_length = strlen(datastore_path) + strlen(current->file_name) + 2;
+		char path[path_length];
+		if (!os_utils_filepath_join(datastore_path, current->file_name, path, path_length))
+			continue;
+		if (os_utils_is_directory(path)) {
+			// a shard directory
+			struct FileList* inner_first = os_utils_list_directory(path);
+			for(struct FileList* inner = inner_first; inner != NULL; inner = inner->next)
+				ipfs_flatfs_remove_temporary_file(path, inner->file_name, &removed);
+			if (inner_first != NULL)
+				os_utils_free_file_list(inner_first);
+		} else {
+			ipfs_flatfs_remove_temporary_file(datastore_path, current->file_name, &removed);
+		}
+	}
+	if (first != NULL)
+		os_utils_free_file_list(first);
+	if (files_removed != NULL)
+		*files_removed = removed;
+	return 1;
+}
+
 /**
  * Write a file given the key and the contents
  * @param datastore_path the root of the flatfs datastore
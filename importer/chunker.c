@@ -0,0 +1,298 @@
+/***
+ * Splits a file into chunks. See chunker.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ipfs/importer/chunker.h"
+
+/**
+ * Rabin fingerprints are computed modulo this irreducible polynomial of degree 53, over a window of 64 bytes
+ */
+#define RABIN_POLYNOMIAL 0x3DA3358B4DC173ULL
+#define RABIN_DEGREE 53
+#define RABIN_WINDOW 64
+#define BUZHASH_WINDOW 32
+
+static pthread_once_t chunker_tables_once = PTHREAD_ONCE_INIT;
+// the fingerprint of a byte once it has travelled the whole window, to remove it again
+static uint64_t rabin_out_table[256];
+// reduces the 8 bits that a shift pushes past the degree of the polynomial
+static uint64_t rabin_mod_table[256];
+static uint32_t buzhash_table[256];
+
+int ipfs_chunker_polynomial_degree(uint64_t p) {
+	int degree = -1;
+	while (p != 0) {
+		degree++;
+		p >>= 1;
+	}
+	return degree;
+}
+
+uint64_t ipfs_chunker_polynomial_mod(uint64_t x, uint64_t p) {
+	int p_degree = ipfs_chunker_polynomial_degree(p);
+	int x_degree = ipfs_chunker_polynomial_degree(x);
+	while (x_degree >= p_degree) {
+		x ^= p << (x_degree - p_degree);
+		x_degree = ipfs_chunker_polynomial_degree(x);
+	}
+	return x;
+}
+
+/***
+ * Build the lookup tables of the rolling hashes. Called once.
+ */
+void ipfs_chunker_init_tables() {
+	for(int b = 0; b < 256; b++) {
+		uint64_t h = ipfs_chunker_polynomial_mod((uint64_t)b, RABIN_POLYNOMIAL);
+		for(int i = 0; i < RABIN_WINDOW - 1; i++)
+			h = ipfs_chunker_polynomial_mod(h << 8, RABIN_POLYNOMIAL);
+		rabin_out_table[b] = h;
+		rabin_mod_table[b] = ipfs_chunker_polynomial_mod((uint64_t)b << RABIN_DEGREE, RABIN_POLYNOMIAL) | ((uint64_t)b << RABIN_DEGREE);
+	}
+	// any well mixed values will do, but they must never change, or the same file would chunk differently
+	uint64_t state = 0x62757a68617368ULL;
+	for(int b = 0; b < 256; b++) {
+		// splitmix64
+		state += 0x9E3779B97F4A7C15ULL;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		buzhash_table[b] = (uint32_t)(z ^ (z >> 31));
+	}
+}
+
+/***
+ * Parse up to max_sizes numbers separated by dashes
+ * @param in the string, positioned after the name of the chunker
+ * @param sizes where to put the numbers
+ * @param max_sizes the size of the sizes array
+ * @returns the number of sizes found, or -1 on error
+ */
+int ipfs_chunker_parse_sizes(const char* in, size_t* sizes, int max_sizes) {
+	int count = 0;
+	while (*in != 0) {
+		if (*in != '-' || count == max_sizes)
+			return -1;
+		in++;
+		char* end = NULL;
+		unsigned long long value = strtoull(in, &end, 10);
+		if (end == in)
+			return -1;
+		sizes[count++] = (size_t)value;
+		in = end;
+	}
+	return count;
+}
+
+/***
+ * Parse the string representation of a chunker
+ * @param in the string, i.e. "size-262144" or "rabin-65536-262144-524288"
+ * @param spec where to put the results
+ * @returns true(1) on success, false(0) if the string was not understood or the sizes are out of range
+ */
+int ipfs_chunker_spec_parse(const char* in, struct ChunkerSpec* spec) {
+	size_t sizes[3];
+	int count = 0;
+	if (in == NULL)
+		return 0;
+	if (strncmp(in, "size", 4) == 0) {
+		count = ipfs_chunker_parse_sizes(&in[4], sizes, 1);
+		if (count == 0)
+			sizes[0] = 262144;
+		else if (count != 1)
+			return 0;
+		spec->type = CHUNKER_FIXED;
+		spec->min_size = spec->avg_size = spec->max_size = sizes[0];
+		return (sizes[0] > 0 && sizes[0] <= IPFS_CHUNKER_SIZE_LIMIT);
+	}
+	if (strncmp(in, "rabin", 5) == 0) {
+		spec->type = CHUNKER_RABIN;
+		count = ipfs_chunker_parse_sizes(&in[5], sizes, 3);
+	} else if (strncmp(in, "buzhash", 7) == 0) {
+		spec->type = CHUNKER_BUZHASH;
+		count = ipfs_chunker_parse_sizes(&in[7], sizes, 3);
+		if (count == 1)
+			return 0;
+	} else {
+		return 0;
+	}
+	switch (count) {
+		case 0:
+			spec->avg_size = 262144;
+			spec->min_size = (spec->type == CHUNKER_RABIN ? spec->avg_size / 4 : spec->avg_size / 2);
+			spec->max_size = spec->avg_size * 2;
+			break;
+		case 1:
+			spec->avg_size = sizes[0];
+			spec->min_size = spec->avg_size / 4;
+			spec->max_size = spec->avg_size * 2;
+			break;
+		case 3:
+			spec->min_size = sizes[0];
+			spec->avg_size = sizes[1];
+			spec->max_size = sizes[2];
+			break;
+		default:
+			return 0;
+	}
+	if (spec->max_size > IPFS_CHUNKER_SIZE_LIMIT)
+		return 0;
+	return (spec->min_size >= IPFS_CHUNKER_MIN_SIZE && spec->min_size <= spec->avg_size && spec->avg_size <= spec->max_size);
+}
+
+/***
+ * Create a new Chunker that reads from a file
+ * @param spec how to chunk
+ * @param file the file, opened for reading. The caller must close it.
+ * @returns the Chunker, or NULL on error
+ */
+struct Chunker* ipfs_chunker_new(const struct ChunkerSpec* spec, FILE* file) {
+	pthread_once(&chunker_tables_once, ipfs_chunker_init_tables);
+	struct Chunker* chunker = (struct Chunker*)malloc(sizeof(struct Chunker));
+	if (chunker == NULL)
+		return NULL;
+	chunker->spec = *spec;
+	chunker->file = file;
+	chunker->buffer = NULL;
+	chunker->buffer_start = 0;
+	chunker->buffer_end = 0;
+	chunker->eof = 0;
+	// after min_size, a boundary is found on average every 2^bits bytes, so pick bits to land near avg_size
+	int bits = 0;
+	size_t spread = spec->avg_size - spec->min_size;
+	while (bits < 31 && ((size_t)2 << bits) <= spread)
+		bits++;
+	chunker->mask = (spread == 0 ? 0 : ((uint64_t)1 << bits) - 1);
+	if (spec->type != CHUNKER_FIXED) {
+		chunker->buffer = (unsigned char*)malloc(spec->max_size);
+		if (chunker->buffer == NULL) {
+			free(chunker);
+			return NULL;
+		}
+	}
+	return chunker;
+}
+
+/***
+ * Free the resources of a Chunker
+ * @param chunker the Chunker
+ * @returns true(1)
+ */
+int ipfs_chunker_free(struct Chunker* chunker) {
+	if (chunker != NULL) {
+		if (chunker->buffer != NULL)
+			free(chunker->buffer);
+		free(chunker);
+	}
+	return 1;
+}
+
+/***
+ * Find a Rabin boundary.
+ * Only the last RABIN_WINDOW bytes decide a boundary, so hashing starts just before min_size.
+ * @param data the bytes (more than min_size of them)
+ * @param limit the most bytes the chunk can have
+ * @param min_size the fewest bytes the chunk can have
+ * @param mask the bits that must be clear at a boundary
+ * @returns the size of the chunk
+ */
+size_t ipfs_chunker_rabin_boundary(const unsigned char* data, size_t limit, size_t min_size, uint64_t mask) {
+	const int shift = RABIN_DEGREE - 8;
+	uint64_t digest = 0;
+	size_t pos = min_size - RABIN_WINDOW;
+	// fill the window. Nothing leaves it yet, and rabin_out_table[0] is 0.
+	for(size_t end = min_size; pos < end; pos++) {
+		uint64_t index = digest >> shift;
+		digest = ((digest << 8) | data[pos]) ^ rabin_mod_table[index];
+	}
+	if ((digest & mask) == 0)
+		return min_size;
+	for(; pos < limit; pos++) {
+		digest ^= rabin_out_table[data[pos - RABIN_WINDOW]];
+		uint64_t index = digest >> shift;
+		digest = ((digest << 8) | data[pos]) ^ rabin_mod_table[index];
+		if ((digest & mask) == 0)
+			return pos + 1;
+	}
+	return limit;
+}
+
+/***
+ * Find a buzhash boundary.
+ * With a window of 32 bytes, the rotation of the byte leaving the window is a full turn, so it is just removed.
+ * @param data the bytes (more than min_size of them)
+ * @param limit the most bytes the chunk can have
+ * @param min_size the fewest bytes the chunk can have
+ * @param mask the bits that must be clear at a boundary
+ * @returns the size of the chunk
+ */
+size_t ipfs_chunker_buzhash_boundary(const unsigned char* data, size_t limit, size_t min_size, uint32_t mask) {
+	uint32_t hash = 0;
+	size_t pos = min_size - BUZHASH_WINDOW;
+	for(size_t end = min_size; pos < end; pos++)
+		hash = ((hash << 1) | (hash >> 31)) ^ buzhash_table[data[pos]];
+	if ((hash & mask) == 0)
+		return min_size;
+	for(; pos < limit; pos++) {
+		hash = ((hash << 1) | (hash >> 31)) ^ buzhash_table[data[pos - BUZHASH_WINDOW]] ^ buzhash_table[data[pos]];
+		if ((hash & mask) == 0)
+			return pos + 1;
+	}
+	return limit;
+}
+
+/***
+ * Find the first boundary in a block of memory
+ * @param chunker the Chunker (only the spec and mask are used)
+ * @param data the bytes
+ * @param data_size the number of bytes. If there is no boundary, all of them (up to max_size) are one chunk.
+ * @returns the size of the chunk that starts at data
+ */
+size_t ipfs_chunker_find_boundary(const struct Chunker* chunker, const unsigned char* data, size_t data_size) {
+	size_t limit = (data_size < chunker->spec.max_size ? data_size : chunker->spec.max_size);
+	if (limit <= chunker->spec.min_size || chunker->spec.type == CHUNKER_FIXED)
+		return limit;
+	if (chunker->spec.type == CHUNKER_RABIN)
+		return ipfs_chunker_rabin_boundary(data, limit, chunker->spec.min_size, chunker->mask);
+	return ipfs_chunker_buzhash_boundary(data, limit, chunker->spec.min_size, (uint32_t)chunker->mask);
+}
+
+/***
+ * Get the next chunk of the file
+ * @param chunker the Chunker
+ * @param out where to put the chunk. Must hold spec.max_size bytes.
+ * @param out_size the size of the chunk, or 0 at the end of the file
+ * @returns true(1) on success, false(0) on a read error
+ */
+int ipfs_chunker_next(struct Chunker* chunker, unsigned char* out, size_t* out_size) {
+	size_t max_size = chunker->spec.max_size;
+	*out_size = 0;
+	if (chunker->spec.type == CHUNKER_FIXED) {
+		*out_size = fread(out, 1, max_size, chunker->file);
+		return (*out_size > 0 || !ferror(chunker->file));
+	}
+	// keep a whole max_size read ahead, so a boundary is never missed at the end of the buffer
+	if (chunker->buffer_start > 0) {
+		memmove(chunker->buffer, &chunker->buffer[chunker->buffer_start], chunker->buffer_end - chunker->buffer_start);
+		chunker->buffer_end -= chunker->buffer_start;
+		chunker->buffer_start = 0;
+	}
+	while (!chunker->eof && chunker->buffer_end < max_size) {
+		size_t bytes_read = fread(&chunker->buffer[chunker->buffer_end], 1, max_size - chunker->buffer_end, chunker->file);
+		if (bytes_read == 0) {
+			if (ferror(chunker->file))
+				return 0;
+			chunker->eof = 1;
+		}
+		chunker->buffer_end += bytes_read;
+	}
+	if (chunker->buffer_end == 0)
+		return 1;
+	*out_size = ipfs_chunker_find_boundary(chunker, chunker->buffer, chunker->buffer_end);
+	memcpy(out, chunker->buffer, *out_size);
+	chunker->buffer_start = *out_size;
+	return 1;
+}
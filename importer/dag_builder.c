@@ -0,0 +1,342 @@
+/***
+ * Builds the DAG of a file as its chunks arrive.
+ *
+ * Each depth of the tree keeps a list of finished children. When a list is full
+ * and another child arrives, the list becomes a parent node one level up. At the end,
+ * the partial lists are turned into parents from the bottom up. Because each parent
+ * is encoded exactly once, the cost of an import is linear in the number of chunks.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipfs/importer/dag_builder.h"
+#include "ipfs/merkledag/merkledag.h"
+#include "ipfs/unixfs/unixfs.h"
+
+/***
+ * Create a new DagBuilder
+ * @param fs_repo where to store the nodes
+ * @param max_links the most links a node can have (0 for the default)
+ * @returns the DagBuilder, or NULL on error
+ */
+struct DagBuilder* ipfs_importer_dag_builder_new(struct FSRepo* fs_repo, int max_links) {
+	struct DagBuilder* builder = (struct DagBuilder*)malloc(sizeof(struct DagBuilder));
+	if (builder == NULL)
+		return NULL;
+	builder->fs_repo = fs_repo;
+	builder->max_links = (max_links < 2 ? IPFS_DAG_BUILDER_DEFAULT_MAX_LINKS : max_links);
+	builder->levels = NULL;
+	builder->num_levels = 0;
+	builder->leaf_count = 0;
+	builder->first_leaf = NULL;
+	builder->bytes_written = 0;
+	return builder;
+}
+
+/***
+ * Free the resources of a DagBuilder
+ * @param builder the DagBuilder
+ * @returns true(1)
+ */
+int ipfs_importer_dag_builder_free(struct DagBuilder* builder) {
+	if (builder != NULL) {
+		for(int i = 0; i < builder->num_levels; i++) {
+			struct DagBuilderLevel* level = &builder->levels[i];
+			for(int j = 0; j < level->count; j++)
+				free(level->entries[j].hash);
+			free(level->entries);
+		}
+		if (builder->levels != NULL)
+			free(builder->levels);
+		if (builder->first_leaf != NULL)
+			ipfs_hashtable_node_free(builder->first_leaf);
+		free(builder);
+	}
+	return 1;
+}
+
+/***
+ * Make sure a level exists
+ * @param builder the DagBuilder
+ * @param level the depth (0 is the leaves)
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_ensure_level(struct DagBuilder* builder, int level) {
+	while (builder->num_levels <= level) {
+		struct DagBuilderLevel* new_levels = (struct DagBuilderLevel*)realloc(builder->levels, sizeof(struct DagBuilderLevel) * (builder->num_levels + 1));
+		if (new_levels == NULL)
+			return 0;
+		builder->levels = new_levels;
+		struct DagBuilderLevel* new_level = &builder->levels[builder->num_levels];
+		new_level->entries = (struct DagBuilderEntry*)malloc(sizeof(struct DagBuilderEntry) * builder->max_links);
+		if (new_level->entries == NULL)
+			return 0;
+		new_level->count = 0;
+		builder->num_levels++;
+	}
+	return 1;
+}
+
+/***
+ * Turn the children waiting at a level into a parent node, and store it.
+ * The level is empty afterwards.
+ * @param builder the DagBuilder
+ * @param level the depth of the children
+ * @param parent where to put the new node. The caller must free it.
+ * @param t_size the size of the parent plus its children
+ * @param file_size the bytes of file data below the parent
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_build_parent(struct DagBuilder* builder, int level, struct HashtableNode** parent, size_t* t_size, size_t* file_size) {
+	int retVal = 0;
+	struct UnixFS* unix_fs = NULL;
+	unsigned char* protobuf = NULL;
+	struct DagBuilderLevel* current = &builder->levels[level];
+	struct NodeLink* last_link = NULL;
+	struct UnixFSBlockSizeNode* last_block_size = NULL;
+	size_t children_t_size = 0;
+
+	*parent = NULL;
+	if (!ipfs_hashtable_node_new(parent))
+		goto exit;
+	if (!ipfs_unixfs_new(&unix_fs))
+		goto exit;
+	unix_fs->data_type = UNIXFS_FILE;
+	unix_fs->file_size = 0;
+
+	for(int i = 0; i < current->count; i++) {
+		struct DagBuilderEntry* entry = &current->entries[i];
+		// the link
+		struct NodeLink* link = NULL;
+		if (!ipfs_node_link_create(NULL, entry->hash, entry->hash_size, &link))
+			goto exit;
+		link->t_size = entry->t_size;
+		if (last_link == NULL)
+			(*parent)->head_link = link;
+		else
+			last_link->next = link;
+		last_link = link;
+		// the block size
+		struct UnixFSBlockSizeNode* block_size = (struct UnixFSBlockSizeNode*)malloc(sizeof(struct UnixFSBlockSizeNode));
+		if (block_size == NULL)
+			goto exit;
+		block_size->block_size = entry->file_size;
+		block_size->next = NULL;
+		if (last_block_size == NULL)
+			unix_fs->block_size_head = block_size;
+		else
+			last_block_size->next = block_size;
+		last_block_size = block_size;
+
+		unix_fs->file_size += entry->file_size;
+		children_t_size += entry->t_size;
+	}
+
+	// encode the data section once
+	size_t protobuf_size = ipfs_unixfs_protobuf_encode_size(unix_fs);
+	protobuf = (unsigned char*)malloc(protobuf_size);
+	if (protobuf == NULL)
+		goto exit;
+	if (!ipfs_unixfs_protobuf_encode(unix_fs, protobuf, protobuf_size, &protobuf_size))
+		goto exit;
+	if (!ipfs_hashtable_node_set_data(*parent, protobuf, protobuf_size))
+		goto exit;
+
+	// store it
+	size_t written = 0;
+	if (!ipfs_merkledag_add(*parent, builder->fs_repo, &written))
+		goto exit;
+	builder->bytes_written += written;
+	*t_size = written + children_t_size;
+	*file_size = unix_fs->file_size;
+
+	// the children now belong to the parent
+	for(int i = 0; i < current->count; i++)
+		free(current->entries[i].hash);
+	current->count = 0;
+
+	retVal = 1;
+	exit:
+	if (retVal == 0 && *parent != NULL) {
+		ipfs_hashtable_node_free(*parent);
+		*parent = NULL;
+	}
+	if (unix_fs != NULL)
+		ipfs_unixfs_free(unix_fs);
+	if (protobuf != NULL)
+		free(protobuf);
+	return retVal;
+}
+
+int ipfs_importer_dag_builder_level_add(struct DagBuilder* builder, int level, const unsigned char* hash, size_t hash_size, size_t t_size, size_t file_size);
+
+/***
+ * Turn a full level into a parent, and add the parent to the next level
+ * @param builder the DagBuilder
+ * @param level the level to flush
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_level_flush(struct DagBuilder* builder, int level) {
+	struct HashtableNode* parent = NULL;
+	size_t t_size = 0;
+	size_t file_size = 0;
+	if (!ipfs_importer_dag_builder_build_parent(builder, level, &parent, &t_size, &file_size))
+		return 0;
+	int retVal = ipfs_importer_dag_builder_level_add(builder, level + 1, parent->hash, parent->hash_size, t_size, file_size);
+	ipfs_hashtable_node_free(parent);
+	return retVal;
+}
+
+/***
+ * Add a finished child to a level, making room first if the level is full
+ * @param builder the DagBuilder
+ * @param level the depth of the child
+ * @param hash the hash of the child
+ * @param hash_size the length of the hash
+ * @param t_size the size of the child plus everything below it
+ * @param file_size the bytes of file data below the child
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_level_add(struct DagBuilder* builder, int level, const unsigned char* hash, size_t hash_size, size_t t_size, size_t file_size) {
+	if (!ipfs_importer_dag_builder_ensure_level(builder, level))
+		return 0;
+	if (builder->levels[level].count == builder->max_links) {
+		if (!ipfs_importer_dag_builder_level_flush(builder, level))
+			return 0;
+	}
+	struct DagBuilderLevel* current = &builder->levels[level];
+	struct DagBuilderEntry* entry = &current->entries[current->count];
+	entry->hash = (unsigned char*)malloc(hash_size);
+	if (entry->hash == NULL)
+		return 0;
+	memcpy(entry->hash, hash, hash_size);
+	entry->hash_size = hash_size;
+	entry->t_size = t_size;
+	entry->file_size = file_size;
+	current->count++;
+	return 1;
+}
+
+/***
+ * Add a leaf that has already been stored
+ * NOTE: leaves must be added in file order
+ * @param builder the DagBuilder
+ * @param leaf the stored leaf. The builder keeps it if it may become the root, so it must not be freed by the caller.
+ * @param t_size the bytes written when the leaf was stored
+ * @param file_size the bytes of file data in the leaf
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_add_stored_leaf(struct DagBuilder* builder, struct HashtableNode* leaf, size_t t_size, size_t file_size) {
+	builder->leaf_count++;
+	builder->bytes_written += t_size;
+	// a file of one chunk is just the chunk, so hold on to the first one
+	if (builder->first_leaf != NULL) {
+		ipfs_hashtable_node_free(builder->first_leaf);
+		builder->first_leaf = NULL;
+	}
+	int retVal = ipfs_importer_dag_builder_level_add(builder, 0, leaf->hash, leaf->hash_size, t_size, file_size);
+	if (builder->leaf_count == 1 && retVal)
+		builder->first_leaf = leaf;
+	else
+		ipfs_hashtable_node_free(leaf);
+	return retVal;
+}
+
+/***
+ * Encode a chunk of a file as a leaf, and store it. This does not touch a DagBuilder,
+ * so it can be called from several threads at once.
+ * @param fs_repo where to store the leaf
+ * @param data the chunk. It is not copied, and is not changed.
+ * @param data_size the size of the chunk
+ * @param leaf where to put the stored leaf. The caller must free it.
+ * @param bytes_written the bytes written to the repo
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_store_leaf(struct FSRepo* fs_repo, unsigned char* data, size_t data_size, struct HashtableNode** leaf, size_t* bytes_written) {
+	int retVal = 0;
+	struct UnixFS* unix_fs = NULL;
+	unsigned char* protobuf = NULL;
+
+	*leaf = NULL;
+	*bytes_written = 0;
+	if (!ipfs_unixfs_new(&unix_fs))
+		goto exit;
+	unix_fs->data_type = UNIXFS_FILE;
+	unix_fs->file_size = data_size;
+	// borrow the caller's buffer rather than copying it. It is given back before the free below.
+	unix_fs->bytes = data;
+	unix_fs->bytes_size = data_size;
+
+	size_t protobuf_size = ipfs_unixfs_protobuf_encode_size(unix_fs);
+	protobuf = (unsigned char*)malloc(protobuf_size);
+	if (protobuf == NULL)
+		goto exit;
+	if (!ipfs_unixfs_protobuf_encode(unix_fs, protobuf, protobuf_size, &protobuf_size))
+		goto exit;
+	if (!ipfs_hashtable_node_new_from_data(protobuf, protobuf_size, leaf))
+		goto exit;
+
+	if (!ipfs_merkledag_add(*leaf, fs_repo, bytes_written))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (unix_fs != NULL) {
+		unix_fs->bytes = NULL;
+		unix_fs->bytes_size = 0;
+		ipfs_unixfs_free(unix_fs);
+	}
+	if (protobuf != NULL)
+		free(protobuf);
+	if (retVal == 0 && *leaf != NULL) {
+		ipfs_hashtable_node_free(*leaf);
+		*leaf = NULL;
+	}
+	return retVal;
+}
+
+/***
+ * Store the next chunk of the file as a leaf
+ * @param builder the DagBuilder
+ * @param data the chunk
+ * @param data_size the size of the chunk
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_add_leaf(struct DagBuilder* builder, unsigned char* data, size_t data_size) {
+	struct HashtableNode* leaf = NULL;
+	size_t written = 0;
+	if (!ipfs_importer_dag_builder_store_leaf(builder->fs_repo, data, data_size, &leaf, &written))
+		return 0;
+	return ipfs_importer_dag_builder_add_stored_leaf(builder, leaf, written, data_size);
+}
+
+/***
+ * Build the remaining parents, and return the root of the file
+ * @param builder the DagBuilder
+ * @param root where to put the root node. The caller must free it.
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_finish(struct DagBuilder* builder, struct HashtableNode** root) {
+	*root = NULL;
+	// an empty file is a single empty leaf
+	if (builder->leaf_count == 0) {
+		unsigned char empty = 0;
+		if (!ipfs_importer_dag_builder_add_leaf(builder, &empty, 0))
+			return 0;
+	}
+	if (builder->leaf_count == 1) {
+		*root = builder->first_leaf;
+		builder->first_leaf = NULL;
+		return *root != NULL;
+	}
+	// push the partial levels up. NOTE: a flush can add a level, so num_levels is re-read each time
+	for(int level = 0; level < builder->num_levels - 1; level++) {
+		if (builder->levels[level].count > 0) {
+			if (!ipfs_importer_dag_builder_level_flush(builder, level))
+				return 0;
+		}
+	}
+	size_t t_size = 0;
+	size_t file_size = 0;
+	return ipfs_importer_dag_builder_build_parent(builder, builder->num_levels - 1, root, &t_size, &file_size);
+}
@@ -0,0 +1,306 @@
+/***
+ * Reads parts of a file stored as a DAG. See dag_reader.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipfs/importer/dag_reader.h"
+#include "ipfs/importer/export_pipeline.h"
+
+/***
+ * Fetch a node of the file, counting it
+ * @param reader the DagReader
+ * @param hash the hash of the node
+ * @param hash_size the length of the hash
+ * @param node where to put the node
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_fetch(struct DagReader* reader, const unsigned char* hash, size_t hash_size, struct HashtableNode** node) {
+	reader->fetches++;
+	return ipfs_export_pipeline_fetch(reader->local_node, reader->session, hash, hash_size, node);
+}
+
+/***
+ * Find the number of file bytes in a node and everything below it
+ * @param reader the DagReader
+ * @param node the node
+ * @param size where to put the number of bytes
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_node_size(struct DagReader* reader, const struct HashtableNode* node, size_t* size) {
+	struct UnixFS* unix_fs = NULL;
+	int retVal = 0;
+
+	if (!ipfs_unixfs_protobuf_decode(node->data, node->data_size, &unix_fs))
+		return 0;
+	if (unix_fs->file_size > 0) {
+		*size = unix_fs->file_size;
+		retVal = 1;
+		goto exit;
+	}
+	// nothing was stored, so add it up
+	*size = unix_fs->bytes_size;
+	struct UnixFSBlockSizeNode* block_size = unix_fs->block_size_head;
+	for(struct NodeLink* link = node->head_link; link != NULL; link = link->next) {
+		size_t child_size = 0;
+		if (block_size != NULL) {
+			child_size = block_size->block_size;
+			block_size = block_size->next;
+		} else {
+			struct HashtableNode* child = NULL;
+			if (!ipfs_dag_reader_fetch(reader, link->hash, link->hash_size, &child))
+				goto exit;
+			int success = ipfs_dag_reader_node_size(reader, child, &child_size);
+			ipfs_hashtable_node_free(child);
+			if (!success)
+				goto exit;
+		}
+		*size += child_size;
+	}
+
+	retVal = 1;
+	exit:
+	ipfs_unixfs_free(unix_fs);
+	return retVal;
+}
+
+/***
+ * Add a node to the end of the path
+ * @param reader the DagReader
+ * @param node the node. The path takes it on success.
+ * @param position where the node starts in the file
+ * @param size the number of file bytes in the node and below it
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_push(struct DagReader* reader, struct HashtableNode* node, size_t position, size_t size) {
+	if (reader->depth == reader->path_size) {
+		int path_size = (reader->path_size == 0 ? 4 : reader->path_size * 2);
+		struct DagReaderLevel* path = (struct DagReaderLevel*)realloc(reader->path, path_size * sizeof(struct DagReaderLevel));
+		if (path == NULL)
+			return 0;
+		reader->path = path;
+		reader->path_size = path_size;
+	}
+	struct DagReaderLevel* level = &reader->path[reader->depth];
+	level->unix_fs = NULL;
+	// the node stays while it is on the path, so its bytes are not copied
+	if (!ipfs_unixfs_protobuf_decode_view(node->data, node->data_size, &level->unix_fs))
+		return 0;
+	level->node = node;
+	level->position = position;
+	level->size = size;
+	reader->depth++;
+	return 1;
+}
+
+/***
+ * Remove the last node of the path. The root stays with the reader.
+ * @param reader the DagReader
+ */
+void ipfs_dag_reader_pop(struct DagReader* reader) {
+	reader->depth--;
+	struct DagReaderLevel* level = &reader->path[reader->depth];
+	ipfs_unixfs_view_free(level->unix_fs);
+	if (level->node != reader->root)
+		ipfs_hashtable_node_free(level->node);
+}
+
+/***
+ * Create a new DagReader for a file
+ * @param local_node the context
+ * @param hash the hash of the top node of the file
+ * @param hash_size the length of the hash
+ * @param reader where to put the DagReader
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_new(struct IpfsNode* local_node, const unsigned char* hash, size_t hash_size, struct DagReader** reader) {
+	*reader = (struct DagReader*)malloc(sizeof(struct DagReader));
+	if (*reader == NULL)
+		return 0;
+	(*reader)->local_node = local_node;
+	(*reader)->root = NULL;
+	(*reader)->size = 0;
+	(*reader)->offset = 0;
+	(*reader)->path = NULL;
+	(*reader)->depth = 0;
+	(*reader)->path_size = 0;
+	(*reader)->fetches = 0;
+	// the blocks of a file probably come from the same peers
+	(*reader)->session = NULL;
+	if (local_node->exchange != NULL && local_node->exchange->NewSession != NULL)
+		(*reader)->session = local_node->exchange->NewSession(local_node->exchange);
+	if (!ipfs_dag_reader_fetch(*reader, hash, hash_size, &(*reader)->root)
+			|| !ipfs_dag_reader_node_size(*reader, (*reader)->root, &(*reader)->size)
+			|| !ipfs_dag_reader_push(*reader, (*reader)->root, 0, (*reader)->size)) {
+		ipfs_dag_reader_free(*reader);
+		*reader = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Free the resources of a DagReader
+ * @param reader the DagReader
+ * @returns true(1)
+ */
+int ipfs_dag_reader_free(struct DagReader* reader) {
+	if (reader != NULL) {
+		while (reader->depth > 0)
+			ipfs_dag_reader_pop(reader);
+		if (reader->path != NULL)
+			free(reader->path);
+		if (reader->root != NULL)
+			ipfs_hashtable_node_free(reader->root);
+		if (reader->session != NULL)
+			reader->local_node->exchange->CloseSession(reader->local_node->exchange, reader->session);
+		free(reader);
+	}
+	return 1;
+}
+
+/***
+ * Move to a place in the file
+ * @param reader the DagReader
+ * @param offset where the next read starts
+ * @returns true(1) on success, false(0) if the offset is past the end of the file
+ */
+int ipfs_dag_reader_seek(struct DagReader* reader, size_t offset) {
+	if (offset > reader->size)
+		return 0;
+	reader->offset = offset;
+	return 1;
+}
+
+/***
+ * Add the child of the last node of the path that covers a place in the file
+ * @param reader the DagReader
+ * @param position the place in the file, after the bytes of the last node itself
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_descend(struct DagReader* reader, size_t position) {
+	struct DagReaderLevel* level = &reader->path[reader->depth - 1];
+	size_t child_position = level->position + level->unix_fs->bytes_size;
+	struct UnixFSBlockSizeNode* block_size = level->unix_fs->block_size_head;
+	for(struct NodeLink* link = level->node->head_link; link != NULL; link = link->next) {
+		struct HashtableNode* child = NULL;
+		size_t child_size = 0;
+		if (block_size != NULL) {
+			child_size = block_size->block_size;
+			block_size = block_size->next;
+		} else {
+			// without the sizes, the child has to be fetched to know where it is
+			if (!ipfs_dag_reader_fetch(reader, link->hash, link->hash_size, &child))
+				return 0;
+			if (!ipfs_dag_reader_node_size(reader, child, &child_size)) {
+				ipfs_hashtable_node_free(child);
+				return 0;
+			}
+		}
+		// skip the links that are before it, without fetching them
+		if (child_position + child_size > position) {
+			if (child == NULL && !ipfs_dag_reader_fetch(reader, link->hash, link->hash_size, &child))
+				return 0;
+			if (!ipfs_dag_reader_push(reader, child, child_position, child_size)) {
+				ipfs_hashtable_node_free(child);
+				return 0;
+			}
+			return 1;
+		}
+		if (child != NULL)
+			ipfs_hashtable_node_free(child);
+		child_position += child_size;
+	}
+	// the sizes do not add up
+	return 0;
+}
+
+/***
+ * Read bytes from a place in the file. Only the blocks that cover those bytes are fetched.
+ * @param reader the DagReader
+ * @param offset where in the file to start
+ * @param buffer where to put the bytes
+ * @param length the most bytes to read
+ * @param bytes_read the number of bytes read (less than length at the end of the file)
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_read_at(struct DagReader* reader, size_t offset, unsigned char* buffer, size_t length, size_t* bytes_read) {
+	*bytes_read = 0;
+	if (offset >= reader->size)
+		return 1;
+	if (length > reader->size - offset)
+		length = reader->size - offset;
+	size_t end = offset + length;
+
+	size_t position = offset;
+	while (position < end) {
+		// climb only as far as needed. The root covers the whole file.
+		while (reader->depth > 1) {
+			struct DagReaderLevel* level = &reader->path[reader->depth - 1];
+			if (position >= level->position && position < level->position + level->size)
+				break;
+			ipfs_dag_reader_pop(reader);
+		}
+		struct DagReaderLevel* level = &reader->path[reader->depth - 1];
+		// the bytes in the node itself come before the bytes of its links
+		size_t bytes_end = level->position + level->unix_fs->bytes_size;
+		if (position < bytes_end) {
+			size_t to = (end < bytes_end ? end : bytes_end);
+			memcpy(&buffer[position - offset], &level->unix_fs->bytes[position - level->position], to - position);
+			position = to;
+		} else if (!ipfs_dag_reader_descend(reader, position)) {
+			return 0;
+		}
+	}
+	*bytes_read = length;
+	return 1;
+}
+
+/***
+ * Read bytes from where the last read (or seek) stopped
+ * @param reader the DagReader
+ * @param buffer where to put the bytes
+ * @param length the most bytes to read
+ * @param bytes_read the number of bytes read (0 at the end of the file)
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_read(struct DagReader* reader, unsigned char* buffer, size_t length, size_t* bytes_read) {
+	if (!ipfs_dag_reader_read_at(reader, reader->offset, buffer, length, bytes_read))
+		return 0;
+	reader->offset += *bytes_read;
+	return 1;
+}
+
+/***
+ * Write part of the file to a stream
+ * @param reader the DagReader
+ * @param offset where in the file to start
+ * @param length the number of bytes to write (the rest of the file if it is longer than that)
+ * @param file where to write
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_write(struct DagReader* reader, size_t offset, size_t length, FILE* file) {
+	size_t buffer_size = 262144;
+	unsigned char* buffer = (unsigned char*)malloc(buffer_size);
+	int retVal = 0;
+
+	if (buffer == NULL)
+		return 0;
+	if (!ipfs_dag_reader_seek(reader, offset))
+		goto exit;
+	while (length > 0) {
+		size_t bytes_read = 0;
+		if (!ipfs_dag_reader_read(reader, buffer, (length < buffer_size ? length : buffer_size), &bytes_read))
+			goto exit;
+		if (bytes_read == 0)
+			break;
+		if (fwrite(buffer, 1, bytes_read, file) != bytes_read)
+			goto exit;
+		length -= bytes_read;
+	}
+
+	retVal = 1;
+	exit:
+	free(buffer);
+	return retVal;
+}
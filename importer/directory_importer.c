@@ -0,0 +1,420 @@
+/***
+ * Imports a directory tree using a pool of threads. See directory_importer.h
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipfs/importer/directory_importer.h"
+#include "ipfs/importer/importer.h"
+#include "ipfs/merkledag/merkledag.h"
+#include "libp2p/os/utils.h"
+
+void ipfs_import_directory_job(void* arg);
+
+/***
+ * Join two parts of a path
+ * NOTE: This allocates memory that must be freed
+ * @param first the first part (can be NULL)
+ * @param second the second part
+ * @returns the joined path, or NULL on error
+ */
+char* ipfs_import_directory_join(const char* first, const char* second) {
+	if (first == NULL) {
+		char* result = malloc(strlen(second) + 1);
+		if (result != NULL)
+			strcpy(result, second);
+		return result;
+	}
+	size_t len = strlen(first) + strlen(second) + 2;
+	char* result = malloc(len);
+	if (result != NULL && !os_utils_filepath_join(first, second, result, len)) {
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+/***
+ * Create a new DirectoryImportEntry
+ * @param importer the DirectoryImporter
+ * @param parent the directory it is in (NULL for the top)
+ * @param path where it is on disk
+ * @param display_path how it is shown in the results
+ * @param name the name of the link in the parent (can be NULL)
+ * @returns the new entry, or NULL on error
+ */
+struct DirectoryImportEntry* ipfs_import_directory_entry_new(struct DirectoryImporter* importer, struct DirectoryImportEntry* parent,
+		const char* path, const char* display_path, const char* name) {
+	struct DirectoryImportEntry* entry = (struct DirectoryImportEntry*)malloc(sizeof(struct DirectoryImportEntry));
+	if (entry == NULL)
+		return NULL;
+	entry->importer = importer;
+	entry->parent = parent;
+	entry->path = ipfs_import_directory_join(NULL, path);
+	entry->display_path = ipfs_import_directory_join(NULL, display_path);
+	entry->name = (name == NULL ? NULL : ipfs_import_directory_join(NULL, name));
+	entry->is_directory = os_utils_is_directory(path);
+	entry->children = NULL;
+	entry->num_children = 0;
+	entry->pending = 0;
+	entry->hash = NULL;
+	entry->hash_size = 0;
+	entry->bytes_written = 0;
+	entry->failed = 0;
+	if (entry->path == NULL || entry->display_path == NULL || (name != NULL && entry->name == NULL)) {
+		free(entry->path);
+		free(entry->display_path);
+		free(entry->name);
+		free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+int ipfs_import_directory_entry_free(struct DirectoryImportEntry* entry);
+
+/***
+ * Free the children of a DirectoryImportEntry
+ * @param entry the entry
+ * @returns true(1)
+ */
+int ipfs_import_directory_entry_free_children(struct DirectoryImportEntry* entry) {
+	for(size_t i = 0; i < entry->num_children; i++)
+		ipfs_import_directory_entry_free(entry->children[i]);
+	free(entry->children);
+	entry->children = NULL;
+	entry->num_children = 0;
+	return 1;
+}
+
+/***
+ * Free a DirectoryImportEntry and its children
+ * @param entry the entry
+ * @returns true(1)
+ */
+int ipfs_import_directory_entry_free(struct DirectoryImportEntry* entry) {
+	if (entry != NULL) {
+		ipfs_import_directory_entry_free_children(entry);
+		free(entry->path);
+		free(entry->display_path);
+		free(entry->name);
+		free(entry->hash);
+		free(entry);
+	}
+	return 1;
+}
+
+/***
+ * Keep the hash of a stored node in its entry
+ * @param entry the entry
+ * @param node the stored node
+ * @returns true(1) on success
+ */
+int ipfs_import_directory_set_hash(struct DirectoryImportEntry* entry, const struct HashtableNode* node) {
+	entry->hash = (unsigned char*)malloc(node->hash_size);
+	if (entry->hash == NULL)
+		return 0;
+	memcpy(entry->hash, node->hash, node->hash_size);
+	entry->hash_size = node->hash_size;
+	return 1;
+}
+
+/***
+ * Build and store the node of a directory whose children are all finished.
+ * The children are freed afterwards.
+ * @param entry the directory
+ * @returns true(1) on success
+ */
+int ipfs_import_directory_build(struct DirectoryImportEntry* entry) {
+	struct DirectoryImporter* importer = entry->importer;
+	struct HashtableNode* directory = NULL;
+	struct NodeLink* last_link = NULL;
+	size_t written = 0;
+	int retVal = 0;
+
+	if (!ipfs_hashtable_node_create_directory(&directory))
+		goto exit;
+	entry->bytes_written = 0;
+	for(size_t i = 0; i < entry->num_children; i++) {
+		struct DirectoryImportEntry* child = entry->children[i];
+		if (child->failed)
+			goto exit;
+		struct NodeLink* link = NULL;
+		if (!ipfs_node_link_create(child->name, child->hash, child->hash_size, &link))
+			goto exit;
+		link->t_size = child->bytes_written;
+		// directories can be large, so add to the end without walking the list
+		if (last_link == NULL)
+			directory->head_link = link;
+		else
+			last_link->next = link;
+		last_link = link;
+		entry->bytes_written += child->bytes_written;
+	}
+	if (!ipfs_merkledag_add(directory, importer->local_node->repo, &written))
+		goto exit;
+	entry->bytes_written += written;
+	if (!ipfs_import_directory_set_hash(entry, directory))
+		goto exit;
+
+	pthread_mutex_lock(&importer->provide_lock);
+	importer->local_node->routing->Provide(importer->local_node->routing, directory->hash, directory->hash_size);
+	pthread_mutex_unlock(&importer->provide_lock);
+
+	if (entry->parent == NULL) {
+		// the caller gets the top directory
+		importer->root = directory;
+		directory = NULL;
+	} else {
+		ipfs_import_print_node_results(directory, entry->display_path);
+	}
+
+	retVal = 1;
+	exit:
+	if (directory != NULL)
+		ipfs_hashtable_node_free(directory);
+	ipfs_import_directory_entry_free_children(entry);
+	if (!retVal)
+		entry->failed = 1;
+	return retVal;
+}
+
+/***
+ * Called when an entry is finished. Tells the parent, and builds the parent if
+ * this was the last child it was waiting for. That continues up the tree.
+ * @param entry the finished entry
+ */
+void ipfs_import_directory_finished(struct DirectoryImportEntry* entry) {
+	struct DirectoryImporter* importer = entry->importer;
+	while (1) {
+		pthread_mutex_lock(&importer->lock);
+		if (entry->is_directory) {
+			importer->directories_imported++;
+		} else {
+			importer->files_imported++;
+			importer->bytes_imported += entry->bytes_written;
+		}
+		if (entry->failed)
+			importer->failed = 1;
+		struct DirectoryImportEntry* parent = entry->parent;
+		if (parent == NULL) {
+			importer->done = 1;
+			pthread_cond_broadcast(&importer->finished);
+			pthread_mutex_unlock(&importer->lock);
+			return;
+		}
+		int ready = (--parent->pending == 0);
+		pthread_mutex_unlock(&importer->lock);
+		if (!ready)
+			return;
+		ipfs_import_directory_build(parent);
+		entry = parent;
+	}
+}
+
+/***
+ * List a directory, and start a job for everything in it
+ * @param entry the directory
+ * @returns true(1) on success
+ */
+int ipfs_import_directory_list(struct DirectoryImportEntry* entry) {
+	struct DirectoryImporter* importer = entry->importer;
+	struct FileList* first = os_utils_list_directory(entry->path);
+	size_t count = 0;
+	for(struct FileList* current = first; current != NULL; current = current->next)
+		count++;
+
+	if (count > 0) {
+		entry->children = (struct DirectoryImportEntry**)malloc(sizeof(struct DirectoryImportEntry*) * count);
+		if (entry->children == NULL) {
+			os_utils_free_file_list(first);
+			return 0;
+		}
+		for(struct FileList* current = first; current != NULL; current = current->next) {
+			char* path = ipfs_import_directory_join(entry->path, current->file_name);
+			char* display_path = ipfs_import_directory_join(entry->display_path, current->file_name);
+			struct DirectoryImportEntry* child = NULL;
+			if (path != NULL && display_path != NULL)
+				child = ipfs_import_directory_entry_new(importer, entry, path, display_path, current->file_name);
+			free(path);
+			free(display_path);
+			if (child == NULL) {
+				os_utils_free_file_list(first);
+				return 0;
+			}
+			entry->children[entry->num_children++] = child;
+		}
+	}
+	os_utils_free_file_list(first);
+
+	if (entry->num_children == 0) {
+		// nothing to wait for
+		ipfs_import_directory_build(entry);
+		ipfs_import_directory_finished(entry);
+		return 1;
+	}
+
+	// every child must be counted before any of them can finish
+	pthread_mutex_lock(&importer->lock);
+	entry->pending = entry->num_children;
+	for(size_t i = 0; i < entry->num_children; i++) {
+		if (!entry->children[i]->is_directory)
+			importer->files_found++;
+	}
+	pthread_mutex_unlock(&importer->lock);
+	// once the last child is queued, this directory can be built (and its children freed)
+	// by another thread at any time, so only local copies are used from here on
+	size_t num_children = entry->num_children;
+	struct DirectoryImportEntry** children = entry->children;
+	for(size_t i = 0; i < num_children; i++) {
+		struct DirectoryImportEntry* child = children[i];
+		if (thpool_add_work(importer->pool, ipfs_import_directory_job, child) != 0) {
+			// finish it here, so the directory is not waiting forever
+			child->failed = 1;
+			ipfs_import_directory_finished(child);
+		}
+	}
+	return 1;
+}
+
+/***
+ * Import one file
+ * @param entry the file
+ * @returns true(1) on success
+ */
+int ipfs_import_directory_file(struct DirectoryImportEntry* entry) {
+	struct DirectoryImporter* importer = entry->importer;
+	struct HashtableNode* node = NULL;
+	// the files are already spread over the pool, so each one is imported on a single thread
+	if (!ipfs_import_file_contents(entry->path, &node, importer->local_node, &entry->bytes_written, 1))
+		return 0;
+	int retVal = ipfs_import_directory_set_hash(entry, node);
+	if (retVal) {
+		ipfs_import_print_node_results(node, entry->display_path);
+		pthread_mutex_lock(&importer->provide_lock);
+		ipfs_import_provide(importer->local_node, node);
+		pthread_mutex_unlock(&importer->provide_lock);
+	}
+	ipfs_hashtable_node_free(node);
+	return retVal;
+}
+
+/***
+ * The job run by the pool for each entry
+ * @param arg the DirectoryImportEntry
+ */
+void ipfs_import_directory_job(void* arg) {
+	struct DirectoryImportEntry* entry = (struct DirectoryImportEntry*)arg;
+	// once something has failed, the rest is not worth doing
+	if (entry->importer->failed) {
+		entry->failed = 1;
+		ipfs_import_directory_finished(entry);
+		return;
+	}
+	if (entry->is_directory) {
+		if (!ipfs_import_directory_list(entry)) {
+			entry->failed = 1;
+			ipfs_import_directory_entry_free_children(entry);
+			ipfs_import_directory_finished(entry);
+		}
+		return;
+	}
+	if (!ipfs_import_directory_file(entry))
+		entry->failed = 1;
+	ipfs_import_directory_finished(entry);
+}
+
+/***
+ * Import a directory and everything below it
+ * @param root_dir where the directory is shown to be in the results (can be NULL)
+ * @param directory the path to the directory
+ * @param node where to put the directory node. The caller must free it.
+ * @param local_node the context
+ * @param bytes_written incremented by the number of bytes written to the repo
+ * @param recursive false(0) to import the directory without its contents
+ * @param workers the number of threads to use
+ * @returns true(1) on success
+ */
+int ipfs_import_directory(const char* root_dir, const char* directory, struct HashtableNode** node, struct IpfsNode* local_node, size_t* bytes_written, int recursive, int workers) {
+	int retVal = 0;
+	struct DirectoryImporter importer;
+	struct DirectoryImportEntry* root = NULL;
+	char* path = NULL;
+	char* file = NULL;
+	char* display_path = NULL;
+
+	importer.local_node = local_node;
+	importer.pool = NULL;
+	importer.done = 0;
+	importer.failed = 0;
+	importer.root = NULL;
+	importer.files_found = 0;
+	importer.files_imported = 0;
+	importer.directories_imported = 0;
+	importer.bytes_imported = 0;
+	pthread_mutex_init(&importer.lock, NULL);
+	pthread_cond_init(&importer.finished, NULL);
+	pthread_mutex_init(&importer.provide_lock, NULL);
+
+	// the results show the directory as root_dir/[last part of the directory]
+	if (!os_utils_split_filename(directory, &path, &file))
+		goto exit;
+	display_path = ipfs_import_directory_join(root_dir, file);
+	if (display_path == NULL)
+		goto exit;
+	root = ipfs_import_directory_entry_new(&importer, NULL, directory, display_path, NULL);
+	if (root == NULL)
+		goto exit;
+
+	if (!recursive) {
+		// just the directory, without its contents
+		if (!ipfs_import_directory_build(root))
+			goto exit;
+	} else {
+		importer.pool = thpool_init(workers < 1 ? 1 : workers);
+		if (importer.pool == NULL)
+			goto exit;
+		if (thpool_add_work(importer.pool, ipfs_import_directory_job, root) != 0)
+			goto exit;
+		int show_progress = isatty(fileno(stderr));
+		pthread_mutex_lock(&importer.lock);
+		while (!importer.done) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += 1;
+			pthread_cond_timedwait(&importer.finished, &importer.lock, &deadline);
+			if (show_progress && !importer.done)
+				fprintf(stderr, "\rImported %lu of %lu files found so far (%lu directories, %lu bytes)",
+						importer.files_imported, importer.files_found, importer.directories_imported, importer.bytes_imported);
+		}
+		pthread_mutex_unlock(&importer.lock);
+		if (show_progress)
+			fprintf(stderr, "\n");
+		if (importer.failed || root->failed)
+			goto exit;
+	}
+
+	*bytes_written += root->bytes_written;
+	*node = importer.root;
+	importer.root = NULL;
+	retVal = 1;
+	exit:
+	if (importer.pool != NULL) {
+		thpool_wait(importer.pool);
+		thpool_destroy(importer.pool);
+	}
+	if (importer.root != NULL)
+		ipfs_hashtable_node_free(importer.root);
+	ipfs_import_directory_entry_free(root);
+	free(path);
+	free(file);
+	free(display_path);
+	pthread_mutex_destroy(&importer.lock);
+	pthread_cond_destroy(&importer.finished);
+	pthread_mutex_destroy(&importer.provide_lock);
+	return retVal;
+}
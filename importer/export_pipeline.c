@@ -0,0 +1,332 @@
+/***
+ * Writes a file's DAG while fetching blocks ahead of time. See export_pipeline.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipfs/blocks/block.h"
+#include "ipfs/blocks/blockstore.h"
+#include "ipfs/cid/cid.h"
+#include "ipfs/importer/export_pipeline.h"
+#include "ipfs/importer/exporter.h"
+#include "ipfs/merkledag/merkledag.h"
+#include "ipfs/unixfs/unixfs.h"
+#include "libp2p/utils/logger.h"
+#include "libp2p/utils/vector.h"
+
+/***
+ * Create a new ExportPipeline
+ * @param local_node the context
+ * @param max_fetches the most fetches at a time
+ * @param max_bytes the most bytes to hold that are being fetched or are fetched but not written
+ * @returns the ExportPipeline, or NULL on error
+ */
+struct ExportPipeline* ipfs_export_pipeline_new(struct IpfsNode* local_node, int max_fetches, size_t max_bytes) {
+	struct ExportPipeline* pipeline = (struct ExportPipeline*)malloc(sizeof(struct ExportPipeline));
+	if (pipeline == NULL)
+		return NULL;
+	pipeline->local_node = local_node;
+	pipeline->max_fetches = (max_fetches < 1 ? 1 : max_fetches);
+	pipeline->max_bytes = max_bytes;
+	pipeline->head = NULL;
+	pipeline->next_fetch = NULL;
+	pipeline->fetching = 0;
+	pipeline->fetched_bytes = 0;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->block_finished, NULL);
+	// the blocks of a file probably come from the same peers
+	pipeline->session = NULL;
+	if (local_node->exchange != NULL && local_node->exchange->NewSession != NULL)
+		pipeline->session = local_node->exchange->NewSession(local_node->exchange);
+	// the threads are started once for the node, not for every file
+	pipeline->pool = ipfs_node_export_pool(local_node, pipeline->max_fetches);
+	if (pipeline->pool == NULL) {
+		ipfs_export_pipeline_free(pipeline);
+		return NULL;
+	}
+	return pipeline;
+}
+
+/***
+ * Free an ExportBlock
+ * @param block the block
+ * @returns true(1)
+ */
+int ipfs_export_pipeline_block_free(struct ExportBlock* block) {
+	if (block != NULL) {
+		if (block->view.data != NULL) {
+			ipfs_hashtable_node_view_free(block->node);
+			ipfs_block_view_release(&block->view);
+		} else if (block->node != NULL)
+			ipfs_hashtable_node_free(block->node);
+		free(block->hash);
+		free(block);
+	}
+	return 1;
+}
+
+/***
+ * Wait for the fetches of this pipeline, and free its resources
+ * @param pipeline the ExportPipeline
+ * @returns true(1)
+ */
+int ipfs_export_pipeline_free(struct ExportPipeline* pipeline) {
+	if (pipeline != NULL) {
+		// the workers fill in the blocks, so they must be done before anything is freed.
+		// The pool is shared, so only the fetches of this pipeline are waited for.
+		pthread_mutex_lock(&pipeline->lock);
+		while (pipeline->fetching > 0)
+			pthread_cond_wait(&pipeline->block_finished, &pipeline->lock);
+		pthread_mutex_unlock(&pipeline->lock);
+		if (pipeline->session != NULL)
+			pipeline->local_node->exchange->CloseSession(pipeline->local_node->exchange, pipeline->session);
+		while (pipeline->head != NULL) {
+			struct ExportBlock* next = pipeline->head->next;
+			ipfs_export_pipeline_block_free(pipeline->head);
+			pipeline->head = next;
+		}
+		pthread_mutex_destroy(&pipeline->lock);
+		pthread_cond_destroy(&pipeline->block_finished);
+		free(pipeline);
+	}
+	return 1;
+}
+
+/***
+ * Used by ipfs_export_pipeline_fetch_remote to keep the block that arrived
+ * @param block the block
+ * @param arg where to put it
+ * @returns true(1)
+ */
+int ipfs_export_pipeline_block_received(struct Block* block, void* arg) {
+	*(struct Block**)arg = block;
+	return 1;
+}
+
+/***
+ * Fetch a node that is not in the local blockstore, from the exchange or the routing
+ * @param local_node the context
+ * @param session the exchange session the node belongs to (can be NULL)
+ * @param hash the hash of the node
+ * @param hash_size the length of the hash
+ * @param node where to put the node
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_fetch_remote(struct IpfsNode* local_node, void* session, const unsigned char* hash, size_t hash_size, struct HashtableNode** node) {
+	*node = NULL;
+
+	// bitswap can have many blocks wanted at once
+	if (local_node->exchange != NULL) {
+		struct Cid* cid = ipfs_cid_new(0, hash, hash_size, CID_PROTOBUF);
+		struct Block* block = NULL;
+		int found = 0;
+		if (cid != NULL && session != NULL) {
+			struct Libp2pVector* cids = libp2p_utils_vector_new(1);
+			if (cids != NULL) {
+				libp2p_utils_vector_add(cids, cid);
+				local_node->exchange->GetBlocksStream(local_node->exchange, session, cids, ipfs_export_pipeline_block_received, &block);
+				libp2p_utils_vector_free(cids);
+			}
+		} else if (cid != NULL) {
+			local_node->exchange->GetBlock(local_node->exchange, cid, &block);
+		}
+		if (block != NULL) {
+			found = ipfs_hashtable_node_protobuf_decode(block->data, block->data_length, node);
+			ipfs_block_free(block);
+		}
+		ipfs_cid_free(cid);
+		if (found) {
+			ipfs_hashtable_node_set_hash(*node, hash, hash_size);
+			return 1;
+		}
+		if (*node != NULL) {
+			ipfs_hashtable_node_free(*node);
+			*node = NULL;
+		}
+	}
+
+	// the routing
+	libp2p_logger_debug("export_pipeline", "Block not found by the exchange. Asking the routing.\n");
+	pthread_mutex_lock(&local_node->routing_lock);
+	int retVal = ipfs_exporter_get_node(local_node, hash, hash_size, node);
+	pthread_mutex_unlock(&local_node->routing_lock);
+	return retVal;
+}
+
+/***
+ * Fetch a node, from the local blockstore if it is there, otherwise from the network
+ * @param local_node the context
+ * @param session the exchange session the node belongs to (can be NULL)
+ * @param hash the hash of the node
+ * @param hash_size the length of the hash
+ * @param node where to put the node
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_fetch(struct IpfsNode* local_node, void* session, const unsigned char* hash, size_t hash_size, struct HashtableNode** node) {
+	*node = NULL;
+	if (ipfs_merkledag_get(hash, hash_size, node, local_node->repo))
+		return 1;
+	return ipfs_export_pipeline_fetch_remote(local_node, session, hash, hash_size, node);
+}
+
+/***
+ * The job run by the workers: fetch one block
+ * @param arg the ExportBlock
+ */
+void ipfs_export_pipeline_fetch_block(void* arg) {
+	struct ExportBlock* block = (struct ExportBlock*)arg;
+	struct ExportPipeline* pipeline = block->pipeline;
+	struct HashtableNode* node = NULL;
+	struct BlockView view;
+	memset(&view, 0, sizeof(struct BlockView));
+	// blocks that are here are read in place, so a large file is not copied on its way out
+	int success = ipfs_blockstore_get_node_view(block->hash, block->hash_size, &node, &view, pipeline->local_node->repo);
+	// it was just looked for here, so only the network is left
+	if (!success)
+		success = ipfs_export_pipeline_fetch_remote(pipeline->local_node, pipeline->session, block->hash, block->hash_size, &node);
+
+	pthread_mutex_lock(&pipeline->lock);
+	block->node = node;
+	block->view = view;
+	block->node_size = (node != NULL ? node->data_size : 0);
+	block->state = (success ? EXPORT_BLOCK_DONE : EXPORT_BLOCK_FAILED);
+	pipeline->fetching--;
+	// what was reserved is swapped for what arrived
+	pipeline->fetched_bytes = pipeline->fetched_bytes - block->reserved + block->node_size;
+	block->reserved = 0;
+	pthread_cond_broadcast(&pipeline->block_finished);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/***
+ * Put the links of a node at the front of the list, in order
+ * @param pipeline the ExportPipeline
+ * @param node the node
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_push_links(struct ExportPipeline* pipeline, const struct HashtableNode* node) {
+	struct ExportBlock* first = NULL;
+	struct ExportBlock* last = NULL;
+
+	for(struct NodeLink* link = node->head_link; link != NULL; link = link->next) {
+		struct ExportBlock* block = (struct ExportBlock*)malloc(sizeof(struct ExportBlock));
+		if (block != NULL) {
+			block->hash = (unsigned char*)malloc(link->hash_size);
+			if (block->hash == NULL) {
+				free(block);
+				block = NULL;
+			}
+		}
+		if (block == NULL) {
+			while (first != NULL) {
+				struct ExportBlock* next = first->next;
+				ipfs_export_pipeline_block_free(first);
+				first = next;
+			}
+			return 0;
+		}
+		memcpy(block->hash, link->hash, link->hash_size);
+		block->hash_size = link->hash_size;
+		block->pipeline = pipeline;
+		block->state = EXPORT_BLOCK_WAITING;
+		block->node = NULL;
+		memset(&block->view, 0, sizeof(struct BlockView));
+		block->node_size = 0;
+		// a leaf's link gives its size, and the link of anything else gives the size of its tree
+		block->reserved = (link->t_size > 0 && link->t_size < EXPORT_PIPELINE_BLOCK_ESTIMATE ? link->t_size : EXPORT_PIPELINE_BLOCK_ESTIMATE);
+		block->next = NULL;
+		if (last == NULL)
+			first = block;
+		else
+			last->next = block;
+		last = block;
+	}
+	if (first != NULL) {
+		last->next = pipeline->head;
+		pipeline->head = first;
+		// the new blocks are the first ones that have not been asked for
+		pipeline->next_fetch = first;
+	}
+	return 1;
+}
+
+/***
+ * Start fetching the blocks at the front of the list, as far as the limits allow.
+ * The first block is always started, so there is something to wait for.
+ * @param pipeline the ExportPipeline
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_fill(struct ExportPipeline* pipeline) {
+	int retVal = 1;
+	pthread_mutex_lock(&pipeline->lock);
+	struct ExportBlock* block = pipeline->next_fetch;
+	while (block != NULL) {
+		if (block->state == EXPORT_BLOCK_WAITING) {
+			if (block != pipeline->head && (pipeline->fetching >= pipeline->max_fetches
+					|| pipeline->fetched_bytes + block->reserved > pipeline->max_bytes))
+				break;
+			block->state = EXPORT_BLOCK_FETCHING;
+			pipeline->fetching++;
+			pipeline->fetched_bytes += block->reserved;
+			if (thpool_add_work(pipeline->pool, ipfs_export_pipeline_fetch_block, block) != 0) {
+				block->state = EXPORT_BLOCK_FAILED;
+				pipeline->fetching--;
+				pipeline->fetched_bytes -= block->reserved;
+				block->reserved = 0;
+				retVal = 0;
+				break;
+			}
+		}
+		block = block->next;
+	}
+	pipeline->next_fetch = block;
+	pthread_mutex_unlock(&pipeline->lock);
+	return retVal;
+}
+
+/***
+ * Write everything below a node to a file
+ * NOTE: the data of the node itself is not written
+ * @param pipeline the ExportPipeline
+ * @param node the node whose links are written
+ * @param file where to write
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_write(struct ExportPipeline* pipeline, const struct HashtableNode* node, FILE* file) {
+	if (!ipfs_export_pipeline_push_links(pipeline, node))
+		return 0;
+
+	while (pipeline->head != NULL) {
+		if (!ipfs_export_pipeline_fill(pipeline))
+			return 0;
+
+		// wait for the next block in the file
+		struct ExportBlock* block = pipeline->head;
+		pthread_mutex_lock(&pipeline->lock);
+		while (block->state == EXPORT_BLOCK_FETCHING)
+			pthread_cond_wait(&pipeline->block_finished, &pipeline->lock);
+		pipeline->fetched_bytes -= block->node_size;
+		pthread_mutex_unlock(&pipeline->lock);
+		if (block->state != EXPORT_BLOCK_DONE)
+			return 0;
+
+		pipeline->head = block->next;
+		if (pipeline->next_fetch == block)
+			pipeline->next_fetch = block->next;
+
+		struct UnixFS* unix_fs = NULL;
+		// the bytes are written straight from the node, which may be straight from the disk
+		int retVal = ipfs_unixfs_protobuf_decode_view(block->node->data, block->node->data_size, &unix_fs);
+		if (retVal && unix_fs != NULL && unix_fs->bytes_size > 0 && fwrite(unix_fs->bytes, 1, unix_fs->bytes_size, file) != unix_fs->bytes_size)
+			retVal = 0;
+		if (unix_fs != NULL)
+			ipfs_unixfs_view_free(unix_fs);
+		// large files are trees, so the block may have links of its own
+		if (retVal)
+			retVal = ipfs_export_pipeline_push_links(pipeline, block->node);
+		ipfs_export_pipeline_block_free(block);
+		if (!retVal)
+			return 0;
+	}
+	return 1;
+}
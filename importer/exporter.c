@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ipfs/cid/cid.h"
@@ -7,6 +8,9 @@
 #include "ipfs/repo/fsrepo/fs_repo.h"
 #include "ipfs/repo/init.h"
 #include "ipfs/core/ipfs_node.h"
+#include "ipfs/importer/exporter.h"
+#include "ipfs/importer/export_pipeline.h"
+#include "ipfs/importer/dag_reader.h"
 #include "libp2p/utils/logger.h"
 
 /**
@@ -68,9 +72,9 @@ int ipfs_exporter_to_filestream(const unsigned char* hash, FILE* file_descriptor
 		return 0;
 	}
 
-	// find block
+	// find block. One that is here is decoded from its file, rather than copied through the routing.
 	struct HashtableNode* read_node = NULL;
-	if (!ipfs_exporter_get_node(local_node, cid->hash, cid->hash_length, &read_node)) {
+	if (!ipfs_export_pipeline_fetch(local_node, NULL, cid->hash, cid->hash_length, &read_node)) {
 		ipfs_cid_free(cid);
 		return 0;
 	}
@@ -78,38 +82,10 @@ int ipfs_exporter_to_filestream(const unsigned char* hash, FILE* file_descriptor
 	// no longer need the cid
 	ipfs_cid_free(cid);
 
-	if (read_node->head_link == NULL) {
-		// convert the node's data into a UnixFS data block
-		struct UnixFS* unix_fs;
-		ipfs_unixfs_protobuf_decode(read_node->data, read_node->data_size, &unix_fs);
-		size_t bytes_written = fwrite(unix_fs->bytes, 1, unix_fs->bytes_size, file_descriptor);
-		if (bytes_written != unix_fs->bytes_size) {
-			ipfs_hashtable_node_free(read_node);
-			ipfs_unixfs_free(unix_fs);
-			return 0;
-		}
-		ipfs_unixfs_free(unix_fs);
-	} else {
-		struct NodeLink* link = read_node->head_link;
-		struct HashtableNode* link_node = NULL;
-		while (link != NULL) {
-			if ( !ipfs_exporter_get_node(local_node, link->hash, link->hash_size, &link_node)) {
-				ipfs_hashtable_node_free(read_node);
-				return 0;
-			}
-			struct UnixFS* unix_fs;
-			ipfs_unixfs_protobuf_decode(link_node->data, link_node->data_size, &unix_fs);
-			size_t bytes_written = fwrite(unix_fs->bytes, 1, unix_fs->bytes_size, file_descriptor);
-			if (bytes_written != unix_fs->bytes_size) {
-				ipfs_hashtable_node_free(link_node);
-				ipfs_hashtable_node_free(read_node);
-				ipfs_unixfs_free(unix_fs);
-				return 0;
-			}
-			ipfs_hashtable_node_free(link_node);
-			ipfs_unixfs_free(unix_fs);
-			link = link->next;
-		}
+	// write this node, and everything below it
+	if (!ipfs_exporter_cat_node(read_node, local_node, file_descriptor)) {
+		ipfs_hashtable_node_free(read_node);
+		return 0;
 	}
 
 	if (read_node != NULL)
@@ -149,9 +125,9 @@ int ipfs_exporter_to_console(const unsigned char* hash, struct IpfsNode *local_n
 		return 0;
 	}
 
-	// find block
+	// find block. One that is here is decoded from its file, rather than copied through the routing.
 	struct HashtableNode* read_node = NULL;
-	if (!ipfs_exporter_get_node(local_node, cid->hash, cid->hash_length, &read_node)) {
+	if (!ipfs_export_pipeline_fetch(local_node, NULL, cid->hash, cid->hash_length, &read_node)) {
 		ipfs_cid_free(cid);
 		return 0;
 	}
@@ -212,22 +188,40 @@ int ipfs_exporter_cat_node(struct HashtableNode* node, struct IpfsNode* local_no
 	// process this node, then move on to the links
 
 	// build the unixfs
-	struct UnixFS* unix_fs;
-	ipfs_unixfs_protobuf_decode(node->data, node->data_size, &unix_fs);
-	for(size_t i = 0LU; i < unix_fs->bytes_size; i++) {
-		fprintf(file, "%c", unix_fs->bytes[i]);
+	struct UnixFS* unix_fs = NULL;
+	if (!ipfs_unixfs_protobuf_decode(node->data, node->data_size, &unix_fs))
+		return 0;
+	if (unix_fs->bytes_size > 0 && fwrite(unix_fs->bytes, 1, unix_fs->bytes_size, file) != unix_fs->bytes_size) {
+		ipfs_unixfs_free(unix_fs);
+		return 0;
 	}
 	ipfs_unixfs_free(unix_fs);
-	// process links
+	if (node->head_link == NULL)
+		return 1;
+
+	struct Exporter* config = &local_node->repo->config->exporter;
+	if (config->prefetch > 1) {
+		// fetch the blocks ahead of what is being written
+		struct ExportPipeline* pipeline = ipfs_export_pipeline_new(local_node, config->prefetch, config->prefetch_bytes);
+		if (pipeline == NULL)
+			return 0;
+		int retVal = ipfs_export_pipeline_write(pipeline, node, file);
+		ipfs_export_pipeline_free(pipeline);
+		return retVal;
+	}
+
+	// process links. NOTE: large files are trees, so the children may have children
 	struct NodeLink* current = node->head_link;
 	while (current != NULL) {
 		// find the node
 		struct HashtableNode* child_node = NULL;
-		if (!ipfs_exporter_get_node(local_node, current->hash, current->hash_size, &child_node)) {
+		if (!ipfs_export_pipeline_fetch(local_node, NULL, current->hash, current->hash_size, &child_node)) {
 			return 0;
 		}
-		ipfs_exporter_cat_node(child_node, local_node, file);
+		int retVal = ipfs_exporter_cat_node(child_node, local_node, file);
 		ipfs_hashtable_node_free(child_node);
+		if (!retVal)
+			return 0;
 		current = current->next;
 	}
 
@@ -237,8 +231,8 @@ int ipfs_exporter_cat_node(struct HashtableNode* node, struct IpfsNode* local_no
 int ipfs_exporter_object_cat_to_file(struct IpfsNode *local_node, unsigned char* hash, int hash_size, FILE* file) {
 	struct HashtableNode* read_node = NULL;
 
-	// find block
-	if (!ipfs_exporter_get_node(local_node, hash, hash_size, &read_node)) {
+	// find block. One that is here is decoded from its file, rather than copied through the routing.
+	if (!ipfs_export_pipeline_fetch(local_node, NULL, hash, hash_size, &read_node)) {
 		return 0;
 	}
 
@@ -248,8 +242,50 @@ int ipfs_exporter_object_cat_to_file(struct IpfsNode *local_node, unsigned char*
 }
 
 /***
- * Called from the command line with ipfs cat [hash]. Retrieves the object
- * pointed to by hash, and displays its raw block data to the console
+ * Find a size (like an offset or a length) on the command line
+ * @param argc number of arguments
+ * @param argv arguments
+ * @param short_name the short name of the option, i.e. "-o"
+ * @param long_name the long name of the option, i.e. "--offset"
+ * @param value where to put the size
+ * @returns true(1) if the option was found and is a number
+ */
+int ipfs_exporter_get_size_option(int argc, char** argv, const char* short_name, const char* long_name, size_t* value) {
+	for(int i = 0; i < argc - 1; i++) {
+		if (strcmp(argv[i], short_name) == 0 || strcmp(argv[i], long_name) == 0) {
+			char* end = NULL;
+			unsigned long long result = strtoull(argv[i + 1], &end, 10);
+			if (end == argv[i + 1] || *end != 0)
+				return 0;
+			*value = (size_t)result;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/***
+ * Find the hash on the command line. It is the first argument after the command that is not an option.
+ * @param argc number of arguments
+ * @param argv arguments
+ * @returns the hash, or NULL if there was none
+ */
+char* ipfs_exporter_get_hash_argument(int argc, char** argv) {
+	for(int i = 2; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			// all the options have a value
+			i++;
+			continue;
+		}
+		return argv[i];
+	}
+	return NULL;
+}
+
+/***
+ * Called from the command line with ipfs cat [-o offset] [-l length] [hash]. Retrieves the object
+ * pointed to by hash, and displays its raw block data to the console. With an offset or a length,
+ * only the blocks that cover that part of the file are retrieved.
  * @param argc number of arguments
  * @param argv arguments
  * @returns true(1) on success
@@ -257,23 +293,42 @@ int ipfs_exporter_object_cat_to_file(struct IpfsNode *local_node, unsigned char*
 int ipfs_exporter_object_cat(int argc, char** argv) {
 	struct IpfsNode *local_node = NULL;
 	char* repo_dir = NULL;
+	size_t offset = 0;
+	size_t length = (size_t)-1;
 
 	if (!ipfs_repo_get_directory(argc, argv, &repo_dir)) {
 		fprintf(stderr, "Unable to open repo: %s\n", repo_dir);
 		return 0;
 	}
 
+	char* hash = ipfs_exporter_get_hash_argument(argc, argv);
+	if (hash == NULL) {
+		fprintf(stderr, "No hash given\n");
+		return 0;
+	}
+	int ranged = ipfs_exporter_get_size_option(argc, argv, "-o", "--offset", &offset);
+	ranged = ipfs_exporter_get_size_option(argc, argv, "-l", "--length", &length) || ranged;
+
 	if (!ipfs_node_online_new(repo_dir, &local_node))
 		return 0;
 
 	// find hash
 	// convert hash to cid
 	struct Cid* cid = NULL;
-	if ( ipfs_cid_decode_hash_from_base58((unsigned char*)argv[2], strlen(argv[2]), &cid) == 0) {
+	if ( ipfs_cid_decode_hash_from_base58((unsigned char*)hash, strlen(hash), &cid) == 0) {
 		return 0;
 	}
 
-	int retVal = ipfs_exporter_object_cat_to_file(local_node, cid->hash, cid->hash_length, stdout);
+	int retVal = 0;
+	if (ranged) {
+		struct DagReader* reader = NULL;
+		if (ipfs_dag_reader_new(local_node, cid->hash, cid->hash_length, &reader)) {
+			retVal = ipfs_dag_reader_write(reader, offset, length, stdout);
+			ipfs_dag_reader_free(reader);
+		}
+	} else {
+		retVal = ipfs_exporter_object_cat_to_file(local_node, cid->hash, cid->hash_length, stdout);
+	}
 	ipfs_cid_free(cid);
 
 	return retVal;
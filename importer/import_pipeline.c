@@ -0,0 +1,181 @@
+/***
+ * Imports a file using several threads. See import_pipeline.h
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ipfs/importer/import_pipeline.h"
+
+/***
+ * The number of workers to use when the config says 0
+ * @returns the number of processors online
+ */
+int ipfs_import_pipeline_default_workers() {
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (processors < 1)
+		return 1;
+	return (int)processors;
+}
+
+/***
+ * Create a new ImportPipeline
+ * @param builder the DagBuilder that receives the leaves. The pipeline does not own it.
+ * @param num_workers the number of threads that store chunks (0 for one per processor)
+ * @param chunk_size the largest chunk
+ * @returns the ImportPipeline, or NULL on error
+ */
+struct ImportPipeline* ipfs_import_pipeline_new(struct DagBuilder* builder, int num_workers, size_t chunk_size) {
+	struct ImportPipeline* pipeline = (struct ImportPipeline*)malloc(sizeof(struct ImportPipeline));
+	if (pipeline == NULL)
+		return NULL;
+	pipeline->builder = builder;
+	pipeline->num_workers = (num_workers < 1 ? ipfs_import_pipeline_default_workers() : num_workers);
+	pipeline->chunk_size = chunk_size;
+	// enough chunks to keep every worker busy while the oldest one waits for its turn
+	pipeline->window_size = pipeline->num_workers * 2;
+	pipeline->next_read = 0;
+	pipeline->next_write = 0;
+	pipeline->pool = NULL;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->chunk_finished, NULL);
+	pipeline->window = (struct ImportChunk*)malloc(sizeof(struct ImportChunk) * pipeline->window_size);
+	if (pipeline->window == NULL) {
+		pipeline->window_size = 0;
+		ipfs_import_pipeline_free(pipeline);
+		return NULL;
+	}
+	for(size_t i = 0; i < pipeline->window_size; i++) {
+		struct ImportChunk* chunk = &pipeline->window[i];
+		chunk->pipeline = pipeline;
+		chunk->data_size = 0;
+		chunk->state = IMPORT_CHUNK_EMPTY;
+		chunk->leaf = NULL;
+		chunk->bytes_written = 0;
+		chunk->data = (unsigned char*)malloc(chunk_size);
+	}
+	for(size_t i = 0; i < pipeline->window_size; i++) {
+		if (pipeline->window[i].data == NULL) {
+			ipfs_import_pipeline_free(pipeline);
+			return NULL;
+		}
+	}
+	pipeline->pool = thpool_init(pipeline->num_workers);
+	if (pipeline->pool == NULL) {
+		ipfs_import_pipeline_free(pipeline);
+		return NULL;
+	}
+	return pipeline;
+}
+
+/***
+ * Wait for the workers, and free the resources of an ImportPipeline
+ * @param pipeline the ImportPipeline
+ * @returns true(1)
+ */
+int ipfs_import_pipeline_free(struct ImportPipeline* pipeline) {
+	if (pipeline != NULL) {
+		if (pipeline->pool != NULL) {
+			// the workers use the buffers, so they must be done before anything is freed
+			thpool_wait(pipeline->pool);
+			thpool_destroy(pipeline->pool);
+		}
+		for(size_t i = 0; i < pipeline->window_size; i++) {
+			struct ImportChunk* chunk = &pipeline->window[i];
+			if (chunk->leaf != NULL)
+				ipfs_hashtable_node_free(chunk->leaf);
+			if (chunk->data != NULL)
+				free(chunk->data);
+		}
+		if (pipeline->window != NULL)
+			free(pipeline->window);
+		pthread_mutex_destroy(&pipeline->lock);
+		pthread_cond_destroy(&pipeline->chunk_finished);
+		free(pipeline);
+	}
+	return 1;
+}
+
+/***
+ * The job run by the workers: store one chunk
+ * @param arg the ImportChunk
+ */
+void ipfs_import_pipeline_store_chunk(void* arg) {
+	struct ImportChunk* chunk = (struct ImportChunk*)arg;
+	struct ImportPipeline* pipeline = chunk->pipeline;
+	struct HashtableNode* leaf = NULL;
+	size_t bytes_written = 0;
+	int success = ipfs_importer_dag_builder_store_leaf(pipeline->builder->fs_repo, chunk->data, chunk->data_size, &leaf, &bytes_written);
+
+	pthread_mutex_lock(&pipeline->lock);
+	chunk->leaf = leaf;
+	chunk->bytes_written = bytes_written;
+	chunk->state = (success ? IMPORT_CHUNK_DONE : IMPORT_CHUNK_FAILED);
+	pthread_cond_broadcast(&pipeline->chunk_finished);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/***
+ * Wait for the oldest chunk, and give its leaf to the DagBuilder
+ * @param pipeline the ImportPipeline
+ * @returns true(1) on success
+ */
+int ipfs_import_pipeline_write_next(struct ImportPipeline* pipeline) {
+	struct ImportChunk* chunk = &pipeline->window[pipeline->next_write % pipeline->window_size];
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (chunk->state == IMPORT_CHUNK_PENDING)
+		pthread_cond_wait(&pipeline->chunk_finished, &pipeline->lock);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pipeline->next_write++;
+	int retVal = 0;
+	if (chunk->state == IMPORT_CHUNK_DONE) {
+		// the DagBuilder takes the leaf
+		retVal = ipfs_importer_dag_builder_add_stored_leaf(pipeline->builder, chunk->leaf, chunk->bytes_written, chunk->data_size);
+		chunk->leaf = NULL;
+	}
+	chunk->state = IMPORT_CHUNK_EMPTY;
+	return retVal;
+}
+
+/***
+ * Read a file to the end, storing each chunk and giving the leaves to the DagBuilder
+ * NOTE: call ipfs_importer_dag_builder_finish afterwards to get the root
+ * @param pipeline the ImportPipeline
+ * @param chunker where the chunks come from. Its max_size must not be more than the chunk_size of the pipeline.
+ * @returns true(1) on success
+ */
+int ipfs_import_pipeline_read(struct ImportPipeline* pipeline, struct Chunker* chunker) {
+	int retVal = 1;
+
+	while (retVal) {
+		// make room in the window
+		if (pipeline->next_read - pipeline->next_write == pipeline->window_size) {
+			if (!ipfs_import_pipeline_write_next(pipeline)) {
+				retVal = 0;
+				break;
+			}
+		}
+		struct ImportChunk* chunk = &pipeline->window[pipeline->next_read % pipeline->window_size];
+		if (!ipfs_chunker_next(chunker, chunk->data, &chunk->data_size)) {
+			retVal = 0;
+			break;
+		}
+		if (chunk->data_size == 0)
+			break;
+		chunk->state = IMPORT_CHUNK_PENDING;
+		if (thpool_add_work(pipeline->pool, ipfs_import_pipeline_store_chunk, chunk) != 0) {
+			chunk->state = IMPORT_CHUNK_EMPTY;
+			retVal = 0;
+			break;
+		}
+		pipeline->next_read++;
+	}
+
+	// everything that was read must come back, even after an error, so the buffers are free
+	while (pipeline->next_write != pipeline->next_read) {
+		if (!ipfs_import_pipeline_write_next(pipeline))
+			retVal = 0;
+	}
+	return retVal;
+}
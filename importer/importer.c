@@ -3,6 +3,10 @@
 #include <string.h>
 
 #include "ipfs/importer/importer.h"
+#include "ipfs/importer/chunker.h"
+#include "ipfs/importer/dag_builder.h"
+#include "ipfs/importer/directory_importer.h"
+#include "ipfs/importer/import_pipeline.h"
 #include "ipfs/merkledag/merkledag.h"
 #include "libp2p/os/utils.h"
 #include "ipfs/core/ipfs_node.h"
@@ -10,176 +14,107 @@
 #include "ipfs/repo/init.h"
 #include "ipfs/unixfs/unixfs.h"
 
-#define MAX_DATA_SIZE 262144 // 1024 * 256;
-
 /***
  * Imports OS files into the datastore
  */
 
-/***
- * adds a blocksize to the UnixFS structure stored in the data
- * element of a Node
- * @param node the node to work with
- * @param blocksize the blocksize to add
- * @returns true(1) on success
+/**
+ * Prints to the console the results of a node import
+ * @param node the node imported
+ * @param file_name the name of the file
+ * @returns true(1) if successful, false(0) if couldn't generate the MultiHash to be displayed
  */
-int ipfs_importer_add_filesize_to_data_section(struct HashtableNode* node, size_t bytes_read) {
-	// now add to the data section
-	struct UnixFS* data_section = NULL;
-	if (node->data == NULL) {
-		// nothing in data section yet, create new UnixFS
-		ipfs_unixfs_new(&data_section);
-		data_section->data_type = UNIXFS_FILE;
-	} else {
-		ipfs_unixfs_protobuf_decode(node->data, node->data_size, &data_section);
+int ipfs_import_print_node_results(const struct HashtableNode* node, const char* file_name) {
+	// give some results to the user
+	//TODO: if directory_entry is itself a directory, traverse and report files
+	int buffer_len = 100;
+	unsigned char buffer[buffer_len];
+	if (ipfs_cid_hash_to_base58(node->hash, node->hash_size, buffer, buffer_len) == 0) {
+		printf("Unable to generate hash for file %s.\n", file_name);
+		return 0;
 	}
-	struct UnixFSBlockSizeNode bs;
-	bs.block_size = bytes_read;
-	ipfs_unixfs_add_blocksize(&bs, data_section);
-	data_section->file_size += bytes_read;
-	// put the new data back in the data section
-	size_t protobuf_size = ipfs_unixfs_protobuf_encode_size(data_section); //delay bytes_size entry
-	unsigned char protobuf[protobuf_size];
-	ipfs_unixfs_protobuf_encode(data_section, protobuf, protobuf_size, &protobuf_size);
-	ipfs_unixfs_free(data_section);
-	ipfs_hashtable_node_set_data(node, protobuf, protobuf_size);
+	printf("added %s %s\n", buffer, file_name);
 	return 1;
 }
 
+
 /**
- * read the next chunk of bytes, create a node, and add a link to the node in the passed-in node
- * @param file the file handle
- * @param node the node to add to
- * @returns number of bytes read
+ * Import the contents of a file, without telling the network about it
+ * @param fileName the file
+ * @param node where to put the root node of the file. The caller must free it.
+ * @param local_node the context
+ * @param bytes_written incremented by the number of bytes written to the repo
+ * @param workers the number of threads that store chunks (1 to use only the calling thread)
+ * @returns true(1) on success
  */
-size_t ipfs_import_chunk(FILE* file, struct HashtableNode* parent_node, struct FSRepo* fs_repo, size_t* total_size, size_t* bytes_written) {
-	unsigned char buffer[MAX_DATA_SIZE];
-	size_t bytes_read = fread(buffer, 1, MAX_DATA_SIZE, file);
-
-	// structs used by this method
-	struct UnixFS* new_unixfs = NULL;
-	struct HashtableNode* new_node = NULL;
-	struct NodeLink* new_link = NULL;
-
-	// put the file bits into a new UnixFS file
-	if (ipfs_unixfs_new(&new_unixfs) == 0)
-		return 0;
-	new_unixfs->data_type = UNIXFS_FILE;
-	new_unixfs->file_size = bytes_read;
-	if (ipfs_unixfs_add_data(&buffer[0], bytes_read, new_unixfs) == 0) {
-		ipfs_unixfs_free(new_unixfs);
+int ipfs_import_file_contents(const char* fileName, struct HashtableNode** node, struct IpfsNode* local_node, size_t* bytes_written, int workers) {
+	int retVal = 1;
+	// process this file, one chunk at a time
+	struct ChunkerSpec spec;
+	const char* chunker_string = local_node->repo->config->importer.chunker;
+	if (!ipfs_chunker_spec_parse(chunker_string != NULL ? chunker_string : IPFS_CHUNKER_DEFAULT, &spec)) {
+		fprintf(stderr, "Invalid chunker: %s\n", chunker_string);
 		return 0;
 	}
-	// protobuf the UnixFS
-	size_t protobuf_size = ipfs_unixfs_protobuf_encode_size(new_unixfs);
-	if (protobuf_size == 0) {
-		ipfs_unixfs_free(new_unixfs);
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL)
 		return 0;
-	}
-	unsigned char protobuf[protobuf_size];
-	*bytes_written = 0;
-	if (ipfs_unixfs_protobuf_encode(new_unixfs, protobuf, protobuf_size, bytes_written) == 0) {
-		ipfs_unixfs_free(new_unixfs);
+	unsigned char* buffer = NULL;
+	struct Chunker* chunker = ipfs_chunker_new(&spec, file);
+	struct DagBuilder* builder = ipfs_importer_dag_builder_new(local_node->repo, local_node->repo->config->importer.max_links);
+	if (chunker == NULL || builder == NULL) {
+		fclose(file);
+		ipfs_chunker_free(chunker);
+		ipfs_importer_dag_builder_free(builder);
 		return 0;
 	}
-
-	// we're done with the UnixFS object
-	ipfs_unixfs_free(new_unixfs);
-
-	size_t size_of_node = 0;
-
-	// if there is more to read, create a new node.
-	if (bytes_read == MAX_DATA_SIZE) {
-		// create a new node
-		if (ipfs_hashtable_node_new_from_data(protobuf, *bytes_written, &new_node) == 0) {
-			return 0;
-		}
-		// persist
-		size_t size_of_node = 0;
-		if (ipfs_merkledag_add(new_node, fs_repo, &size_of_node) == 0) {
-			ipfs_hashtable_node_free(new_node);
-			return 0;
-		}
-
-		// put link in parent node
-		if (ipfs_node_link_create(NULL, new_node->hash, new_node->hash_size, &new_link) == 0) {
-			ipfs_hashtable_node_free(new_node);
-			return 0;
-		}
-		new_link->t_size = size_of_node;
-		*total_size += new_link->t_size;
-		// NOTE: disposal of this link object happens when the parent is disposed
-		if (ipfs_hashtable_node_add_link(parent_node, new_link) == 0) {
-			ipfs_hashtable_node_free(new_node);
-			return 0;
-		}
-		ipfs_importer_add_filesize_to_data_section(parent_node, bytes_read);
-		ipfs_hashtable_node_free(new_node);
-		*bytes_written = size_of_node;
-		size_of_node = 0;
+	if (workers > 1 && os_utils_file_size(fileName) > spec.max_size) {
+		// hash and store the chunks on several threads
+		struct ImportPipeline* pipeline = ipfs_import_pipeline_new(builder, workers, spec.max_size);
+		if (pipeline == NULL)
+			retVal = 0;
+		else
+			retVal = ipfs_import_pipeline_read(pipeline, chunker);
+		ipfs_import_pipeline_free(pipeline);
 	} else {
-		// if there are no existing links, put what we pulled from the file into parent_node
-		// otherwise, add it as a link
-		if (parent_node->head_link == NULL) {
-			ipfs_hashtable_node_set_data(parent_node, protobuf, *bytes_written);
-		} else {
-			// there are existing links. put the data in a new node, save it, then put the link in parent_node
-			// create a new node
-			if (ipfs_hashtable_node_new_from_data(protobuf, *bytes_written, &new_node) == 0) {
-				return 0;
-			}
-			// persist
-			if (ipfs_merkledag_add(new_node, fs_repo, &size_of_node) == 0) {
-				ipfs_hashtable_node_free(new_node);
-				return 0;
-			}
-
-			// put link in parent node
-			if (ipfs_node_link_create(NULL, new_node->hash, new_node->hash_size, &new_link) == 0) {
-				ipfs_hashtable_node_free(new_node);
-				return 0;
-			}
-			new_link->t_size = size_of_node;
-			*total_size += new_link->t_size;
-			// NOTE: disposal of this link object happens when the parent is disposed
-			if (ipfs_hashtable_node_add_link(parent_node, new_link) == 0) {
-				ipfs_hashtable_node_free(new_node);
-				return 0;
-			}
-			ipfs_importer_add_filesize_to_data_section(parent_node, bytes_read);
-			ipfs_hashtable_node_free(new_node);
+		buffer = (unsigned char*)malloc(spec.max_size);
+		size_t bytes_read = 0;
+		if (buffer == NULL)
+			retVal = 0;
+		while (retVal && (retVal = ipfs_chunker_next(chunker, buffer, &bytes_read)) && bytes_read > 0) {
+			if (!ipfs_importer_dag_builder_add_leaf(builder, buffer, bytes_read))
+				retVal = 0;
 		}
-		// persist the main node
-		ipfs_merkledag_add(parent_node, fs_repo, bytes_written);
-		*bytes_written += size_of_node;
-	} // add to parent vs add as link
-
-	return bytes_read;
+	}
+	fclose(file);
+	free(buffer);
+	ipfs_chunker_free(chunker);
+	if (retVal)
+		retVal = ipfs_importer_dag_builder_finish(builder, node);
+	*bytes_written += builder->bytes_written;
+	ipfs_importer_dag_builder_free(builder);
+	return retVal;
 }
 
 /**
- * Prints to the console the results of a node import
- * @param node the node imported
- * @param file_name the name of the file
- * @returns true(1) if successful, false(0) if couldn't generate the MultiHash to be displayed
+ * Tell the network that we have a node, and the nodes it links to
+ * @param local_node the context
+ * @param node the node
+ * @returns true(1)
  */
-int ipfs_import_print_node_results(const struct HashtableNode* node, const char* file_name) {
-	// give some results to the user
-	//TODO: if directory_entry is itself a directory, traverse and report files
-	int buffer_len = 100;
-	unsigned char buffer[buffer_len];
-	if (ipfs_cid_hash_to_base58(node->hash, node->hash_size, buffer, buffer_len) == 0) {
-		printf("Unable to generate hash for file %s.\n", file_name);
-		return 0;
+int ipfs_import_provide(struct IpfsNode* local_node, const struct HashtableNode* node) {
+	local_node->routing->Provide(local_node->routing, node->hash, node->hash_size);
+	// notif the network of the subnodes too
+	struct NodeLink *nl = node->head_link;
+	while (nl != NULL) {
+		local_node->routing->Provide(local_node->routing, nl->hash, nl->hash_size);
+		nl = nl->next;
 	}
-	printf("added %s %s\n", buffer, file_name);
 	return 1;
 }
 
-
 /**
  * Creates a node based on an incoming file or directory
- * NOTE: this can be called recursively for directories
  * NOTE: When this function completes, parent_node will be either:
  * 	1) the complete file, in the case of a small file (<256k-ish)
  * 	2) a node with links to the various pieces of a large file
@@ -193,116 +128,17 @@ int ipfs_import_print_node_results(const struct HashtableNode* node, const char*
  * @returns true(1) on success
  */
 int ipfs_import_file(const char* root_dir, const char* fileName, struct HashtableNode** parent_node, struct IpfsNode* local_node, size_t* bytes_written, int recursive) {
-	/**
-	 * NOTE: When this function completes, parent_node will be either:
-	 * 1) the complete file, in the case of a small file (<256k-ish)
-	 * 2) a node with links to the various pieces of a large file
-	 * 3) a node with links to files and directories if 'fileName' is a directory
-	 */
-	int retVal = 1;
-	int bytes_read = MAX_DATA_SIZE;
-	size_t total_size = 0;
+	int workers = local_node->repo->config->importer.workers;
+	if (workers == 0)
+		workers = ipfs_import_pipeline_default_workers();
 
-	if (os_utils_is_directory(fileName)) {
-		// calculate the new root_dir
-		char* new_root_dir = (char*)root_dir;
-		char* path = NULL;
-		char* file = NULL;
-		os_utils_split_filename(fileName, &path, &file);
-		if (root_dir == NULL) {
-			new_root_dir = file;
-		} else {
-			free(path);
-			path = malloc(strlen(root_dir) + strlen(file) + 2);
-			os_utils_filepath_join(root_dir, file, path, strlen(root_dir) + strlen(file) + 2);
-			new_root_dir = path;
-		}
-		// initialize parent_node as a directory
-		if (ipfs_hashtable_node_create_directory(parent_node) == 0) {
-			if (path != NULL)
-				free(path);
-			if (file != NULL)
-				free(file);
-			return 0;
-		}
-		// get list of files
-		struct FileList* first = os_utils_list_directory(fileName);
-		struct FileList* next = first;
-		if (recursive) {
-			while (next != NULL) {
-				// process each file. NOTE: could be an embedded directory
-				*bytes_written = 0;
-				struct HashtableNode* file_node;
-				// put the filename together from fileName, which is the directory, and next->file_name
-				// which is a file (or a directory) within the directory we just found.
-				size_t filename_len = strlen(fileName) + strlen(next->file_name) + 2;
-				char full_file_name[filename_len];
-				os_utils_filepath_join(fileName, next->file_name, full_file_name, filename_len);
-				// adjust root directory
-
-				if (ipfs_import_file(new_root_dir, full_file_name, &file_node, local_node, bytes_written, recursive) == 0) {
-					ipfs_hashtable_node_free(*parent_node);
-					os_utils_free_file_list(first);
-					if (file != NULL)
-						free(file);
-					if (path != NULL)
-						free (path);
-					return 0;
-				}
-				// TODO: probably need to display what was imported
-				int len = strlen(next->file_name) + strlen(new_root_dir) + 2;
-				char full_path[len];
-				os_utils_filepath_join(new_root_dir, next->file_name, full_path, len);
-				ipfs_import_print_node_results(file_node, full_path);
-				// TODO: Determine what needs to be done if this file_node is a file, a split file, or a directory
-				// Create link from file_node
-				struct NodeLink* file_node_link;
-				ipfs_node_link_create(next->file_name, file_node->hash, file_node->hash_size, &file_node_link);
-				file_node_link->t_size = *bytes_written;
-				// add file_node as link to parent_node
-				ipfs_hashtable_node_add_link(*parent_node, file_node_link);
-				// clean up file_node
-				ipfs_hashtable_node_free(file_node);
-				// move to next file in list
-				next = next->next;
-			} // while going through files
-		}
-		// save the parent_node (the directory)
-		size_t bytes_written;
-		ipfs_merkledag_add(*parent_node, local_node->repo, &bytes_written);
-		if (file != NULL)
-			free(file);
-		if (path != NULL)
-			free (path);
-		os_utils_free_file_list(first);
-	} else {
-		// process this file
-		FILE* file = fopen(fileName, "rb");
-		retVal = ipfs_hashtable_node_new(parent_node);
-		if (retVal == 0) {
-			return 0;
-		}
-
-		// add all nodes (will be called multiple times for large files)
-		while ( bytes_read == MAX_DATA_SIZE) {
-			size_t written = 0;
-			bytes_read = ipfs_import_chunk(file, *parent_node, local_node->repo, &total_size, &written);
-			*bytes_written += written;
-		}
-		fclose(file);
-	}
+	if (os_utils_is_directory(fileName))
+		return ipfs_import_directory(root_dir, fileName, parent_node, local_node, bytes_written, recursive, workers);
 
+	if (!ipfs_import_file_contents(fileName, parent_node, local_node, bytes_written, workers))
+		return 0;
 	// notify the network
-	struct HashtableNode *htn = *parent_node;
-	local_node->routing->Provide(local_node->routing, htn->hash, htn->hash_size);
-	// notif the network of the subnodes too
-	struct NodeLink *nl = htn->head_link;
-	while (nl != NULL) {
-		local_node->routing->Provide(local_node->routing, nl->hash, nl->hash_size);
-		nl = nl->next;
-	}
-
-	return 1;
+	return ipfs_import_provide(local_node, *parent_node);
 }
 
 /**
@@ -324,7 +160,8 @@ struct FileList* ipfs_import_get_filelist(int argc, char** argv) {
 		if (strcmp(argv[i], "-r") == 0) {
 			continue;
 		}
-		if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+		if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0
+				|| strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--chunker") == 0) {
 			skipNext = 1;
 			continue;
 		}
@@ -358,6 +195,20 @@ int ipfs_import_is_recursive(int argc, char** argv) {
 	return 0;
 }
 
+/**
+ * See if a chunker was passed on the command line
+ * @param argc number of command line parameters
+ * @param argv command line parameters
+ * @returns the chunker string after -s or --chunker, or NULL if there was none
+ */
+char* ipfs_import_get_chunker(int argc, char** argv) {
+	for(int i = 0; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--chunker") == 0)
+			return argv[i + 1];
+	}
+	return NULL;
+}
+
 /**
  * called from the command line to import multiple files or directories
  * @param argc the number of arguments
@@ -378,6 +229,7 @@ int ipfs_import_files(int argc, char** argv) {
 	char* path = NULL;
 	char* filename = NULL;
 	struct HashtableNode* directory_entry = NULL;
+	int batch_started = 0;
 
 	int recursive = ipfs_import_is_recursive(argc, argv);
 
@@ -390,6 +242,28 @@ int ipfs_import_files(int argc, char** argv) {
 		goto exit;
 	}
 	ipfs_node_online_new(repo_path, &local_node);
+	if (local_node == NULL)
+		goto exit;
+
+	// a chunker on the command line overrides the one in the config, for this import only
+	char* chunker_string = ipfs_import_get_chunker(argc, argv);
+	if (chunker_string != NULL) {
+		struct ChunkerSpec spec;
+		if (!ipfs_chunker_spec_parse(chunker_string, &spec)) {
+			fprintf(stderr, "Invalid chunker: %s\n", chunker_string);
+			goto exit;
+		}
+		char* copy = malloc(strlen(chunker_string) + 1);
+		if (copy == NULL)
+			goto exit;
+		strcpy(copy, chunker_string);
+		free(local_node->repo->config->importer.chunker);
+		local_node->repo->config->importer.chunker = copy;
+	}
+	// commit the datastore records in groups, rather than one at a time
+	if (!ipfs_repo_fsrepo_batch_begin(local_node->repo))
+		goto exit;
+	batch_started = 1;
 
 
 	// import the file(s)
@@ -418,6 +292,10 @@ int ipfs_import_files(int argc, char** argv) {
 
 	retVal = 1;
 	exit:
+	if (batch_started && !ipfs_repo_fsrepo_batch_commit(local_node->repo)) {
+		fprintf(stderr, "Unable to write the index of added blocks\n");
+		retVal = 0;
+	}
 	if (local_node != NULL)
 		ipfs_node_free(local_node);
 	// free file list
@@ -7,11 +7,13 @@
 #define __IPFS_BLOCKS_BLOCK_H__
 
 #include "ipfs/cid/cid.h"
+#include "ipfs/blocks/block_view.h"
 
 struct Block {
 	struct Cid* cid;
 	unsigned char* data;
 	size_t data_length;
+	struct BlockView* view; // what data points into, released with the block (NULL if the block has its own copy)
 };
 
 /***
@@ -55,6 +57,17 @@ int ipfs_blocks_block_protobuf_encode(const struct Block* block, unsigned char*
  */
 int ipfs_blocks_block_protobuf_decode(const unsigned char* buffer, const size_t buffer_length, struct Block** block);
 
+/***
+ * Decode from a protobuf stream into a Block struct, with the data of the block
+ * pointing into the buffer rather than copied
+ * NOTE: the buffer must outlive the block. Set the view of the block to free them together.
+ * @param buffer the buffer to pull from
+ * @param buffer_length the length of the buffer
+ * @param block the block to fill
+ * @returns true(1) on success
+ */
+int ipfs_blocks_block_protobuf_decode_view(const unsigned char* buffer, const size_t buffer_length, struct Block** block);
+
 /***
  * Make a copy of a block
  * @param original the original
@@ -0,0 +1,113 @@
+#pragma once
+/***
+ * Keeps the bytes of recently read blocks in memory, so blocks that are read
+ * again and again (the roots of DAGs, directories) do not go to the disk.
+ *
+ * The cache is split into BLOCK_CACHE_SHARDS shards, each with its own lock
+ * and an equal part of the bytes. Each shard uses 2Q: a block read for the
+ * first time goes into a short FIFO, and only a block read again after it was
+ * pushed out of there goes into the LRU that holds most of the bytes. To know
+ * that, a shard remembers the keys (but not the bytes) of as many blocks pushed
+ * out of the FIFO as it holds. Reading a large file once therefore does not push
+ * out the blocks that are used all the time.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the number of shards (a power of 2)
+#define BLOCK_CACHE_SHARDS 16
+// the part of the bytes of a shard given to blocks seen once, in percent
+#define BLOCK_CACHE_FIFO_PERCENT 25
+
+struct BlockCacheEntry;
+
+/***
+ * A list of entries, the newest first
+ */
+struct BlockCacheList {
+	struct BlockCacheEntry* head;
+	struct BlockCacheEntry* tail;
+	size_t bytes; // the bytes of the blocks in the list
+	size_t count;
+};
+
+struct BlockCacheShard {
+	pthread_mutex_t lock;
+	struct BlockCacheEntry** buckets;
+	size_t bucket_count; // a power of 2
+	size_t entry_count; // all the entries, including the ghosts
+	size_t max_bytes;
+	struct BlockCacheList fifo; // read once
+	struct BlockCacheList lru; // read again after leaving the fifo
+	struct BlockCacheList ghosts; // keys of blocks pushed out of the fifo (no data)
+	unsigned long long hits;
+	unsigned long long misses;
+};
+
+struct BlockCache {
+	size_t max_bytes;
+	struct BlockCacheShard shards[BLOCK_CACHE_SHARDS];
+};
+
+/***
+ * Create a new BlockCache
+ * @param max_bytes the most bytes of blocks to keep (more than 0)
+ * @returns the BlockCache, or NULL on error
+ */
+struct BlockCache* ipfs_block_cache_new(size_t max_bytes);
+
+/***
+ * Free the resources of a BlockCache
+ * @param cache the BlockCache
+ * @returns true(1)
+ */
+int ipfs_block_cache_free(struct BlockCache* cache);
+
+/***
+ * Get a copy of the bytes of a block
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @param bytes where to put the copy
+ * @param bytes_size the number of bytes
+ * @returns true(1) if the block was in the cache
+ */
+int ipfs_block_cache_get(struct BlockCache* cache, const char* key, unsigned char** bytes, size_t* bytes_size);
+
+/***
+ * Find out if the bytes of a block are in the cache, without counting it as a read
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @returns true(1) if the block is in the cache
+ */
+int ipfs_block_cache_has(struct BlockCache* cache, const char* key);
+
+/***
+ * Keep the bytes of a block that was read from the disk
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @param bytes the bytes (they are copied)
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success, false(0) if the block is too big to keep
+ */
+int ipfs_block_cache_put(struct BlockCache* cache, const char* key, const unsigned char* bytes, size_t bytes_size);
+
+/***
+ * Forget a block
+ * @param cache the BlockCache
+ * @param key the key of the block (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_block_cache_remove(struct BlockCache* cache, const char* key);
+
+/***
+ * How well the cache is doing
+ * @param cache the BlockCache
+ * @param hits the reads that were in the cache
+ * @param misses the reads that were not
+ * @param bytes the bytes of blocks in the cache (can be NULL)
+ * @returns true(1)
+ */
+int ipfs_block_cache_stats(struct BlockCache* cache, unsigned long long* hits, unsigned long long* misses, size_t* bytes);
@@ -0,0 +1,49 @@
+#pragma once
+/***
+ * The bytes of a block as they are on the disk, without copying them where that
+ * is cheaper.
+ *
+ * Blocks of BLOCK_VIEW_MAP_MIN bytes or more are mapped into memory. Reading
+ * them then costs no copy, and the pages come from the page cache. Smaller blocks
+ * are read into memory, as mapping them costs more than reading them.
+ * Either way, the view must be released when it is no longer needed.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the smallest block that is mapped rather than read
+#define BLOCK_VIEW_MAP_MIN (64 * 1024)
+
+struct BlockView {
+	unsigned char* data; // the bytes of the block (read only if they are mapped)
+	size_t size;
+	void* mapping; // what was mapped, or NULL if data was read into memory
+	size_t mapping_size;
+};
+
+/***
+ * Look at part of a file. It is mapped if it is large enough, otherwise read.
+ * @param fd the file
+ * @param offset where the block starts in the file
+ * @param size the size of the block
+ * @param view where to put the results
+ * @returns true(1) on success. Only call ipfs_block_view_release on success.
+ */
+int ipfs_block_view_load(int fd, uint64_t offset, size_t size, struct BlockView* view);
+
+/***
+ * Look at bytes that were already read into memory
+ * @param bytes the bytes. The view now owns them, and they are freed on release
+ * @param size the number of bytes
+ * @param view where to put the results
+ * @returns true(1)
+ */
+int ipfs_block_view_take(unsigned char* bytes, size_t size, struct BlockView* view);
+
+/***
+ * Release a view. The data is no longer valid after this.
+ * @param view the view
+ * @returns true(1)
+ */
+int ipfs_block_view_release(struct BlockView* view);
@@ -6,6 +6,7 @@
 #define __IPFS_BLOCKS_BLOCKSTORE_H__
 
 #include "ipfs/cid/cid.h"
+#include "ipfs/blocks/block_view.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
 
 struct BlockstoreContext {
@@ -20,6 +21,10 @@ struct Blockstore {
 	 * Retrieve a block from the blockstore
 	 */
 	int (*Get)(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block);
+	/**
+	 * Retrieve a block, with its data pointing into the file where that saves a copy
+	 */
+	int (*GetView)(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block);
 	int (*Put)(const struct BlockstoreContext* context, struct Block* block);
 };
 
@@ -53,6 +58,64 @@ int ipfs_blockstore_delete(const struct BlockstoreContext* context, struct Cid*
  */
 int ipfs_blockstore_has(const struct BlockstoreContext* context, struct Cid* cid);
 
+/***
+ * Turn a hash into the key of its file in the blockstore
+ * NOTE: This allocates memory that must be freed
+ * @param hash the hash
+ * @param hash_length the length of the hash
+ * @returns the key (base32 multihash), or NULL on error
+ */
+unsigned char* ipfs_blockstore_hash_to_base32(const unsigned char* hash, size_t hash_length);
+
+/***
+ * Get the full path of a file in the blockstore, taking the shard function into account
+ * NOTE: This allocates memory that must be freed
+ * @param fs_repo the repo
+ * @param filename the key (base32 multihash)
+ * @returns the full path, or NULL on error
+ */
+char* ipfs_blockstore_path_get(const struct FSRepo* fs_repo, const char* filename);
+
+/***
+ * Get the full path of a file in the blockstore, creating its shard directory if needed
+ * NOTE: This allocates memory that must be freed
+ * @param fs_repo the repo
+ * @param filename the key (base32 multihash)
+ * @returns the full path, or NULL on error
+ */
+char* ipfs_blockstore_path_create(const struct FSRepo* fs_repo, const char* filename);
+
+/***
+ * Write bytes to the file of a key in the blockstore
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param bytes the bytes to write
+ * @param bytes_size the number of bytes
+ * @param bytes_written the number of bytes written (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_write_file(const struct FSRepo* fs_repo, const char* key, const unsigned char* bytes, size_t bytes_size, size_t* bytes_written);
+
+/***
+ * Read the file of a key in the blockstore
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param bytes where to put the contents
+ * @param bytes_size the number of bytes read
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_read_file(const struct FSRepo* fs_repo, const char* key, unsigned char** bytes, size_t* bytes_size);
+
+/***
+ * Look at the file of a key in the blockstore. Large blocks are not copied.
+ * @param fs_repo the repo
+ * @param key the key (base32 multihash)
+ * @param view where to put the results
+ * @returns true(1) on success. Only call ipfs_block_view_release on success.
+ */
+int ipfs_blockstore_read_view(const struct FSRepo* fs_repo, const char* key, struct BlockView* view);
+
 /***
  * Find a block based on its Cid
  * @param context the context
@@ -62,6 +125,16 @@ int ipfs_blockstore_has(const struct BlockstoreContext* context, struct Cid* cid
  */
 int ipfs_blockstore_get(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block);
 
+/***
+ * Find a block based on its Cid, with its data in a view of the file rather than
+ * copied. Large blocks are mapped. Free it with ipfs_block_free, as usual.
+ * @param context the context
+ * @param cid the Cid to look for
+ * @param block where to put the block
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_get_view(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block);
+
 /***
  * Put a block in the blockstore
  * @param block the block to store
@@ -94,4 +167,16 @@ int ipfs_blockstore_get_unixfs(const unsigned char* hash, size_t hash_length, st
 int ipfs_blockstore_put_node(const struct HashtableNode* node, const struct FSRepo* fs_repo, size_t* bytes_written);
 int ipfs_blockstore_get_node(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, const struct FSRepo* fs_repo);
 
+/***
+ * Find a node based on its hash, with its data pointing into the block rather than copied
+ * NOTE: free the node with ipfs_hashtable_node_view_free, then release the view
+ * @param hash the hash to look for
+ * @param hash_length the length of the hash
+ * @param node where to put the node
+ * @param view where to put the block the node points into
+ * @param fs_repo where to look for the data
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_get_node_view(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, struct BlockView* view, const struct FSRepo* fs_repo);
+
 #endif
@@ -0,0 +1,152 @@
+#pragma once
+/***
+ * A counting Bloom filter of the keys in the blockstore, so asking for a block
+ * that is not there does not go to the disk.
+ *
+ * It is built from the blockstore directory when the repo is opened, kept up to
+ * date as blocks are written and deleted, and saved to BLOCKSTORE_FILTER_FILENAME
+ * when the repo is freed, so the next open does not have to list every file.
+ * The saved filter is removed once it is read. If the process dies, it is
+ * rebuilt on the next open rather than trusted.
+ *
+ * Each process has a filter of its own. So it learns what other processes write,
+ * every process appends the keys it writes to BLOCKSTORE_FILTER_LOG_FILENAME, and a
+ * key a filter does not have is only taken to be missing once the keys added to the
+ * log since it was last read are in the filter. The first process to open the repo
+ * empties the log. Once another process has had the repo open (ipfs_repo_fsrepo_shared),
+ * the filter is not saved, and what it deletes stays in it, as the filter may not
+ * have had it.
+ *
+ * Its size comes from Datastore.BloomFilterSize, in bytes (one byte per
+ * counter). 0 means BLOCKSTORE_FILTER_DEFAULT_SIZE, and less than 0 turns it off.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// the counters set for each key
+#define BLOCKSTORE_FILTER_PROBES 4
+// enough for about 400,000 blocks with 1 in 100 false positives
+#define BLOCKSTORE_FILTER_DEFAULT_SIZE (4 * 1024 * 1024)
+// where the filter is kept, in the repo directory
+#define BLOCKSTORE_FILTER_FILENAME "blockstore.filter"
+// the keys each process wrote while the repo was open, one to a line, in the repo directory
+#define BLOCKSTORE_FILTER_LOG_FILENAME "blockstore.filter.log"
+
+struct BlockstoreFilter {
+	pthread_mutex_t lock;
+	unsigned char* counters; // 255 means it is stuck, and is never taken down
+	size_t size; // the number of counters (a power of 2)
+	pthread_mutex_t log_lock;
+	int log_fd; // BLOCKSTORE_FILTER_LOG_FILENAME (or -1)
+	off_t log_offset; // how much of the log is in the filter
+};
+
+/***
+ * Create a new, empty BlockstoreFilter
+ * @param size the number of counters (rounded up to a power of 2)
+ * @returns the BlockstoreFilter, or NULL on error
+ */
+struct BlockstoreFilter* ipfs_blockstore_filter_new(size_t size);
+
+/***
+ * Free the resources of a BlockstoreFilter
+ * @param filter the BlockstoreFilter
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_free(struct BlockstoreFilter* filter);
+
+/***
+ * Record that a key is in the blockstore
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_add(struct BlockstoreFilter* filter, const char* key);
+
+/***
+ * Record that a key is no longer in the blockstore
+ * NOTE: only call this for keys that were added, or keys that are there could be missed
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_remove(struct BlockstoreFilter* filter, const char* key);
+
+/***
+ * Find out if a key may be in the blockstore
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it may be there, false(0) if it is certainly not
+ */
+int ipfs_blockstore_filter_contains(struct BlockstoreFilter* filter, const char* key);
+
+/***
+ * Open the log of the keys every process writes. What is in it already is taken to be
+ * in the blockstore, so open it before the filter is filled.
+ * @param filter the BlockstoreFilter
+ * @param filename the log
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_open(struct BlockstoreFilter* filter, const char* filename);
+
+/***
+ * Empty the log
+ * NOTE: only call this when no other process has the repo open
+ * @param filter the BlockstoreFilter
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_reset(struct BlockstoreFilter* filter);
+
+/***
+ * Tell the other processes about a key that was written
+ * NOTE: call this once the block is in the blockstore, so a process that lists the
+ * blockstore after it read the log does not miss it
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_log_add(struct BlockstoreFilter* filter, const char* key);
+
+/***
+ * Find out if a key may be in the blockstore, reading what other processes wrote if the
+ * filter does not have it
+ * @param filter the BlockstoreFilter
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it may be there, false(0) if it is certainly not
+ */
+int ipfs_blockstore_filter_contains_logged(struct BlockstoreFilter* filter, const char* key);
+
+/***
+ * Add a key. Can be given to a walk of the keys of a store.
+ * @param key the key
+ * @param arg the BlockstoreFilter
+ * @returns true(1)
+ */
+int ipfs_blockstore_filter_fill_key(const char* key, void* arg);
+
+/***
+ * Add every key in a blockstore directory
+ * @param filter the BlockstoreFilter
+ * @param blockstore_path the blockstore directory
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_fill(struct BlockstoreFilter* filter, const char* blockstore_path);
+
+/***
+ * Read a saved filter into this one, adding up the counters. Only a filter of the same size can be read.
+ * @param filter the BlockstoreFilter
+ * @param filename the file
+ * @returns true(1) if it was read
+ */
+int ipfs_blockstore_filter_load(struct BlockstoreFilter* filter, const char* filename);
+
+/***
+ * Save a filter. If another process saved its filter there since this one was read,
+ * the keys of both are kept.
+ * @param filter the BlockstoreFilter
+ * @param filename the file
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_filter_save(struct BlockstoreFilter* filter, const char* filename);
@@ -0,0 +1,89 @@
+#pragma once
+/***
+ * Makes blockstore files durable, a group of writers at a time.
+ *
+ * A block is written to a temporary file beside its final name, synced, then renamed
+ * over the final name, and the directory is synced. A crash leaves either the old file
+ * or the complete new one, never part of one.
+ *
+ * Syncing every block on its own would cost an fsync per block. Instead, writers join
+ * a queue, and whoever finds nobody syncing leads the next batch: it syncs every file
+ * in the queue, renames them all, then syncs each directory once, while the next
+ * batch gathers behind it. On Linux 5.8 and later, a batch of BLOCKSTORE_SYNC_SYNCFS_MIN
+ * files or more syncs the whole filesystem once instead of each file. Earlier kernels
+ * do not report a file that failed to write from syncfs, so each file is synced there.
+ *
+ * Blocks appended to a pack segment join the same batches with ipfs_blockstore_sync_data.
+ * There is nothing to rename, and a segment that many writers appended to is synced once.
+ */
+
+#include <pthread.h>
+
+// a batch this large is cheaper to sync as a whole filesystem than file by file
+#define BLOCKSTORE_SYNC_SYNCFS_MIN 8
+
+struct BlockstoreSyncEntry {
+	int fd; // the temporary file, still open
+	const char* temporary; // NULL if the file stays open and is only synced
+	const char* filename;
+	int done;
+	int result;
+	struct BlockstoreSyncEntry* next;
+};
+
+struct BlockstoreSync {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	struct BlockstoreSyncEntry* first; // waiting for the next batch
+	struct BlockstoreSyncEntry* last;
+	int syncing; // a batch is being synced
+	int no_sync; // rename, but do not wait for the disk (Datastore.NoSync)
+	int use_syncfs; // syncfs reports write errors, so large batches can use it
+	unsigned long long batches;
+	unsigned long long files;
+	unsigned long long syncs;
+};
+
+/***
+ * Create a new BlockstoreSync
+ * @param no_sync true(1) to skip syncing, so files are only renamed
+ * @returns the struct, or NULL on error
+ */
+struct BlockstoreSync* ipfs_blockstore_sync_new(int no_sync);
+
+/***
+ * Free a BlockstoreSync. Nothing may be committing.
+ * @param sync the struct
+ * @returns true(1)
+ */
+int ipfs_blockstore_sync_free(struct BlockstoreSync* sync);
+
+/***
+ * Make a written temporary file durable under its final name. This waits until the
+ * batch it joins is on the disk.
+ * @param sync the BlockstoreSync (NULL to rename without syncing)
+ * @param fd the temporary file. It is closed, whatever happens.
+ * @param temporary the name of the temporary file. It is removed if anything fails.
+ * @param filename the final name
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_sync_commit(struct BlockstoreSync* sync, int fd, const char* temporary, const char* filename);
+
+/***
+ * Make what was appended to a file that stays open durable. This waits until the batch
+ * it joins is on the disk, and the file is synced once for the whole batch.
+ * @param sync the BlockstoreSync (NULL to not wait)
+ * @param fd the file. It stays open.
+ * @returns true(1) on success
+ */
+int ipfs_blockstore_sync_data(struct BlockstoreSync* sync, int fd);
+
+/***
+ * How much batching there has been
+ * @param sync the struct
+ * @param batches the number of batches (can be NULL)
+ * @param files the number of files committed (can be NULL)
+ * @param syncs the number of fsync or syncfs calls (can be NULL)
+ * @returns true(1)
+ */
+int ipfs_blockstore_sync_stats(struct BlockstoreSync* sync, unsigned long long* batches, unsigned long long* files, unsigned long long* syncs);
@@ -0,0 +1,187 @@
+#pragma once
+/***
+ * A blockstore that appends blocks to a few large files instead of writing a file
+ * for each block, so small blocks do not each take an inode and a filesystem block.
+ *
+ * The blocks are appended to segments named "00000000.pack", "00000001.pack"...
+ * in PACK_STORE_DIRECTORY of the repo. When a segment reaches its size, it is
+ * sealed and a new one is started. Each record is
+ *
+ *   key length (uint32) | data length (uint32) | key | data
+ *
+ * in little-endian order. A data length of PACK_STORE_TOMBSTONE records a delete.
+ *
+ * Where the newest record of each key is kept is in an LMDB database in the
+ * "index" directory, opened with lmdb_datastore. Index changes are kept in memory
+ * and written PACK_STORE_PENDING_MAX at a time, once they are PACK_STORE_PENDING_SECONDS
+ * old, or when a segment is sealed or the store is closed. Until then, other
+ * processes do not see them. With them goes how far each segment is indexed. If the
+ * process dies before that, they are rebuilt from there in each segment when the store
+ * is opened again.
+ *
+ * A put returns once its record is on the disk. The writers that append at the same time
+ * share one fdatasync of the segment through the BlockstoreSync of the repo.
+ *
+ * Records that were replaced or deleted are dead space. ipfs_pack_store_compact
+ * copies what is still used out of the segments that are mostly dead, and removes them.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "libp2p/db/datastore.h"
+#include "ipfs/blocks/block_view.h"
+#include "ipfs/blocks/blockstore_sync.h"
+
+// where the segments are, in the repo directory
+#define PACK_STORE_DIRECTORY "packs"
+// the size at which a segment is sealed
+#define PACK_STORE_SEGMENT_BYTES (256 * 1024 * 1024)
+// segments with at least this much dead space are compacted, in percent
+#define PACK_STORE_COMPACT_PERCENT 50
+// the data length of a delete
+#define PACK_STORE_TOMBSTONE 0xffffffff
+// the most index changes kept in memory
+#define PACK_STORE_PENDING_MAX 1024
+// the longest index changes are kept in memory, so other processes see them
+#define PACK_STORE_PENDING_SECONDS 1
+// the buckets of the index changes kept in memory (a power of 2)
+#define PACK_STORE_PENDING_BUCKETS 256
+
+struct PackSegment {
+	int fd; // -1 if there is no such segment
+	uint64_t size;
+	uint64_t live_bytes; // the bytes of the records the index points at
+	uint64_t indexed; // the records before this offset are in the index
+	uint64_t appended; // where the records this process appended or read again end
+	int shared; // another process appended to it, so this one cannot tell how far it is indexed
+};
+
+/***
+ * Where the newest record of a key is
+ */
+struct PackLocation {
+	uint32_t segment;
+	uint32_t data_length;
+	uint64_t offset; // of the start of the record
+};
+
+/***
+ * An index change that is not yet in the index
+ */
+struct PackPending {
+	char* key;
+	int deleted; // true(1) if the key was deleted
+	struct PackLocation location;
+	struct PackPending* next;
+};
+
+struct PackStore {
+	char* path;
+	struct Datastore* index;
+	pthread_mutex_t write_lock; // one append, seal or compaction at a time
+	pthread_rwlock_t segments_lock; // readers of segments, against sealing and compaction
+	struct PackSegment* segments; // by number
+	uint32_t segment_count;
+	uint32_t current; // the segment being appended to
+	uint64_t segment_bytes;
+	pthread_mutex_t pending_lock;
+	struct PackPending* pending[PACK_STORE_PENDING_BUCKETS];
+	size_t pending_count;
+	time_t pending_since;
+	pthread_t flusher; // writes the index changes that waited too long
+	pthread_cond_t flusher_wake; // with the write lock, when the store is closing
+	int flusher_started;
+	int closing;
+	struct BlockstoreSync* sync; // a put waits until its record is on the disk (NULL to not wait)
+};
+
+/***
+ * Open a pack store, creating it if needed
+ * @param repo_path the repo directory
+ * @param segment_bytes the size at which a segment is sealed (0 for PACK_STORE_SEGMENT_BYTES)
+ * @param store where to put the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_open(const char* repo_path, uint64_t segment_bytes, struct PackStore** store);
+
+/***
+ * Write what is pending to the index, and free the resources of a PackStore
+ * @param store the PackStore
+ * @returns true(1) if everything was written
+ */
+int ipfs_pack_store_close(struct PackStore* store);
+
+/***
+ * Write the index changes kept in memory
+ * @param store the PackStore
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_flush(struct PackStore* store);
+
+/***
+ * Append a block. A block that is already there is replaced.
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param bytes the bytes of the block
+ * @param bytes_size the number of bytes
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_put(struct PackStore* store, const char* key, const unsigned char* bytes, size_t bytes_size);
+
+/***
+ * Read a block
+ * NOTE: This allocates memory for bytes that must be freed
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param bytes where to put the bytes
+ * @param bytes_size the number of bytes
+ * @returns true(1) if the block was found
+ */
+int ipfs_pack_store_get(struct PackStore* store, const char* key, unsigned char** bytes, size_t* bytes_size);
+
+/***
+ * Look at a block in its segment, without copying it if it is large
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @param view where to put the results
+ * @returns true(1) if the block was found. Only call ipfs_block_view_release if it was.
+ */
+int ipfs_pack_store_get_view(struct PackStore* store, const char* key, struct BlockView* view);
+
+/***
+ * Find out if a block is there
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it is
+ */
+int ipfs_pack_store_has(struct PackStore* store, const char* key);
+
+/***
+ * Delete a block
+ * @param store the PackStore
+ * @param key the key (base32 multihash)
+ * @returns true(1) if it was there and was deleted
+ */
+int ipfs_pack_store_delete(struct PackStore* store, const char* key);
+
+/***
+ * Call a function with the key of each block
+ * @param store the PackStore
+ * @param func the function. Returning false(0) stops the walk
+ * @param arg passed to func
+ * @returns true(1) if every key was walked
+ */
+int ipfs_pack_store_walk(struct PackStore* store, int (*func)(const char* key, void* arg), void* arg);
+
+/***
+ * Copy the blocks that are still used out of the sealed segments with at least
+ * percent of dead space, and remove those segments
+ * @param store the PackStore
+ * @param percent the least dead space of a segment to compact, in percent
+ * @param bytes_freed the bytes of the removed segments (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_pack_store_compact(struct PackStore* store, int percent, uint64_t* bytes_freed);
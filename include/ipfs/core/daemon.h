@@ -2,10 +2,13 @@
 #define DAEMON_H
 
 #include <stdint.h>
+#include <time.h>
 #include "ipfs/core/ipfs_node.h"
+#include "ipfs/util/thread_pool.h"
 
 #define MAX 5
-#define CONNECTIONS 50
+// the most connections the listener keeps. Idle ones do not use a thread.
+#define CONNECTIONS 4096
 
 struct null_connection_params {
 	int file_descriptor;
@@ -13,6 +16,14 @@ struct null_connection_params {
 	char* ip;
 	int port;
 	struct IpfsNode* local_node;
+	struct SessionContext* session; // once multistream is negotiated
+	int epoll_descriptor; // where the listener watches the connection
+	time_t last_read; // when they last sent something, so a connection that stays quiet can be closed
+	int busy; // a worker has the connection, so it is not watched
+	time_t job_started; // when a worker started on it, so one that takes too long can be cut off (0 if no worker is on it)
+	threadpool thpool; // the workers, so a connection with more to read can be handed back to them
+	struct null_connection_params* prior; // the other open connections
+	struct null_connection_params* next;
 };
 
 struct null_listen_params {
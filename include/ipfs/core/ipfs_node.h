@@ -1,5 +1,7 @@
 #pragma once
 
+#include <pthread.h>
+
 #include "libp2p/peer/peerstore.h"
 #include "libp2p/peer/providerstore.h"
 #include "ipfs/blocks/blockstore.h"
@@ -7,6 +9,7 @@
 #include "ipfs/repo/config/identity.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
 #include "ipfs/routing/routing.h"
+#include "ipfs/util/thread_pool.h"
 
 enum NodeMode { MODE_OFFLINE, MODE_ONLINE };
 
@@ -20,6 +23,9 @@ struct IpfsNode {
 	struct Blockstore* blockstore;
 	struct Exchange* exchange;
 	struct Libp2pVector* protocol_handlers;
+	threadpool export_pool; // fetches blocks ahead of the exporter (NULL until something is exported)
+	pthread_mutex_t export_pool_lock;
+	pthread_mutex_t routing_lock; // the routing is not thread safe, so the export pool takes turns with it
 	//struct Pinner pinning; // an interface
 	//struct Mount** mounts;
 	// TODO: Add more here
@@ -32,6 +38,15 @@ struct IpfsNode {
  * @returns true(1) on success
  */
 int ipfs_node_online_new(const char* repo_path, struct IpfsNode** node);
+
+/***
+ * Get the pool that fetches blocks for the exporter, starting it the first time
+ * @param node the node
+ * @param num_threads the number of threads, if the pool has to be started
+ * @returns the pool, or NULL on error
+ */
+threadpool ipfs_node_export_pool(struct IpfsNode* node, int num_threads);
+
 /***
  * Free resources from the creation of an IpfsNode
  * @param node the node to free
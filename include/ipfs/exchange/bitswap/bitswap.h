@@ -19,6 +19,7 @@ struct BitswapContext {
 	struct WantListQueue* localWantlist;
 	struct PeerRequestQueue* peerRequestQueue;
 	struct BitswapEngine* bitswap_engine;
+	struct BitswapVerifier* verifier; // checks the blocks that arrive
 };
 
 /**
@@ -54,6 +55,15 @@ int ipfs_bitswap_close(struct Exchange* exchange);
  */
 int ipfs_bitswap_has_block(struct Exchange* exchange, struct Block* block);
 
+/***
+ * Handle a block that arrived: store it, and hand it to whoever wanted it
+ * @param context the BitswapContext
+ * @param block the block (this takes it)
+ * @param from the peer that sent it, or NULL
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_receive_block(struct BitswapContext* context, struct Block* block, struct Libp2pPeer* from);
+
 /**
  * Retrieve a block from the BitswapNetwork
  * Note: This may pull the file from the local blockstore.
@@ -72,7 +82,36 @@ int ipfs_bitswap_get_block(struct Exchange* exchange, struct Cid* cid, struct Bl
  *
  * @param exchangeContext a pointer to a BitswapContext
  * @param cids a collection of Cid structs
- * @param blocks a collection that contains the results.
+ * @param blocks a collection that contains the results, in the order they arrived.
  * @param true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_get_blocks(struct Exchange* exchange, struct Libp2pVector* cids, struct Libp2pVector** blocks);
+
+/***
+ * Retrieve a collection of blocks from the BitswapNetwork, handing each one over as it arrives.
+ * All of the Cids are wanted at once, so each peer is asked for them in one message.
+ * Note: This gives up when no block has arrived for Bitswap.TimeoutSeconds in the config.
+ *
+ * @param exchange the exchange
+ * @param session a BitswapSession from ipfs_bitswap_new_session, or NULL
+ * @param cids a collection of Cid structs
+ * @param block_received called with each block. It owns the block, and returns false(0) to stop.
+ * @param arg passed to block_received
+ * @returns true(1) if all blocks were found, false(0) otherwise
+ */
+int ipfs_bitswap_get_blocks_stream(struct Exchange* exchange, void* session, struct Libp2pVector* cids, int (*block_received)(struct Block* block, void* arg), void* arg);
+
+/***
+ * Start a BitswapSession, for blocks that are retrieved together
+ * @param exchange the exchange
+ * @returns the BitswapSession, or NULL on error
+ */
+void* ipfs_bitswap_new_session(struct Exchange* exchange);
+
+/***
+ * End a BitswapSession
+ * @param exchange the exchange
+ * @param session the BitswapSession
+ * @returns true(1)
+ */
+int ipfs_bitswap_close_session(struct Exchange* exchange, void* session);
@@ -5,10 +5,24 @@
 
 struct BitswapContext;
 
+// how long to wait before asking again for a block that nobody could be asked for
+#define BITSWAP_WANTLIST_RETRY_MILLISECONDS 1000
+// the most wants to look for before sending the messages to the peers
+#define BITSWAP_WANTLIST_BATCH_SIZE 256
+// how soon to look at the network again after something happened. With nothing happening,
+// the wait doubles up to Bitswap.PollMilliseconds.
+#define BITSWAP_ENGINE_POLL_MIN_MILLISECONDS 10
+
 struct BitswapEngine {
 	int shutting_down;
 	pthread_t wantlist_processor_thread;
 	pthread_t peer_request_processor_thread;
+	// the threads sleep until they are told there is something to do
+	pthread_mutex_t lock;
+	pthread_cond_t wantlist_changed;
+	pthread_cond_t peer_requests_changed;
+	unsigned long wantlist_version; // incremented for each change, so a change is not missed while the thread is busy
+	unsigned long peer_requests_version;
 };
 
 /***
@@ -24,6 +38,18 @@ struct BitswapEngine* ipfs_bitswap_engine_new();
  */
 int ipfs_bitswap_engine_free(struct BitswapEngine* engine);
 
+/***
+ * Wake the thread that processes the local wantlist
+ * @param engine the engine
+ */
+void ipfs_bitswap_engine_wantlist_changed(struct BitswapEngine* engine);
+
+/***
+ * Wake the thread that processes the requests to and from peers
+ * @param engine the engine
+ */
+void ipfs_bitswap_engine_peer_requests_changed(struct BitswapEngine* engine);
+
 /**
  * Starts the bitswap engine that processes queue items. There
  * should only be one of these per ipfs instance.
@@ -0,0 +1,54 @@
+#pragma once
+/***
+ * A BitswapLedger keeps track of what was exchanged with a peer. Peers that
+ * send us about as much as we send them get a bigger share of what we serve
+ * than peers that only take.
+ */
+
+// the bytes a peer of weight 1 may be sent each round
+#define BITSWAP_LEDGER_QUANTUM_BYTES 262144
+// the weight of a peer that is not in debt
+#define BITSWAP_LEDGER_MAX_WEIGHT 4
+
+struct BitswapLedger {
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned long blocks_sent;
+	unsigned long blocks_received;
+};
+
+/***
+ * Set all the counters of a ledger to 0
+ * @param ledger the ledger
+ */
+void ipfs_bitswap_ledger_init(struct BitswapLedger* ledger);
+
+/***
+ * Record blocks that were sent to the peer
+ * @param ledger the ledger
+ * @param blocks the number of blocks
+ * @param bytes the size of the blocks
+ */
+void ipfs_bitswap_ledger_sent(struct BitswapLedger* ledger, unsigned long blocks, unsigned long long bytes);
+
+/***
+ * Record blocks that the peer sent us
+ * @param ledger the ledger
+ * @param blocks the number of blocks
+ * @param bytes the size of the blocks
+ */
+void ipfs_bitswap_ledger_received(struct BitswapLedger* ledger, unsigned long blocks, unsigned long long bytes);
+
+/***
+ * How much more we sent the peer than it sent us
+ * @param ledger the ledger
+ * @returns the bytes sent divided by the bytes received (plus one)
+ */
+double ipfs_bitswap_ledger_debt_ratio(const struct BitswapLedger* ledger);
+
+/***
+ * The share of a round the peer gets
+ * @param ledger the ledger
+ * @returns from 1 (a peer deep in debt) to BITSWAP_LEDGER_MAX_WEIGHT
+ */
+int ipfs_bitswap_ledger_weight(const struct BitswapLedger* ledger);
@@ -182,6 +182,13 @@ int ipfs_bitswap_message_free(struct BitswapMessage* message);
  */
 size_t ipfs_bitswap_message_protobuf_encode_size(const struct BitswapMessage* message);
 
+/***
+ * The number of bytes a Block takes as a payload entry of a BitswapMessage
+ * @param block the block
+ * @returns the number of bytes it is encoded in
+ */
+size_t ipfs_bitswap_message_payload_encode_size(const struct Block* block);
+
 /***
  * Encode a BitswapMessage into a protobuf buffer
  * @param message the message to encode
@@ -213,6 +220,7 @@ int ipfs_bitswap_message_add_wantlist_items(struct BitswapMessage* message, stru
  * Add the blocks to the BitswapMessage
  * @param message the message
  * @param blocks the requested blocks
+ * @param cids_they_want the CidEntries to cancel the blocks in (can be NULL)
  * @returns true(1) on success, false(0) otherwise
  */
 int ipfs_bitswap_message_add_blocks(struct BitswapMessage* message, struct Libp2pVector* blocks, struct Libp2pVector* cids_they_want);
@@ -7,38 +7,80 @@
 #include <pthread.h>
 #include "libp2p/peer/peer.h"
 #include "ipfs/exchange/bitswap/bitswap.h"
+#include "ipfs/exchange/bitswap/ledger.h"
 #include "ipfs/blocks/block.h"
 
+// the number of separately locked parts of the index of peers
+#define BITSWAP_PEER_REQUEST_QUEUE_STRIPES 16
+// how many cancelled entries cids_they_want keeps before they are cleaned out
+#define BITSWAP_PEER_REQUEST_MAX_CANCELLED 64
+// the size a message to a peer is filled to before it is sent
+#define BITSWAP_MESSAGE_TARGET_SIZE (1024 * 1024)
+// the longest a message waits for more of their blocks before it is sent anyway
+#define BITSWAP_MESSAGE_FLUSH_MILLISECONDS 20
+
 struct CidEntry {
 	struct Cid* cid;
 	int cancel;
 	int cancel_has_been_sent;
 	int request_has_been_sent;
+	int not_here; // they want it, but we did not have it when we looked
+	struct CidEntry* next_in_bucket; // the next entry in the same bucket of the index
 };
 
 struct PeerRequest {
+	// protects the collections, the ledger and the deficit. It is not held while the
+	// blockstore or the network is used.
 	pthread_mutex_t request_mutex;
+	// held for a whole turn, so the messages to the peer go out one at a time, in order
+	pthread_mutex_t turn_mutex;
 	struct Libp2pPeer* peer;
-	// CidEntry collection of cids that they want
+	// CidEntry collection of cids that they want, in the order they asked
 	struct Libp2pVector* cids_they_want;
+	// the same CidEntries, indexed by multihash
+	struct CidEntry** they_want_buckets;
+	size_t they_want_bucket_count;
+	size_t they_want_cancelled; // the entries of cids_they_want that are cancelled
+	size_t they_want_not_here; // the entries of cids_they_want that are not cancelled, but not here
 	// CidEntry collection of cids that we want or are canceling
 	struct Libp2pVector* cids_we_want;
 	// blocks to send to them
 	struct Libp2pVector* blocks_we_want_to_send;
 	// blocks they sent us are processed immediately, so no queue necessary
 	// although the cid can go in cids_we_want again, with a cancel flag
+	struct BitswapLedger ledger;
+	// the bytes of blocks they may still be sent in this round
+	unsigned long long deficit;
+	// the message being filled for them, so small turns go out together
+	struct BitswapMessage* outgoing;
+	size_t outgoing_size; // the encoded size of its blocks
+	long long outgoing_since; // when it was started
 };
 
 struct PeerRequestEntry {
 	struct PeerRequestEntry* prior;
 	struct PeerRequest* current;
 	struct PeerRequestEntry* next;
+	struct PeerRequestEntry* next_in_bucket; // the next entry in the same bucket of the index
+};
+
+/***
+ * Part of the index of peers, with its own lock, so looking up
+ * different peers does not wait on one lock
+ */
+struct PeerRequestStripe {
+	pthread_mutex_t lock;
+	struct PeerRequestEntry** buckets;
+	size_t bucket_count;
+	size_t total;
 };
 
 struct PeerRequestQueue {
-	pthread_mutex_t queue_mutex;
+	pthread_mutex_t queue_mutex; // protects the order of the entries
 	struct PeerRequestEntry* first;
 	struct PeerRequestEntry* last;
+	// the entries by peer id
+	struct PeerRequestStripe stripes[BITSWAP_PEER_REQUEST_QUEUE_STRIPES];
 };
 
 /***
@@ -87,12 +129,13 @@ int ipfs_bitswap_peer_request_queue_add(struct PeerRequestQueue* queue, struct P
  * @param request the request
  * @returns true(1) on success, otherwise false(0)
  */
-int ipfs_bitswap_peer_request_quque_remove(struct PeerRequestQueue* queue, struct PeerRequest* request);
+int ipfs_bitswap_peer_request_queue_remove(struct PeerRequestQueue* queue, struct PeerRequest* request);
 
 /**
- * Pull a PeerRequest off the queue
+ * Pull a PeerRequest off the queue. The requests take turns, and each turn adds
+ * the peer's share of a round (see ledger.h) to the bytes it may be sent.
  * @param queue the queue
- * @returns the PeerRequest that should be handled next.
+ * @returns the PeerRequest that should be handled next, or NULL if none have something to do
  */
 struct PeerRequest* ipfs_bitswap_peer_request_queue_pop(struct PeerRequestQueue* queue);
 
@@ -113,6 +156,41 @@ struct PeerRequestEntry* ipfs_bitswap_peer_request_queue_find_entry(struct PeerR
  */
 int ipfs_bitswap_peer_request_queue_fill(struct PeerRequestQueue* queue, struct Libp2pPeer* who, struct Block* block);
 
+/***
+ * Find a cid they want
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid
+ * @returns the CidEntry (that may be cancelled), or NULL if they did not ask for it
+ */
+struct CidEntry* ipfs_bitswap_peer_request_they_want_find(struct PeerRequest* request, const struct Cid* cid);
+
+/***
+ * Add a cid they want, or ask for it again if it was cancelled
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid (the request takes it)
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_peer_request_they_want_add(struct PeerRequest* request, struct Cid* cid);
+
+/***
+ * Cancel a cid they want, because they cancelled it or it is being sent
+ * NOTE: the request_mutex must be held
+ * @param request the request
+ * @param cid the cid
+ * @returns true(1) if they wanted it, false(0) otherwise
+ */
+int ipfs_bitswap_peer_request_they_want_cancel(struct PeerRequest* request, const struct Cid* cid);
+
+/***
+ * A block is here now, so the peers that want it are looked at again
+ * @param queue the queue
+ * @param cid the cid of the block
+ * @returns true(1) if a peer wants it, false(0) otherwise
+ */
+int ipfs_bitswap_peer_request_queue_has_block(struct PeerRequestQueue* queue, const struct Cid* cid);
+
 /***
  * Allocate resources for a PeerRequestEntry struct
  * @returns the allocated struct or NULL if there was a problem
@@ -127,7 +205,8 @@ struct PeerRequestEntry* ipfs_bitswap_peer_request_entry_new();
 int ipfs_bitswap_peer_request_entry_free(struct PeerRequestEntry* entry);
 
 /****
- * Handle a PeerRequest
+ * Handle a PeerRequest. Our wants are always sent, but their blocks only as far as the deficit allows.
+ * NOTE: the request_mutex must not be held. It is released while connecting, reading blocks and sending.
  * @param context the BitswapContext
  * @param request the request to process
  * @returns true(1) on succes, otherwise false(0)
@@ -0,0 +1,51 @@
+#pragma once
+/***
+ * A BitswapSession is a group of blocks that are fetched together, usually
+ * the blocks of one DAG. The peers that sent blocks of the session probably
+ * have the rest, so the next wants go to them first. The routing is only asked
+ * for providers when they have not sent the block in time.
+ */
+
+#include <pthread.h>
+#include "libp2p/peer/peer.h"
+#include "libp2p/utils/vector.h"
+
+// the most peers a session remembers
+#define BITSWAP_SESSION_MAX_PEERS 8
+
+struct BitswapSession {
+	pthread_mutex_t lock;
+	// the Libp2pPeers (from the peerstore) that sent blocks, the latest first
+	struct Libp2pVector* peers;
+	int provider_delay; // milliseconds to wait for the peers before asking the routing
+};
+
+/***
+ * Create a new BitswapSession
+ * @param provider_delay milliseconds to wait for the peers of the session before asking the routing
+ * @returns the BitswapSession, or NULL on error
+ */
+struct BitswapSession* ipfs_bitswap_session_new(int provider_delay);
+
+/***
+ * Free the resources of a BitswapSession
+ * @param session the session
+ * @returns true(1)
+ */
+int ipfs_bitswap_session_free(struct BitswapSession* session);
+
+/***
+ * Remember a peer that sent a block of the session
+ * @param session the session
+ * @param peer the peer (it must outlive the session, like the ones in the peerstore)
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_session_add_peer(struct BitswapSession* session, struct Libp2pPeer* peer);
+
+/***
+ * Add the peers of the session to a vector, if they are not in it already
+ * @param session the session
+ * @param peers the vector of Libp2pPeers
+ * @returns the number of peers the session has
+ */
+int ipfs_bitswap_session_get_peers(struct BitswapSession* session, struct Libp2pVector* peers);
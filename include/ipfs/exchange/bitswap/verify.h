@@ -0,0 +1,71 @@
+#pragma once
+/***
+ * Blocks that arrive from the network are only stored, and only fill wants,
+ * once their data hashes to their Cid. The hashing is done by a pool of workers,
+ * so a connection can read its next message while the last one is checked.
+ * Small blocks are checked together, so each job has about
+ * BITSWAP_VERIFY_BATCH_BYTES to hash. Once BITSWAP_VERIFY_MAX_BYTES are waiting
+ * for the workers, a connection hashes what it received itself, so a peer that
+ * sends faster than the blocks are checked slows down instead of filling memory.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "ipfs/blocks/block.h"
+#include "ipfs/util/thread_pool.h"
+#include "libp2p/peer/peer.h"
+#include "libp2p/utils/vector.h"
+
+// the bytes a worker is given to hash at a time
+#define BITSWAP_VERIFY_BATCH_BYTES 262144
+// the most bytes waiting for the workers
+#define BITSWAP_VERIFY_MAX_BYTES (64 * 1024 * 1024)
+
+struct BitswapContext;
+
+struct BitswapVerifier {
+	threadpool pool; // NULL when the blocks are checked on the thread that received them
+	int workers;
+	pthread_mutex_t lock;
+	size_t queued_bytes; // given to the workers, and not yet checked
+	size_t max_bytes; // past this, blocks are checked on the thread that received them
+};
+
+/***
+ * Find out if the hash of a Cid is one that blocks can be checked against
+ * @param cid the Cid
+ * @returns true(1) if it is a sha2-256 hash, false(0) otherwise
+ */
+int ipfs_bitswap_verify_supported(const struct Cid* cid);
+
+/***
+ * Find out if the data of a block hashes to its Cid
+ * @param block the block
+ * @returns true(1) if it does, false(0) if it does not, or the hash can not be checked
+ */
+int ipfs_bitswap_verify_block(const struct Block* block);
+
+/***
+ * Create a new BitswapVerifier
+ * @param workers the number of threads that hash (0 for one per processor, 1 to hash on the calling thread)
+ * @returns the BitswapVerifier, or NULL on error
+ */
+struct BitswapVerifier* ipfs_bitswap_verifier_new(int workers);
+
+/***
+ * Wait for the blocks that are being checked, and free the resources of a BitswapVerifier
+ * @param verifier the BitswapVerifier
+ * @returns true(1)
+ */
+int ipfs_bitswap_verifier_free(struct BitswapVerifier* verifier);
+
+/***
+ * Check blocks that arrived, and hand the good ones to ipfs_bitswap_receive_block.
+ * The blocks that do not match their Cid are thrown away, and do not count toward the ledger of the peer.
+ * @param context the BitswapContext
+ * @param blocks the Blocks (this takes the vector and the blocks)
+ * @param from the peer that sent them, or NULL
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_verifier_add(struct BitswapContext* context, struct Libp2pVector* blocks, struct Libp2pPeer* from);
@@ -9,12 +9,24 @@
 #include "ipfs/cid/cid.h"
 #include "ipfs/blocks/block.h"
 #include "ipfs/exchange/bitswap/bitswap.h"
+#include "ipfs/exchange/bitswap/session.h"
 
 enum WantListSessionType { WANTLIST_SESSION_TYPE_LOCAL, WANTLIST_SESSION_TYPE_REMOTE };
 
 struct WantListSession {
 	enum WantListSessionType type;
 	void* context; // either an IpfsNode (local) or a Libp2pPeer (remote)
+	struct BitswapSession* bitswap_session; // the blocks that are fetched with this one (can be NULL)
+};
+
+/***
+ * Someone waiting for any of several blocks. When the block of an entry it
+ * watches arrives, the entry is put in arrived, and block_arrived is signalled
+ * (with the mutex of the WantListQueue).
+ */
+struct WantListWaiter {
+	pthread_cond_t block_arrived;
+	struct Libp2pVector* arrived; // WantListQueueEntries whose blocks arrived, not handled yet
 };
 
 struct WantListQueueEntry {
@@ -23,14 +35,35 @@ struct WantListQueueEntry {
 	// a vector of WantListSessions
 	struct Libp2pVector* sessionsRequesting;
 	struct Block* block;
+	pthread_cond_t block_arrived; // signalled (with the mutex of the WantListQueue) when block is filled in
 	int asked_network;
+	int asked_session; // the peers of its sessions were asked, but not the routing
 	int attempts;
+	long long not_before; // when it can be popped (see ipfs_bitswap_wantlist_queue_now)
+	// kept by the WantListQueue
+	unsigned long sequence; // the order entries were added in
+	int ready_index; // where it is in the ready queue, or -1 if it is not there
+	int processing; // popped, and not released yet
+	int removed; // nobody wants it, but it is still being processed
+	struct WantListQueueEntry* next_in_bucket;
+	struct Libp2pVector* waiters; // the WantListWaiters watching this entry
 };
 
+/***
+ * The WantListQueueEntries are in a hash table, keyed on the multihash of the Cid.
+ * The ones that still need to be looked for are also in a priority queue (a binary
+ * heap), so adding, finding, removing and popping do not look at every entry.
+ */
 struct WantListQueue {
 	pthread_mutex_t wantlist_mutex;
-	// a vector of WantListEntries
-	struct Libp2pVector* queue;
+	struct WantListQueueEntry** buckets;
+	size_t bucket_count;
+	size_t total; // the number of entries
+	// the entries that need to be looked for, the next one first
+	struct WantListQueueEntry** ready;
+	size_t ready_total;
+	size_t ready_size;
+	unsigned long next_sequence;
 };
 
 /***
@@ -68,7 +101,19 @@ int ipfs_bitswap_wantlist_queue_free(struct WantListQueue* wantlist);
 struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_add(struct WantListQueue* wantlist, const struct Cid* cid, const struct WantListSession* session);
 
 /***
- * Remove (decrement the counter) a Cid from the WantList
+ * Add several Cids to the WantList at once
+ * @param wantlist the WantList to add to
+ * @param cids the Cids to add
+ * @param cids_size the number of Cids
+ * @param session who wants them
+ * @param entries where to put the entries, in the same order as the Cids
+ * @returns true(1) on success. On error, none of them are added.
+ */
+int ipfs_bitswap_wantlist_queue_add_many(struct WantListQueue* wantlist, struct Cid** cids, size_t cids_size, const struct WantListSession* session, struct WantListQueueEntry** entries);
+
+/***
+ * Remove (decrement the counter) a Cid from the WantList. When nobody wants it
+ * any more, the entry is freed.
  * @param wantlist the WantList
  * @param cid the Cid
  * @returns true(1) on success, otherwise false(0)
@@ -77,12 +122,67 @@ int ipfs_bitswap_wantlist_queue_remove(struct WantListQueue* wantlist, const str
 
 /***
  * Find a Cid in the WantList
+ * NOTE: the caller must hold the wantlist_mutex
  * @param wantlist the list
  * @param cid the Cid
  * @returns the WantListQueueEntry
  */
 struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_find(struct WantListQueue* wantlist, const struct Cid* cid);
 
+/***
+ * Fill in the block of an entry, and wake everyone waiting for it
+ * @param wantlist the WantList that has the entry
+ * @param entry the entry, or NULL to look for the entry of the block's Cid
+ * @param block the block. The entry takes it, or it is freed if the entry already has one (or there is no entry).
+ * @param from the peer that sent the block, remembered by the sessions of the entry (NULL if it did not come from a peer)
+ * @returns true(1) if the entry took the block
+ */
+int ipfs_bitswap_wantlist_queue_entry_set_block(struct WantListQueue* wantlist, struct WantListQueueEntry* entry, struct Block* block, struct Libp2pPeer* from);
+
+/***
+ * The time used for WantListQueueEntry.not_before
+ * @returns milliseconds since some time in the past
+ */
+long long ipfs_bitswap_wantlist_queue_now();
+
+/***
+ * How long until the next entry can be popped
+ * @param wantlist the list
+ * @returns milliseconds (0 if one can be popped now), or -1 if nothing needs to be looked for
+ */
+long ipfs_bitswap_wantlist_queue_next_due(struct WantListQueue* wantlist);
+
+/***
+ * Create a WantListWaiter, to wait for any of several blocks
+ * @returns the WantListWaiter, or NULL on error
+ */
+struct WantListWaiter* ipfs_bitswap_wantlist_waiter_new();
+
+/***
+ * Free a WantListWaiter. It must not be watching any entries.
+ * @param waiter the WantListWaiter
+ * @returns true(1)
+ */
+int ipfs_bitswap_wantlist_waiter_free(struct WantListWaiter* waiter);
+
+/***
+ * Be told when the block of an entry arrives. If it is already there, it is
+ * put in the waiter's arrived list now.
+ * NOTE: the caller must hold the wantlist_mutex
+ * @param entry the entry
+ * @param waiter who to tell
+ * @returns true(1) on success
+ */
+int ipfs_bitswap_wantlist_queue_entry_watch(struct WantListQueueEntry* entry, struct WantListWaiter* waiter);
+
+/***
+ * Stop being told about an entry
+ * NOTE: the caller must hold the wantlist_mutex
+ * @param entry the entry
+ * @param waiter who was being told
+ */
+void ipfs_bitswap_wantlist_queue_entry_unwatch(struct WantListQueueEntry* entry, struct WantListWaiter* waiter);
+
 /***
  * compare 2 sessions for equality
  * @param a side a
@@ -91,19 +191,41 @@ struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_find(struct WantListQueue
  */
 int ipfs_bitswap_wantlist_session_compare(const struct WantListSession* a, const struct WantListSession* b);
 
+/***
+ * Attempt to retrieve a block from the local blockstore. The block is a view of its file
+ * when the blockstore can make one, so it is not copied on its way to the peers.
+ *
+ * @param context the BitswapContext
+ * @param cid the id to look for
+ * @param block where to put the results. Free it with ipfs_block_free, as usual.
+ * @returns true(1) if found, false(0) otherwise
+ */
+int ipfs_bitswap_wantlist_get_block_locally(struct BitswapContext* context, struct Cid* cid, struct Block** block);
+
 /**
  * Called by the Bitswap engine, this processes an item on the WantListQueue
  * @param context the context
  * @param entry the WantListQueueEntry
- * @returns true(1) on success, false(0) if not.
+ * @param peer_requests where to collect the PeerRequests that have something to send, so the
+ * wants for a peer go in one message. If NULL, the messages are sent now.
+ * @returns true(1) if the block was found or the network was asked for it, false(0) if not.
  */
-int ipfs_bitswap_wantlist_process_entry(struct BitswapContext* context, struct WantListQueueEntry* entry);
+int ipfs_bitswap_wantlist_process_entry(struct BitswapContext* context, struct WantListQueueEntry* entry, struct Libp2pVector* peer_requests);
 
 /***
- * Pops the top one off the queue
+ * Pops the top one off the queue, if it is time to look for it. The entry stays in
+ * the WantList, but is not popped again until it is released.
  *
  * @param wantlist the list
- * @returns the WantListQueueEntry
+ * @returns the WantListQueueEntry, or NULL if nothing needs to be looked for
  */
 struct WantListQueueEntry* ipfs_bitswap_wantlist_queue_pop(struct WantListQueue* wantlist);
 
+/***
+ * Give back an entry that was popped. If it still has to be looked for, it goes back
+ * in the queue. If it was removed in the meantime, it is freed.
+ * @param wantlist the list
+ * @param entry the entry that was popped
+ */
+void ipfs_bitswap_wantlist_queue_release(struct WantListQueue* wantlist, struct WantListQueueEntry* entry);
+
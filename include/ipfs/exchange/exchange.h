@@ -38,6 +38,33 @@ struct Exchange {
 	 */
 	int (*GetBlocks)(struct Exchange* exchange, struct Libp2pVector* Cids, struct Libp2pVector** blocks);
 
+	/**
+	 * Retrieve several blocks, handing each one over as soon as it arrives
+	 * @param context the context
+	 * @param session from NewSession, or NULL
+	 * @param cids a vector of hashes for the blocks to be retrieved
+	 * @param block_received called with each block, in the order they arrive. It owns the block, and returns false(0) to stop.
+	 * @param arg passed to block_received
+	 * @returns true(1) if every block was retrieved, otherwise false(0)
+	 */
+	int (*GetBlocksStream)(struct Exchange* exchange, void* session, struct Libp2pVector* cids, int (*block_received)(struct Block* block, void* arg), void* arg);
+
+	/**
+	 * Start a session, for blocks that are retrieved together (i.e. the blocks of a DAG).
+	 * The peers that sent blocks of a session are asked first for the rest.
+	 * @param context the context
+	 * @returns the session, or NULL on error
+	 */
+	void* (*NewSession)(struct Exchange* exchange);
+
+	/**
+	 * End a session. Nothing may be retrieved with it any more.
+	 * @param context the context
+	 * @param session the session
+	 * @returns true(1)
+	 */
+	int (*CloseSession)(struct Exchange* exchange, void* session);
+
 	/**
 	 * Announces the existance of a block to this bitswap service. The service will
 	 * potentially notify its peers.
@@ -4,6 +4,37 @@
  * the local file system, regardless of the
  * hierarchy of the keys. Modeled after go-ds-flatfs
  */
+#ifndef __IPFS_FLATFS_FLATFS_H__
+#define __IPFS_FLATFS_FLATFS_H__
+
+#include <stddef.h>
+
+#define FLATFS_MAX_PREFIX_LENGTH 16
+
+/**
+ * The name of the file (in the root of the datastore) that records the shard function in use
+ */
+#define FLATFS_SHARDING_FILENAME "SHARDING"
+#define FLATFS_SHARD_PREFIX_V1 "/repo/flatfs/shard/v1/"
+/**
+ * The shard function used for new repositories (same as go-ipfs)
+ */
+#define FLATFS_DEFAULT_SHARD "/repo/flatfs/shard/v1/next-to-last/2"
+
+/**
+ * How a key is turned into a subdirectory name
+ */
+enum FlatfsShardType {
+	FLATFS_SHARD_NONE, // everything in one directory, no suffix (the original blockstore layout)
+	FLATFS_SHARD_PREFIX, // the first n characters of the key
+	FLATFS_SHARD_SUFFIX, // the last n characters of the key
+	FLATFS_SHARD_NEXT_TO_LAST // n characters, skipping the last character of the key
+};
+
+struct FlatfsShard {
+	enum FlatfsShardType type;
+	int length;
+};
 
 /**
  * Given a filename (usually a long hash), derive a subdirectory name
@@ -36,3 +67,111 @@ int ipfs_flatfs_get_filename(const char* proposed_filename, char* derived_filena
  */
 int ipfs_flatfs_get_full_filename(const char* datastore_path, const char* proposed_filename,
 		char* derived_full_filename, size_t max_derived_filename_length);
+
+/**
+ * Create a directory if it doesn't already exist
+ * @param full_directory the full path
+ * @returns true(1) on successful create or if it already exists and is writable. false(0) otherwise.
+ */
+int ipfs_flatfs_create_directory(const char* full_directory);
+
+/***
+ * Parse a shard function string such as "/repo/flatfs/shard/v1/next-to-last/2".
+ * The "/repo/flatfs/shard/v1/" prefix is optional, so "prefix/4" also works.
+ * @param in the string
+ * @param shard the struct to fill
+ * @returns true(1) on success, false(0) if the string was not understood
+ */
+int ipfs_flatfs_shard_parse(const char* in, struct FlatfsShard* shard);
+
+/***
+ * Turn a shard into its string representation
+ * @param shard the shard
+ * @param out where to put the results
+ * @param max_out_length the size of the out buffer
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_to_string(const struct FlatfsShard* shard, char* out, size_t max_out_length);
+
+/***
+ * Get the subdirectory name (not the full path) that a key belongs in
+ * @param shard the shard function
+ * @param key the key (without preceeding slash)
+ * @param out where to put the results. Must be at least shard->length + 1 in size
+ * @param max_out_length the size of the out buffer
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_directory_name(const struct FlatfsShard* shard, const char* key, char* out, size_t max_out_length);
+
+/**
+ * Given a filename (usually a long hash), derive the subdirectory using a shard function
+ * @param datastore_path the path to the datastore
+ * @param shard the shard function
+ * @param proposed_filename the filename to use
+ * @param derived_path the complete pathname to the directory that should contain the proposed_filename
+ * @param max_derived_path_length the maximum memory allocated for derived_path
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_get_sharded_directory(const char* datastore_path, const struct FlatfsShard* shard, const char* proposed_filename,
+		char* derived_path, size_t max_derived_path_length);
+
+/**
+ * Build the complete filename on disk of a key using a shard function
+ * NOTE: FLATFS_SHARD_NONE gives [datastore_path]/[key], all others [datastore_path]/[dir]/[key].data
+ * @param datastore_path where the datastore is
+ * @param shard the shard function
+ * @param proposed_filename the filename we want to use
+ * @param derived_full_filename where the results will be put
+ * @param max_derived_filename_length the size of memory allocated for "derived_full_filename"
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_get_sharded_full_filename(const char* datastore_path, const struct FlatfsShard* shard, const char* proposed_filename,
+		char* derived_full_filename, size_t max_derived_filename_length);
+
+/***
+ * Read the SHARDING file of a datastore
+ * @param datastore_path the root of the datastore
+ * @param shard where to put the results
+ * @returns true(1) on success, false(0) if the file is missing or not understood
+ */
+int ipfs_flatfs_shard_read(const char* datastore_path, struct FlatfsShard* shard);
+
+/***
+ * Write the SHARDING file of a datastore
+ * @param datastore_path the root of the datastore
+ * @param shard the shard function in use
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_shard_write(const char* datastore_path, const struct FlatfsShard* shard);
+
+/***
+ * Move every file of a datastore into the layout of a new shard function, then
+ * rewrite the SHARDING file. This works from any layout (including a partially
+ * completed reshard), so it can be run again if interrupted.
+ * NOTE: This is an offline operation. Nothing else should be using the datastore.
+ * @param datastore_path the root of the datastore
+ * @param new_shard the shard function to move to
+ * @param files_moved the number of files that were moved (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_reshard(const char* datastore_path, const struct FlatfsShard* new_shard, size_t* files_moved);
+
+/***
+ * Call a function with the key of every file of a datastore, whatever its layout
+ * @param datastore_path the root of the datastore
+ * @param func the function. Returning false(0) stops the walk.
+ * @param arg passed to the function
+ * @returns true(1) if every file was seen
+ */
+int ipfs_flatfs_walk(const char* datastore_path, int (*func)(const char* key, void* arg), void* arg);
+
+/***
+ * Remove the temporary files a crash left behind, in a datastore of any layout
+ * NOTE: Nothing else should be writing to the datastore.
+ * @param datastore_path the root of the datastore
+ * @param files_removed the number of files removed (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_flatfs_remove_temporary(const char* datastore_path, size_t* files_removed);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __IPFS_IMPORTER_CHUNKER_H__
+#define __IPFS_IMPORTER_CHUNKER_H__
+
+/***
+ * Splits a file into chunks.
+ *
+ * The fixed chunker cuts every n bytes. The Rabin and buzhash chunkers cut where a rolling
+ * hash of the last few bytes matches a pattern, so a boundary depends on the content around it and
+ * not on its offset. An insert near the start of a file then only changes the chunks around the insert.
+ *
+ * Chunkers are described by strings, the same as the --chunker option of go-ipfs:
+ * 	size-<bytes>
+ * 	rabin, rabin-<avg>, rabin-<min>-<avg>-<max>
+ * 	buzhash, buzhash-<min>-<avg>-<max>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define IPFS_CHUNKER_DEFAULT "size-262144"
+/**
+ * The largest chunk allowed, so that blocks can still be sent to other peers
+ */
+#define IPFS_CHUNKER_SIZE_LIMIT 1048576
+/**
+ * The smallest "min" of a content defined chunker. Must not be less than the windows of the rolling hashes.
+ */
+#define IPFS_CHUNKER_MIN_SIZE 64
+
+enum ChunkerType {
+	CHUNKER_FIXED,
+	CHUNKER_RABIN,
+	CHUNKER_BUZHASH
+};
+
+struct ChunkerSpec {
+	enum ChunkerType type;
+	size_t min_size;
+	size_t avg_size; // the expected size of a chunk
+	size_t max_size; // also the size of the buffer passed to ipfs_chunker_next
+};
+
+struct Chunker {
+	struct ChunkerSpec spec;
+	uint64_t mask; // a boundary is where the hash has these bits clear
+	FILE* file;
+	unsigned char* buffer; // max_size bytes read ahead from the file
+	size_t buffer_start;
+	size_t buffer_end;
+	int eof;
+};
+
+/***
+ * Parse the string representation of a chunker
+ * @param in the string, i.e. "size-262144" or "rabin-65536-262144-524288"
+ * @param spec where to put the results
+ * @returns true(1) on success, false(0) if the string was not understood or the sizes are out of range
+ */
+int ipfs_chunker_spec_parse(const char* in, struct ChunkerSpec* spec);
+
+/***
+ * Create a new Chunker that reads from a file
+ * @param spec how to chunk
+ * @param file the file, opened for reading. The caller must close it.
+ * @returns the Chunker, or NULL on error
+ */
+struct Chunker* ipfs_chunker_new(const struct ChunkerSpec* spec, FILE* file);
+
+/***
+ * Free the resources of a Chunker
+ * @param chunker the Chunker
+ * @returns true(1)
+ */
+int ipfs_chunker_free(struct Chunker* chunker);
+
+/***
+ * Get the next chunk of the file
+ * @param chunker the Chunker
+ * @param out where to put the chunk. Must hold spec.max_size bytes.
+ * @param out_size the size of the chunk, or 0 at the end of the file
+ * @returns true(1) on success, false(0) on a read error
+ */
+int ipfs_chunker_next(struct Chunker* chunker, unsigned char* out, size_t* out_size);
+
+/***
+ * Find the first boundary in a block of memory
+ * @param chunker the Chunker (only the spec and mask are used)
+ * @param data the bytes
+ * @param data_size the number of bytes. If there is no boundary, all of them (up to max_size) are one chunk.
+ * @returns the size of the chunk that starts at data
+ */
+size_t ipfs_chunker_find_boundary(const struct Chunker* chunker, const unsigned char* data, size_t data_size);
+
+#endif
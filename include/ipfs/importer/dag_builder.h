@@ -0,0 +1,101 @@
+#ifndef __IPFS_IMPORTER_DAG_BUILDER_H__
+#define __IPFS_IMPORTER_DAG_BUILDER_H__
+
+/***
+ * Builds the DAG of a file as its chunks arrive, without holding the file in memory.
+ * The result is a balanced tree: every leaf is at the same depth, and no node has
+ * more than max_links links.
+ */
+
+#include "ipfs/merkledag/node.h"
+#include "ipfs/repo/fsrepo/fs_repo.h"
+
+/**
+ * The default number of links in a node (the same as go-ipfs)
+ */
+#define IPFS_DAG_BUILDER_DEFAULT_MAX_LINKS 174
+
+/***
+ * A finished child, waiting for its parent to be built
+ */
+struct DagBuilderEntry {
+	unsigned char* hash;
+	size_t hash_size;
+	size_t t_size; // the size of the child, plus everything below it
+	size_t file_size; // the bytes of file data below the child
+};
+
+/***
+ * The children waiting at one depth of the tree
+ */
+struct DagBuilderLevel {
+	struct DagBuilderEntry* entries; // max_links entries
+	int count;
+};
+
+struct DagBuilder {
+	struct FSRepo* fs_repo;
+	int max_links;
+	struct DagBuilderLevel* levels; // levels[0] holds leaves
+	int num_levels;
+	size_t leaf_count;
+	struct HashtableNode* first_leaf; // kept in case it turns out to be the whole file
+	size_t bytes_written; // bytes written to the repo so far
+};
+
+/***
+ * Create a new DagBuilder
+ * @param fs_repo where to store the nodes
+ * @param max_links the most links a node can have (0 for the default)
+ * @returns the DagBuilder, or NULL on error
+ */
+struct DagBuilder* ipfs_importer_dag_builder_new(struct FSRepo* fs_repo, int max_links);
+
+/***
+ * Free the resources of a DagBuilder
+ * @param builder the DagBuilder
+ * @returns true(1)
+ */
+int ipfs_importer_dag_builder_free(struct DagBuilder* builder);
+
+/***
+ * Encode a chunk of a file as a leaf, and store it. This does not touch a DagBuilder,
+ * so it can be called from several threads at once.
+ * @param fs_repo where to store the leaf
+ * @param data the chunk. It is not copied, and is not changed.
+ * @param data_size the size of the chunk
+ * @param leaf where to put the stored leaf. The caller must free it.
+ * @param bytes_written the bytes written to the repo
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_store_leaf(struct FSRepo* fs_repo, unsigned char* data, size_t data_size, struct HashtableNode** leaf, size_t* bytes_written);
+
+/***
+ * Store the next chunk of the file as a leaf
+ * @param builder the DagBuilder
+ * @param data the chunk
+ * @param data_size the size of the chunk
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_add_leaf(struct DagBuilder* builder, unsigned char* data, size_t data_size);
+
+/***
+ * Add a leaf that has already been stored
+ * NOTE: leaves must be added in file order
+ * @param builder the DagBuilder
+ * @param leaf the stored leaf. The builder keeps it if it may become the root, so it must not be freed by the caller.
+ * @param t_size the bytes written when the leaf was stored
+ * @param file_size the bytes of file data in the leaf
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_add_stored_leaf(struct DagBuilder* builder, struct HashtableNode* leaf, size_t t_size, size_t file_size);
+
+/***
+ * Build the remaining parents, and return the root of the file
+ * @param builder the DagBuilder
+ * @param root where to put the root node. The caller must free it.
+ * @returns true(1) on success
+ */
+int ipfs_importer_dag_builder_finish(struct DagBuilder* builder, struct HashtableNode** root);
+
+#endif
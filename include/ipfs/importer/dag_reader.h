@@ -0,0 +1,100 @@
+#ifndef __IPFS_IMPORTER_DAG_READER_H__
+#define __IPFS_IMPORTER_DAG_READER_H__
+
+/***
+ * Reads any part of a file that is stored as a DAG, without fetching the whole file.
+ *
+ * The parents in a file's DAG list the number of file bytes below each link (the blocksizes
+ * of the UnixFS), so a read walks down only the links that cover the bytes asked for.
+ * Trees of any depth can be read.
+ *
+ * The nodes from the root down to the last leaf that was read are kept. The next read
+ * climbs only as far as the first of them that covers its bytes, so reading a file in
+ * order fetches each block once.
+ */
+
+#include <stdio.h>
+
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/merkledag/node.h"
+#include "ipfs/unixfs/unixfs.h"
+
+/***
+ * A node on the path to the last leaf that was read
+ */
+struct DagReaderLevel {
+	struct HashtableNode* node;
+	struct UnixFS* unix_fs; // the decoded data of the node, pointing into it
+	size_t position; // where the node starts in the file
+	size_t size; // the number of file bytes in the node and below it
+};
+
+struct DagReader {
+	struct IpfsNode* local_node;
+	struct HashtableNode* root;
+	size_t size; // the number of bytes in the file
+	size_t offset; // where the next read starts
+	struct DagReaderLevel* path; // from the root down to the last leaf that was read
+	int depth; // the number of levels in path
+	int path_size; // the number of levels path has room for
+	unsigned long fetches; // the blocks fetched since the reader was created
+	void* session; // the exchange session the blocks are fetched in (can be NULL)
+};
+
+/***
+ * Create a new DagReader for a file
+ * @param local_node the context
+ * @param hash the hash of the top node of the file
+ * @param hash_size the length of the hash
+ * @param reader where to put the DagReader
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_new(struct IpfsNode* local_node, const unsigned char* hash, size_t hash_size, struct DagReader** reader);
+
+/***
+ * Free the resources of a DagReader
+ * @param reader the DagReader
+ * @returns true(1)
+ */
+int ipfs_dag_reader_free(struct DagReader* reader);
+
+/***
+ * Move to a place in the file
+ * @param reader the DagReader
+ * @param offset where the next read starts
+ * @returns true(1) on success, false(0) if the offset is past the end of the file
+ */
+int ipfs_dag_reader_seek(struct DagReader* reader, size_t offset);
+
+/***
+ * Read bytes from a place in the file. Only the blocks that cover those bytes are fetched.
+ * @param reader the DagReader
+ * @param offset where in the file to start
+ * @param buffer where to put the bytes
+ * @param length the most bytes to read
+ * @param bytes_read the number of bytes read (less than length at the end of the file)
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_read_at(struct DagReader* reader, size_t offset, unsigned char* buffer, size_t length, size_t* bytes_read);
+
+/***
+ * Read bytes from where the last read (or seek) stopped
+ * @param reader the DagReader
+ * @param buffer where to put the bytes
+ * @param length the most bytes to read
+ * @param bytes_read the number of bytes read (0 at the end of the file)
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_read(struct DagReader* reader, unsigned char* buffer, size_t length, size_t* bytes_read);
+
+/***
+ * Write part of the file to a stream
+ * @param reader the DagReader
+ * @param offset where in the file to start
+ * @param length the number of bytes to write (the rest of the file if it is longer than that)
+ * @param file where to write
+ * @returns true(1) on success
+ */
+int ipfs_dag_reader_write(struct DagReader* reader, size_t offset, size_t length, FILE* file);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __IPFS_IMPORTER_DIRECTORY_IMPORTER_H__
+#define __IPFS_IMPORTER_DIRECTORY_IMPORTER_H__
+
+/***
+ * Imports a directory tree using a pool of threads.
+ *
+ * Listing a directory and importing a file are both jobs on the pool. Each directory
+ * counts the children it is waiting for. The thread that finishes the last child builds
+ * the directory node (with links in the order they were listed), and then reports to
+ * the directory's parent. The tree is done when the top directory is built.
+ */
+
+#include <pthread.h>
+
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/merkledag/node.h"
+#include "ipfs/util/thread_pool.h"
+
+struct DirectoryImporter;
+
+/***
+ * A file or directory within the tree being imported
+ */
+struct DirectoryImportEntry {
+	struct DirectoryImporter* importer;
+	struct DirectoryImportEntry* parent;
+	char* path; // where it is on disk
+	char* display_path; // how it is shown in the results
+	char* name; // the name of the link in the parent
+	int is_directory;
+	struct DirectoryImportEntry** children; // in the order they were listed
+	size_t num_children;
+	size_t pending; // children that are not finished yet
+	// the results
+	unsigned char* hash;
+	size_t hash_size;
+	size_t bytes_written; // this entry plus everything below it
+	int failed;
+};
+
+struct DirectoryImporter {
+	struct IpfsNode* local_node;
+	threadpool pool;
+	pthread_mutex_t lock; // protects pending, the counters and done
+	pthread_cond_t finished;
+	pthread_mutex_t provide_lock; // routing is not thread safe
+	int done;
+	int failed;
+	struct HashtableNode* root; // the node of the top directory, once done
+	// progress
+	size_t files_found;
+	size_t files_imported;
+	size_t directories_imported;
+	size_t bytes_imported;
+};
+
+/***
+ * Import a directory and everything below it
+ * @param root_dir where the directory is shown to be in the results (can be NULL)
+ * @param directory the path to the directory
+ * @param node where to put the directory node. The caller must free it.
+ * @param local_node the context
+ * @param bytes_written incremented by the number of bytes written to the repo
+ * @param recursive false(0) to import the directory without its contents
+ * @param workers the number of threads to use
+ * @returns true(1) on success
+ */
+int ipfs_import_directory(const char* root_dir, const char* directory, struct HashtableNode** node, struct IpfsNode* local_node, size_t* bytes_written, int recursive, int workers);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __IPFS_IMPORTER_EXPORT_PIPELINE_H__
+#define __IPFS_IMPORTER_EXPORT_PIPELINE_H__
+
+/***
+ * Writes the contents of a file's DAG while fetching the blocks ahead of time.
+ *
+ * The blocks still to be written are kept in a list, in file order. The workers of the
+ * node's export pool fetch the blocks at the front of the list, up to a number of fetches
+ * at a time, and up to a number of bytes that are being fetched or are fetched but not
+ * written yet. A block is counted when its fetch starts, by the size its link gives, and
+ * by its real size once it arrives. The calling thread waits for the first block, writes
+ * it, and puts its links (if any) at the front of the list, so they are fetched next.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/blocks/block_view.h"
+#include "ipfs/merkledag/node.h"
+#include "ipfs/util/thread_pool.h"
+
+// what a block is counted as while it is fetched, if its link does not give a smaller size
+#define EXPORT_PIPELINE_BLOCK_ESTIMATE (256 * 1024)
+
+enum ExportBlockState {
+	EXPORT_BLOCK_WAITING, // not asked for yet
+	EXPORT_BLOCK_FETCHING, // a worker has it
+	EXPORT_BLOCK_DONE, // fetched, waiting to be written
+	EXPORT_BLOCK_FAILED
+};
+
+struct ExportPipeline;
+
+/***
+ * A block that has not been written yet
+ */
+struct ExportBlock {
+	struct ExportPipeline* pipeline;
+	unsigned char* hash;
+	size_t hash_size;
+	enum ExportBlockState state;
+	struct HashtableNode* node;
+	struct BlockView view; // what the data of node points into, if it was read from the blockstore in place
+	size_t node_size; // the bytes held by node, once it is fetched
+	size_t reserved; // the bytes counted for the block while it is fetched
+	struct ExportBlock* next;
+};
+
+struct ExportPipeline {
+	struct IpfsNode* local_node;
+	threadpool pool; // the node's export pool, shared with other pipelines
+	int max_fetches; // the most fetches at a time
+	size_t max_bytes; // the most bytes being fetched, or fetched but not written
+	struct ExportBlock* head; // the next block to write
+	struct ExportBlock* next_fetch; // where to start looking for blocks to fetch
+	int fetching;
+	size_t fetched_bytes; // what is reserved for the fetches, plus what is fetched but not written
+	pthread_mutex_t lock; // protects the states, fetching and fetched_bytes
+	pthread_cond_t block_finished;
+	void* session; // the exchange session the blocks are fetched in (can be NULL)
+};
+
+/***
+ * Create a new ExportPipeline
+ * @param local_node the context
+ * @param max_fetches the most fetches at a time
+ * @param max_bytes the most bytes to hold that are being fetched or are fetched but not written
+ * @returns the ExportPipeline, or NULL on error
+ */
+struct ExportPipeline* ipfs_export_pipeline_new(struct IpfsNode* local_node, int max_fetches, size_t max_bytes);
+
+/***
+ * Wait for the fetches of this pipeline, and free its resources
+ * @param pipeline the ExportPipeline
+ * @returns true(1)
+ */
+int ipfs_export_pipeline_free(struct ExportPipeline* pipeline);
+
+/***
+ * Fetch a node, from the local blockstore if it is there, otherwise from the network
+ * @param local_node the context
+ * @param session the exchange session the node belongs to (can be NULL)
+ * @param hash the hash of the node
+ * @param hash_size the length of the hash
+ * @param node where to put the node
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_fetch(struct IpfsNode* local_node, void* session, const unsigned char* hash, size_t hash_size, struct HashtableNode** node);
+
+/***
+ * Fetch a node that is not in the local blockstore, from the exchange or the routing
+ * @param local_node the context
+ * @param session the exchange session the node belongs to (can be NULL)
+ * @param hash the hash of the node
+ * @param hash_size the length of the hash
+ * @param node where to put the node
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_fetch_remote(struct IpfsNode* local_node, void* session, const unsigned char* hash, size_t hash_size, struct HashtableNode** node);
+
+/***
+ * Write everything below a node to a file
+ * NOTE: the data of the node itself is not written
+ * @param pipeline the ExportPipeline
+ * @param node the node whose links are written
+ * @param file where to write
+ * @returns true(1) on success
+ */
+int ipfs_export_pipeline_write(struct ExportPipeline* pipeline, const struct HashtableNode* node, FILE* file);
+
+#endif
@@ -26,6 +26,15 @@ int ipfs_exporter_get_node(struct IpfsNode* local_node, const unsigned char* has
 
 int ipfs_exporter_object_get(int argc, char** argv);
 
+/***
+ * Write the data of a node, and all the nodes below it, to a file
+ * @param node the node
+ * @param local_node the context
+ * @param file where to write
+ * @returns true(1) on success
+ */
+int ipfs_exporter_cat_node(struct HashtableNode* node, struct IpfsNode* local_node, FILE *file);
+
 /***
  * Called from the command line with ipfs cat [hash]. Retrieves the object pointed to by hash, and displays its block data (links and data elements)
  * @param argc number of arguments
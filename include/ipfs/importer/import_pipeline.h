@@ -0,0 +1,85 @@
+#ifndef __IPFS_IMPORTER_IMPORT_PIPELINE_H__
+#define __IPFS_IMPORTER_IMPORT_PIPELINE_H__
+
+/***
+ * Imports a file using several threads.
+ *
+ * The calling thread reads chunks into a window of buffers. A pool of workers encodes,
+ * hashes and stores each chunk as a leaf. The calling thread hands the finished
+ * leaves to a DagBuilder in file order, so the links of the parents are in the
+ * same order as a single threaded import.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ipfs/importer/chunker.h"
+#include "ipfs/importer/dag_builder.h"
+#include "ipfs/util/thread_pool.h"
+
+enum ImportChunkState {
+	IMPORT_CHUNK_EMPTY, // the buffer is free
+	IMPORT_CHUNK_PENDING, // a worker has it
+	IMPORT_CHUNK_DONE, // the leaf is stored, waiting to be given to the DagBuilder
+	IMPORT_CHUNK_FAILED
+};
+
+struct ImportPipeline;
+
+/***
+ * One slot in the window of chunks
+ */
+struct ImportChunk {
+	struct ImportPipeline* pipeline;
+	unsigned char* data; // chunk_size bytes, reused for each chunk that lands in this slot
+	size_t data_size;
+	enum ImportChunkState state;
+	struct HashtableNode* leaf;
+	size_t bytes_written;
+};
+
+struct ImportPipeline {
+	struct DagBuilder* builder;
+	threadpool pool;
+	int num_workers;
+	size_t chunk_size;
+	struct ImportChunk* window;
+	size_t window_size;
+	size_t next_read; // the number of the next chunk to be read
+	size_t next_write; // the number of the next chunk to be given to the DagBuilder
+	pthread_mutex_t lock; // protects the state of the chunks
+	pthread_cond_t chunk_finished;
+};
+
+/***
+ * The number of workers to use when the config says 0
+ * @returns the number of processors online
+ */
+int ipfs_import_pipeline_default_workers();
+
+/***
+ * Create a new ImportPipeline
+ * @param builder the DagBuilder that receives the leaves. The pipeline does not own it.
+ * @param num_workers the number of threads that store chunks (0 for one per processor)
+ * @param chunk_size the largest chunk
+ * @returns the ImportPipeline, or NULL on error
+ */
+struct ImportPipeline* ipfs_import_pipeline_new(struct DagBuilder* builder, int num_workers, size_t chunk_size);
+
+/***
+ * Wait for the workers, and free the resources of an ImportPipeline
+ * @param pipeline the ImportPipeline
+ * @returns true(1)
+ */
+int ipfs_import_pipeline_free(struct ImportPipeline* pipeline);
+
+/***
+ * Read a file to the end, storing each chunk and giving the leaves to the DagBuilder
+ * NOTE: call ipfs_importer_dag_builder_finish afterwards to get the root
+ * @param pipeline the ImportPipeline
+ * @param chunker where the chunks come from. Its max_size must not be more than the chunk_size of the pipeline.
+ * @returns true(1) on success
+ */
+int ipfs_import_pipeline_read(struct ImportPipeline* pipeline, struct Chunker* chunker);
+
+#endif
@@ -6,7 +6,7 @@
 
 /**
  * Creates a node based on an incoming file or directory
- * NOTE: this can be called recursively for directories
+ * NOTE: directories are imported on a pool of Importer.Workers threads
  * NOTE: When this function completes, parent_node will be either:
  * 	1) the complete file, in the case of a small file (<256k-ish)
  * 	2) a node with links to the various pieces of a large file
@@ -21,6 +21,33 @@
  */
 int ipfs_import_file(const char* root, const char* fileName, struct HashtableNode** parent_node, struct IpfsNode *local_node, size_t* bytes_written, int recursive);
 
+/**
+ * Import the contents of a file, without telling the network about it
+ * @param fileName the file
+ * @param node where to put the root node of the file. The caller must free it.
+ * @param local_node the context
+ * @param bytes_written incremented by the number of bytes written to the repo
+ * @param workers the number of threads that store chunks (1 to use only the calling thread)
+ * @returns true(1) on success
+ */
+int ipfs_import_file_contents(const char* fileName, struct HashtableNode** node, struct IpfsNode* local_node, size_t* bytes_written, int workers);
+
+/**
+ * Tell the network that we have a node, and the nodes it links to
+ * @param local_node the context
+ * @param node the node
+ * @returns true(1)
+ */
+int ipfs_import_provide(struct IpfsNode* local_node, const struct HashtableNode* node);
+
+/**
+ * Prints to the console the results of a node import
+ * @param node the node imported
+ * @param file_name the name of the file
+ * @returns true(1) if successful, false(0) if couldn't generate the MultiHash to be displayed
+ */
+int ipfs_import_print_node_results(const struct HashtableNode* node, const char* file_name);
+
 /**
  * called from the command line
  * @param argc the number of arguments
@@ -124,6 +124,17 @@ int ipfs_hashtable_node_protobuf_encode(const struct HashtableNode* node, unsign
  */
 int ipfs_hashtable_node_protobuf_decode(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node);
 
+/***
+ * Decode a stream of bytes into a Node structure, with the data of the node
+ * pointing into the buffer rather than copied
+ * NOTE: the buffer must outlive the node, which is freed with ipfs_hashtable_node_view_free
+ * @param buffer where to get the bytes from
+ * @param buffer_length the length of buffer
+ * @param node pointer to the Node to be created
+ * @returns true(1) on success
+ */
+int ipfs_hashtable_node_protobuf_decode_view(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node);
+
 /*====================================================================================
  * Node Functions
  *===================================================================================*/
@@ -188,6 +199,13 @@ unsigned char * ipfs_hashtable_node_get_data(struct HashtableNode * N);
  */
 int ipfs_hashtable_node_free(struct HashtableNode * N);
 
+/***
+ * Free a node from ipfs_hashtable_node_protobuf_decode_view. Its data is left alone.
+ * @param node the node
+ * @returns true(1)
+ */
+int ipfs_hashtable_node_view_free(struct HashtableNode* node);
+
 /*ipfs_node_get_link_by_name
  * Returns a copy of the link with given name
  * @param Name: (char * name) searches for link with this name
@@ -0,0 +1,28 @@
+#ifndef __REPO_CONFIG_BLOCKSTORE_H__
+#define __REPO_CONFIG_BLOCKSTORE_H__
+
+/***
+ * Settings for the on-disk blockstore
+ */
+struct BlockstoreConfig {
+	char* type; // "flatfs" for a file per block, or "pack" to append them to segments
+	char* shard_func; // i.e. "/repo/flatfs/shard/v1/next-to-last/2"
+	int cache_size; // bytes of blocks kept in memory (0 to read everything from the disk)
+	int pack_segment_size; // the size at which a pack segment is sealed
+};
+
+/***
+ * allocate memory and initialize the blockstore config struct
+ * @param config a pointer to the struct to be allocated
+ * @returns true(1) on success, false(0) otherwise
+ */
+int repo_config_blockstore_new(struct BlockstoreConfig** config);
+
+/***
+ * Frees memory of a blockstore config struct
+ * @param config the struct
+ * @returns true(1)
+ */
+int repo_config_blockstore_free(struct BlockstoreConfig* config);
+
+#endif
@@ -8,6 +8,7 @@
 #include "addresses.h"
 #include "gateway.h"
 #include "replication.h"
+#include "blockstore.h"
 
 struct MDNS {
 	int enabled;
@@ -31,6 +32,32 @@ struct Reprovider {
 	char* interval;
 };
 
+/***
+ * When a batch of datastore writes is flushed
+ */
+struct DatastoreBatch {
+	int max_entries;
+	int max_seconds;
+};
+
+struct Importer {
+	int max_links; // the most links in one node of a file's DAG
+	char* chunker; // how files are split, i.e. "size-262144" or "rabin" (see importer/chunker.h)
+	int workers; // threads that store the chunks of a file (0 for one per processor, 1 to import on the calling thread)
+};
+
+struct Exporter {
+	int prefetch; // blocks fetched at a time while writing a file (1 to fetch them one by one)
+	int prefetch_bytes; // the most bytes fetched ahead of what is written
+};
+
+struct BitswapConfig {
+	int timeout_seconds; // how long to wait for a block from the network
+	int poll_milliseconds; // the longest wait between looks for messages from peers, once nothing has happened for a while
+	int provider_delay_milliseconds; // how long the peers of a session have to send a block before the routing is asked
+	int verify_workers; // threads that check blocks against their Cids (0 for one per processor, 1 to check on the network thread)
+};
+
 struct RepoConfig {
 	struct Identity* identity;
 	struct Datastore* datastore;
@@ -46,6 +73,11 @@ struct RepoConfig {
 	//struct api api;
 	struct Reprovider reprovider;
 	struct Replication* replication;
+	struct BlockstoreConfig* blockstore;
+	struct DatastoreBatch datastore_batch;
+	struct Importer importer;
+	struct Exporter exporter;
+	struct BitswapConfig bitswap;
 };
 
 /**
@@ -5,11 +5,26 @@
 #define fs_repo_h
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "ipfs/repo/config/config.h"
 #include "ipfs/unixfs/unixfs.h"
 #include "ipfs/merkledag/node.h"
 #include "ipfs/blocks/block.h"
+#include "ipfs/flatfs/flatfs.h"
+#include "ipfs/blocks/block_cache.h"
+#include "ipfs/blocks/blockstore_filter.h"
+#include "ipfs/blocks/pack_store.h"
+#include "ipfs/blocks/blockstore_sync.h"
+
+// there while the repo is open, and empty once it was closed cleanly
+#define FS_REPO_OPEN_FILENAME "repo.open"
+// locked by a process while it marks the repo open or closed, so nothing changes between
+// finding out it is the only one and holding its shared lock
+#define FS_REPO_OPEN_GATE_FILENAME "repo.open.lock"
+// holds a file for each process that has the repo open, removed when it closes the repo.
+// A file left there means a process died with the repo open, even if others had it open too.
+#define FS_REPO_OPEN_DIRECTORY "repo.open.d"
 
 /**
  * a structure to hold the repo info
@@ -19,6 +34,15 @@ struct FSRepo {
 	char* path;
 	struct IOCloser* lock_file;
 	struct RepoConfig* config;
+	struct FlatfsShard blockstore_shard; // how the blockstore directory is laid out
+	struct BlockCache* block_cache; // the blocks read recently (NULL if there is no cache)
+	struct BlockstoreFilter* blockstore_filter; // the keys in the blockstore (NULL if there is no filter)
+	struct PackStore* pack_store; // where blocks are written if Blockstore.Type is "pack" (otherwise NULL)
+	struct BlockstoreSync* blockstore_sync; // makes blockstore files durable (NULL until the blockstore is open)
+	int open_fd; // FS_REPO_OPEN_FILENAME, locked shared while the repo is open (or -1)
+	off_t open_size; // the size of FS_REPO_OPEN_FILENAME once this process marked it. Each process that opens the repo adds a byte.
+	int open_shared; // another process had the repo open when this one opened it
+	char* open_marker; // the file of this process in FS_REPO_OPEN_DIRECTORY (or NULL)
 };
 
 /**
@@ -67,6 +91,58 @@ int ipfs_repo_fsrepo_free(struct FSRepo* config);
  */
 int ipfs_repo_fsrepo_init(struct FSRepo* config);
 
+/***
+ * Find out if another process has had the repo open since this one opened it. If so, it
+ * may have written blocks this process does not know about.
+ * @param fs_repo the repo
+ * @returns true(1) if another process may have written to the repo
+ */
+int ipfs_repo_fsrepo_shared(const struct FSRepo* fs_repo);
+
+/***
+ * Read the SHARDING file of the blockstore into fs_repo->blockstore_shard. If there is none,
+ * this is a repository from before sharding, and everything is in one directory.
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_open(struct FSRepo* fs_repo);
+
+/***
+ * Drop the datastore records of blocks that are missing or corrupt, and remove the
+ * temporary files of writes that never finished. This is what a crash can leave.
+ * NOTE: Nothing else should be using the repo.
+ * @param fs_repo the repo, with its blockstore open
+ * @param records_dropped the number of records dropped (can be NULL)
+ * @param files_removed the number of temporary files removed (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_scrub(struct FSRepo* fs_repo, size_t* records_dropped, size_t* files_removed);
+
+/***
+ * Begin holding datastore writes, so that many can be committed together.
+ * Flushes happen based on the DatastoreBatch section of the config.
+ * NOTE: Each call must be matched with a call to ipfs_repo_fsrepo_batch_commit
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_batch_begin(const struct FSRepo* fs_repo);
+
+/***
+ * End a batch started with ipfs_repo_fsrepo_batch_begin, writing what is pending
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_batch_commit(const struct FSRepo* fs_repo);
+
+/***
+ * Determine if the datastore has a record for this hash. For LMDB, this does not copy the record.
+ * @param hash the hash to look for
+ * @param hash_length the length of the hash
+ * @param fs_repo the repo
+ * @returns true(1) if found
+ */
+int ipfs_repo_fsrepo_datastore_has(const unsigned char* hash, size_t hash_length, const struct FSRepo* fs_repo);
+
 /***
  * Write a block to the datastore and blockstore
  * @param block the block to write
@@ -3,6 +3,17 @@
 
 #include "libp2p/db/datastore.h"
 
+/***
+ * A zero-copy look at a record. "data" points into the database's memory map,
+ * and is only valid until the view is released.
+ */
+struct LmdbView {
+	const unsigned char* data;
+	size_t data_size;
+	void* read_handle; // the read-only transaction that keeps the data valid
+	unsigned char* copy; // the data, if it was copied from a batch that is not written yet (otherwise NULL)
+};
+
 /***
  * Places the LMDB methods into the datastore's function pointers
  * @param datastore the datastore to fill
@@ -27,6 +38,78 @@ int repo_fsrepro_lmdb_open(int argc, char** argv, struct Datastore* datastore);
  */
 int repo_fsrepo_lmdb_close(struct Datastore* datastore);
 
+/***
+ * Look at a record without copying it. The data points into the memory map, and
+ * stays valid until repo_fsrepo_lmdb_release_view is called.
+ * NOTE: Do not hold a view for long. It pins the pages it points to.
+ * @param key the key to look for
+ * @param key_size the length of the key
+ * @param view where to put the results
+ * @param datastore where to look for the data
+ * @returns true(1) on success, false(0) if not found. Only call release_view on success.
+ */
+int repo_fsrepo_lmdb_get_view(const unsigned char* key, size_t key_size, struct LmdbView* view, const struct Datastore* datastore);
+
+/***
+ * Release a view from repo_fsrepo_lmdb_get_view. The data is no longer valid after this.
+ * @param view the view
+ * @param datastore the datastore
+ * @returns true(1)
+ */
+int repo_fsrepo_lmdb_release_view(struct LmdbView* view, const struct Datastore* datastore);
+
+/***
+ * Start holding puts in memory, so many of them can be written in one transaction.
+ * Batches nest. The puts are written when the batch becomes full, is too old, or
+ * when the outermost batch is committed. Gets always see pending puts, without writing them.
+ * If a batch cannot be written, its puts are dropped, and the next put, flush or commit fails.
+ * @param max_entries write the batch when it holds this many puts (0 = no limit)
+ * @param max_seconds write the batch when the oldest put is this old (0 = no limit)
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_begin(size_t max_entries, int max_seconds, const struct Datastore* datastore);
+
+/***
+ * Add many records in one transaction
+ * @param keys the keys
+ * @param key_sizes the length of each key
+ * @param data the values
+ * @param data_sizes the length of each value
+ * @param count the number of records
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_put_many(unsigned char** keys, size_t* key_sizes, unsigned char** data, size_t* data_sizes, size_t count, const struct Datastore* datastore);
+
+/***
+ * Set or remove many records in one transaction. Unlike a put, a record that is
+ * already there is replaced.
+ * NOTE: this does not go through the batch, so do not mix it with batched puts of the same keys
+ * @param keys the keys
+ * @param key_sizes the length of each key
+ * @param data the new values (NULL to remove the record)
+ * @param data_sizes the length of each value
+ * @param count the number of records
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_replace_many(unsigned char** keys, size_t* key_sizes, unsigned char** data, size_t* data_sizes, size_t count, const struct Datastore* datastore);
+
+/***
+ * Write any pending puts now, without ending the batch
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_flush(const struct Datastore* datastore);
+
+/***
+ * End a batch. When the outermost batch ends, pending puts are written.
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_commit(const struct Datastore* datastore);
+
 /***
  * Creates the directory
  * @param datastore contains the path that needs to be created
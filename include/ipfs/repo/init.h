@@ -30,3 +30,21 @@ int ipfs_repo_init(int argc, char** argv);
  */
 int ipfs_repo_get_directory(int argc, char** argv, char** repo_dir);
 
+
+/***
+ * Move the blockstore to a new shard function, called from the command line
+ * NOTE: the daemon must not be running while this happens
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @returns true(1) on success, false(0) otherwise
+ */
+int ipfs_repo_reshard(int argc, char** argv);
+
+/***
+ * Remove the dead space of the pack store, called from the command line
+ * NOTE: the daemon must not be running while this happens
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @returns true(1) on success, false(0) otherwise
+ */
+int ipfs_repo_compact(int argc, char** argv);
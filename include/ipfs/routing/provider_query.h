@@ -0,0 +1,130 @@
+#pragma once
+/***
+ * Asks the connected peers for the providers of a key, several at a time.
+ *
+ * The peers are asked in order of how fast they answered before. Up to
+ * ROUTING_PROVIDER_QUERY_ALPHA questions are out at once, and the first answer
+ * that has providers is used. The questions are asked by a pool of
+ * ROUTING_PROVIDER_QUERY_WORKERS threads that lives as long as the routing.
+ *
+ * A peer is only asked one question at a time, as its stream can not tell the answers
+ * apart. Everything that asks a peer claims it first (see ipfs_routing_peer_times_ask),
+ * and a peer that has a question out for another query is asked after the others,
+ * once it is free. The questions still out when a query ends are not waited for. An
+ * answer with providers that comes after that is kept, and the next query for the
+ * same key uses it instead of asking that peer again.
+ */
+
+#include <pthread.h>
+#include "ipfs/util/thread_pool.h"
+#include "libp2p/conn/session.h"
+#include "libp2p/peer/peer.h"
+#include "libp2p/record/message.h"
+#include "libp2p/utils/vector.h"
+
+// the most peers asked at a time
+#define ROUTING_PROVIDER_QUERY_ALPHA 3
+// the threads that ask, shared by every query
+#define ROUTING_PROVIDER_QUERY_WORKERS (ROUTING_PROVIDER_QUERY_ALPHA * 4)
+// the time (in milliseconds) given to a peer that has not been asked yet
+#define ROUTING_PEER_TIME_UNKNOWN 500
+// the time (in milliseconds) given to a peer that did not answer
+#define ROUTING_PEER_TIME_FAILED 5000
+// how often (in milliseconds) a query that waits for a busy peer looks to see if it is over
+#define ROUTING_PROVIDER_QUERY_WAIT_MILLISECONDS 100
+
+struct IpfsRouting;
+
+/***
+ * How fast a peer answers
+ */
+struct RoutingPeerTime {
+	struct Libp2pPeer* peer;
+	long long milliseconds; // the average time of an answer
+	int busy; // a question is out
+	struct Libp2pMessage* late; // an answer with providers that came after its query ended
+	unsigned char* late_key; // what the late answer was asked for
+	size_t late_key_size;
+};
+
+/***
+ * How fast the peers answer, and the workers that ask them
+ */
+struct RoutingPeerTimes {
+	pthread_mutex_t lock;
+	pthread_cond_t peer_released; // a peer's question was answered (or was not)
+	struct Libp2pVector* times; // of RoutingPeerTime
+	threadpool pool; // the workers, that may still be asking for a query that is over
+	// asks a peer (ipfs_routing_online_send_receive_message, unless a test stands in for the network)
+	struct Libp2pMessage* (*send_receive)(struct SessionContext* sessionContext, struct Libp2pMessage* message);
+};
+
+/***
+ * Create a new RoutingPeerTimes
+ * @returns the RoutingPeerTimes, or NULL on error
+ */
+struct RoutingPeerTimes* ipfs_routing_peer_times_new();
+
+/***
+ * Wait for the workers that are still asking, and free the resources of a RoutingPeerTimes
+ * @param times the RoutingPeerTimes
+ * @returns true(1)
+ */
+int ipfs_routing_peer_times_free(struct RoutingPeerTimes* times);
+
+/***
+ * How fast a peer answers
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @returns the average milliseconds, or ROUTING_PEER_TIME_UNKNOWN if it was never asked
+ */
+long long ipfs_routing_peer_times_get(struct RoutingPeerTimes* times, const struct Libp2pPeer* peer);
+
+/***
+ * Record how long a peer took to answer
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param milliseconds how long it took, or ROUTING_PEER_TIME_FAILED if it did not answer
+ */
+void ipfs_routing_peer_times_record(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, long long milliseconds);
+
+/***
+ * Mark a peer as having a question out, unless it already has one
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @returns true(1) if the peer can be asked
+ */
+int ipfs_routing_peer_times_claim(struct RoutingPeerTimes* times, struct Libp2pPeer* peer);
+
+/***
+ * The peer answered (or did not). Record the time, and let it be asked again.
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param milliseconds how long it took, or ROUTING_PEER_TIME_FAILED if it did not answer
+ */
+void ipfs_routing_peer_times_release(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, long long milliseconds);
+
+/***
+ * Ask a peer something, once nothing else is asking it
+ * @param times the RoutingPeerTimes (NULL to ask right away)
+ * @param peer the peer
+ * @param message the question
+ * @returns the answer, or NULL
+ */
+struct Libp2pMessage* ipfs_routing_peer_times_ask(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, struct Libp2pMessage* message);
+
+/***
+ * Build the list of connected peers, the fastest first
+ * @param routing the context
+ * @returns a vector of Libp2pPeers, or NULL on error
+ */
+struct Libp2pVector* ipfs_routing_provider_query_peers(struct IpfsRouting* routing);
+
+/***
+ * Ask the connected peers who can provide a key, ROUTING_PROVIDER_QUERY_ALPHA at a time
+ * @param routing the context (its peer_times keeps the times)
+ * @param key the key
+ * @param key_size the length of the key
+ * @returns the first answer that has providers, or NULL
+ */
+struct Libp2pMessage* ipfs_routing_provider_query(struct IpfsRouting* routing, const unsigned char* key, size_t key_size);
@@ -12,6 +12,7 @@ struct IpfsRouting {
 	struct IpfsNode* local_node;
 	size_t ds_len;
 	struct RsaPrivateKey* sk;
+	struct RoutingPeerTimes* peer_times; // how fast the peers answer (online only, otherwise NULL)
 
 	/**
 	 * Put a value in the datastore
@@ -82,6 +83,7 @@ ipfs_routing* ipfs_routing_new_offline (struct IpfsNode* local_node, struct RsaP
 // online using secio, should probably be deprecated
 ipfs_routing* ipfs_routing_new_online (struct IpfsNode* local_node, struct RsaPrivateKey* private_key);
 int ipfs_routing_online_free(ipfs_routing*);
+struct Libp2pMessage* ipfs_routing_online_send_receive_message(struct SessionContext* sessionContext, struct Libp2pMessage* message);
 // online using DHT/kademlia, the recommended router
 ipfs_routing* ipfs_routing_new_kademlia(struct IpfsNode* local_node, struct RsaPrivateKey* private_key);
 // generic routines
@@ -67,6 +67,13 @@ int ipfs_unixfs_new(struct UnixFS** obj);
  */
 int ipfs_unixfs_free(struct UnixFS* obj);
 
+/***
+ * Free a UnixFS struct from ipfs_unixfs_protobuf_decode_view. Its bytes are left alone.
+ * @param obj the struct to free
+ * @returns true(1)
+ */
+int ipfs_unixfs_view_free(struct UnixFS* obj);
+
 /***
  * Write data to data section of a UnixFS stuct. NOTE: this also calculates a sha256 hash
  * @param data the data to write
@@ -106,3 +113,14 @@ int ipfs_unixfs_protobuf_encode(const struct UnixFS* incoming, unsigned char* ou
  * @param outgoing the UnixFS object
  */
 int ipfs_unixfs_protobuf_decode(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing);
+
+/***
+ * Decodes a protobuf array of bytes into a UnixFS object, with its bytes
+ * pointing into the array rather than copied
+ * NOTE: the array must outlive the object, which is freed with ipfs_unixfs_view_free
+ * @param incoming the array of bytes
+ * @param incoming_size the length of the array
+ * @param outgoing the UnixFS object
+ * @returns true(1) on success
+ */
+int ipfs_unixfs_protobuf_decode_view(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing);
@@ -59,6 +59,8 @@ void strip_quotes(int argc, char** argv) {
 #define DAEMON 6
 #define PING 7
 #define GET 8
+#define REPO_RESHARD 9
+#define REPO_COMPACT 10
 
 /***
  * Basic parsing of command line arguments to figure out where the user wants to go
@@ -92,6 +94,12 @@ int parse_arguments(int argc, char** argv) {
 	if (strcmp("get", argv[1]) == 0) {
 		return GET;
 	}
+	if (strcmp("repo", argv[1]) == 0 && argc > 2 && strcmp("reshard", argv[2]) == 0) {
+		return REPO_RESHARD;
+	}
+	if (strcmp("repo", argv[1]) == 0 && argc > 2 && strcmp("compact", argv[2]) == 0) {
+		return REPO_COMPACT;
+	}
 	return -1;
 }
 
@@ -136,6 +144,12 @@ int main(int argc, char** argv) {
 	case (PING):
 		ipfs_ping(argc, argv);
 		break;
+	case (REPO_RESHARD):
+		ipfs_repo_reshard(argc, argv);
+		break;
+	case (REPO_COMPACT):
+		ipfs_repo_compact(argc, argv);
+		break;
 	}
 	libp2p_logger_free();
 }
@@ -25,20 +25,31 @@ int ipfs_merkledag_add(struct HashtableNode* node, struct FSRepo* fs_repo, size_
 
 	// compute the hash if necessary
 	if (node->hash == NULL) {
+		// NOTE: this can be the size of a whole chunk, so keep it off the stack
 		size_t protobuf_size = ipfs_hashtable_node_protobuf_encode_size(node);
-		unsigned char protobuf[protobuf_size];
+		unsigned char* protobuf = (unsigned char*)malloc(protobuf_size);
+		if (protobuf == NULL)
+			return 0;
 		size_t bytes_encoded;
 		retVal = ipfs_hashtable_node_protobuf_encode(node, protobuf, protobuf_size, &bytes_encoded);
+		if (retVal == 0) {
+			free(protobuf);
+			return 0;
+		}
 
 		node->hash_size = 32;
 		node->hash = (unsigned char*)malloc(node->hash_size);
 		if (node->hash == NULL) {
+			free(protobuf);
 			return 0;
 		}
 		if (libp2p_crypto_hashing_sha256(protobuf, bytes_encoded, &node->hash[0]) == 0) {
+			free(protobuf);
 			free(node->hash);
+			node->hash = NULL;
 			return 0;
 		}
+		free(protobuf);
 	}
 
 	// write to block store & datastore
@@ -61,16 +72,9 @@ int ipfs_merkledag_add(struct HashtableNode* node, struct FSRepo* fs_repo, size_
  */
 int ipfs_merkledag_get(const unsigned char* hash, size_t hash_size, struct HashtableNode** node, const struct FSRepo* fs_repo) {
 	int retVal = 1;
-	size_t key_length = 100;
-	unsigned char key[key_length];
-
-	// look for the node in the datastore. If it is not there, it is not a node.
-	// If it exists, it is only a block.
-	retVal = fs_repo->config->datastore->datastore_get((char*)hash, hash_size, key, key_length, &key_length, fs_repo->config->datastore);
-	if (retVal == 0)
-		return 0;
 
-	// we have the record from the db. Go get the node from the blockstore
+	// look for the node in the datastore (if it is not there, it is not a node),
+	// then get the node from the blockstore
 	retVal = ipfs_repo_fsrepo_node_read(hash, hash_size, node, fs_repo);
 	if (retVal == 0) {
 		return 0;
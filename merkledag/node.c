@@ -13,6 +13,7 @@
 #include "ipfs/cid/cid.h"
 #include "ipfs/merkledag/node.h"
 #include "ipfs/unixfs/unixfs.h"
+#include "varint.h"
 
 extern char *strtok_r(char *, const char *, char **);
 
@@ -282,7 +283,7 @@ int ipfs_hashtable_node_protobuf_encode(const struct HashtableNode* node, unsign
  * @param node pointer to the Node to be created
  * @returns true(1) on success
  */
-int ipfs_hashtable_node_protobuf_decode(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node) {
+int ipfs_hashtable_node_protobuf_decode_internal(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node, int borrow) {
 	/*
 	 * Field 1: data
 	 * Field 2: link
@@ -306,6 +307,16 @@ int ipfs_hashtable_node_protobuf_decode(unsigned char* buffer, size_t buffer_len
 		pos += bytes_read;
 		switch(field_no) {
 			case (1): { // data
+				if (borrow) {
+					// point into the buffer rather than copying it
+					size_t data_size = varint_decode(&buffer[pos], buffer_length - pos, &bytes_read);
+					if (bytes_read == 0 || data_size > buffer_length - pos - bytes_read)
+						goto exit;
+					(*node)->data = &buffer[pos + bytes_read];
+					(*node)->data_size = data_size;
+					pos += bytes_read + data_size;
+					break;
+				}
 				if (protobuf_decode_length_delimited(&buffer[pos], buffer_length - pos, (char**)&((*node)->data), &((*node)->data_size), &bytes_read) == 0)
 					goto exit;
 				pos += bytes_read;
@@ -329,7 +340,10 @@ int ipfs_hashtable_node_protobuf_decode(unsigned char* buffer, size_t buffer_len
 
 exit:
 	if (retVal == 0) {
-		ipfs_hashtable_node_free(*node);
+		if (borrow)
+			ipfs_hashtable_node_view_free(*node);
+		else
+			ipfs_hashtable_node_free(*node);
 	}
 	if (temp_buffer != NULL)
 		free(temp_buffer);
@@ -337,6 +351,30 @@ exit:
 	return retVal;
 }
 
+/***
+ * Decode a stream of bytes into a Node structure
+ * @param buffer where to get the bytes from
+ * @param buffer_length the length of buffer
+ * @param node pointer to the Node to be created
+ * @returns true(1) on success
+ */
+int ipfs_hashtable_node_protobuf_decode(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node) {
+	return ipfs_hashtable_node_protobuf_decode_internal(buffer, buffer_length, node, 0);
+}
+
+/***
+ * Decode a stream of bytes into a Node structure, with the data of the node
+ * pointing into the buffer rather than copied
+ * NOTE: the buffer must outlive the node, which is freed with ipfs_hashtable_node_view_free
+ * @param buffer where to get the bytes from
+ * @param buffer_length the length of buffer
+ * @param node pointer to the Node to be created
+ * @returns true(1) on success
+ */
+int ipfs_hashtable_node_protobuf_decode_view(unsigned char* buffer, size_t buffer_length, struct HashtableNode** node) {
+	return ipfs_hashtable_node_protobuf_decode_internal(buffer, buffer_length, node, 1);
+}
+
 /*====================================================================================
  * Node Functions
  *===================================================================================*/
@@ -514,6 +552,20 @@ int ipfs_node_remove_link(struct HashtableNode* node, struct NodeLink* toRemove)
 	return 0;
 }
 
+/***
+ * Free a node from ipfs_hashtable_node_protobuf_decode_view. Its data is left alone.
+ * @param node the node
+ * @returns true(1)
+ */
+int ipfs_hashtable_node_view_free(struct HashtableNode* node) {
+	if (node != NULL) {
+		// the data belongs to the buffer the node was decoded from
+		node->data = NULL;
+		node->data_size = 0;
+	}
+	return ipfs_hashtable_node_free(node);
+}
+
 /*ipfs_node_free
  * Once you are finished using a node, always delete it using this.
  * It will take care of the links inside it.
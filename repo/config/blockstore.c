@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipfs/blocks/pack_store.h"
+#include "ipfs/flatfs/flatfs.h"
+#include "ipfs/repo/config/blockstore.h"
+
+/***
+ * allocate memory and initialize the blockstore config struct
+ * @param config a pointer to the struct to be allocated
+ * @returns true(1) on success, false(0) otherwise
+ */
+int repo_config_blockstore_new(struct BlockstoreConfig** config) {
+	*config = (struct BlockstoreConfig*)malloc(sizeof(struct BlockstoreConfig));
+	if (*config == NULL)
+		return 0;
+	struct BlockstoreConfig* out = *config;
+	out->type = malloc(strlen("flatfs") + 1);
+	out->shard_func = malloc(strlen(FLATFS_DEFAULT_SHARD) + 1);
+	if (out->type == NULL || out->shard_func == NULL) {
+		free(out->type);
+		free(out->shard_func);
+		free(out);
+		*config = NULL;
+		return 0;
+	}
+	strcpy(out->type, "flatfs");
+	strcpy(out->shard_func, FLATFS_DEFAULT_SHARD);
+	out->cache_size = 64 * 1024 * 1024;
+	out->pack_segment_size = PACK_STORE_SEGMENT_BYTES;
+	return 1;
+}
+
+/***
+ * Frees memory of a blockstore config struct
+ * @param config the struct
+ * @returns true(1)
+ */
+int repo_config_blockstore_free(struct BlockstoreConfig* config) {
+	if (config != NULL) {
+		if (config->type != NULL)
+			free(config->type);
+		if (config->shard_func != NULL)
+			free(config->shard_func);
+		free(config);
+	}
+	return 1;
+}
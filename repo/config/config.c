@@ -7,6 +7,7 @@
 #include "libp2p/os/utils.h"
 #include "ipfs/repo/config/bootstrap_peers.h"
 #include "ipfs/repo/config/swarm.h"
+#include "ipfs/importer/chunker.h"
 #include "libp2p/db/filestore.h"
 #include "multiaddr/multiaddr.h"
 
@@ -187,6 +188,20 @@ int ipfs_repo_config_new(struct RepoConfig** config) {
 
 	// set initial values
 	(*config)->bootstrap_peers = NULL;
+	(*config)->datastore_batch.max_entries = 1024;
+	(*config)->datastore_batch.max_seconds = 5;
+	(*config)->bitswap.timeout_seconds = 60;
+	(*config)->bitswap.poll_milliseconds = 1000;
+	(*config)->bitswap.provider_delay_milliseconds = 1000;
+	(*config)->bitswap.verify_workers = 0;
+	(*config)->exporter.prefetch = 16;
+	(*config)->exporter.prefetch_bytes = 16 * 1024 * 1024;
+	(*config)->importer.max_links = 174;
+	(*config)->importer.workers = 0;
+	(*config)->importer.chunker = malloc(strlen(IPFS_CHUNKER_DEFAULT) + 1);
+	if ((*config)->importer.chunker == NULL)
+		return 0;
+	strcpy((*config)->importer.chunker, IPFS_CHUNKER_DEFAULT);
 
 	int retVal = 1;
 	retVal = repo_config_identity_new(&((*config)->identity));
@@ -210,6 +225,9 @@ int ipfs_repo_config_new(struct RepoConfig** config) {
 	if (!repo_config_replication_new(&((*config)->replication)))
 		return 0;
 
+	if (!repo_config_blockstore_new(&((*config)->blockstore)))
+		return 0;
+
 	return 1;
 }
 
@@ -234,6 +252,10 @@ int ipfs_repo_config_free(struct RepoConfig* config) {
 			repo_config_gateway_free(config->gateway);
 		if (config->replication != NULL)
 			repo_config_replication_free(config->replication);
+		if (config->blockstore != NULL)
+			repo_config_blockstore_free(config->blockstore);
+		if (config->importer.chunker != NULL)
+			free(config->importer.chunker);
 		free(config);
 	}
 	return 1;
@@ -1,12 +1,19 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "libp2p/crypto/encoding/base64.h"
 #include "libp2p/crypto/key.h"
+#include "libp2p/crypto/sha256.h"
 #include "libp2p/peer/peer.h"
+#include "libp2p/utils/logger.h"
 #include "libp2p/utils/vector.h"
 #include "ipfs/blocks/blockstore.h"
 #include "ipfs/datastore/ds_helper.h"
+#include "ipfs/importer/chunker.h"
 #include "libp2p/db/datastore.h"
 #include "libp2p/db/filestore.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
@@ -69,6 +76,26 @@ int repo_config_write_config_file(char* full_filename, struct RepoConfig* config
 	fprintf(out_file, "  \"NoSync\": %s,\n", config->datastore->no_sync ? "true" : "false");
 	fprintf(out_file, "  \"HashOnRead\": %s,\n", config->datastore->hash_on_read ? "true" : "false");
 	fprintf(out_file, "  \"BloomFilterSize\": %d\n", config->datastore->bloom_filter_size);
+	fprintf(out_file, " },\n \"Blockstore\": {\n");
+	fprintf(out_file, "  \"Type\": \"%s\",\n", config->blockstore->type);
+	fprintf(out_file, "  \"ShardFunc\": \"%s\",\n", config->blockstore->shard_func);
+	fprintf(out_file, "  \"CacheSize\": %d,\n", config->blockstore->cache_size);
+	fprintf(out_file, "  \"PackSegmentSize\": %d\n", config->blockstore->pack_segment_size);
+	fprintf(out_file, " },\n \"DatastoreBatch\": {\n");
+	fprintf(out_file, "  \"MaxEntries\": %d,\n", config->datastore_batch.max_entries);
+	fprintf(out_file, "  \"MaxSeconds\": %d\n", config->datastore_batch.max_seconds);
+	fprintf(out_file, " },\n \"Importer\": {\n");
+	fprintf(out_file, "  \"MaxLinks\": %d,\n", config->importer.max_links);
+	fprintf(out_file, "  \"Workers\": %d,\n", config->importer.workers);
+	fprintf(out_file, "  \"Chunker\": \"%s\"\n", config->importer.chunker != NULL ? config->importer.chunker : IPFS_CHUNKER_DEFAULT);
+	fprintf(out_file, " },\n \"Exporter\": {\n");
+	fprintf(out_file, "  \"Prefetch\": %d,\n", config->exporter.prefetch);
+	fprintf(out_file, "  \"PrefetchBytes\": %d\n", config->exporter.prefetch_bytes);
+	fprintf(out_file, " },\n \"Bitswap\": {\n");
+	fprintf(out_file, "  \"TimeoutSeconds\": %d,\n", config->bitswap.timeout_seconds);
+	fprintf(out_file, "  \"PollMilliseconds\": %d,\n", config->bitswap.poll_milliseconds);
+	fprintf(out_file, "  \"ProviderDelayMilliseconds\": %d,\n", config->bitswap.provider_delay_milliseconds);
+	fprintf(out_file, "  \"VerifyWorkers\": %d\n", config->bitswap.verify_workers);
 	fprintf(out_file, " },\n \"Addresses\": {\n");
 	fprintf(out_file, "  \"Swarm\": [\n");
 	struct Libp2pLinkedList* current = config->addresses->swarm_head;
@@ -163,6 +190,17 @@ int ipfs_repo_fsrepo_new(const char* repo_path, struct RepoConfig* config, struc
 		(*repo)->path = (char*)malloc(len);
 		strncpy((*repo)->path, repo_path, len);
 	}
+	// older repositories have no SHARDING file, and keep everything in one directory
+	(*repo)->blockstore_shard.type = FLATFS_SHARD_NONE;
+	(*repo)->blockstore_shard.length = 0;
+	(*repo)->block_cache = NULL;
+	(*repo)->blockstore_filter = NULL;
+	(*repo)->pack_store = NULL;
+	(*repo)->blockstore_sync = NULL;
+	(*repo)->open_fd = -1;
+	(*repo)->open_size = 0;
+	(*repo)->open_shared = 1;
+	(*repo)->open_marker = NULL;
 	// allocate other structures
 	if (config != NULL)
 		(*repo)->config = config;
@@ -175,6 +213,234 @@ int ipfs_repo_fsrepo_new(const char* repo_path, struct RepoConfig* config, struc
 	return 1;
 }
 
+/***
+ * Empty the filter of the keys in the blockstore, and fill it again by listing the blockstore
+ * @param fs_repo the repo, with its filter
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_filter_rebuild(struct FSRepo* fs_repo) {
+	struct BlockstoreFilter* filter = fs_repo->blockstore_filter;
+	size_t full_path_size = strlen(fs_repo->path) + 15;
+	char full_path[full_path_size];
+	if (!os_utils_filepath_join(fs_repo->path, "blockstore", full_path, full_path_size))
+		return 0;
+	memset(filter->counters, 0, filter->size);
+	if (!ipfs_blockstore_filter_fill(filter, full_path)
+			|| (fs_repo->pack_store != NULL && !ipfs_pack_store_walk(fs_repo->pack_store, ipfs_blockstore_filter_fill_key, filter))) {
+		libp2p_logger_error("fs_repo", "Unable to list the blockstore, so blocks will always be looked for on disk.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Lock FS_REPO_OPEN_GATE_FILENAME, waiting for any process that is marking the repo open or closed.
+ * A lock on FS_REPO_OPEN_FILENAME cannot go from exclusive to shared without being let go
+ * in between, so this keeps others out while it does.
+ * @param fs_repo the repo
+ * @returns the locked file, to be closed when done, or -1 on error
+ */
+int ipfs_repo_fsrepo_open_gate(struct FSRepo* fs_repo) {
+	size_t filename_length = strlen(fs_repo->path) + strlen(FS_REPO_OPEN_GATE_FILENAME) + 2;
+	char filename[filename_length];
+	if (!os_utils_filepath_join(fs_repo->path, FS_REPO_OPEN_GATE_FILENAME, filename, filename_length))
+		return -1;
+	int fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/***
+ * Look for the files that processes left in FS_REPO_OPEN_DIRECTORY
+ * NOTE: only call this when no other process has the repo open, so each file is of one that died
+ * @param directory FS_REPO_OPEN_DIRECTORY in the repo
+ * @param remove true(1) to remove them
+ * @param found set to true(1) if there were any
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_open_markers_left(const char* directory, int remove, int* found) {
+	int retVal = 1;
+	*found = 0;
+	struct FileList* first = os_utils_list_directory(directory);
+	for(struct FileList* current = first; current != NULL; current = current->next) {
+		if (current->file_name[0] == '.')
+			continue;
+		*found = 1;
+		if (!remove)
+			continue;
+		size_t filename_length = strlen(directory) + strlen(current->file_name) + 2;
+		char filename[filename_length];
+		if (!os_utils_filepath_join(directory, current->file_name, filename, filename_length) || unlink(filename) != 0)
+			retVal = 0;
+	}
+	os_utils_free_file_list(first);
+	return retVal;
+}
+
+/***
+ * Leave a file in FS_REPO_OPEN_DIRECTORY for this process, so if it dies with the repo
+ * open, the next process to have the repo to itself knows to check the blockstore
+ * @param fs_repo the repo
+ * @param directory FS_REPO_OPEN_DIRECTORY in the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_open_marker_create(struct FSRepo* fs_repo, const char* directory) {
+	size_t filename_length = strlen(directory) + 8;
+	char* filename = (char*)malloc(filename_length);
+	if (filename == NULL)
+		return 0;
+	if (!os_utils_filepath_join(directory, "XXXXXX", filename, filename_length)) {
+		free(filename);
+		return 0;
+	}
+	int fd = mkstemp(filename);
+	if (fd < 0) {
+		free(filename);
+		return 0;
+	}
+	close(fd);
+	// the file must outlast a crash, or the crash would go unnoticed
+	int directory_fd = open(directory, O_RDONLY);
+	if (directory_fd < 0 || fsync(directory_fd) != 0) {
+		if (directory_fd >= 0)
+			close(directory_fd);
+		unlink(filename);
+		free(filename);
+		return 0;
+	}
+	close(directory_fd);
+	fs_repo->open_marker = filename;
+	return 1;
+}
+
+/***
+ * Mark the repo as open. The first process to open it checks the blockstore if a
+ * process that had it open did not close it. Each process adds a byte to the file, so
+ * the others can tell that it opened the repo, and leaves a file in FS_REPO_OPEN_DIRECTORY
+ * until it closes the repo, so a process that dies beside others is not forgotten.
+ * @param fs_repo the repo, with its blockstore open
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_open_mark(struct FSRepo* fs_repo) {
+	int retVal = 0;
+	int fd = -1;
+	size_t filename_length = strlen(fs_repo->path) + strlen(FS_REPO_OPEN_FILENAME) + 2;
+	char filename[filename_length];
+	if (!os_utils_filepath_join(fs_repo->path, FS_REPO_OPEN_FILENAME, filename, filename_length))
+		return 0;
+	size_t directory_length = strlen(fs_repo->path) + strlen(FS_REPO_OPEN_DIRECTORY) + 2;
+	char directory[directory_length];
+	if (!os_utils_filepath_join(fs_repo->path, FS_REPO_OPEN_DIRECTORY, directory, directory_length))
+		return 0;
+	if (mkdir(directory, S_IRWXU) != 0 && errno != EEXIST)
+		return 0;
+	int gate_fd = ipfs_repo_fsrepo_open_gate(fs_repo);
+	if (gate_fd < 0)
+		return 0;
+	fd = open(filename, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto exit;
+	struct stat file_stat;
+	// while another process has the repo open, what is in the file says nothing, and the
+	// blockstore cannot be checked while it writes, so a crash waits until nobody else has it
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		fs_repo->open_shared = 0;
+		int crashed = 0;
+		if (!ipfs_repo_fsrepo_open_markers_left(directory, 0, &crashed))
+			goto exit;
+		if (crashed || (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)) {
+			size_t records_dropped = 0;
+			size_t files_removed = 0;
+			if (!ipfs_repo_fsrepo_blockstore_scrub(fs_repo, &records_dropped, &files_removed))
+				libp2p_logger_error("fs_repo", "The repo was not closed, and the blockstore could not be checked.\n");
+			else if (records_dropped > 0)
+				libp2p_logger_error("fs_repo", "The repo was not closed. %lu blocks were lost, and are no longer indexed.\n", (unsigned long)records_dropped);
+			libp2p_logger_debug("fs_repo", "Removed %lu unfinished blockstore files.\n", (unsigned long)files_removed);
+			// a saved filter does not have what the process that died wrote
+			if (fs_repo->blockstore_filter != NULL && !ipfs_repo_fsrepo_blockstore_filter_rebuild(fs_repo)) {
+				ipfs_blockstore_filter_free(fs_repo->blockstore_filter);
+				fs_repo->blockstore_filter = NULL;
+			}
+			// only once it was checked, so dying while checking means checking again
+			if (!ipfs_repo_fsrepo_open_markers_left(directory, 1, &crashed) || ftruncate(fd, 0) != 0)
+				goto exit;
+		}
+		// what the processes before wrote is in the blockstore, where the filter was filled from
+		if (fs_repo->blockstore_filter != NULL && !ipfs_blockstore_filter_log_reset(fs_repo->blockstore_filter))
+			goto exit;
+		if (write(fd, "1", 1) != 1 || fsync(fd) != 0 || fstat(fd, &file_stat) != 0)
+			goto exit;
+		fs_repo->open_size = file_stat.st_size;
+		// the lock is let go for a moment here, but nobody else can get past the gate
+		if (flock(fd, LOCK_SH) != 0)
+			goto exit;
+	} else {
+		fs_repo->open_shared = 1;
+		// only a process past the gate holds it exclusively, so this does not wait
+		if (flock(fd, LOCK_SH) != 0)
+			goto exit;
+		// so the processes that have it open know there is another writer
+		if (write(fd, "1", 1) != 1)
+			goto exit;
+	}
+	if (!ipfs_repo_fsrepo_open_marker_create(fs_repo, directory))
+		goto exit;
+	fs_repo->open_fd = fd;
+	fd = -1;
+	retVal = 1;
+	exit:
+	if (fd >= 0)
+		close(fd);
+	close(gate_fd);
+	return retVal;
+}
+
+/***
+ * Find out if another process has had the repo open since this one opened it. If so, it
+ * may have written blocks this process does not know about.
+ * @param fs_repo the repo
+ * @returns true(1) if another process may have written to the repo
+ */
+int ipfs_repo_fsrepo_shared(const struct FSRepo* fs_repo) {
+	if (fs_repo->open_fd < 0 || fs_repo->open_shared)
+		return 1;
+	// the file only grows while this process has it locked
+	struct stat file_stat;
+	if (fstat(fs_repo->open_fd, &file_stat) != 0)
+		return 1;
+	return file_stat.st_size != fs_repo->open_size;
+}
+
+/***
+ * Mark the repo as closed by this process, and closed altogether if no other process has it open
+ * @param fs_repo the repo
+ */
+void ipfs_repo_fsrepo_close_mark(struct FSRepo* fs_repo) {
+	if (fs_repo->open_fd < 0)
+		return;
+	// so a process that is opening the repo does not take it for closed
+	int gate_fd = ipfs_repo_fsrepo_open_gate(fs_repo);
+	// this process is done, whether or not others still have the repo open
+	if (fs_repo->open_marker != NULL) {
+		if (unlink(fs_repo->open_marker) != 0)
+			libp2p_logger_error("fs_repo", "Unable to mark the repo as closed.\n");
+		free(fs_repo->open_marker);
+		fs_repo->open_marker = NULL;
+	}
+	// if another process has it open, that process marks it closed
+	if (gate_fd >= 0 && flock(fs_repo->open_fd, LOCK_EX | LOCK_NB) == 0 && ftruncate(fs_repo->open_fd, 0) != 0)
+		libp2p_logger_error("fs_repo", "Unable to mark the repo as closed.\n");
+	close(fs_repo->open_fd);
+	fs_repo->open_fd = -1;
+	if (gate_fd >= 0)
+		close(gate_fd);
+}
+
 /**
  * Cleans up memory
  * @param repo the struct to clean up
@@ -182,10 +448,46 @@ int ipfs_repo_fsrepo_new(const char* repo_path, struct RepoConfig* config, struc
  */
 int ipfs_repo_fsrepo_free(struct FSRepo* repo) {
 	if (repo != NULL) {
+		// nothing should be left in a batch, but just in case
+		if (repo->config != NULL && repo->config->datastore != NULL && repo->config->datastore->handle != NULL
+				&& repo->config->datastore->type != NULL && strncmp(repo->config->datastore->type, "lmdb", 4) == 0)
+			repo_fsrepo_lmdb_batch_flush(repo->config->datastore);
+		if (repo->blockstore_filter != NULL) {
+			// so the next open does not have to list the blockstore
+			if (repo->path != NULL) {
+				size_t filename_length = strlen(repo->path) + strlen(BLOCKSTORE_FILTER_FILENAME) + 2;
+				char filename[filename_length];
+				if (!os_utils_filepath_join(repo->path, BLOCKSTORE_FILTER_FILENAME, filename, filename_length)) {
+					libp2p_logger_error("fs_repo", "Unable to save the blockstore filter.\n");
+				} else if (ipfs_repo_fsrepo_shared(repo)) {
+					// it does not have what the other processes wrote, so the next open lists the blockstore
+					unlink(filename);
+				} else if (!ipfs_blockstore_filter_save(repo->blockstore_filter, filename)) {
+					libp2p_logger_error("fs_repo", "Unable to save the blockstore filter.\n");
+				}
+			}
+			ipfs_blockstore_filter_free(repo->blockstore_filter);
+		}
+		if (repo->pack_store != NULL && !ipfs_pack_store_close(repo->pack_store))
+			libp2p_logger_error("fs_repo", "Unable to write the pack index.\n");
+		if (repo->blockstore_sync != NULL) {
+			unsigned long long batches = 0, files = 0, syncs = 0;
+			ipfs_blockstore_sync_stats(repo->blockstore_sync, &batches, &files, &syncs);
+			libp2p_logger_debug("fs_repo", "Blockstore sync: %llu files in %llu batches, %llu syncs.\n", files, batches, syncs);
+			ipfs_blockstore_sync_free(repo->blockstore_sync);
+		}
+		// everything is written, so the next open has nothing to check
+		ipfs_repo_fsrepo_close_mark(repo);
 		if (repo->path != NULL)
 			free(repo->path);
 		if (repo->config != NULL)
 			ipfs_repo_config_free(repo->config);
+		if (repo->block_cache != NULL) {
+			unsigned long long hits = 0, misses = 0;
+			ipfs_block_cache_stats(repo->block_cache, &hits, &misses, NULL);
+			libp2p_logger_debug("fs_repo", "Block cache: %llu hits, %llu misses.\n", hits, misses);
+			ipfs_block_cache_free(repo->block_cache);
+		}
 		free(repo);
 	}
 	return 1;
@@ -426,6 +728,58 @@ int fs_repo_open_config(struct FSRepo* repo) {
 	_get_json_int_value(data, tokens, num_tokens, curr_pos, "HashOnRead", &repo->config->datastore->hash_on_read);
 	_get_json_int_value(data, tokens, num_tokens, curr_pos, "BloomFilterSize", &repo->config->datastore->bloom_filter_size);
 
+	// blockstore
+	int blockstore_pos = _find_token(data, tokens, num_tokens, 0, "Blockstore");
+	if (blockstore_pos >= 0) {
+		char* type = NULL;
+		if (_get_json_string_value(data, tokens, num_tokens, blockstore_pos, "Type", &type)) {
+			free(repo->config->blockstore->type);
+			repo->config->blockstore->type = type;
+		}
+		char* shard_func = NULL;
+		if (_get_json_string_value(data, tokens, num_tokens, blockstore_pos, "ShardFunc", &shard_func)) {
+			free(repo->config->blockstore->shard_func);
+			repo->config->blockstore->shard_func = shard_func;
+		}
+		_get_json_int_value(data, tokens, num_tokens, blockstore_pos, "CacheSize", &repo->config->blockstore->cache_size);
+		_get_json_int_value(data, tokens, num_tokens, blockstore_pos, "PackSegmentSize", &repo->config->blockstore->pack_segment_size);
+	}
+
+	// datastore batches
+	int batch_pos = _find_token(data, tokens, num_tokens, 0, "DatastoreBatch");
+	if (batch_pos >= 0) {
+		_get_json_int_value(data, tokens, num_tokens, batch_pos, "MaxEntries", &repo->config->datastore_batch.max_entries);
+		_get_json_int_value(data, tokens, num_tokens, batch_pos, "MaxSeconds", &repo->config->datastore_batch.max_seconds);
+	}
+
+	// importer
+	int importer_pos = _find_token(data, tokens, num_tokens, 0, "Importer");
+	if (importer_pos >= 0) {
+		_get_json_int_value(data, tokens, num_tokens, importer_pos, "MaxLinks", &repo->config->importer.max_links);
+		_get_json_int_value(data, tokens, num_tokens, importer_pos, "Workers", &repo->config->importer.workers);
+		char* chunker = NULL;
+		if (_get_json_string_value(data, tokens, num_tokens, importer_pos, "Chunker", &chunker)) {
+			free(repo->config->importer.chunker);
+			repo->config->importer.chunker = chunker;
+		}
+	}
+
+	// exporter
+	int exporter_pos = _find_token(data, tokens, num_tokens, 0, "Exporter");
+	if (exporter_pos >= 0) {
+		_get_json_int_value(data, tokens, num_tokens, exporter_pos, "Prefetch", &repo->config->exporter.prefetch);
+		_get_json_int_value(data, tokens, num_tokens, exporter_pos, "PrefetchBytes", &repo->config->exporter.prefetch_bytes);
+	}
+
+	// bitswap
+	int bitswap_pos = _find_token(data, tokens, num_tokens, 0, "Bitswap");
+	if (bitswap_pos >= 0) {
+		_get_json_int_value(data, tokens, num_tokens, bitswap_pos, "TimeoutSeconds", &repo->config->bitswap.timeout_seconds);
+		_get_json_int_value(data, tokens, num_tokens, bitswap_pos, "PollMilliseconds", &repo->config->bitswap.poll_milliseconds);
+		_get_json_int_value(data, tokens, num_tokens, bitswap_pos, "ProviderDelayMilliseconds", &repo->config->bitswap.provider_delay_milliseconds);
+		_get_json_int_value(data, tokens, num_tokens, bitswap_pos, "VerifyWorkers", &repo->config->bitswap.verify_workers);
+	}
+
 	// get addresses. First is Swarm array, then Api, then Gateway
 	curr_pos = _find_token(data, tokens, num_tokens, curr_pos, "Addresses");
 	if (curr_pos < 0) {
@@ -593,6 +947,16 @@ int ipfs_repo_fsrepo_open(struct FSRepo* repo) {
 	if (!fs_repo_open_datastore(repo)) {
 		return 0;
 	}
+
+	// find out how the blockstore is laid out
+	if (!ipfs_repo_fsrepo_blockstore_open(repo)) {
+		return 0;
+	}
+
+	// a crash may have left blocks that were indexed but never written
+	if (!ipfs_repo_fsrepo_open_mark(repo)) {
+		return 0;
+	}
 	
 	// init the filestore
 	repo->config->filestore->handle = repo;
@@ -621,7 +985,207 @@ int ipfs_repo_fsrepo_datastore_init(struct FSRepo* fs_repo) {
 	return repo_fsrepo_lmdb_cast(fs_repo->config->datastore);
 }
 
-int ipfs_repo_fsrepo_blockstore_init(const struct FSRepo* fs_repo) {
+/***
+ * Build the filter of the keys in the blockstore, from the one saved when the repo was
+ * last freed if there is one, otherwise by listing the blockstore
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_filter_open(struct FSRepo* fs_repo) {
+	int size = fs_repo->config->datastore->bloom_filter_size;
+	struct BlockstoreFilter* filter = ipfs_blockstore_filter_new(size > 0 ? (size_t)size : BLOCKSTORE_FILTER_DEFAULT_SIZE);
+	if (filter == NULL)
+		return 0;
+	size_t filename_length = strlen(fs_repo->path) + strlen(BLOCKSTORE_FILTER_LOG_FILENAME) + 2;
+	char filename[filename_length];
+	// before the filter is filled, so what is written after the blockstore is listed is read from it later
+	if (!os_utils_filepath_join(fs_repo->path, BLOCKSTORE_FILTER_LOG_FILENAME, filename, filename_length)
+			|| !ipfs_blockstore_filter_log_open(filter, filename)) {
+		ipfs_blockstore_filter_free(filter);
+		return 0;
+	}
+	if (!os_utils_filepath_join(fs_repo->path, BLOCKSTORE_FILTER_FILENAME, filename, filename_length)) {
+		ipfs_blockstore_filter_free(filter);
+		return 0;
+	}
+	// the saved filter is only good until this process writes, so it is taken away until it is saved again
+	if (ipfs_blockstore_filter_load(filter, filename) && unlink(filename) == 0) {
+		fs_repo->blockstore_filter = filter;
+		return 1;
+	}
+	fs_repo->blockstore_filter = filter;
+	if (!ipfs_repo_fsrepo_blockstore_filter_rebuild(fs_repo)) {
+		ipfs_blockstore_filter_free(filter);
+		fs_repo->blockstore_filter = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/***
+ * Read the SHARDING file of the blockstore. If there is none, this is a
+ * repository from before sharding, and everything is in one directory.
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_open(struct FSRepo* fs_repo) {
+	size_t full_path_size = strlen(fs_repo->path) + 15;
+	char full_path[full_path_size];
+	int retVal = os_utils_filepath_join(fs_repo->path, "blockstore", full_path, full_path_size);
+	if (retVal == 0)
+		return 0;
+	if (!ipfs_flatfs_shard_read(full_path, &fs_repo->blockstore_shard)) {
+		fs_repo->blockstore_shard.type = FLATFS_SHARD_NONE;
+		fs_repo->blockstore_shard.length = 0;
+	}
+	// small blocks are appended to segments, instead of a file each
+	if (fs_repo->pack_store == NULL && fs_repo->config->blockstore != NULL && fs_repo->config->blockstore->type != NULL
+			&& strcmp(fs_repo->config->blockstore->type, "pack") == 0) {
+		int segment_size = fs_repo->config->blockstore->pack_segment_size;
+		if (!ipfs_pack_store_open(fs_repo->path, segment_size > 0 ? (uint64_t)segment_size : 0, &fs_repo->pack_store)) {
+			libp2p_logger_error("fs_repo", "Unable to open the pack store.\n");
+			return 0;
+		}
+	}
+	// the blocks that are read again and again stay in memory
+	if (fs_repo->block_cache == NULL && fs_repo->config->blockstore != NULL && fs_repo->config->blockstore->cache_size > 0)
+		fs_repo->block_cache = ipfs_block_cache_new(fs_repo->config->blockstore->cache_size);
+	// blocks are on the disk before they are indexed
+	if (fs_repo->blockstore_sync == NULL) {
+		fs_repo->blockstore_sync = ipfs_blockstore_sync_new(fs_repo->config->datastore != NULL && fs_repo->config->datastore->no_sync);
+		if (fs_repo->blockstore_sync == NULL)
+			return 0;
+	}
+	// appends to the segments share the syncs of the blockstore files
+	if (fs_repo->pack_store != NULL)
+		fs_repo->pack_store->sync = fs_repo->blockstore_sync;
+	// asking for a block that is not there should not go to the disk
+	if (fs_repo->blockstore_filter == NULL && fs_repo->config->datastore != NULL && fs_repo->config->datastore->bloom_filter_size >= 0)
+		ipfs_repo_fsrepo_blockstore_filter_open(fs_repo);
+	return 1;
+}
+
+/***
+ * Determine if the block of a datastore record can be read
+ * @param fs_repo the repo
+ * @param hash the key of the record
+ * @param hash_length the length of the key
+ * @returns true(1) if it can, false(0) if it is missing or corrupt
+ */
+int ipfs_repo_fsrepo_blockstore_check(const struct FSRepo* fs_repo, const unsigned char* hash, size_t hash_length) {
+	struct BlockView view;
+	unsigned char* key = ipfs_blockstore_hash_to_base32(hash, hash_length);
+	// without the key there is no telling, so the record stays
+	if (key == NULL)
+		return 1;
+	int retVal = ipfs_blockstore_read_view(fs_repo, (char*)key, &view);
+	free(key);
+	if (!retVal)
+		return 0;
+	// a node is stored under the hash of its bytes
+	unsigned char digest[32];
+	if (hash_length == 32 && libp2p_crypto_hashing_sha256(view.data, view.size, digest) && memcmp(digest, hash, 32) == 0) {
+		ipfs_block_view_release(&view);
+		return 1;
+	}
+	// a UnixFS or a block is stored under another hash, so all that can be asked is that it decodes
+	retVal = (view.size > 0);
+	if (retVal) {
+		struct HashtableNode* node = NULL;
+		struct UnixFS* unix_fs = NULL;
+		struct Block* block = NULL;
+		if (ipfs_hashtable_node_protobuf_decode_view(view.data, view.size, &node))
+			ipfs_hashtable_node_view_free(node);
+		else if (ipfs_unixfs_protobuf_decode_view(view.data, view.size, &unix_fs))
+			ipfs_unixfs_view_free(unix_fs);
+		else if (ipfs_blocks_block_protobuf_decode(view.data, view.size, &block))
+			ipfs_block_free(block);
+		else
+			retVal = 0;
+	}
+	ipfs_block_view_release(&view);
+	return retVal;
+}
+
+/***
+ * Drop the datastore records of blocks that are missing or corrupt, and remove the
+ * temporary files of writes that never finished. This is what a crash can leave.
+ * NOTE: Nothing else should be using the repo.
+ * @param fs_repo the repo, with its blockstore open
+ * @param records_dropped the number of records dropped (can be NULL)
+ * @param files_removed the number of temporary files removed (can be NULL)
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_blockstore_scrub(struct FSRepo* fs_repo, size_t* records_dropped, size_t* files_removed) {
+	int retVal = 0;
+	struct Datastore* datastore = fs_repo->config->datastore;
+	unsigned char** keys = NULL;
+	size_t* key_sizes = NULL;
+	size_t count = 0;
+	size_t max_count = 0;
+	unsigned char* key = NULL;
+	int key_length = 0;
+
+	if (records_dropped != NULL)
+		*records_dropped = 0;
+	size_t full_path_size = strlen(fs_repo->path) + 15;
+	char full_path[full_path_size];
+	if (!os_utils_filepath_join(fs_repo->path, "blockstore", full_path, full_path_size)
+			|| !ipfs_flatfs_remove_temporary(full_path, files_removed))
+		return 0;
+	if (datastore == NULL || datastore->type == NULL || strncmp(datastore->type, "lmdb", 4) != 0)
+		return 0;
+
+	// the records are dropped after the cursor is closed, so the walk sees one snapshot
+	if (!datastore->datastore_cursor_open(datastore))
+		return 0;
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (datastore->datastore_cursor_get(&key, &key_length, NULL, NULL, op, datastore)) {
+		op = CURSOR_NEXT;
+		if (ipfs_repo_fsrepo_blockstore_check(fs_repo, key, key_length)) {
+			free(key);
+			continue;
+		}
+		if (count == max_count) {
+			max_count = (max_count == 0 ? 16 : max_count * 2);
+			unsigned char** new_keys = (unsigned char**)realloc(keys, max_count * sizeof(unsigned char*));
+			if (new_keys != NULL)
+				keys = new_keys;
+			size_t* new_key_sizes = (size_t*)realloc(key_sizes, max_count * sizeof(size_t));
+			if (new_key_sizes != NULL)
+				key_sizes = new_key_sizes;
+			if (new_keys == NULL || new_key_sizes == NULL) {
+				free(key);
+				datastore->datastore_cursor_close(datastore);
+				goto exit;
+			}
+		}
+		keys[count] = key;
+		key_sizes[count] = key_length;
+		count++;
+	}
+	datastore->datastore_cursor_close(datastore);
+
+	if (count > 0) {
+		unsigned char* data[count];
+		size_t data_sizes[count];
+		memset(data, 0, sizeof(data));
+		memset(data_sizes, 0, sizeof(data_sizes));
+		if (!repo_fsrepo_lmdb_replace_many(keys, key_sizes, data, data_sizes, count, datastore))
+			goto exit;
+	}
+	if (records_dropped != NULL)
+		*records_dropped = count;
+	retVal = 1;
+	exit:
+	for(size_t i = 0; i < count; i++)
+		free(keys[i]);
+	free(keys);
+	free(key_sizes);
+	return retVal;
+}
+
+int ipfs_repo_fsrepo_blockstore_init(struct FSRepo* fs_repo) {
 	size_t full_path_size = strlen(fs_repo->path) + 15;
 	char full_path[full_path_size];
 	int retVal = os_utils_filepath_join(fs_repo->path, "blockstore", full_path, full_path_size);
@@ -634,6 +1198,15 @@ int ipfs_repo_fsrepo_blockstore_init(const struct FSRepo* fs_repo) {
 	if (mkdir(full_path, S_IRWXU) != 0)
 #endif
 		return 0;
+
+	// record the layout of the new blockstore
+	const char* shard_func = FLATFS_DEFAULT_SHARD;
+	if (fs_repo->config->blockstore != NULL && fs_repo->config->blockstore->shard_func != NULL)
+		shard_func = fs_repo->config->blockstore->shard_func;
+	if (!ipfs_flatfs_shard_parse(shard_func, &fs_repo->blockstore_shard))
+		return 0;
+	if (!ipfs_flatfs_shard_write(full_path, &fs_repo->blockstore_shard))
+		return 0;
 	return 1;
 }
 
@@ -778,14 +1351,59 @@ int ipfs_repo_fsrepo_node_write(const struct HashtableNode* node, const struct F
 	return 1;
 }
 
-int ipfs_repo_fsrepo_node_read(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, const struct FSRepo* fs_repo) {
-	int retVal = 0;
+/***
+ * Begin holding datastore writes, so that many can be committed together.
+ * Flushes happen based on the DatastoreBatch section of the config.
+ * NOTE: Each call must be matched with a call to ipfs_repo_fsrepo_batch_commit
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_batch_begin(const struct FSRepo* fs_repo) {
+	struct Datastore* datastore = fs_repo->config->datastore;
+	if (datastore->type == NULL || strncmp(datastore->type, "lmdb", 4) != 0)
+		return 1; // this datastore writes immediately
+	return repo_fsrepo_lmdb_batch_begin(fs_repo->config->datastore_batch.max_entries,
+			fs_repo->config->datastore_batch.max_seconds, datastore);
+}
 
-	// get the base32 hash from the database
-	// We do this only to see if it is in the database
+/***
+ * End a batch started with ipfs_repo_fsrepo_batch_begin, writing what is pending
+ * @param fs_repo the repo
+ * @returns true(1) on success
+ */
+int ipfs_repo_fsrepo_batch_commit(const struct FSRepo* fs_repo) {
+	struct Datastore* datastore = fs_repo->config->datastore;
+	if (datastore->type == NULL || strncmp(datastore->type, "lmdb", 4) != 0)
+		return 1;
+	return repo_fsrepo_lmdb_batch_commit(datastore);
+}
+
+/***
+ * Determine if the datastore has a record for this hash. For LMDB, this does not copy the record.
+ * @param hash the hash to look for
+ * @param hash_length the length of the hash
+ * @param fs_repo the repo
+ * @returns true(1) if found
+ */
+int ipfs_repo_fsrepo_datastore_has(const unsigned char* hash, size_t hash_length, const struct FSRepo* fs_repo) {
+	struct Datastore* datastore = fs_repo->config->datastore;
+	if (datastore->type != NULL && strncmp(datastore->type, "lmdb", 4) == 0) {
+		struct LmdbView view;
+		if (!repo_fsrepo_lmdb_get_view(hash, hash_length, &view, datastore))
+			return 0;
+		repo_fsrepo_lmdb_release_view(&view, datastore);
+		return 1;
+	}
 	size_t fs_key_length = 100;
 	unsigned char fs_key[fs_key_length];
-	retVal = fs_repo->config->datastore->datastore_get((const char*)hash, hash_length, fs_key, fs_key_length, &fs_key_length, fs_repo->config->datastore);
+	return datastore->datastore_get((const char*)hash, hash_length, fs_key, fs_key_length, &fs_key_length, datastore);
+}
+
+int ipfs_repo_fsrepo_node_read(const unsigned char* hash, size_t hash_length, struct HashtableNode** node, const struct FSRepo* fs_repo) {
+	int retVal = 0;
+
+	// make sure it is in the database
+	retVal = ipfs_repo_fsrepo_datastore_has(hash, hash_length, fs_repo);
 	if (retVal == 0) // maybe it doesn't exist?
 		return 0;
 	// now get the block from the blockstore
@@ -798,11 +1416,8 @@ int ipfs_repo_fsrepo_node_read(const unsigned char* hash, size_t hash_length, st
 int ipfs_repo_fsrepo_block_read(const unsigned char* hash, size_t hash_length, struct Block** block, const struct FSRepo* fs_repo) {
 	int retVal = 0;
 
-	// get the base32 hash from the database
-	// We do this only to see if it is in the database
-	size_t fs_key_length = 100;
-	unsigned char fs_key[fs_key_length];
-	retVal = fs_repo->config->datastore->datastore_get((const char*)hash, hash_length, fs_key, fs_key_length, &fs_key_length, fs_repo->config->datastore);
+	// make sure it is in the database
+	retVal = ipfs_repo_fsrepo_datastore_has(hash, hash_length, fs_repo);
 	if (retVal == 0) // maybe it doesn't exist?
 		return 0;
 	// now get the block from the blockstore
@@ -823,11 +1438,8 @@ int ipfs_repo_fsrepo_block_read(const unsigned char* hash, size_t hash_length, s
 int ipfs_repo_fsrepo_unixfs_read(const unsigned char* hash, size_t hash_length, struct UnixFS** unix_fs, const struct FSRepo* fs_repo) {
 	int retVal = 0;
 
-	// get the base32 hash from the database
-	// We do this only to see if it is in the database
-	size_t fs_key_length = 100;
-	unsigned char fs_key[fs_key_length];
-	retVal = fs_repo->config->datastore->datastore_get((const char*)hash, hash_length, fs_key, fs_key_length, &fs_key_length, fs_repo->config->datastore);
+	// make sure it is in the database
+	retVal = ipfs_repo_fsrepo_datastore_has(hash, hash_length, fs_repo);
 	if (retVal == 0) // maybe it doesn't exist?
 		return 0;
 	// now get the block from the blockstore
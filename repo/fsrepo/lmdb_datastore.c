@@ -8,6 +8,9 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "lmdb.h"
 #include "ipfs/repo/fsrepo/lmdb_datastore.h"
@@ -17,65 +20,484 @@ struct lmdb_trans_cursor {
 	MDB_cursor* cursor;
 };
 
+/**
+ * The maximum number of idle read-only transactions kept for reuse
+ */
+#define LMDB_READ_POOL_MAX 32
+
+/**
+ * The buckets of the puts waiting in a batch (a power of 2)
+ */
+#define LMDB_BATCH_BUCKETS 256
+
 /***
- * retrieve a record from the database and put in a pre-sized buffer
- * @param key the key to look for
+ * A read-only transaction that has been reset, and is waiting to be renewed
+ */
+struct lmdb_read_txn {
+	MDB_txn* txn;
+	struct lmdb_read_txn* next;
+};
+
+/***
+ * A put that is waiting for the batch to be written
+ */
+struct lmdb_batch_entry {
+	unsigned char* key;
+	size_t key_size;
+	unsigned char* data;
+	size_t data_size;
+	struct lmdb_batch_entry* next;
+	struct lmdb_batch_entry* bucket_next; // the next entry in the same bucket
+};
+
+/***
+ * What is kept in datastore->handle
+ */
+struct lmdb_context {
+	MDB_env* env;
+	MDB_dbi dbi; // opened once, and valid for the life of the environment
+	pthread_mutex_t read_pool_lock;
+	struct lmdb_read_txn* read_pool; // idle read-only transactions
+	int read_pool_size;
+	// batched writes. Puts are held in memory and written in one transaction.
+	pthread_mutex_t batch_lock;
+	int batch_depth; // number of callers that have begun a batch
+	size_t batch_max_entries;
+	int batch_max_seconds;
+	time_t batch_started; // when the oldest pending put arrived
+	struct lmdb_batch_entry* batch_first;
+	struct lmdb_batch_entry* batch_last;
+	size_t batch_count; // also read without the lock, so readers skip it when the batch is empty
+	struct lmdb_batch_entry* batch_buckets[LMDB_BATCH_BUCKETS];
+	int batch_error; // a batch written by the timer failed, and no writer has been told yet
+	pthread_t batch_flusher; // writes a batch that is batch_max_seconds old
+	pthread_cond_t batch_wake;
+	int batch_flusher_started;
+	int closing;
+};
+
+/***
+ * Get a read-only transaction, reusing one from the pool if possible
+ * NOTE: the environment is opened with MDB_NOTLS, so the transaction can be used
+ * (and returned) by any thread.
+ * @param context the lmdb context
+ * @returns the transaction, or NULL on error
+ */
+MDB_txn* repo_fsrepo_lmdb_read_txn_acquire(struct lmdb_context* context) {
+	MDB_txn* txn = NULL;
+	pthread_mutex_lock(&context->read_pool_lock);
+	struct lmdb_read_txn* pooled = context->read_pool;
+	if (pooled != NULL) {
+		context->read_pool = pooled->next;
+		context->read_pool_size--;
+	}
+	pthread_mutex_unlock(&context->read_pool_lock);
+
+	if (pooled != NULL) {
+		txn = pooled->txn;
+		free(pooled);
+		if (mdb_txn_renew(txn) == 0)
+			return txn;
+		mdb_txn_abort(txn);
+		txn = NULL;
+	}
+	if (mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn) != 0)
+		return NULL;
+	return txn;
+}
+
+/***
+ * Give a read-only transaction back to the pool
+ * @param context the lmdb context
+ * @param txn the transaction from repo_fsrepo_lmdb_read_txn_acquire
+ */
+void repo_fsrepo_lmdb_read_txn_release(struct lmdb_context* context, MDB_txn* txn) {
+	if (txn == NULL)
+		return;
+	mdb_txn_reset(txn);
+	struct lmdb_read_txn* pooled = NULL;
+	pthread_mutex_lock(&context->read_pool_lock);
+	if (context->read_pool_size < LMDB_READ_POOL_MAX) {
+		pooled = (struct lmdb_read_txn*)malloc(sizeof(struct lmdb_read_txn));
+		if (pooled != NULL) {
+			pooled->txn = txn;
+			pooled->next = context->read_pool;
+			context->read_pool = pooled;
+			context->read_pool_size++;
+		}
+	}
+	pthread_mutex_unlock(&context->read_pool_lock);
+	if (pooled == NULL)
+		mdb_txn_abort(txn);
+}
+
+/***
+ * Find the bucket of a key in the batch
+ * @param key the key
  * @param key_size the length of the key
- * @param data the data that is retrieved
- * @param max_data_size the length of the data buffer
- * @param data_size the length of the data that was found in the database
- * @param datastore where to look for the data
+ * @returns the bucket
+ */
+size_t repo_fsrepo_lmdb_batch_bucket(const unsigned char* key, size_t key_size) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+	return hash & (LMDB_BATCH_BUCKETS - 1);
+}
+
+/***
+ * Free the entries of the batch, and empty it
+ * NOTE: batch_lock must be held
+ * @param context the lmdb context
+ */
+void repo_fsrepo_lmdb_batch_clear(struct lmdb_context* context) {
+	struct lmdb_batch_entry* current = context->batch_first;
+	while (current != NULL) {
+		struct lmdb_batch_entry* next = current->next;
+		free(current->key);
+		free(current->data);
+		free(current);
+		current = next;
+	}
+	context->batch_first = NULL;
+	context->batch_last = NULL;
+	memset(context->batch_buckets, 0, sizeof(context->batch_buckets));
+	__atomic_store_n(&context->batch_count, 0, __ATOMIC_RELEASE);
+}
+
+/***
+ * Write a list of entries in one transaction. Whether it works or not, the batch
+ * is emptied, so a batch that cannot be written (i.e. MDB_MAP_FULL) does not grow forever.
+ * NOTE: batch_lock must be held
+ * @param context the lmdb context
  * @returns true(1) on success
  */
-int repo_fsrepo_lmdb_get(const char* key, size_t key_size, unsigned char* data, size_t max_data_size, size_t* data_size, const struct Datastore* datastore) {
-	int retVal;
+int repo_fsrepo_lmdb_batch_write(struct lmdb_context* context) {
 	MDB_txn* mdb_txn;
-	MDB_dbi mdb_dbi;
 	struct MDB_val db_key;
 	struct MDB_val db_value;
+	int retVal = 1;
+
+	if (context->batch_first == NULL)
+		return 1;
 
-	MDB_env* mdb_env = (MDB_env*)datastore->handle;
-	if (mdb_env == NULL)
+	if (mdb_txn_begin(context->env, NULL, 0, &mdb_txn) != 0) {
+		repo_fsrepo_lmdb_batch_clear(context);
 		return 0;
+	}
+	for(struct lmdb_batch_entry* current = context->batch_first; current != NULL; current = current->next) {
+		db_key.mv_size = current->key_size;
+		db_key.mv_data = current->key;
+		db_value.mv_size = current->data_size;
+		db_value.mv_data = current->data;
+		int rc = mdb_put(mdb_txn, context->dbi, &db_key, &db_value, MDB_NODUPDATA | MDB_NOOVERWRITE);
+		if (rc != 0 && rc != MDB_KEYEXIST) {
+			retVal = 0;
+			break;
+		}
+	}
+	if (retVal == 0)
+		mdb_txn_abort(mdb_txn);
+	else if (mdb_txn_commit(mdb_txn) != 0)
+		retVal = 0;
 
-	// open transaction
-	retVal = mdb_txn_begin(mdb_env, NULL, 0, &mdb_txn);
-	if (retVal != 0)
+	repo_fsrepo_lmdb_batch_clear(context);
+	return retVal;
+}
+
+/***
+ * Write the batch, and tell the caller about a batch the timer could not write
+ * NOTE: batch_lock must be held
+ * @param context the lmdb context
+ * @returns true(1) if everything put since the last report was written
+ */
+int repo_fsrepo_lmdb_batch_write_reported(struct lmdb_context* context) {
+	int retVal = repo_fsrepo_lmdb_batch_write(context);
+	if (context->batch_error) {
+		context->batch_error = 0;
+		retVal = 0;
+	}
+	return retVal;
+}
+
+/***
+ * Write the batch once its oldest put is batch_max_seconds old, when no more puts
+ * come to write it. Runs as a thread until the datastore is closed.
+ * @param arg the lmdb context
+ * @returns NULL
+ */
+void* repo_fsrepo_lmdb_batch_flusher(void* arg) {
+	struct lmdb_context* context = (struct lmdb_context*)arg;
+	pthread_mutex_lock(&context->batch_lock);
+	while (!context->closing) {
+		if (context->batch_first == NULL || context->batch_max_seconds <= 0) {
+			pthread_cond_wait(&context->batch_wake, &context->batch_lock);
+			continue;
+		}
+		struct timespec deadline;
+		deadline.tv_sec = context->batch_started + context->batch_max_seconds;
+		deadline.tv_nsec = 0;
+		if (time(NULL) < deadline.tv_sec) {
+			pthread_cond_timedwait(&context->batch_wake, &context->batch_lock, &deadline);
+			continue;
+		}
+		// nobody is waiting on this write, so the next writer hears about it
+		if (!repo_fsrepo_lmdb_batch_write(context))
+			context->batch_error = 1;
+	}
+	pthread_mutex_unlock(&context->batch_lock);
+	return NULL;
+}
+
+/***
+ * Start holding puts in memory, so many of them can be written in one transaction.
+ * Batches nest. The puts are written when the batch becomes full, is too old, or
+ * when the outermost batch is committed. Gets always see pending puts, without writing them.
+ * If a batch cannot be written, its puts are dropped, and the next put, flush or commit fails.
+ * @param max_entries write the batch when it holds this many puts (0 = no limit)
+ * @param max_seconds write the batch when the oldest put is this old (0 = no limit)
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_begin(size_t max_entries, int max_seconds, const struct Datastore* datastore) {
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
+		return 0;
+	int retVal = 1;
+	pthread_mutex_lock(&context->batch_lock);
+	if (context->batch_depth == 0) {
+		context->batch_max_entries = max_entries;
+		context->batch_max_seconds = max_seconds;
+	}
+	context->batch_depth++;
+	// the first batch with a time limit starts the timer
+	if (max_seconds > 0 && !context->batch_flusher_started) {
+		if (pthread_create(&context->batch_flusher, NULL, repo_fsrepo_lmdb_batch_flusher, context) == 0)
+			context->batch_flusher_started = 1;
+		else
+			retVal = 0;
+	}
+	pthread_mutex_unlock(&context->batch_lock);
+	return retVal;
+}
+
+/***
+ * Write any pending puts now, without ending the batch
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_flush(const struct Datastore* datastore) {
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
 		return 0;
-	retVal = mdb_dbi_open(mdb_txn, NULL, MDB_DUPSORT, &mdb_dbi);
-	if (retVal != 0) {
-		mdb_txn_commit(mdb_txn);
+	pthread_mutex_lock(&context->batch_lock);
+	int retVal = repo_fsrepo_lmdb_batch_write_reported(context);
+	pthread_mutex_unlock(&context->batch_lock);
+	return retVal;
+}
+
+/***
+ * End a batch. When the outermost batch ends, pending puts are written.
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_commit(const struct Datastore* datastore) {
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
 		return 0;
+	int retVal = 1;
+	pthread_mutex_lock(&context->batch_lock);
+	if (context->batch_depth > 0)
+		context->batch_depth--;
+	if (context->batch_depth == 0)
+		retVal = repo_fsrepo_lmdb_batch_write_reported(context);
+	pthread_mutex_unlock(&context->batch_lock);
+	return retVal;
+}
+
+/***
+ * Hold a put in the batch, if a batch is active
+ * @param context the lmdb context
+ * @param key the key
+ * @param key_size the length of the key
+ * @param data the value
+ * @param data_size the length of the value
+ * @param batched set to true(1) if the put is now the batch's responsibility
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_batch_add(struct lmdb_context* context, const unsigned char* key, size_t key_size,
+		const unsigned char* data, size_t data_size, int* batched) {
+	int retVal = 1;
+	*batched = 0;
+	pthread_mutex_lock(&context->batch_lock);
+	if (context->batch_depth == 0)
+		goto exit;
+
+	struct lmdb_batch_entry* entry = (struct lmdb_batch_entry*)malloc(sizeof(struct lmdb_batch_entry));
+	if (entry == NULL)
+		goto exit;
+	entry->key = (unsigned char*)malloc(key_size);
+	entry->data = (unsigned char*)malloc(data_size);
+	if (entry->key == NULL || entry->data == NULL) {
+		free(entry->key);
+		free(entry->data);
+		free(entry);
+		goto exit;
+	}
+	memcpy(entry->key, key, key_size);
+	entry->key_size = key_size;
+	memcpy(entry->data, data, data_size);
+	entry->data_size = data_size;
+	entry->next = NULL;
+	size_t bucket = repo_fsrepo_lmdb_batch_bucket(key, key_size);
+	entry->bucket_next = context->batch_buckets[bucket];
+	context->batch_buckets[bucket] = entry;
+	if (context->batch_last == NULL) {
+		context->batch_first = entry;
+		context->batch_started = time(NULL);
+		// so the timer starts counting
+		pthread_cond_signal(&context->batch_wake);
+	} else {
+		context->batch_last->next = entry;
 	}
+	context->batch_last = entry;
+	__atomic_store_n(&context->batch_count, context->batch_count + 1, __ATOMIC_RELEASE);
+	*batched = 1;
 
-	// prepare data
+	// is it time to write?
+	if ( (context->batch_max_entries > 0 && context->batch_count >= context->batch_max_entries)
+			|| (context->batch_max_seconds > 0 && time(NULL) - context->batch_started >= context->batch_max_seconds) )
+		retVal = repo_fsrepo_lmdb_batch_write_reported(context);
+	else if (context->batch_error) {
+		context->batch_error = 0;
+		retVal = 0;
+	}
+
+	exit:
+	pthread_mutex_unlock(&context->batch_lock);
+	return retVal;
+}
+
+/***
+ * Copy a put that is waiting in the batch
+ * @param context the lmdb context
+ * @param key the key
+ * @param key_size the length of the key
+ * @param data_size where to put the length of the copy
+ * @returns the copy, or NULL if the key is not in the batch
+ */
+unsigned char* repo_fsrepo_lmdb_batch_find(struct lmdb_context* context, const unsigned char* key, size_t key_size, size_t* data_size) {
+	unsigned char* copy = NULL;
+	// most reads happen when nothing is waiting
+	if (__atomic_load_n(&context->batch_count, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+	pthread_mutex_lock(&context->batch_lock);
+	// the bucket has the newest first, and the first put of a key is the one written
+	struct lmdb_batch_entry* found = NULL;
+	for(struct lmdb_batch_entry* current = context->batch_buckets[repo_fsrepo_lmdb_batch_bucket(key, key_size)]; current != NULL; current = current->bucket_next) {
+		if (current->key_size == key_size && memcmp(current->key, key, key_size) == 0)
+			found = current;
+	}
+	if (found != NULL) {
+		copy = (unsigned char*)malloc(found->data_size > 0 ? found->data_size : 1);
+		if (copy != NULL) {
+			memcpy(copy, found->data, found->data_size);
+			*data_size = found->data_size;
+		}
+	}
+	pthread_mutex_unlock(&context->batch_lock);
+	return copy;
+}
+
+/***
+ * Look at a record without copying it. The data points into the memory map, and
+ * stays valid until repo_fsrepo_lmdb_release_view is called.
+ * @param key the key to look for
+ * @param key_size the length of the key
+ * @param view where to put the results
+ * @param datastore where to look for the data
+ * @returns true(1) on success, false(0) if not found. Only call release_view on success.
+ */
+int repo_fsrepo_lmdb_get_view(const unsigned char* key, size_t key_size, struct LmdbView* view, const struct Datastore* datastore) {
+	struct MDB_val db_key;
+	struct MDB_val db_value;
+	size_t pending_size = 0;
+
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
+		return 0;
+
+	// look in the batch first. If it is written in between, the database has it.
+	unsigned char* pending = repo_fsrepo_lmdb_batch_find(context, key, key_size, &pending_size);
+
+	MDB_txn* mdb_txn = repo_fsrepo_lmdb_read_txn_acquire(context);
 	db_key.mv_size = key_size;
 	db_key.mv_data = (char*)key;
+	if (mdb_txn != NULL && mdb_get(mdb_txn, context->dbi, &db_key, &db_value) == 0) {
+		// a record that is already there is not replaced by the batch
+		free(pending);
+		view->data = (const unsigned char*)db_value.mv_data;
+		view->data_size = db_value.mv_size;
+		view->read_handle = mdb_txn;
+		view->copy = NULL;
+		return 1;
+	}
+	repo_fsrepo_lmdb_read_txn_release(context, mdb_txn);
+	if (pending == NULL)
+		return 0;
+	view->data = pending;
+	view->data_size = pending_size;
+	view->read_handle = NULL;
+	view->copy = pending;
+	return 1;
+}
 
-	//printf("Looking for data that has a key size of %lu that starts with %02x and ends with %02x\n", db_key.mv_size, ((char*)db_key.mv_data)[0], ((char*)db_key.mv_data)[db_key.mv_size - 1]);
+/***
+ * Release a view from repo_fsrepo_lmdb_get_view. The data is no longer valid after this.
+ * @param view the view
+ * @param datastore the datastore
+ * @returns true(1)
+ */
+int repo_fsrepo_lmdb_release_view(struct LmdbView* view, const struct Datastore* datastore) {
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context != NULL && view->read_handle != NULL)
+		repo_fsrepo_lmdb_read_txn_release(context, (MDB_txn*)view->read_handle);
+	free(view->copy);
+	view->copy = NULL;
+	view->read_handle = NULL;
+	view->data = NULL;
+	view->data_size = 0;
+	return 1;
+}
+
+/***
+ * retrieve a record from the database and put in a pre-sized buffer
+ * @param key the key to look for
+ * @param key_size the length of the key
+ * @param data the data that is retrieved
+ * @param max_data_size the length of the data buffer
+ * @param data_size the length of the data that was found in the database
+ * @param datastore where to look for the data
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_get(const char* key, size_t key_size, unsigned char* data, size_t max_data_size, size_t* data_size, const struct Datastore* datastore) {
+	struct LmdbView view;
 
-	retVal = mdb_get(mdb_txn, mdb_dbi, &db_key, &db_value);
-	if (retVal != 0) {
-		//mdb_dbi_close(mdb_env, mdb_dbi);
-		mdb_txn_commit(mdb_txn);
+	if (!repo_fsrepo_lmdb_get_view((const unsigned char*)key, key_size, &view, datastore))
 		return 0;
-	}
 
 	// now copy the data
-	if (db_value.mv_size > max_data_size) {
-		//mdb_dbi_close(mdb_env, mdb_dbi);
-		mdb_txn_commit(mdb_txn);
+	if (view.data_size > max_data_size) {
+		repo_fsrepo_lmdb_release_view(&view, datastore);
 		return 0;
 	}
 
 	// set return values
-	memcpy(data, db_value.mv_data, db_value.mv_size);
-	(*data_size) = db_value.mv_size;
-
-	// clean up
-	//mdb_dbi_close(mdb_env, mdb_dbi);
-	mdb_txn_commit(mdb_txn);
+	memcpy(data, view.data, view.data_size);
+	(*data_size) = view.data_size;
 
+	repo_fsrepo_lmdb_release_view(&view, datastore);
 	return 1;
 }
 
@@ -91,19 +513,22 @@ int repo_fsrepo_lmdb_get(const char* key, size_t key_size, unsigned char* data,
 int repo_fsrepo_lmdb_put(unsigned const char* key, size_t key_size, unsigned char* data, size_t data_size, const struct Datastore* datastore) {
 	int retVal;
 	MDB_txn* mdb_txn;
-	MDB_dbi mdb_dbi;
 	struct MDB_val db_key;
 	struct MDB_val db_value;
 
-	MDB_env* mdb_env = (MDB_env*)datastore->handle;
-	if (mdb_env == NULL)
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
 		return 0;
 
-	// open transaction
-	retVal = mdb_txn_begin(mdb_env, NULL, 0, &mdb_txn);
-	if (retVal != 0)
+	// if a batch is running, it will be written later
+	int batched = 0;
+	if (!repo_fsrepo_lmdb_batch_add(context, key, key_size, data, data_size, &batched))
 		return 0;
-	retVal = mdb_dbi_open(mdb_txn, NULL, MDB_DUPSORT, &mdb_dbi);
+	if (batched)
+		return 1;
+
+	// open transaction
+	retVal = mdb_txn_begin(context->env, NULL, 0, &mdb_txn);
 	if (retVal != 0)
 		return 0;
 
@@ -114,7 +539,7 @@ int repo_fsrepo_lmdb_put(unsigned const char* key, size_t key_size, unsigned cha
 	// write
 	db_value.mv_size = data_size;
 	db_value.mv_data = data;
-	retVal = mdb_put(mdb_txn, mdb_dbi, &db_key, &db_value, MDB_NODUPDATA | MDB_NOOVERWRITE);
+	retVal = mdb_put(mdb_txn, context->dbi, &db_key, &db_value, MDB_NODUPDATA | MDB_NOOVERWRITE);
 	if (retVal == 0) // the normal case
 		retVal = 1;
 	else {
@@ -125,11 +550,90 @@ int repo_fsrepo_lmdb_put(unsigned const char* key, size_t key_size, unsigned cha
 	}
 
 	// cleanup
-	//mdb_dbi_close(mdb_env, mdb_dbi);
-	mdb_txn_commit(mdb_txn);
+	if (mdb_txn_commit(mdb_txn) != 0)
+		retVal = 0;
+	return retVal;
+}
+
+/***
+ * Add many records in one transaction
+ * @param keys the keys
+ * @param key_sizes the length of each key
+ * @param data the values
+ * @param data_sizes the length of each value
+ * @param count the number of records
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_put_many(unsigned char** keys, size_t* key_sizes, unsigned char** data, size_t* data_sizes, size_t count, const struct Datastore* datastore) {
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
+		return 0;
+	if (!repo_fsrepo_lmdb_batch_begin(0, 0, datastore))
+		return 0;
+	int retVal = 1;
+	for(size_t i = 0; i < count; i++) {
+		if (!repo_fsrepo_lmdb_put(keys[i], key_sizes[i], data[i], data_sizes[i], datastore)) {
+			retVal = 0;
+			break;
+		}
+	}
+	if (!repo_fsrepo_lmdb_batch_commit(datastore))
+		retVal = 0;
 	return retVal;
 }
 
+/***
+ * Set or remove many records in one transaction. Unlike a put, a record that is
+ * already there is replaced.
+ * NOTE: this does not go through the batch, so do not mix it with batched puts of the same keys
+ * @param keys the keys
+ * @param key_sizes the length of each key
+ * @param data the new values (NULL to remove the record)
+ * @param data_sizes the length of each value
+ * @param count the number of records
+ * @param datastore the datastore
+ * @returns true(1) on success
+ */
+int repo_fsrepo_lmdb_replace_many(unsigned char** keys, size_t* key_sizes, unsigned char** data, size_t* data_sizes, size_t count, const struct Datastore* datastore) {
+	MDB_txn* mdb_txn;
+	struct MDB_val db_key;
+	struct MDB_val db_value;
+	int retVal = 1;
+
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
+		return 0;
+	if (count == 0)
+		return 1;
+
+	if (mdb_txn_begin(context->env, NULL, 0, &mdb_txn) != 0)
+		return 0;
+	for(size_t i = 0; i < count; i++) {
+		db_key.mv_size = key_sizes[i];
+		db_key.mv_data = keys[i];
+		// the database allows duplicates, so the old value has to go first
+		int rc = mdb_del(mdb_txn, context->dbi, &db_key, NULL);
+		if (rc != 0 && rc != MDB_NOTFOUND) {
+			retVal = 0;
+			break;
+		}
+		if (data[i] != NULL) {
+			db_value.mv_size = data_sizes[i];
+			db_value.mv_data = data[i];
+			if (mdb_put(mdb_txn, context->dbi, &db_key, &db_value, 0) != 0) {
+				retVal = 0;
+				break;
+			}
+		}
+	}
+	if (retVal == 0) {
+		mdb_txn_abort(mdb_txn);
+		return 0;
+	}
+	return mdb_txn_commit(mdb_txn) == 0;
+}
+
 /**
  * Open an lmdb database with the given parameters.
  * Note: for now, the parameters are not used
@@ -137,6 +641,7 @@ int repo_fsrepo_lmdb_put(unsigned const char* key, size_t key_size, unsigned cha
  * @param argv an array of parameters
  */
 int repo_fsrepro_lmdb_open(int argc, char** argv, struct Datastore* datastore) {
+	MDB_txn* mdb_txn;
 	// create environment
 	struct MDB_env* mdb_env;
 	int retVal = mdb_env_create(&mdb_env);
@@ -146,13 +651,49 @@ int repo_fsrepro_lmdb_open(int argc, char** argv, struct Datastore* datastore) {
 	}
 
 	// open the environment
-	retVal = mdb_env_open(mdb_env, datastore->path, 0, S_IRWXU);
+	// NOTE: MDB_NOTLS lets pooled read transactions move between threads
+	retVal = mdb_env_open(mdb_env, datastore->path, MDB_NOTLS, S_IRWXU);
 	if (retVal < 0) {
 		mdb_env_close(mdb_env);
 		return 0;
 	}
 
-	datastore->handle = (void*)mdb_env;
+	struct lmdb_context* context = (struct lmdb_context*)malloc(sizeof(struct lmdb_context));
+	if (context == NULL) {
+		mdb_env_close(mdb_env);
+		return 0;
+	}
+	context->env = mdb_env;
+	context->read_pool = NULL;
+	context->read_pool_size = 0;
+	pthread_mutex_init(&context->read_pool_lock, NULL);
+	context->batch_depth = 0;
+	context->batch_max_entries = 0;
+	context->batch_max_seconds = 0;
+	context->batch_started = 0;
+	context->batch_first = NULL;
+	context->batch_last = NULL;
+	context->batch_count = 0;
+	memset(context->batch_buckets, 0, sizeof(context->batch_buckets));
+	context->batch_error = 0;
+	context->batch_flusher_started = 0;
+	context->closing = 0;
+	pthread_mutex_init(&context->batch_lock, NULL);
+	pthread_cond_init(&context->batch_wake, NULL);
+
+	// open the database once. The handle is good until the environment closes
+	if (mdb_txn_begin(mdb_env, NULL, 0, &mdb_txn) != 0
+			|| mdb_dbi_open(mdb_txn, NULL, MDB_DUPSORT, &context->dbi) != 0
+			|| mdb_txn_commit(mdb_txn) != 0) {
+		pthread_mutex_destroy(&context->read_pool_lock);
+		pthread_mutex_destroy(&context->batch_lock);
+		pthread_cond_destroy(&context->batch_wake);
+		free(context);
+		mdb_env_close(mdb_env);
+		return 0;
+	}
+
+	datastore->handle = (void*)context;
 	return 1;
 }
 
@@ -164,31 +705,61 @@ int repo_fsrepro_lmdb_open(int argc, char** argv, struct Datastore* datastore) {
  * @param datastore the datastore struct that contains information about the opened database
  */
 int repo_fsrepo_lmdb_close(struct Datastore* datastore) {
-	struct MDB_env* mdb_env = (struct MDB_env*)datastore->handle;
-	mdb_env_close(mdb_env);
+	struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
+	if (context == NULL)
+		return 1;
+	if (context->batch_flusher_started) {
+		pthread_mutex_lock(&context->batch_lock);
+		context->closing = 1;
+		pthread_cond_signal(&context->batch_wake);
+		pthread_mutex_unlock(&context->batch_lock);
+		pthread_join(context->batch_flusher, NULL);
+	}
+	// write anything still waiting in a batch
+	context->batch_depth = 0;
+	repo_fsrepo_lmdb_batch_flush(datastore);
+	pthread_mutex_destroy(&context->batch_lock);
+	pthread_cond_destroy(&context->batch_wake);
+	// the pooled read transactions must go before the environment
+	while (context->read_pool != NULL) {
+		struct lmdb_read_txn* next = context->read_pool->next;
+		mdb_txn_abort(context->read_pool->txn);
+		free(context->read_pool);
+		context->read_pool = next;
+	}
+	pthread_mutex_destroy(&context->read_pool_lock);
+	mdb_env_close(context->env);
+	free(context);
+	datastore->handle = NULL;
 	return 1;
 }
 
+/***
+ * Open a cursor over the records. It reads from a pooled read-only transaction, so
+ * walking the records does not hold the writer lock.
+ * @param datastore the context
+ * @returns true(1) on success
+ */
 int repo_fsrepo_lmdb_cursor_open(struct Datastore* datastore) {
 	if (datastore->handle != NULL) {
-		MDB_env* mdb_env = (MDB_env*)datastore->handle;
-		MDB_dbi mdb_dbi;
+		struct lmdb_context* context = (struct lmdb_context*)datastore->handle;
 		if (datastore->cursor == NULL ) {
-			datastore->cursor = malloc(sizeof(struct lmdb_trans_cursor));
-			struct lmdb_trans_cursor* cursor = (struct lmdb_trans_cursor*)datastore->cursor;
-			// open transaction
-			if (mdb_txn_begin(mdb_env, NULL, 0, &cursor->transaction) != 0)
+			struct lmdb_trans_cursor* cursor = (struct lmdb_trans_cursor*)malloc(sizeof(struct lmdb_trans_cursor));
+			if (cursor == NULL)
 				return 0;
-			MDB_txn* mdb_txn = (MDB_txn*)cursor->transaction;
-			if (mdb_dbi_open(mdb_txn, NULL, MDB_DUPSORT, &mdb_dbi) != 0) {
-				mdb_txn_commit(mdb_txn);
+			// open transaction
+			cursor->transaction = repo_fsrepo_lmdb_read_txn_acquire(context);
+			if (cursor->transaction == NULL) {
+				free(cursor);
 				return 0;
 			}
 			// open cursor
-			if (mdb_cursor_open(mdb_txn, mdb_dbi, &cursor->cursor) != 0) {
-				mdb_txn_commit(mdb_txn);
+			if (mdb_cursor_open(cursor->transaction, context->dbi, &cursor->cursor) != 0) {
+				repo_fsrepo_lmdb_read_txn_release(context, cursor->transaction);
+				free(cursor);
 				return 0;
 			}
+			datastore->cursor = cursor;
 			return 1;
 		}
 	}
@@ -233,11 +804,13 @@ int repo_fsrepo_lmdb_cursor_close(struct Datastore* datastore) {
 		struct lmdb_trans_cursor* cursor = (struct lmdb_trans_cursor*)datastore->cursor;
 		if (cursor->cursor != NULL) {
 			mdb_cursor_close(cursor->cursor);
-			mdb_txn_commit(cursor->transaction);
+			repo_fsrepo_lmdb_read_txn_release((struct lmdb_context*)datastore->handle, cursor->transaction);
 			free(cursor);
+			datastore->cursor = NULL;
 			return 1;
 		}
 		free(cursor);
+		datastore->cursor = NULL;
 	}
 	return 0;
 }
@@ -5,6 +5,7 @@
 #include "libp2p/os/utils.h"
 #include "ipfs/repo/config/config.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
+#include "ipfs/flatfs/flatfs.h"
 
 /**
  * The basic functions for initializing an IPFS repo
@@ -134,3 +135,116 @@ int ipfs_repo_init(int argc, char** argv) {
 	// make the repository
 	return make_ipfs_repository(repo_directory, 4001, NULL, NULL);
 }
+
+/***
+ * Move the blockstore to a new shard function, called from the command line
+ * i.e. ipfs repo reshard /repo/flatfs/shard/v1/next-to-last/2
+ * NOTE: the daemon must not be running while this happens
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @returns true(1) on success, false(0) otherwise
+ */
+int ipfs_repo_reshard(int argc, char** argv) {
+	int retVal = 0;
+	char* repo_directory = NULL;
+	char* blockstore_path = NULL;
+	const char* shard_func = NULL;
+	struct FlatfsShard new_shard;
+	size_t files_moved = 0;
+
+	// the shard function is the first parameter after "repo reshard" that is not the config directory
+	for(int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+			i++;
+			continue;
+		}
+		shard_func = argv[i];
+		break;
+	}
+	if (shard_func == NULL || !ipfs_flatfs_shard_parse(shard_func, &new_shard)) {
+		fprintf(stderr, "Syntax: ipfs repo reshard [prefix|suffix|next-to-last]/[length]\n");
+		goto exit;
+	}
+
+	if (!ipfs_repo_get_directory(argc, argv, &repo_directory)) {
+		fprintf(stderr, "Repository not found at %s\n", repo_directory);
+		goto exit;
+	}
+	size_t blockstore_path_length = strlen(repo_directory) + 12;
+	blockstore_path = malloc(blockstore_path_length);
+	if (blockstore_path == NULL || !os_utils_filepath_join(repo_directory, "blockstore", blockstore_path, blockstore_path_length))
+		goto exit;
+
+	printf("resharding %s\n", blockstore_path);
+	if (!ipfs_flatfs_reshard(blockstore_path, &new_shard, &files_moved)) {
+		fprintf(stderr, "Reshard stopped after moving %lu files. It is safe to run it again.\n", (unsigned long)files_moved);
+		goto exit;
+	}
+	printf("moved %lu files\n", (unsigned long)files_moved);
+
+	retVal = 1;
+	exit:
+	if (repo_directory != NULL)
+		free(repo_directory);
+	if (blockstore_path != NULL)
+		free(blockstore_path);
+	return retVal;
+}
+
+/***
+ * Remove the dead space of the pack store, called from the command line
+ * i.e. ipfs repo compact 50
+ * NOTE: the daemon must not be running while this happens
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @returns true(1) on success, false(0) otherwise
+ */
+int ipfs_repo_compact(int argc, char** argv) {
+	int retVal = 0;
+	char* repo_directory = NULL;
+	struct FSRepo* fs_repo = NULL;
+	int percent = PACK_STORE_COMPACT_PERCENT;
+	uint64_t bytes_freed = 0;
+
+	// the dead space percent is the first parameter after "repo compact" that is not the config directory
+	for(int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+			i++;
+			continue;
+		}
+		percent = atoi(argv[i]);
+		if (percent <= 0 || percent > 100) {
+			fprintf(stderr, "Syntax: ipfs repo compact [percent of dead space, 1 to 100]\n");
+			goto exit;
+		}
+		break;
+	}
+
+	if (!ipfs_repo_get_directory(argc, argv, &repo_directory)) {
+		fprintf(stderr, "Repository not found at %s\n", repo_directory);
+		goto exit;
+	}
+	if (!ipfs_repo_fsrepo_new(repo_directory, NULL, &fs_repo) || !ipfs_repo_fsrepo_open(fs_repo)) {
+		fprintf(stderr, "Unable to open the repository at %s\n", repo_directory);
+		goto exit;
+	}
+	if (fs_repo->pack_store == NULL) {
+		fprintf(stderr, "The blockstore does not use packs, so there is nothing to compact.\n");
+		goto exit;
+	}
+
+	printf("compacting segments with %d%% or more dead space\n", percent);
+	if (!ipfs_pack_store_compact(fs_repo->pack_store, percent, &bytes_freed)) {
+		fprintf(stderr, "Compaction stopped after freeing %llu bytes. It is safe to run it again.\n", (unsigned long long)bytes_freed);
+		goto exit;
+	}
+	printf("freed %llu bytes\n", (unsigned long long)bytes_freed);
+
+	retVal = 1;
+	exit:
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	if (repo_directory != NULL)
+		free(repo_directory);
+	return retVal;
+}
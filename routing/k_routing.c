@@ -160,6 +160,7 @@ struct IpfsRouting* ipfs_routing_new_kademlia(struct IpfsNode* local_node, struc
 	if (routing != NULL) {
 		routing->local_node = local_node;
 		routing->sk = private_key;
+		routing->peer_times = NULL;
 		routing->PutValue = ipfs_routing_kademlia_put_value;
 		routing->GetValue = ipfs_routing_kademlia_get_value;
 		routing->FindProviders = ipfs_routing_kademlia_find_providers;
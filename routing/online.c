@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "ipfs/routing/routing.h"
+#include "ipfs/routing/provider_query.h"
 #include "ipfs/core/null.h"
 #include "libp2p/record/message.h"
 #include "libp2p/net/stream.h"
@@ -73,55 +74,28 @@ struct Libp2pMessage* ipfs_routing_online_send_receive_message(struct SessionCon
  * @returns true(1) on success, otherwise false(0)
  */
 int ipfs_routing_online_find_remote_providers(struct IpfsRouting* routing, const unsigned char* key, size_t key_size, struct Libp2pVector** peers) {
-	int found = 0;
-	// build the message to be transmitted
-	struct Libp2pMessage* message = libp2p_message_new();
-	message->message_type = MESSAGE_TYPE_GET_PROVIDERS;
-	message->key_size = key_size;
-	message->key = malloc(message->key_size);
-	memcpy(message->key, key, message->key_size);
-	// loop through the connected peers, asking for the hash
-	struct Libp2pLinkedList* current_entry = routing->local_node->peerstore->head_entry;
-	while (current_entry != NULL) {
-		struct Libp2pPeer* peer = ((struct PeerEntry*)current_entry->item)->peer;
-		if (peer->connection_type == CONNECTION_TYPE_CONNECTED) {
-			// Ask for hash, if it has it, break out of the loop and stop looking
-			libp2p_logger_debug("online", "FindRemoteProviders: Asking for who can provide\n");
-			struct Libp2pMessage* return_message = ipfs_routing_online_send_receive_message(peer->sessionContext, message);
-			if (return_message != NULL && return_message->provider_peer_head != NULL) {
-				libp2p_logger_debug("online", "FindRemoteProviders: Return value is not null\n");
-				found = 1;
-				*peers = libp2p_utils_vector_new(1);
-				struct Libp2pLinkedList * current_provider_peer_list_item = return_message->provider_peer_head;
-				while (current_provider_peer_list_item != NULL) {
-					struct Libp2pPeer *current_peer = current_provider_peer_list_item->item;
-					// if we can find the peer in the peerstore, use that one instead
-					struct Libp2pPeer* peerstorePeer = libp2p_peerstore_get_peer(routing->local_node->peerstore, (unsigned char*)current_peer->id, current_peer->id_size);
-					if (peerstorePeer != NULL) {
-						// add it to the peerstore
-						libp2p_peerstore_add_peer(routing->local_node->peerstore, current_peer);
-						peerstorePeer = libp2p_peerstore_get_peer(routing->local_node->peerstore, (unsigned char*)current_peer->id, current_peer->id_size);
-					}
-					current_peer = peerstorePeer;
-					libp2p_utils_vector_add(*peers, current_peer);
-					current_provider_peer_list_item = current_provider_peer_list_item->next;
-				}
-				libp2p_message_free(return_message);
-				break;
-			} else {
-				libp2p_logger_debug("online", "FindRemoteProviders: Return value is null or providers are empty.\n");
-			}
-			libp2p_message_free(return_message);
-			// TODO: Make this multithreaded
+	// ask the connected peers, several at a time, the fastest first
+	struct Libp2pMessage* return_message = ipfs_routing_provider_query(routing, key, key_size);
+	if (return_message == NULL)
+		return 0;
+	libp2p_logger_debug("online", "FindRemoteProviders: Return value is not null\n");
+	*peers = libp2p_utils_vector_new(1);
+	struct Libp2pLinkedList * current_provider_peer_list_item = return_message->provider_peer_head;
+	while (current_provider_peer_list_item != NULL) {
+		struct Libp2pPeer *current_peer = current_provider_peer_list_item->item;
+		// if we can find the peer in the peerstore, use that one instead
+		struct Libp2pPeer* peerstorePeer = libp2p_peerstore_get_peer(routing->local_node->peerstore, (unsigned char*)current_peer->id, current_peer->id_size);
+		if (peerstorePeer == NULL) {
+			// add it to the peerstore
+			libp2p_peerstore_add_peer(routing->local_node->peerstore, current_peer);
+			peerstorePeer = libp2p_peerstore_get_peer(routing->local_node->peerstore, (unsigned char*)current_peer->id, current_peer->id_size);
 		}
-		if (found)
-			current_entry = NULL;
-		else
-			current_entry = current_entry->next;
+		if (peerstorePeer != NULL)
+			libp2p_utils_vector_add(*peers, peerstorePeer);
+		current_provider_peer_list_item = current_provider_peer_list_item->next;
 	}
-	// clean up
-	libp2p_message_free(message);
-	return found;
+	libp2p_message_free(return_message);
+	return 1;
 }
 
 /**
@@ -161,7 +135,7 @@ int ipfs_routing_online_find_providers(struct IpfsRouting* routing, const unsign
  * helper method. Connect to a peer and ask it for information
  * about another peer
  */
-int ipfs_routing_online_ask_peer_for_peer(struct Libp2pPeer* whoToAsk, const unsigned char* peer_id, size_t peer_id_size, struct Libp2pPeer **result) {
+int ipfs_routing_online_ask_peer_for_peer(struct IpfsRouting* routing, struct Libp2pPeer* whoToAsk, const unsigned char* peer_id, size_t peer_id_size, struct Libp2pPeer **result) {
 	int retVal = 0;
 	struct Libp2pMessage *message = NULL, *return_message = NULL;
 
@@ -176,7 +150,7 @@ int ipfs_routing_online_ask_peer_for_peer(struct Libp2pPeer* whoToAsk, const uns
 			goto exit;
 		memcpy(message->key, peer_id, peer_id_size);
 
-		return_message = ipfs_routing_online_send_receive_message(whoToAsk->sessionContext, message);
+		return_message = ipfs_routing_peer_times_ask(routing->peer_times, whoToAsk, message);
 		if (return_message == NULL) {
 			// some kind of network error
 			whoToAsk->connection_type = CONNECTION_TYPE_NOT_CONNECTED;
@@ -225,7 +199,7 @@ int ipfs_routing_online_find_peer(struct IpfsRouting* routing, const unsigned ch
 	struct Libp2pLinkedList *current = peerstore->head_entry;
 	while(current != NULL) {
 		struct Libp2pPeer *current_peer = ((struct PeerEntry*)current->item)->peer;
-		ipfs_routing_online_ask_peer_for_peer(current_peer, peer_id, peer_id_size, result);
+		ipfs_routing_online_ask_peer_for_peer(routing, current_peer, peer_id, peer_id_size, result);
 		if (*result != NULL)
 			return 1;
 		current = current->next;
@@ -280,7 +254,7 @@ int ipfs_routing_online_provide(struct IpfsRouting* routing, const unsigned char
 			// notify everyone we're connected to
 			if (current_peer->connection_type == CONNECTION_TYPE_CONNECTED) {
 				// ignoring results is okay this time
-				struct Libp2pMessage* rslt = ipfs_routing_online_send_receive_message(current_peer->sessionContext, msg);
+				struct Libp2pMessage* rslt = ipfs_routing_peer_times_ask(routing->peer_times, current_peer, msg);
 				if (rslt != NULL)
 					libp2p_message_free(rslt);
 			}
@@ -316,7 +290,7 @@ int ipfs_routing_online_ping(struct IpfsRouting* routing, struct Libp2pPeer* pee
 			goto exit;
 		outMsg->message_type = MESSAGE_TYPE_PING;
 		// send the message
-		inMsg = ipfs_routing_online_send_receive_message(peer->sessionContext, outMsg);
+		inMsg = ipfs_routing_peer_times_ask(routing->peer_times, peer, outMsg);
 
 		if (inMsg == NULL) {
 			goto exit;
@@ -355,7 +329,7 @@ int ipfs_routing_online_get_peer_value(ipfs_routing* routing, const struct Libp2
 	msg->message_type = MESSAGE_TYPE_GET_VALUE;
 
 	// send message and receive results
-	struct Libp2pMessage* ret_msg = ipfs_routing_online_send_receive_message(peer->sessionContext, msg);
+	struct Libp2pMessage* ret_msg = ipfs_routing_peer_times_ask(routing->peer_times, (struct Libp2pPeer*)peer, msg);
 	libp2p_message_free(msg);
 
 	if (ret_msg == NULL)
@@ -520,6 +494,7 @@ ipfs_routing* ipfs_routing_new_online (struct IpfsNode* local_node, struct RsaPr
     if (onlineRouting) {
         onlineRouting->local_node     = local_node;
         onlineRouting->sk            = private_key;
+        onlineRouting->peer_times    = ipfs_routing_peer_times_new();
 
         onlineRouting->PutValue      = ipfs_routing_generic_put_value;
         onlineRouting->GetValue      = ipfs_routing_online_get_value;
@@ -540,6 +515,8 @@ ipfs_routing* ipfs_routing_new_online (struct IpfsNode* local_node, struct RsaPr
 }
 
 int ipfs_routing_online_free(ipfs_routing* incoming) {
+	if (incoming != NULL)
+		ipfs_routing_peer_times_free(incoming->peer_times);
 	free(incoming);
 	return 1;
 }
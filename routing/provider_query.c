@@ -0,0 +1,522 @@
+#define _POSIX_C_SOURCE 200809L
+/***
+ * Asks the connected peers for providers, several at a time. See provider_query.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libp2p/peer/peerstore.h"
+#include "libp2p/utils/logger.h"
+#include "ipfs/routing/routing.h"
+#include "ipfs/routing/provider_query.h"
+
+/***
+ * A search for providers. The workers that ask the peers share it with the caller,
+ * and the last one to let go of it frees it.
+ */
+struct ProviderQuery {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct IpfsRouting* routing;
+	struct Libp2pMessage* message; // the GET_PROVIDERS message
+	struct Libp2pVector* peers; // the connected peers, the fastest first
+	int next; // the next peer to ask
+	struct Libp2pVector* busy; // the peers that had a question out for another query when their turn came
+	int running; // the workers that are still asking
+	int references; // the workers, and the caller until it returns
+	int done; // an answer was found, or the caller stopped waiting
+	struct Libp2pMessage* answer;
+};
+
+/***
+ * A peer, and how fast it answers, for sorting
+ */
+struct ProviderQueryCandidate {
+	struct Libp2pPeer* peer;
+	long long milliseconds;
+};
+
+/***
+ * The current time
+ * @returns milliseconds from an arbitrary point, that only moves forward
+ */
+long long ipfs_routing_provider_query_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/***
+ * Create a new RoutingPeerTimes
+ * @returns the RoutingPeerTimes, or NULL on error
+ */
+struct RoutingPeerTimes* ipfs_routing_peer_times_new() {
+	struct RoutingPeerTimes* times = (struct RoutingPeerTimes*)malloc(sizeof(struct RoutingPeerTimes));
+	if (times == NULL)
+		return NULL;
+	times->times = libp2p_utils_vector_new(1);
+	if (times->times == NULL) {
+		free(times);
+		return NULL;
+	}
+	times->pool = thpool_init(ROUTING_PROVIDER_QUERY_WORKERS);
+	if (times->pool == NULL) {
+		libp2p_utils_vector_free(times->times);
+		free(times);
+		return NULL;
+	}
+	times->send_receive = ipfs_routing_online_send_receive_message;
+	pthread_mutex_init(&times->lock, NULL);
+	pthread_cond_init(&times->peer_released, NULL);
+	return times;
+}
+
+/***
+ * Wait for the workers that are still asking, and free the resources of a RoutingPeerTimes
+ * @param times the RoutingPeerTimes
+ * @returns true(1)
+ */
+int ipfs_routing_peer_times_free(struct RoutingPeerTimes* times) {
+	if (times != NULL) {
+		// the workers use the peers and the times, so they must be done first
+		thpool_wait(times->pool);
+		thpool_destroy(times->pool);
+		for(int i = 0; i < times->times->total; i++) {
+			struct RoutingPeerTime* current = (struct RoutingPeerTime*)libp2p_utils_vector_get(times->times, i);
+			if (current->late != NULL)
+				libp2p_message_free(current->late);
+			free(current->late_key);
+			free(current);
+		}
+		libp2p_utils_vector_free(times->times);
+		pthread_mutex_destroy(&times->lock);
+		pthread_cond_destroy(&times->peer_released);
+		free(times);
+	}
+	return 1;
+}
+
+/***
+ * Find the time of a peer
+ * NOTE: the lock must be held
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param add true(1) to add the peer if it is not there
+ * @returns the RoutingPeerTime, or NULL
+ */
+struct RoutingPeerTime* ipfs_routing_peer_times_find(struct RoutingPeerTimes* times, const struct Libp2pPeer* peer, int add) {
+	for(int i = 0; i < times->times->total; i++) {
+		struct RoutingPeerTime* current = (struct RoutingPeerTime*)libp2p_utils_vector_get(times->times, i);
+		if (current->peer == peer)
+			return current;
+	}
+	if (!add)
+		return NULL;
+	struct RoutingPeerTime* current = (struct RoutingPeerTime*)malloc(sizeof(struct RoutingPeerTime));
+	if (current == NULL)
+		return NULL;
+	current->peer = (struct Libp2pPeer*)peer;
+	current->milliseconds = -1;
+	current->busy = 0;
+	current->late = NULL;
+	current->late_key = NULL;
+	current->late_key_size = 0;
+	libp2p_utils_vector_add(times->times, current);
+	return current;
+}
+
+/***
+ * How fast a peer answers
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @returns the average milliseconds, or ROUTING_PEER_TIME_UNKNOWN if it was never asked
+ */
+long long ipfs_routing_peer_times_get(struct RoutingPeerTimes* times, const struct Libp2pPeer* peer) {
+	long long milliseconds = ROUTING_PEER_TIME_UNKNOWN;
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 0);
+	if (current != NULL && current->milliseconds >= 0)
+		milliseconds = current->milliseconds;
+	pthread_mutex_unlock(&times->lock);
+	return milliseconds;
+}
+
+/***
+ * Add a time to the average of a peer
+ * NOTE: the lock must be held
+ * @param current the RoutingPeerTime
+ * @param milliseconds how long it took
+ */
+void ipfs_routing_peer_times_add(struct RoutingPeerTime* current, long long milliseconds) {
+	if (current->milliseconds < 0)
+		current->milliseconds = milliseconds;
+	else // the latest answers count the most
+		current->milliseconds = (current->milliseconds * 3 + milliseconds) / 4;
+}
+
+/***
+ * Record how long a peer took to answer
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param milliseconds how long it took, or ROUTING_PEER_TIME_FAILED if it did not answer
+ */
+void ipfs_routing_peer_times_record(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, long long milliseconds) {
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 1);
+	if (current != NULL)
+		ipfs_routing_peer_times_add(current, milliseconds);
+	pthread_mutex_unlock(&times->lock);
+}
+
+/***
+ * Mark a peer as having a question out, unless it already has one
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @returns true(1) if the peer can be asked
+ */
+int ipfs_routing_peer_times_claim(struct RoutingPeerTimes* times, struct Libp2pPeer* peer) {
+	int retVal = 0;
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 1);
+	if (current != NULL && !current->busy) {
+		current->busy = 1;
+		retVal = 1;
+	}
+	pthread_mutex_unlock(&times->lock);
+	return retVal;
+}
+
+/***
+ * The peer answered (or did not). Record the time, and let it be asked again.
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param milliseconds how long it took, or ROUTING_PEER_TIME_FAILED if it did not answer
+ */
+void ipfs_routing_peer_times_release(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, long long milliseconds) {
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 0);
+	if (current != NULL) {
+		current->busy = 0;
+		ipfs_routing_peer_times_add(current, milliseconds);
+	}
+	pthread_cond_broadcast(&times->peer_released);
+	pthread_mutex_unlock(&times->lock);
+}
+
+/***
+ * Ask a peer something, once nothing else is asking it
+ * @param times the RoutingPeerTimes (NULL to ask right away)
+ * @param peer the peer
+ * @param message the question
+ * @returns the answer, or NULL
+ */
+struct Libp2pMessage* ipfs_routing_peer_times_ask(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, struct Libp2pMessage* message) {
+	if (times == NULL)
+		return ipfs_routing_online_send_receive_message(peer->sessionContext, message);
+	// another reader of the stream could take the answer, so wait for it to finish
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 1);
+	if (current == NULL) {
+		pthread_mutex_unlock(&times->lock);
+		return NULL;
+	}
+	while (current->busy)
+		pthread_cond_wait(&times->peer_released, &times->lock);
+	current->busy = 1;
+	pthread_mutex_unlock(&times->lock);
+	long long start = ipfs_routing_provider_query_now();
+	struct Libp2pMessage* answer = times->send_receive(peer->sessionContext, message);
+	ipfs_routing_peer_times_release(times, peer, (answer != NULL ? ipfs_routing_provider_query_now() - start : ROUTING_PEER_TIME_FAILED));
+	return answer;
+}
+
+/***
+ * Keep an answer with providers that came after its query ended, for the next query
+ * of the same key. It takes the place of an older one.
+ * @param times the RoutingPeerTimes
+ * @param peer the peer that answered
+ * @param question what was asked
+ * @param answer the answer, which now belongs to the RoutingPeerTimes
+ */
+void ipfs_routing_peer_times_keep_late(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, struct Libp2pMessage* question, struct Libp2pMessage* answer) {
+	unsigned char* key = (unsigned char*)malloc(question->key_size);
+	if (key == NULL) {
+		libp2p_message_free(answer);
+		return;
+	}
+	memcpy(key, question->key, question->key_size);
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 1);
+	if (current != NULL) {
+		if (current->late != NULL)
+			libp2p_message_free(current->late);
+		free(current->late_key);
+		current->late = answer;
+		current->late_key = key;
+		current->late_key_size = question->key_size;
+		answer = NULL;
+		key = NULL;
+	}
+	pthread_mutex_unlock(&times->lock);
+	if (answer != NULL)
+		libp2p_message_free(answer);
+	free(key);
+}
+
+/***
+ * Take the late answer of a peer, if it was for the same question
+ * @param times the RoutingPeerTimes
+ * @param peer the peer
+ * @param question what is asked now
+ * @returns the answer, or NULL
+ */
+struct Libp2pMessage* ipfs_routing_peer_times_take_late(struct RoutingPeerTimes* times, struct Libp2pPeer* peer, struct Libp2pMessage* question) {
+	struct Libp2pMessage* answer = NULL;
+	pthread_mutex_lock(&times->lock);
+	struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 0);
+	if (current != NULL && current->late != NULL && current->late_key_size == question->key_size
+			&& memcmp(current->late_key, question->key, question->key_size) == 0) {
+		answer = current->late;
+		current->late = NULL;
+		free(current->late_key);
+		current->late_key = NULL;
+		current->late_key_size = 0;
+	}
+	pthread_mutex_unlock(&times->lock);
+	return answer;
+}
+
+/***
+ * Let go of a query, and free it if nobody else has it
+ * @param query the query
+ * @param worker true(1) if a worker is letting go
+ */
+void ipfs_routing_provider_query_release(struct ProviderQuery* query, int worker) {
+	pthread_mutex_lock(&query->lock);
+	if (worker)
+		query->running--;
+	query->references--;
+	int last = (query->references == 0);
+	pthread_cond_broadcast(&query->changed);
+	pthread_mutex_unlock(&query->lock);
+	if (last) {
+		if (query->answer != NULL)
+			libp2p_message_free(query->answer);
+		libp2p_message_free(query->message);
+		libp2p_utils_vector_free(query->peers);
+		libp2p_utils_vector_free(query->busy);
+		pthread_mutex_destroy(&query->lock);
+		pthread_cond_destroy(&query->changed);
+		free(query);
+	}
+}
+
+/***
+ * Wait until a busy peer can be asked, and mark it as having a question out
+ * @param query the query
+ * @param peer the peer
+ * @returns true(1) if the peer can be asked, false(0) if the query ended first
+ */
+int ipfs_routing_provider_query_claim_wait(struct ProviderQuery* query, struct Libp2pPeer* peer) {
+	struct RoutingPeerTimes* times = query->routing->peer_times;
+	while (!ipfs_routing_peer_times_claim(times, peer)) {
+		pthread_mutex_lock(&query->lock);
+		int done = query->done;
+		pthread_mutex_unlock(&query->lock);
+		if (done)
+			return 0;
+		// peers are let go by other queries, so look at this one now and then
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)ROUTING_PROVIDER_QUERY_WAIT_MILLISECONDS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&times->lock);
+		struct RoutingPeerTime* current = ipfs_routing_peer_times_find(times, peer, 0);
+		if (current != NULL && current->busy)
+			pthread_cond_timedwait(&times->peer_released, &times->lock, &deadline);
+		pthread_mutex_unlock(&times->lock);
+	}
+	return 1;
+}
+
+/***
+ * The job of a worker of the pool: ask peers, one after another, until an answer is found
+ * @param arg the ProviderQuery
+ */
+void ipfs_routing_provider_query_worker(void* arg) {
+	struct ProviderQuery* query = (struct ProviderQuery*)arg;
+	struct RoutingPeerTimes* times = query->routing->peer_times;
+
+	for(;;) {
+		struct Libp2pPeer* peer = NULL;
+		int waiting = 0;
+		pthread_mutex_lock(&query->lock);
+		if (!query->done) {
+			if (query->next < query->peers->total) {
+				peer = (struct Libp2pPeer*)libp2p_utils_vector_get(query->peers, query->next++);
+			} else if (query->busy->total > 0) {
+				// everyone else has been asked, so wait for the peers that were busy
+				peer = (struct Libp2pPeer*)libp2p_utils_vector_get(query->busy, 0);
+				libp2p_utils_vector_delete(query->busy, 0);
+				waiting = 1;
+			}
+		}
+		pthread_mutex_unlock(&query->lock);
+		if (peer == NULL)
+			break;
+
+		// the peer may already have answered the same question for a query that ended
+		struct Libp2pMessage* answer = ipfs_routing_peer_times_take_late(times, peer, query->message);
+		if (answer == NULL) {
+			// the answers on a stream can not be told apart, so a peer gets one question at a time
+			if (waiting) {
+				if (!ipfs_routing_provider_query_claim_wait(query, peer))
+					continue;
+			} else if (!ipfs_routing_peer_times_claim(times, peer)) {
+				pthread_mutex_lock(&query->lock);
+				libp2p_utils_vector_add(query->busy, peer);
+				pthread_mutex_unlock(&query->lock);
+				continue;
+			}
+			libp2p_logger_debug("online", "FindRemoteProviders: Asking for who can provide\n");
+			long long start = ipfs_routing_provider_query_now();
+			answer = times->send_receive(peer->sessionContext, query->message);
+			ipfs_routing_peer_times_release(times, peer, (answer != NULL ? ipfs_routing_provider_query_now() - start : ROUTING_PEER_TIME_FAILED));
+		}
+
+		if (answer != NULL && answer->provider_peer_head != NULL) {
+			pthread_mutex_lock(&query->lock);
+			if (!query->done) {
+				query->answer = answer;
+				answer = NULL;
+				query->done = 1;
+				pthread_cond_broadcast(&query->changed);
+			}
+			pthread_mutex_unlock(&query->lock);
+			if (answer != NULL) {
+				// too late for this query, but not for the next one
+				ipfs_routing_peer_times_keep_late(times, peer, query->message, answer);
+				answer = NULL;
+			}
+		} else {
+			libp2p_logger_debug("online", "FindRemoteProviders: Return value is null or providers are empty.\n");
+		}
+		if (answer != NULL)
+			libp2p_message_free(answer);
+	}
+
+	ipfs_routing_provider_query_release(query, 1);
+}
+
+/***
+ * Used by qsort to put the fastest peers first
+ */
+int ipfs_routing_provider_query_compare(const void* a, const void* b) {
+	long long first = ((const struct ProviderQueryCandidate*)a)->milliseconds;
+	long long second = ((const struct ProviderQueryCandidate*)b)->milliseconds;
+	return (first > second) - (first < second);
+}
+
+/***
+ * Build the list of connected peers, the fastest first
+ * @param routing the context
+ * @returns a vector of Libp2pPeers, or NULL on error
+ */
+struct Libp2pVector* ipfs_routing_provider_query_peers(struct IpfsRouting* routing) {
+	int total = 0;
+	for(struct Libp2pLinkedList* current = routing->local_node->peerstore->head_entry; current != NULL; current = current->next)
+		total++;
+	struct ProviderQueryCandidate* candidates = (struct ProviderQueryCandidate*)malloc(sizeof(struct ProviderQueryCandidate) * (total + 1));
+	struct Libp2pVector* peers = libp2p_utils_vector_new(total + 1);
+	if (candidates == NULL || peers == NULL) {
+		free(candidates);
+		if (peers != NULL)
+			libp2p_utils_vector_free(peers);
+		return NULL;
+	}
+	int connected = 0;
+	for(struct Libp2pLinkedList* current = routing->local_node->peerstore->head_entry; current != NULL; current = current->next) {
+		struct Libp2pPeer* peer = ((struct PeerEntry*)current->item)->peer;
+		if (peer->connection_type == CONNECTION_TYPE_CONNECTED && !peer->is_local) {
+			candidates[connected].peer = peer;
+			candidates[connected].milliseconds = ipfs_routing_peer_times_get(routing->peer_times, peer);
+			connected++;
+		}
+	}
+	qsort(candidates, connected, sizeof(struct ProviderQueryCandidate), ipfs_routing_provider_query_compare);
+	for(int i = 0; i < connected; i++)
+		libp2p_utils_vector_add(peers, candidates[i].peer);
+	free(candidates);
+	return peers;
+}
+
+/***
+ * Ask the connected peers who can provide a key, ROUTING_PROVIDER_QUERY_ALPHA at a time
+ * @param routing the context (its peer_times keeps the times)
+ * @param key the key
+ * @param key_size the length of the key
+ * @returns the first answer that has providers, or NULL
+ */
+struct Libp2pMessage* ipfs_routing_provider_query(struct IpfsRouting* routing, const unsigned char* key, size_t key_size) {
+	if (routing->peer_times == NULL)
+		return NULL;
+	struct ProviderQuery* query = (struct ProviderQuery*)malloc(sizeof(struct ProviderQuery));
+	if (query == NULL)
+		return NULL;
+	query->routing = routing;
+	query->next = 0;
+	query->running = 0;
+	query->references = 1;
+	query->done = 0;
+	query->answer = NULL;
+	query->peers = ipfs_routing_provider_query_peers(routing);
+	query->busy = libp2p_utils_vector_new(1);
+	query->message = libp2p_message_new();
+	if (query->message != NULL) {
+		query->message->message_type = MESSAGE_TYPE_GET_PROVIDERS;
+		query->message->key_size = key_size;
+		query->message->key = malloc(key_size);
+		if (query->message->key != NULL)
+			memcpy(query->message->key, key, key_size);
+	}
+	if (query->peers == NULL || query->busy == NULL || query->message == NULL || query->message->key == NULL) {
+		if (query->peers != NULL)
+			libp2p_utils_vector_free(query->peers);
+		if (query->busy != NULL)
+			libp2p_utils_vector_free(query->busy);
+		if (query->message != NULL)
+			libp2p_message_free(query->message);
+		free(query);
+		return NULL;
+	}
+	pthread_mutex_init(&query->lock, NULL);
+	pthread_cond_init(&query->changed, NULL);
+
+	// give the pool the jobs. They are not waited for once there is an answer.
+	int workers = (query->peers->total < ROUTING_PROVIDER_QUERY_ALPHA ? query->peers->total : ROUTING_PROVIDER_QUERY_ALPHA);
+	for(int i = 0; i < workers; i++) {
+		pthread_mutex_lock(&query->lock);
+		query->running++;
+		query->references++;
+		pthread_mutex_unlock(&query->lock);
+		if (thpool_add_work(routing->peer_times->pool, ipfs_routing_provider_query_worker, query) != 0) {
+			ipfs_routing_provider_query_release(query, 1);
+			break;
+		}
+	}
+
+	// wait for an answer, or for everyone to be asked
+	pthread_mutex_lock(&query->lock);
+	while (!query->done && query->running > 0)
+		pthread_cond_wait(&query->changed, &query->lock);
+	struct Libp2pMessage* answer = query->answer;
+	query->answer = NULL;
+	query->done = 1;
+	pthread_mutex_unlock(&query->lock);
+	ipfs_routing_provider_query_release(query, 0);
+	return answer;
+}
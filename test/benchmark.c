@@ -0,0 +1,14 @@
+#include <stdio.h>
+
+#include "node/test_chunker.h"
+
+/**
+ * Run the benchmarks. They print what they measure, and only fail if they could not run.
+ */
+int main(int argc, char** argv) {
+	if (!test_chunker_benchmark()) {
+		printf("test_chunker_benchmark could not run\n");
+		return 1;
+	}
+	return 0;
+}
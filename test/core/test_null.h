@@ -1,4 +1,23 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// connections that negotiate with the daemon at once
+#define TEST_NULL_CONNECTIONS 200
+// connections that send a byte now and then, more of them than the daemon has workers
+#define TEST_NULL_SLOW 40
+// frames the secure stream has already taken off the socket, more than a worker reads at once
+#define TEST_NULL_BURST_FRAMES 40
+
+void ipfs_null_connection_read(void* ptr);
+int ipfs_null_connection_watch(struct null_connection_params* connection_param, int operation);
 
 int test_null_add_provider() {
 	int retVal = 0;
@@ -57,3 +76,271 @@ int test_null_add_provider() {
 		pthread_join(thread2, NULL);
 	return retVal;
 }
+
+/***
+ * Open a connection to the daemon
+ * @param port the port of the daemon
+ * @param seconds how long a read may wait
+ * @returns the socket, or -1 on error
+ */
+int test_null_connect(int port, int seconds) {
+	struct sockaddr_in address;
+	struct timeval timeout;
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	timeout.tv_sec = seconds;
+	timeout.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+	memset(&address, 0, sizeof(struct sockaddr_in));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (connect(s, (struct sockaddr*)&address, sizeof(struct sockaddr_in)) != 0) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/***
+ * Read the multistream header the daemon sends
+ * @param s the socket
+ * @returns true(1) if it came
+ */
+int test_null_read_header(int s) {
+	const char* header = "\x13/multistream/1.0.0\n";
+	char buffer[20];
+	size_t bytes_read = 0;
+	while (bytes_read < sizeof(buffer)) {
+		ssize_t result = recv(s, &buffer[bytes_read], sizeof(buffer) - bytes_read, 0);
+		if (result <= 0)
+			return 0;
+		bytes_read += result;
+	}
+	return memcmp(buffer, header, sizeof(buffer)) == 0;
+}
+
+struct TestNullTrickle {
+	int* sockets;
+	int count;
+	int stop;
+};
+
+/***
+ * Send the multistream header a byte a second to each connection, as a thread. Each
+ * read of the daemon gets its byte well within its timeout.
+ * @param arg the TestNullTrickle
+ * @returns NULL
+ */
+void* test_null_trickle(void* arg) {
+	struct TestNullTrickle* trickle = (struct TestNullTrickle*)arg;
+	const char* header = "\x13/multistream/1.0.0\n";
+	for(int sent = 0; sent < 20 && !trickle->stop; sent++) {
+		for(int i = 0; i < trickle->count; i++)
+			send(trickle->sockets[i], &header[sent], 1, MSG_NOSIGNAL);
+		sleep(1);
+	}
+	return NULL;
+}
+
+/***
+ * Many connections negotiate with the daemon at once, while more connections than
+ * there are workers send a byte now and then. Those are hung up on once they have
+ * held a worker for long enough, however often they send something.
+ */
+int test_null_many_connections() {
+	int retVal = 0;
+	char* ipfs_path = "/tmp/test1";
+	pthread_t daemon_thread;
+	int daemon_started = 0;
+	pthread_t trickle_thread;
+	int trickle_started = 0;
+	int slow[TEST_NULL_SLOW];
+	int talking[TEST_NULL_CONNECTIONS];
+	const char* header = "\x13/multistream/1.0.0\n";
+	struct TestNullTrickle trickle;
+
+	for(int i = 0; i < TEST_NULL_SLOW; i++)
+		slow[i] = -1;
+	for(int i = 0; i < TEST_NULL_CONNECTIONS; i++)
+		talking[i] = -1;
+
+	os_utils_setenv("IPFS_PATH", ipfs_path, 1);
+	drop_and_build_repository(ipfs_path, 4001, NULL, NULL);
+	if (pthread_create(&daemon_thread, NULL, test_routing_daemon_start, (void*)ipfs_path) < 0)
+		goto exit;
+	daemon_started = 1;
+	sleep(3);
+
+	for(int i = 0; i < TEST_NULL_SLOW; i++) {
+		slow[i] = test_null_connect(4001, 60);
+		if (slow[i] < 0)
+			goto exit;
+	}
+	trickle.sockets = slow;
+	trickle.count = TEST_NULL_SLOW;
+	trickle.stop = 0;
+	if (pthread_create(&trickle_thread, NULL, test_null_trickle, &trickle) != 0)
+		goto exit;
+	trickle_started = 1;
+	// all of them ask first, then all of them wait for the answer, which comes
+	// once the slow ones are cut off
+	for(int i = 0; i < TEST_NULL_CONNECTIONS; i++) {
+		talking[i] = test_null_connect(4001, 30);
+		if (talking[i] < 0 || send(talking[i], header, 20, 0) != 20) {
+			fprintf(stderr, "Connection %d could not be opened\n", i);
+			goto exit;
+		}
+	}
+	for(int i = 0; i < TEST_NULL_CONNECTIONS; i++) {
+		if (!test_null_read_header(talking[i])) {
+			fprintf(stderr, "Connection %d did not negotiate\n", i);
+			goto exit;
+		}
+	}
+	// the slow ones never finished sending the header, and the daemon hangs up
+	for(int i = 0; i < TEST_NULL_SLOW; i++) {
+		char buffer[100];
+		ssize_t result = 0;
+		while ((result = recv(slow[i], buffer, sizeof(buffer), 0)) > 0)
+			;
+		if (result != 0 && errno != ECONNRESET) {
+			fprintf(stderr, "The daemon did not hang up on slow connection %d\n", i);
+			goto exit;
+		}
+	}
+
+	retVal = 1;
+	exit:
+	if (trickle_started) {
+		trickle.stop = 1;
+		pthread_join(trickle_thread, NULL);
+	}
+	for(int i = 0; i < TEST_NULL_SLOW; i++)
+		if (slow[i] >= 0)
+			close(slow[i]);
+	for(int i = 0; i < TEST_NULL_CONNECTIONS; i++)
+		if (talking[i] >= 0)
+			close(talking[i]);
+	ipfs_daemon_stop();
+	if (daemon_started)
+		pthread_join(daemon_thread, NULL);
+	return retVal;
+}
+
+int test_null_burst_waiting = 0; // the frames in the fake secure stream
+int test_null_burst_handled = 0;
+pthread_mutex_t test_null_burst_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int test_null_burst_peek(void* stream_context) {
+	pthread_mutex_lock(&test_null_burst_lock);
+	int waiting = test_null_burst_waiting;
+	pthread_mutex_unlock(&test_null_burst_lock);
+	return waiting;
+}
+
+int test_null_burst_read(void* stream_context, unsigned char** results, size_t* results_size, int timeout_secs) {
+	pthread_mutex_lock(&test_null_burst_lock);
+	int waiting = test_null_burst_waiting;
+	if (waiting > 0)
+		test_null_burst_waiting--;
+	pthread_mutex_unlock(&test_null_burst_lock);
+	if (waiting == 0)
+		return 0;
+	*results = (unsigned char*)malloc(13);
+	if (*results == NULL)
+		return 0;
+	memcpy(*results, "/test/burst\n", 13);
+	*results_size = 12;
+	return 1;
+}
+
+int test_null_burst_can_handle(const uint8_t* incoming, size_t incoming_size) {
+	return incoming_size >= 11 && memcmp(incoming, "/test/burst", 11) == 0;
+}
+
+int test_null_burst_handle_message(const uint8_t* incoming, size_t incoming_size, struct SessionContext* session_context, void* protocol_context) {
+	pthread_mutex_lock(&test_null_burst_lock);
+	test_null_burst_handled++;
+	pthread_mutex_unlock(&test_null_burst_lock);
+	return 1;
+}
+
+int test_null_burst_shutdown(void* context) {
+	return 1;
+}
+
+/***
+ * A peer sends many frames at once, and the secure stream takes them all off the socket.
+ * Each is answered, though epoll never hears about the ones after the first.
+ */
+int test_null_frames_burst() {
+	int retVal = 0;
+	int sockets[2] = { -1, -1 };
+	int epoll_descriptor = -1;
+	threadpool thpool = NULL;
+	struct IpfsNode local_node;
+	struct SessionContext session;
+	struct Stream stream;
+	struct Libp2pProtocolHandler handler;
+	struct null_connection_params connection_param;
+
+	memset(&local_node, 0, sizeof(struct IpfsNode));
+	memset(&session, 0, sizeof(struct SessionContext));
+	memset(&stream, 0, sizeof(struct Stream));
+	memset(&connection_param, 0, sizeof(struct null_connection_params));
+	handler.context = NULL;
+	handler.CanHandle = test_null_burst_can_handle;
+	handler.HandleMessage = test_null_burst_handle_message;
+	handler.Shutdown = test_null_burst_shutdown;
+	local_node.protocol_handlers = libp2p_utils_vector_new(1);
+	if (local_node.protocol_handlers == NULL)
+		goto exit;
+	libp2p_utils_vector_add(local_node.protocol_handlers, &handler);
+	stream.peek = test_null_burst_peek;
+	stream.read = test_null_burst_read;
+	session.default_stream = &stream;
+
+	// nothing more ever comes on the socket
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		goto exit;
+	epoll_descriptor = epoll_create1(0);
+	thpool = thpool_init(2);
+	if (epoll_descriptor < 0 || thpool == NULL)
+		goto exit;
+	connection_param.file_descriptor = sockets[0];
+	connection_param.local_node = &local_node;
+	connection_param.session = &session;
+	connection_param.epoll_descriptor = epoll_descriptor;
+	connection_param.thpool = thpool;
+	if (!ipfs_null_connection_watch(&connection_param, EPOLL_CTL_ADD))
+		goto exit;
+
+	// as the listener does when epoll says the first frame is there
+	test_null_burst_waiting = TEST_NULL_BURST_FRAMES;
+	test_null_burst_handled = 0;
+	connection_param.busy = 1;
+	if (thpool_add_work(thpool, ipfs_null_connection_read, &connection_param) != 0)
+		goto exit;
+	for(int i = 0; i < 50 && test_null_burst_peek(NULL) > 0; i++)
+		usleep(100000);
+	thpool_wait(thpool);
+	if (test_null_burst_handled != TEST_NULL_BURST_FRAMES) {
+		fprintf(stderr, "%d of %d frames were answered\n", test_null_burst_handled, TEST_NULL_BURST_FRAMES);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (thpool != NULL)
+		thpool_destroy(thpool);
+	if (epoll_descriptor >= 0)
+		close(epoll_descriptor);
+	for(int i = 0; i < 2; i++)
+		if (sockets[i] >= 0)
+			close(sockets[i]);
+	if (local_node.protocol_handlers != NULL)
+		libp2p_utils_vector_free(local_node.protocol_handlers);
+	return retVal;
+}
@@ -1,11 +1,15 @@
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include "../test_helper.h"
 #include "../routing/test_routing.h" // for test_routing_daemon_start
 #include "libp2p/utils/vector.h"
 #include "libp2p/utils/logger.h"
 #include "ipfs/exchange/bitswap/bitswap.h"
 #include "ipfs/exchange/bitswap/message.h"
+#include "ipfs/exchange/bitswap/verify.h"
+#include "ipfs/exchange/bitswap/wantlist_queue.h"
 #include "ipfs/importer/importer.h"
 
 uint8_t* generate_bytes(size_t size) {
@@ -113,6 +117,199 @@ int test_bitswap_protobuf() {
 	return retVal;
 }
 
+/***
+ * Encode and decode a BitswapMessage with a block in the payload, and make sure
+ * a message that was cut short is not decoded
+ */
+int test_bitswap_protobuf_payload() {
+	int retVal = 0;
+	size_t data_size = 300000;
+	uint8_t* data = generate_bytes(data_size);
+	uint8_t* buffer = NULL;
+	struct BitswapMessage* message = ipfs_bitswap_message_new();
+	struct BitswapMessage* result = NULL;
+	struct Block* block = ipfs_block_new();
+
+	if (!ipfs_blocks_block_add_data(data, data_size, block)) {
+		ipfs_block_free(block);
+		goto exit;
+	}
+	message->payload = libp2p_utils_vector_new(1);
+	libp2p_utils_vector_add(message->payload, block);
+
+	size_t buffer_size = ipfs_bitswap_message_protobuf_encode_size(message);
+	buffer = (uint8_t*)malloc(buffer_size);
+	if (!ipfs_bitswap_message_protobuf_encode(message, buffer, buffer_size, &buffer_size)) {
+		fprintf(stderr, "Unable to encode message\n");
+		goto exit;
+	}
+	if (!ipfs_bitswap_message_protobuf_decode(buffer, buffer_size, &result)) {
+		fprintf(stderr, "Unable to decode message\n");
+		goto exit;
+	}
+	if (result->payload == NULL || result->payload->total != 1) {
+		fprintf(stderr, "Decoded message does not have the block\n");
+		goto exit;
+	}
+	struct Block* decoded = (struct Block*)libp2p_utils_vector_get(result->payload, 0);
+	if (decoded->data_length != data_size || !compare_generated_bytes(decoded->data, decoded->data_length)) {
+		fprintf(stderr, "Decoded block has the wrong data\n");
+		goto exit;
+	}
+	if (decoded->cid == NULL || ipfs_cid_compare(decoded->cid, block->cid) != 0) {
+		fprintf(stderr, "Decoded block has the wrong cid\n");
+		goto exit;
+	}
+	ipfs_bitswap_message_free(result);
+	result = NULL;
+
+	// the block says it is longer than what is left
+	if (ipfs_bitswap_message_protobuf_decode(buffer, buffer_size - 1000, &result)) {
+		fprintf(stderr, "A message that was cut short was decoded\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (result != NULL)
+		ipfs_bitswap_message_free(result);
+	ipfs_bitswap_message_free(message);
+	free(buffer);
+	free(data);
+	return retVal;
+}
+
+/***
+ * A block that arrives must hash to its Cid
+ */
+int test_bitswap_verify_block() {
+	int retVal = 0;
+	size_t data_size = 100000;
+	uint8_t* data = generate_bytes(data_size);
+	struct Block* block = ipfs_block_new();
+	struct Cid* multihash_cid = NULL;
+
+	if (!ipfs_blocks_block_add_data(data, data_size, block))
+		goto exit;
+	if (!ipfs_bitswap_verify_block(block)) {
+		fprintf(stderr, "A good block did not pass\n");
+		goto exit;
+	}
+	// the same hash, as a sha2-256 multihash
+	unsigned char multihash[34];
+	multihash[0] = 0x12;
+	multihash[1] = 32;
+	memcpy(&multihash[2], block->cid->hash, 32);
+	multihash_cid = ipfs_cid_new(0, multihash, 34, CID_PROTOBUF);
+	struct Cid* hash_cid = block->cid;
+	block->cid = multihash_cid;
+	int passed = ipfs_bitswap_verify_block(block);
+	block->cid = hash_cid;
+	if (!passed) {
+		fprintf(stderr, "A good block with a multihash did not pass\n");
+		goto exit;
+	}
+	// a hash type that can not be checked is not passed, and is known to be unsupported
+	multihash[0] = 0x13;
+	multihash[1] = 32;
+	struct Cid* sha512_cid = ipfs_cid_new(0, multihash, 34, CID_PROTOBUF);
+	if (sha512_cid == NULL)
+		goto exit;
+	block->cid = sha512_cid;
+	passed = ipfs_bitswap_verify_block(block);
+	int supported = ipfs_bitswap_verify_supported(sha512_cid);
+	block->cid = hash_cid;
+	ipfs_cid_free(sha512_cid);
+	if (passed || supported || !ipfs_bitswap_verify_supported(hash_cid)) {
+		fprintf(stderr, "A hash type that can not be checked was not seen as unsupported\n");
+		goto exit;
+	}
+	// change a byte
+	block->data[data_size / 2]++;
+	if (ipfs_bitswap_verify_block(block)) {
+		fprintf(stderr, "A block that was changed passed\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	ipfs_cid_free(multihash_cid);
+	ipfs_block_free(block);
+	free(data);
+	return retVal;
+}
+
+// the blocks given to the verifier at once
+#define TEST_BITSWAP_VERIFY_BLOCKS 8
+
+/***
+ * Keeps a worker of the verifier busy until the flag is set
+ * @param arg the flag
+ */
+void test_bitswap_verify_hold(void* arg) {
+	while (!__atomic_load_n((int*)arg, __ATOMIC_SEQ_CST))
+		usleep(1000);
+}
+
+/***
+ * Once the workers have enough waiting, blocks are checked on the thread that received them
+ */
+int test_bitswap_verify_queue() {
+	int retVal = 0;
+	size_t data_size = BITSWAP_VERIFY_BATCH_BYTES + 1000;
+	uint8_t* data = generate_bytes(data_size);
+	struct BitswapContext context;
+	struct Libp2pVector* blocks = libp2p_utils_vector_new(TEST_BITSWAP_VERIFY_BLOCKS);
+	int released = 0;
+
+	memset(&context, 0, sizeof(struct BitswapContext));
+	context.verifier = ipfs_bitswap_verifier_new(2);
+	if (context.verifier == NULL || blocks == NULL)
+		goto exit;
+	context.verifier->max_bytes = BITSWAP_VERIFY_BATCH_BYTES;
+	// blocks that do not match their Cid are thrown away, without going near the rest of the exchange
+	for(int i = 0; i < TEST_BITSWAP_VERIFY_BLOCKS; i++) {
+		struct Block* block = ipfs_block_new();
+		if (block == NULL || !ipfs_blocks_block_add_data(data, data_size, block)) {
+			ipfs_block_free(block);
+			goto exit;
+		}
+		block->data[0]++;
+		libp2p_utils_vector_add(blocks, block);
+	}
+	for(int i = 0; i < 2; i++)
+		thpool_add_work(context.verifier->pool, test_bitswap_verify_hold, &released);
+
+	ipfs_bitswap_verifier_add(&context, blocks, NULL);
+	blocks = NULL;
+	// one job is waiting, and the rest were checked here
+	pthread_mutex_lock(&context.verifier->lock);
+	size_t queued = context.verifier->queued_bytes;
+	pthread_mutex_unlock(&context.verifier->lock);
+	if (queued != data_size) {
+		fprintf(stderr, "%lu bytes are waiting to be checked, not %lu\n", (unsigned long)queued, (unsigned long)data_size);
+		goto exit;
+	}
+	__atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+	thpool_wait(context.verifier->pool);
+	if (context.verifier->queued_bytes != 0) {
+		fprintf(stderr, "The checked blocks are still counted\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	__atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+	if (blocks != NULL) {
+		for(int i = 0; i < blocks->total; i++)
+			ipfs_block_free((struct Block*)libp2p_utils_vector_get(blocks, i));
+		libp2p_utils_vector_free(blocks);
+	}
+	ipfs_bitswap_verifier_free(context.verifier);
+	free(data);
+	return retVal;
+}
+
 /***
  * Put a file in ipfs and attempt to retrieve it using bitswap's Exchange interface
  */
@@ -158,6 +355,318 @@ int test_bitswap_retrieve_file()
 	return retVal;
 }
 
+/***
+ * Used by test_bitswap_retrieve_blocks to count the blocks
+ */
+int test_bitswap_count_block(struct Block* block, void* arg) {
+	(*(int*)arg)++;
+	ipfs_block_free(block);
+	return 1;
+}
+
+/***
+ * Put a file of several blocks in ipfs, and retrieve all of its blocks at once
+ */
+int test_bitswap_retrieve_blocks() {
+	int retVal = 0;
+	struct IpfsNode* localNode = NULL;
+	const char* ipfs_path = "/tmp/ipfstest1";
+	const char* file_name = "/tmp/test_bitswap_retrieve_blocks.bin";
+	struct HashtableNode* node = NULL;
+	size_t bytes_written = 0;
+	struct Libp2pVector* cids = NULL;
+	struct Libp2pVector* blocks = NULL;
+	int links = 0;
+	int streamed = 0;
+	uint8_t* bytes = generate_bytes(1000000);
+
+	create_file(file_name, bytes, 1000000);
+	os_utils_setenv("IPFS_PATH", ipfs_path, 1);
+	drop_and_build_repository(ipfs_path, 4001, NULL, NULL);
+	ipfs_node_online_new(ipfs_path, &localNode);
+	localNode->routing->Bootstrap(localNode->routing);
+	if (!ipfs_import_file(NULL, file_name, &node, localNode, &bytes_written, 0))
+		goto exit;
+
+	// the blocks of the file
+	cids = libp2p_utils_vector_new(1);
+	for(struct NodeLink* link = node->head_link; link != NULL; link = link->next) {
+		libp2p_utils_vector_add(cids, ipfs_cid_new(0, link->hash, link->hash_size, CID_PROTOBUF));
+		links++;
+	}
+	if (links < 2)
+		goto exit;
+
+	if (!localNode->exchange->GetBlocks(localNode->exchange, cids, &blocks) || blocks->total != links)
+		goto exit;
+	if (!localNode->exchange->GetBlocksStream(localNode->exchange, NULL, cids, test_bitswap_count_block, &streamed) || streamed != links)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (blocks != NULL) {
+		for(int i = 0; i < blocks->total; i++)
+			ipfs_block_free((struct Block*)libp2p_utils_vector_get(blocks, i));
+		libp2p_utils_vector_free(blocks);
+	}
+	if (cids != NULL) {
+		for(int i = 0; i < cids->total; i++)
+			ipfs_cid_free((struct Cid*)libp2p_utils_vector_get(cids, i));
+		libp2p_utils_vector_free(cids);
+	}
+	if (node != NULL)
+		ipfs_hashtable_node_free(node);
+	ipfs_node_free(localNode);
+	free(bytes);
+	return retVal;
+}
+
+struct TestBitswapArrival {
+	struct Exchange* exchange;
+	struct Block* block;
+};
+
+/***
+ * Hand a block to the exchange a little later, as if it came from a peer
+ * @param arg the TestBitswapArrival
+ * @returns NULL
+ */
+void* test_bitswap_block_arrives(void* arg) {
+	struct TestBitswapArrival* arrival = (struct TestBitswapArrival*)arg;
+	usleep(200000);
+	arrival->exchange->HasBlock(arrival->exchange, arrival->block);
+	return NULL;
+}
+
+/***
+ * Milliseconds since some time in the past
+ */
+long test_bitswap_milliseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/***
+ * GetBlock returns as soon as the block it waits for arrives, and gives up after
+ * Bitswap.TimeoutSeconds if it never does
+ */
+int test_bitswap_get_block_wait() {
+	int retVal = 0;
+	struct IpfsNode* localNode = NULL;
+	const char* ipfs_path = "/tmp/ipfstest1";
+	struct TestBitswapArrival arrival;
+	struct Block* block = NULL;
+	struct Cid* cid = NULL;
+	pthread_t thread;
+	int thread_started = 0;
+	unsigned char data[100];
+
+	arrival.block = NULL;
+	os_utils_setenv("IPFS_PATH", ipfs_path, 1);
+	drop_and_build_repository(ipfs_path, 4001, NULL, NULL);
+	if (!ipfs_node_online_new(ipfs_path, &localNode))
+		goto exit;
+	localNode->repo->config->bitswap.timeout_seconds = 2;
+
+	// a block that is nowhere yet
+	memset(data, 'w', sizeof(data));
+	arrival.exchange = localNode->exchange;
+	arrival.block = ipfs_block_new();
+	if (arrival.block == NULL || !ipfs_blocks_block_add_data(data, sizeof(data), arrival.block))
+		goto exit;
+	cid = ipfs_cid_new(arrival.block->cid->version, arrival.block->cid->hash, arrival.block->cid->hash_length, arrival.block->cid->codec);
+	if (cid == NULL)
+		goto exit;
+
+	long start = test_bitswap_milliseconds();
+	if (pthread_create(&thread, NULL, test_bitswap_block_arrives, &arrival) != 0)
+		goto exit;
+	thread_started = 1;
+	if (!localNode->exchange->GetBlock(localNode->exchange, cid, &block)) {
+		fprintf(stderr, "GetBlock did not get the block that arrived\n");
+		goto exit;
+	}
+	long waited = test_bitswap_milliseconds() - start;
+	if (waited > 1000) {
+		fprintf(stderr, "GetBlock took %ldms to see a block that arrived after 200ms\n", waited);
+		goto exit;
+	}
+	ipfs_block_free(block);
+	block = NULL;
+	ipfs_cid_free(cid);
+	cid = NULL;
+
+	// a block that never arrives
+	memset(data, 'x', sizeof(data));
+	struct Block* missing = ipfs_block_new();
+	if (missing == NULL)
+		goto exit;
+	if (ipfs_blocks_block_add_data(data, sizeof(data), missing))
+		cid = ipfs_cid_new(missing->cid->version, missing->cid->hash, missing->cid->hash_length, missing->cid->codec);
+	ipfs_block_free(missing);
+	if (cid == NULL)
+		goto exit;
+	start = test_bitswap_milliseconds();
+	if (localNode->exchange->GetBlock(localNode->exchange, cid, &block)) {
+		fprintf(stderr, "GetBlock got a block that nobody has\n");
+		goto exit;
+	}
+	waited = test_bitswap_milliseconds() - start;
+	if (waited < 1500 || waited > 5000) {
+		fprintf(stderr, "GetBlock gave up after %ldms instead of 2 seconds\n", waited);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	// the exchange takes the block once it arrives
+	if (thread_started)
+		pthread_join(thread, NULL);
+	else if (arrival.block != NULL)
+		ipfs_block_free(arrival.block);
+	if (block != NULL)
+		ipfs_block_free(block);
+	if (cid != NULL)
+		ipfs_cid_free(cid);
+	ipfs_node_free(localNode);
+	return retVal;
+}
+
+#define TEST_BITSWAP_ARRIVING_BLOCKS 4
+
+/***
+ * The blocks of test_bitswap_retrieve_blocks_arrive. The first is local, the rest arrive later.
+ */
+struct TestBitswapArriving {
+	struct BitswapContext* context;
+	struct Block* blocks[TEST_BITSWAP_ARRIVING_BLOCKS];
+	int received[TEST_BITSWAP_ARRIVING_BLOCKS];
+	int waiting; // the arrivals started while GetBlocksStream was waiting for all of them
+};
+
+/***
+ * Wait until GetBlocksStream waits for the blocks that are not local, then hand them
+ * to the exchange in reverse order, as if they came from a peer
+ * @param arg the TestBitswapArriving
+ * @returns NULL
+ */
+void* test_bitswap_blocks_arrive(void* arg) {
+	struct TestBitswapArriving* arriving = (struct TestBitswapArriving*)arg;
+	struct WantListQueue* wantlist = arriving->context->localWantlist;
+	for(int tries = 0; tries < 500 && !arriving->waiting; tries++) {
+		usleep(10000);
+		int watched = 0;
+		pthread_mutex_lock(&wantlist->wantlist_mutex);
+		for(int i = 1; i < TEST_BITSWAP_ARRIVING_BLOCKS; i++) {
+			struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(wantlist, arriving->blocks[i]->cid);
+			if (entry != NULL && entry->waiters->total > 0)
+				watched++;
+		}
+		pthread_mutex_unlock(&wantlist->wantlist_mutex);
+		arriving->waiting = (watched == TEST_BITSWAP_ARRIVING_BLOCKS - 1);
+	}
+	// the exchange takes them
+	for(int i = TEST_BITSWAP_ARRIVING_BLOCKS - 1; i > 0; i--) {
+		ipfs_bitswap_receive_block(arriving->context, arriving->blocks[i], NULL);
+		arriving->blocks[i] = NULL;
+	}
+	return NULL;
+}
+
+/***
+ * Used by test_bitswap_retrieve_blocks_arrive to see which blocks came
+ */
+int test_bitswap_arriving_block(struct Block* block, void* arg) {
+	struct TestBitswapArriving* arriving = (struct TestBitswapArriving*)arg;
+	// the others are the exchange's by now, so tell them apart by their data
+	for(int i = 0; i < TEST_BITSWAP_ARRIVING_BLOCKS; i++) {
+		if (block->data_length == 100 && block->data[0] == 'a' + i)
+			arriving->received[i]++;
+	}
+	ipfs_block_free(block);
+	return 1;
+}
+
+/***
+ * GetBlocksStream hands over the blocks that arrive while it waits for them, in the
+ * order they arrive, as well as the ones that were already local
+ */
+int test_bitswap_retrieve_blocks_arrive() {
+	int retVal = 0;
+	struct IpfsNode* localNode = NULL;
+	const char* ipfs_path = "/tmp/ipfstest1";
+	struct TestBitswapArriving arriving;
+	struct Libp2pVector* cids = NULL;
+	pthread_t thread;
+	int thread_started = 0;
+	unsigned char data[100];
+
+	memset(&arriving, 0, sizeof(struct TestBitswapArriving));
+	os_utils_setenv("IPFS_PATH", ipfs_path, 1);
+	drop_and_build_repository(ipfs_path, 4001, NULL, NULL);
+	if (!ipfs_node_online_new(ipfs_path, &localNode))
+		goto exit;
+	localNode->repo->config->bitswap.timeout_seconds = 5;
+	arriving.context = (struct BitswapContext*)localNode->exchange->exchangeContext;
+
+	cids = libp2p_utils_vector_new(1);
+	if (cids == NULL)
+		goto exit;
+	for(int i = 0; i < TEST_BITSWAP_ARRIVING_BLOCKS; i++) {
+		memset(data, 'a' + i, sizeof(data));
+		arriving.blocks[i] = ipfs_block_new();
+		if (arriving.blocks[i] == NULL || !ipfs_blocks_block_add_data(data, sizeof(data), arriving.blocks[i]))
+			goto exit;
+		struct Cid* cid = arriving.blocks[i]->cid;
+		libp2p_utils_vector_add(cids, ipfs_cid_new(cid->version, cid->hash, cid->hash_length, cid->codec));
+	}
+	if (!localNode->blockstore->Put(localNode->blockstore->blockstoreContext, arriving.blocks[0]))
+		goto exit;
+
+	if (pthread_create(&thread, NULL, test_bitswap_blocks_arrive, &arriving) != 0)
+		goto exit;
+	thread_started = 1;
+	long start = test_bitswap_milliseconds();
+	if (!localNode->exchange->GetBlocksStream(localNode->exchange, NULL, cids, test_bitswap_arriving_block, &arriving)) {
+		fprintf(stderr, "GetBlocksStream did not get the blocks that arrived\n");
+		goto exit;
+	}
+	long waited = test_bitswap_milliseconds() - start;
+	pthread_join(thread, NULL);
+	thread_started = 0;
+	if (!arriving.waiting) {
+		fprintf(stderr, "GetBlocksStream was not waiting for the blocks\n");
+		goto exit;
+	}
+	for(int i = 0; i < TEST_BITSWAP_ARRIVING_BLOCKS; i++) {
+		if (arriving.received[i] != 1) {
+			fprintf(stderr, "Block %d was handed over %d times\n", i, arriving.received[i]);
+			goto exit;
+		}
+	}
+	if (waited > 3000) {
+		fprintf(stderr, "GetBlocksStream took %ldms to see the blocks that arrived\n", waited);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (thread_started)
+		pthread_join(thread, NULL);
+	for(int i = 0; i < TEST_BITSWAP_ARRIVING_BLOCKS; i++) {
+		if (arriving.blocks[i] != NULL)
+			ipfs_block_free(arriving.blocks[i]);
+	}
+	if (cids != NULL) {
+		for(int i = 0; i < cids->total; i++)
+			ipfs_cid_free((struct Cid*)libp2p_utils_vector_get(cids, i));
+		libp2p_utils_vector_free(cids);
+	}
+	ipfs_node_free(localNode);
+	return retVal;
+}
+
 /***
  * Attempt to retrieve a file from a known node
  */
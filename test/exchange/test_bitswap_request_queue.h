@@ -1,4 +1,10 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libp2p/conn/session.h"
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/exchange/bitswap/message.h"
 #include "ipfs/exchange/bitswap/peer_request_queue.h"
 
 /***
@@ -27,52 +33,362 @@ int test_bitswap_peer_request_queue_new() {
 	return retVal;
 }
 
-int test_bitswap_peer_request_queue_find() {
-	return 0;
-	/*
+/***
+ * Make sure the requests take turns, and a peer that only takes gets a smaller turn
+ */
+int test_bitswap_peer_request_queue_fair() {
 	int retVal = 0;
 	struct PeerRequestQueue* queue = NULL;
-	struct PeerRequest* request1 = NULL;
-	struct PeerRequest* request2 = NULL;
-	struct PeerRequestEntry* foundRequestEntry = NULL;
+	struct PeerRequest* taker = NULL;
+	struct PeerRequest* giver = NULL;
+	struct Block* block = NULL;
+	unsigned char data[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
 
-	// create a queue
 	queue = ipfs_bitswap_peer_request_queue_new();
 	if (queue == NULL)
 		goto exit;
-
-	// add a request
-	request1 = ipfs_bitswap_peer_request_new();
-	if (request1 == NULL)
+	taker = ipfs_bitswap_peer_request_new();
+	if (taker == NULL)
+		goto exit;
+	ipfs_bitswap_peer_request_queue_add(queue, taker);
+	giver = ipfs_bitswap_peer_request_new();
+	if (giver == NULL)
 		goto exit;
-	request1->peer_id = 1;
-	ipfs_bitswap_peer_request_queue_add(queue, request1);
+	ipfs_bitswap_peer_request_queue_add(queue, giver);
 
-	// add a second request
-	request2 = ipfs_bitswap_peer_request_new();
-	if (request2 == NULL)
+	// nothing to do yet
+	if (ipfs_bitswap_peer_request_queue_pop(queue) != NULL) {
+		fprintf(stderr, "Nothing should have been popped\n");
 		goto exit;
-	request2->peer_id = 2;
-	ipfs_bitswap_peer_request_queue_add(queue, request2);
+	}
 
-	// find the first
-	foundRequestEntry = ipfs_bitswap_peer_request_queue_find_entry(queue, request1);
-	if (foundRequestEntry == NULL)
+	// both have a block to send
+	block = ipfs_block_new();
+	if (block == NULL || !ipfs_blocks_block_add_data(data, sizeof(data), block))
 		goto exit;
-	if (foundRequestEntry->current->peer_id != 1)
+	libp2p_utils_vector_add(taker->blocks_we_want_to_send, block);
+	block = ipfs_block_copy(block);
+	if (block == NULL)
 		goto exit;
+	libp2p_utils_vector_add(giver->blocks_we_want_to_send, block);
+	ipfs_bitswap_ledger_sent(&taker->ledger, 10, 10 * BITSWAP_LEDGER_QUANTUM_BYTES);
+	ipfs_bitswap_ledger_received(&giver->ledger, 10, 10 * BITSWAP_LEDGER_QUANTUM_BYTES);
 
-	// find the second
-	foundRequestEntry = ipfs_bitswap_peer_request_queue_find_entry(queue, request2);
-	if (foundRequestEntry == NULL)
+	if (ipfs_bitswap_peer_request_queue_pop(queue) != taker || ipfs_bitswap_peer_request_queue_pop(queue) != giver
+			|| ipfs_bitswap_peer_request_queue_pop(queue) != taker) {
+		fprintf(stderr, "The requests did not take turns\n");
+		goto exit;
+	}
+	if (taker->deficit != 2 * BITSWAP_LEDGER_QUANTUM_BYTES) {
+		fprintf(stderr, "The taker should get the smallest turn, but got %llu bytes\n", taker->deficit);
 		goto exit;
-	if (foundRequestEntry->current->peer_id != 2)
+	}
+	if (giver->deficit != BITSWAP_LEDGER_MAX_WEIGHT * BITSWAP_LEDGER_QUANTUM_BYTES) {
+		fprintf(stderr, "The giver should get the largest turn, but got %llu bytes\n", giver->deficit);
 		goto exit;
+	}
 
 	retVal = 1;
 	exit:
 	// clean up
 	ipfs_bitswap_peer_request_queue_free(queue);
 	return retVal;
-	*/
+}
+
+/***
+ * Find many peers, and many cids that one of them wants
+ */
+int test_bitswap_peer_request_queue_find() {
+	int retVal = 0;
+	int total = 2000;
+	struct PeerRequestQueue* queue = NULL;
+	struct Libp2pPeer** peers = NULL;
+	struct PeerRequest* request = NULL;
+
+	queue = ipfs_bitswap_peer_request_queue_new();
+	peers = (struct Libp2pPeer**)calloc(total, sizeof(struct Libp2pPeer*));
+	if (queue == NULL || peers == NULL)
+		goto exit;
+
+	for(int i = 0; i < total; i++) {
+		peers[i] = libp2p_peer_new();
+		if (peers[i] == NULL)
+			goto exit;
+		peers[i]->id = malloc(20);
+		if (peers[i]->id == NULL)
+			goto exit;
+		sprintf(peers[i]->id, "QmPeer%d", i);
+		peers[i]->id_size = strlen(peers[i]->id);
+		if (ipfs_peer_request_queue_find_peer(queue, peers[i]) == NULL)
+			goto exit;
+	}
+	// the second time, they are found instead of added
+	for(int i = 0; i < total; i++) {
+		struct PeerRequestEntry* entry = ipfs_bitswap_peer_request_queue_find_entry(queue, peers[i]);
+		if (entry == NULL || entry->current->peer != peers[i] || ipfs_peer_request_queue_find_peer(queue, peers[i]) != entry->current) {
+			fprintf(stderr, "Peer %d was not found\n", i);
+			goto exit;
+		}
+	}
+
+	// what they want
+	request = ipfs_peer_request_queue_find_peer(queue, peers[total / 2]);
+	for(int i = 0; i < total; i++) {
+		unsigned char hash[34];
+		memset(hash, 0, sizeof(hash));
+		hash[0] = 0x12;
+		hash[1] = 32;
+		memcpy(&hash[2], &i, sizeof(int));
+		// ask for each twice, which should only add it once
+		for(int j = 0; j < 2; j++) {
+			struct Cid* cid = ipfs_cid_new(0, hash, sizeof(hash), CID_PROTOBUF);
+			if (cid == NULL || !ipfs_bitswap_peer_request_they_want_add(request, cid))
+				goto exit;
+		}
+	}
+	if (request->cids_they_want->total != total) {
+		fprintf(stderr, "Expected %d cids, but there were %d\n", total, request->cids_they_want->total);
+		goto exit;
+	}
+	for(int i = 0; i < total; i++) {
+		struct CidEntry* entry = (struct CidEntry*)libp2p_utils_vector_get(request->cids_they_want, i);
+		if (ipfs_bitswap_peer_request_they_want_find(request, entry->cid) != entry) {
+			fprintf(stderr, "Cid %d was not found\n", i);
+			goto exit;
+		}
+		if (i % 2 == 0 && !ipfs_bitswap_peer_request_they_want_cancel(request, entry->cid))
+			goto exit;
+	}
+	if (request->they_want_cancelled != (size_t)total / 2) {
+		fprintf(stderr, "Expected %d cancelled, but there were %d\n", total / 2, (int)request->they_want_cancelled);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	// clean up
+	if (queue != NULL)
+		ipfs_bitswap_peer_request_queue_free(queue);
+	for(int i = 0; peers != NULL && i < total; i++)
+		if (peers[i] != NULL)
+			libp2p_peer_free(peers[i]);
+	free(peers);
+	return retVal;
+}
+
+#define TEST_BITSWAP_COALESCE_BLOCK_SIZE 100000
+#define TEST_BITSWAP_COALESCE_MAX_MESSAGES 10
+
+/***
+ * The messages a test peer was sent
+ */
+struct TestBitswapSent {
+	int total;
+	int blocks[TEST_BITSWAP_COALESCE_MAX_MESSAGES];
+	size_t sizes[TEST_BITSWAP_COALESCE_MAX_MESSAGES];
+};
+
+struct TestBitswapSent test_bitswap_sent;
+
+/***
+ * Stands in for the stream to a peer, and counts the blocks of each message
+ */
+int test_bitswap_stream_write(void* stream_context, const unsigned char* buffer, size_t buffer_size) {
+	struct BitswapMessage* message = NULL;
+	// after the protocol header
+	if (buffer_size <= 20 || test_bitswap_sent.total >= TEST_BITSWAP_COALESCE_MAX_MESSAGES
+			|| !ipfs_bitswap_message_protobuf_decode(&buffer[20], buffer_size - 20, &message))
+		return 0;
+	test_bitswap_sent.blocks[test_bitswap_sent.total] = (message->payload == NULL ? 0 : message->payload->total);
+	test_bitswap_sent.sizes[test_bitswap_sent.total] = buffer_size;
+	test_bitswap_sent.total++;
+	ipfs_bitswap_message_free(message);
+	return buffer_size;
+}
+
+/***
+ * Queue blocks to send to a peer
+ * @param request the request of the peer
+ * @param count the number of blocks
+ * @returns true(1) on success
+ */
+int test_bitswap_queue_blocks(struct PeerRequest* request, int count) {
+	unsigned char* data = (unsigned char*)malloc(TEST_BITSWAP_COALESCE_BLOCK_SIZE);
+	if (data == NULL)
+		return 0;
+	memset(data, 0, TEST_BITSWAP_COALESCE_BLOCK_SIZE);
+	for(int i = 0; i < count; i++) {
+		memcpy(data, &i, sizeof(int));
+		struct Block* block = ipfs_block_new();
+		if (block == NULL || !ipfs_blocks_block_add_data(data, TEST_BITSWAP_COALESCE_BLOCK_SIZE, block)) {
+			ipfs_block_free(block);
+			free(data);
+			return 0;
+		}
+		libp2p_utils_vector_add(request->blocks_we_want_to_send, block);
+	}
+	free(data);
+	return 1;
+}
+
+/***
+ * Blocks that can all go now are put in as few messages as fit BITSWAP_MESSAGE_TARGET_SIZE.
+ * A message that is not full waits for the next turn, but not longer than
+ * BITSWAP_MESSAGE_FLUSH_MILLISECONDS.
+ */
+int test_bitswap_peer_request_coalesce() {
+	int retVal = 0;
+	struct IpfsNode local_node;
+	struct BitswapContext context;
+	struct SessionContext session;
+	struct Stream stream;
+	struct Libp2pPeer* peer = NULL;
+	struct PeerRequest* request = NULL;
+
+	memset(&local_node, 0, sizeof(struct IpfsNode));
+	memset(&context, 0, sizeof(struct BitswapContext));
+	context.ipfsNode = &local_node;
+	memset(&stream, 0, sizeof(struct Stream));
+	stream.write = test_bitswap_stream_write;
+	memset(&session, 0, sizeof(struct SessionContext));
+	session.default_stream = &stream;
+	peer = libp2p_peer_new();
+	if (peer == NULL)
+		goto exit;
+	peer->connection_type = CONNECTION_TYPE_CONNECTED;
+	peer->sessionContext = &session;
+	request = ipfs_bitswap_peer_request_new();
+	if (request == NULL)
+		goto exit;
+	request->peer = peer;
+
+	// 25 blocks that can all go now: 10 fit in each message
+	memset(&test_bitswap_sent, 0, sizeof(struct TestBitswapSent));
+	if (!test_bitswap_queue_blocks(request, 25))
+		goto exit;
+	request->deficit = 100 * TEST_BITSWAP_COALESCE_BLOCK_SIZE;
+	if (!ipfs_bitswap_peer_request_process_entry(&context, request))
+		goto exit;
+	if (test_bitswap_sent.total != 3 || test_bitswap_sent.blocks[0] != 10 || test_bitswap_sent.blocks[1] != 10 || test_bitswap_sent.blocks[2] != 5) {
+		fprintf(stderr, "25 blocks went out in %d messages, the first of %d blocks\n", test_bitswap_sent.total, test_bitswap_sent.blocks[0]);
+		goto exit;
+	}
+	for(int i = 0; i < 2; i++) {
+		if (test_bitswap_sent.sizes[i] > BITSWAP_MESSAGE_TARGET_SIZE + 100 || test_bitswap_sent.sizes[i] < BITSWAP_MESSAGE_TARGET_SIZE - TEST_BITSWAP_COALESCE_BLOCK_SIZE) {
+			fprintf(stderr, "Message %d was %lu bytes\n", i, (unsigned long)test_bitswap_sent.sizes[i]);
+			goto exit;
+		}
+	}
+
+	// only 3 of 5 blocks fit in this turn, so the message waits for the rest
+	memset(&test_bitswap_sent, 0, sizeof(struct TestBitswapSent));
+	if (!test_bitswap_queue_blocks(request, 5))
+		goto exit;
+	request->deficit = 3 * TEST_BITSWAP_COALESCE_BLOCK_SIZE;
+	ipfs_bitswap_peer_request_process_entry(&context, request);
+	if (test_bitswap_sent.total != 0 || request->outgoing == NULL) {
+		fprintf(stderr, "A message that was not full went out at once\n");
+		goto exit;
+	}
+	// but not for long
+	usleep((BITSWAP_MESSAGE_FLUSH_MILLISECONDS + 5) * 1000);
+	if (!ipfs_bitswap_peer_request_process_entry(&context, request))
+		goto exit;
+	if (test_bitswap_sent.total != 1 || test_bitswap_sent.blocks[0] != 3 || request->outgoing != NULL) {
+		fprintf(stderr, "The waiting message was not sent after %dms\n", BITSWAP_MESSAGE_FLUSH_MILLISECONDS);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (request != NULL)
+		ipfs_bitswap_peer_request_free(request);
+	if (peer != NULL) {
+		peer->sessionContext = NULL;
+		libp2p_peer_free(peer);
+	}
+	return retVal;
+}
+
+/***
+ * Stands in for the blockstore, which has nothing yet
+ */
+int test_bitswap_not_here_get_view(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block) {
+	*block = NULL;
+	return 0;
+}
+
+/***
+ * A peer that only wants blocks we do not have stops taking turns, until one of them arrives
+ */
+int test_bitswap_peer_request_not_here() {
+	int retVal = 0;
+	struct IpfsNode local_node;
+	struct Blockstore blockstore;
+	struct BitswapContext context;
+	struct PeerRequestQueue* queue = NULL;
+	struct PeerRequest* request = NULL;
+	struct Libp2pPeer* peer = NULL;
+	struct Cid* cid = NULL;
+	unsigned char hash[34];
+
+	memset(&local_node, 0, sizeof(struct IpfsNode));
+	memset(&blockstore, 0, sizeof(struct Blockstore));
+	blockstore.GetView = test_bitswap_not_here_get_view;
+	local_node.blockstore = &blockstore;
+	memset(&context, 0, sizeof(struct BitswapContext));
+	context.ipfsNode = &local_node;
+
+	queue = ipfs_bitswap_peer_request_queue_new();
+	peer = libp2p_peer_new();
+	if (queue == NULL || peer == NULL)
+		goto exit;
+	// nothing has to be sent over a connection
+	peer->is_local = 1;
+	request = ipfs_peer_request_queue_find_peer(queue, peer);
+	memset(hash, 0, sizeof(hash));
+	hash[0] = 0x12;
+	hash[1] = 32;
+	hash[2] = 'n';
+	cid = ipfs_cid_new(0, hash, sizeof(hash), CID_PROTOBUF);
+	if (request == NULL || cid == NULL)
+		goto exit;
+	pthread_mutex_lock(&request->request_mutex);
+	ipfs_bitswap_peer_request_they_want_add(request, ipfs_cid_copy(cid));
+	pthread_mutex_unlock(&request->request_mutex);
+
+	// their turn looks for it, and does not find it
+	if (ipfs_bitswap_peer_request_queue_pop(queue) != request) {
+		fprintf(stderr, "The peer that wants a block did not get a turn\n");
+		goto exit;
+	}
+	ipfs_bitswap_peer_request_process_entry(&context, request);
+	if (request->they_want_not_here != 1) {
+		fprintf(stderr, "The block that is not here was not marked\n");
+		goto exit;
+	}
+	if (ipfs_bitswap_peer_request_queue_pop(queue) != NULL) {
+		fprintf(stderr, "A peer that wants only what is not here took another turn\n");
+		goto exit;
+	}
+
+	// it arrives
+	if (!ipfs_bitswap_peer_request_queue_has_block(queue, cid) || request->they_want_not_here != 0) {
+		fprintf(stderr, "The block that arrived is still marked as not here\n");
+		goto exit;
+	}
+	if (ipfs_bitswap_peer_request_queue_pop(queue) != request) {
+		fprintf(stderr, "The peer did not get a turn once the block arrived\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (cid != NULL)
+		ipfs_cid_free(cid);
+	if (queue != NULL)
+		ipfs_bitswap_peer_request_queue_free(queue);
+	if (peer != NULL)
+		libp2p_peer_free(peer);
+	return retVal;
 }
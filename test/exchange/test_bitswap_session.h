@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/exchange/bitswap/peer_request_queue.h"
+#include "ipfs/exchange/bitswap/session.h"
+#include "ipfs/exchange/bitswap/wantlist_queue.h"
+
+/***
+ * Make sure a session keeps its latest peers first, and no more than it should
+ */
+int test_bitswap_session() {
+	int retVal = 0;
+	int total = BITSWAP_SESSION_MAX_PEERS + 2;
+	struct Libp2pPeer peers[BITSWAP_SESSION_MAX_PEERS + 2];
+	struct Libp2pVector* found = NULL;
+	struct BitswapSession* session = ipfs_bitswap_session_new(1000);
+	if (session == NULL)
+		goto exit;
+
+	for(int i = 0; i < total; i++) {
+		if (!ipfs_bitswap_session_add_peer(session, &peers[i]))
+			goto exit;
+	}
+	// hearing from a peer again moves it to the front
+	if (!ipfs_bitswap_session_add_peer(session, &peers[total - 3]))
+		goto exit;
+
+	found = libp2p_utils_vector_new(1);
+	if (found == NULL)
+		goto exit;
+	// a peer that is already in the vector is not added again
+	libp2p_utils_vector_add(found, &peers[total - 1]);
+	if (ipfs_bitswap_session_get_peers(session, found) != BITSWAP_SESSION_MAX_PEERS) {
+		fprintf(stderr, "The session should have %d peers\n", BITSWAP_SESSION_MAX_PEERS);
+		goto exit;
+	}
+	if (found->total != BITSWAP_SESSION_MAX_PEERS) {
+		fprintf(stderr, "Expected %d peers, but there were %d\n", BITSWAP_SESSION_MAX_PEERS, found->total);
+		goto exit;
+	}
+	if (libp2p_utils_vector_get(found, 1) != &peers[total - 3] || libp2p_utils_vector_get(found, 2) != &peers[total - 2]) {
+		fprintf(stderr, "The peers are not in the order they were heard from\n");
+		goto exit;
+	}
+	// the peers heard from the longest ago are gone
+	for(int i = 0; i < found->total; i++) {
+		if (libp2p_utils_vector_get(found, i) == &peers[0] || libp2p_utils_vector_get(found, i) == &peers[1]) {
+			fprintf(stderr, "Peer %d should have been dropped\n", (libp2p_utils_vector_get(found, i) == &peers[0] ? 0 : 1));
+			goto exit;
+		}
+	}
+
+	retVal = 1;
+	exit:
+	if (found != NULL)
+		libp2p_utils_vector_free(found);
+	ipfs_bitswap_session_free(session);
+	return retVal;
+}
+
+#define TEST_BITSWAP_SESSION_DELAY 300
+#define TEST_BITSWAP_SESSION_MAX_ASKED 8
+
+/***
+ * Who the stub network and routing were asked, and when
+ */
+struct TestBitswapSessionAsked {
+	struct Libp2pPeer* provider; // what the stub routing finds
+	long long start;
+	long long routing; // when the routing was asked, or -1
+	int total;
+	struct Libp2pPeer* peers[TEST_BITSWAP_SESSION_MAX_ASKED];
+	long long times[TEST_BITSWAP_SESSION_MAX_ASKED];
+};
+
+struct TestBitswapSessionAsked test_bitswap_session_asked;
+
+/***
+ * Stands in for the blockstore, which never has the block
+ */
+int test_bitswap_session_get(const struct BlockstoreContext* context, struct Cid* cid, struct Block** block) {
+	return 0;
+}
+
+/***
+ * Stands in for the routing, and remembers when it was asked
+ */
+int test_bitswap_session_find_providers(struct IpfsRouting* routing, const unsigned char* key, size_t key_size, struct Libp2pVector** peers) {
+	if (test_bitswap_session_asked.routing < 0)
+		test_bitswap_session_asked.routing = ipfs_bitswap_wantlist_queue_now() - test_bitswap_session_asked.start;
+	*peers = libp2p_utils_vector_new(1);
+	if (*peers == NULL)
+		return 0;
+	libp2p_utils_vector_add(*peers, test_bitswap_session_asked.provider);
+	return 1;
+}
+
+/***
+ * Stands in for the network. The engine would send these requests now.
+ * @param peer_requests the PeerRequests that have something to send
+ */
+void test_bitswap_session_send(struct Libp2pVector* peer_requests) {
+	for(int i = 0; i < peer_requests->total; i++) {
+		struct PeerRequest* request = (struct PeerRequest*)libp2p_utils_vector_get(peer_requests, i);
+		if (test_bitswap_session_asked.total >= TEST_BITSWAP_SESSION_MAX_ASKED)
+			return;
+		test_bitswap_session_asked.peers[test_bitswap_session_asked.total] = request->peer;
+		test_bitswap_session_asked.times[test_bitswap_session_asked.total] = ipfs_bitswap_wantlist_queue_now() - test_bitswap_session_asked.start;
+		test_bitswap_session_asked.total++;
+	}
+}
+
+/***
+ * When was a peer asked
+ * @param peer the peer
+ * @returns milliseconds after the block was wanted, or -1 if it was not asked
+ */
+long long test_bitswap_session_asked_at(struct Libp2pPeer* peer) {
+	for(int i = 0; i < test_bitswap_session_asked.total; i++) {
+		if (test_bitswap_session_asked.peers[i] == peer)
+			return test_bitswap_session_asked.times[i];
+	}
+	return -1;
+}
+
+/***
+ * The peers of a session are asked for a block at once. The routing is only asked
+ * when they have not sent it within the provider delay.
+ */
+int test_bitswap_session_provider_delay() {
+	int retVal = 0;
+	struct IpfsNode local_node;
+	struct Blockstore blockstore;
+	struct IpfsRouting routing;
+	struct BitswapContext context;
+	struct WantListSession wantlist_session;
+	struct Libp2pPeer peers[3];
+	struct BitswapSession* session = NULL;
+	struct Cid* cid = NULL;
+	struct Libp2pVector* peer_requests = NULL;
+	char* ids[] = { "SessionPeer1", "SessionPeer2", "Provider" };
+	unsigned char hash[34];
+
+	memset(&local_node, 0, sizeof(struct IpfsNode));
+	memset(&blockstore, 0, sizeof(struct Blockstore));
+	blockstore.Get = test_bitswap_session_get;
+	memset(&routing, 0, sizeof(struct IpfsRouting));
+	routing.FindProviders = test_bitswap_session_find_providers;
+	local_node.blockstore = &blockstore;
+	local_node.routing = &routing;
+	memset(&context, 0, sizeof(struct BitswapContext));
+	context.ipfsNode = &local_node;
+	memset(peers, 0, sizeof(peers));
+	for(int i = 0; i < 3; i++) {
+		peers[i].id = ids[i];
+		peers[i].id_size = strlen(ids[i]);
+	}
+	memset(&test_bitswap_session_asked, 0, sizeof(struct TestBitswapSessionAsked));
+	test_bitswap_session_asked.provider = &peers[2];
+	test_bitswap_session_asked.routing = -1;
+
+	context.localWantlist = ipfs_bitswap_wantlist_queue_new();
+	context.peerRequestQueue = ipfs_bitswap_peer_request_queue_new();
+	session = ipfs_bitswap_session_new(TEST_BITSWAP_SESSION_DELAY);
+	peer_requests = libp2p_utils_vector_new(1);
+	if (context.localWantlist == NULL || context.peerRequestQueue == NULL || session == NULL || peer_requests == NULL)
+		goto exit;
+	// these sent other blocks of the session
+	if (!ipfs_bitswap_session_add_peer(session, &peers[0]) || !ipfs_bitswap_session_add_peer(session, &peers[1]))
+		goto exit;
+	wantlist_session.type = WANTLIST_SESSION_TYPE_LOCAL;
+	wantlist_session.context = &local_node;
+	wantlist_session.bitswap_session = session;
+	memset(hash, 0, sizeof(hash));
+	hash[0] = 0x12;
+	hash[1] = 32;
+	cid = ipfs_cid_new(0, hash, sizeof(hash), CID_PROTOBUF);
+	if (cid == NULL)
+		goto exit;
+
+	test_bitswap_session_asked.start = ipfs_bitswap_wantlist_queue_now();
+	if (ipfs_bitswap_wantlist_queue_add(context.localWantlist, cid, &wantlist_session) == NULL)
+		goto exit;
+	// what the engine does, until the routing was asked
+	while (test_bitswap_session_asked.routing < 0 && ipfs_bitswap_wantlist_queue_now() - test_bitswap_session_asked.start < 5 * TEST_BITSWAP_SESSION_DELAY) {
+		struct WantListQueueEntry* entry = NULL;
+		while ((entry = ipfs_bitswap_wantlist_queue_pop(context.localWantlist)) != NULL) {
+			ipfs_bitswap_wantlist_process_entry(&context, entry, peer_requests);
+			ipfs_bitswap_wantlist_queue_release(context.localWantlist, entry);
+		}
+		test_bitswap_session_send(peer_requests);
+		libp2p_utils_vector_free(peer_requests);
+		peer_requests = libp2p_utils_vector_new(1);
+		if (peer_requests == NULL)
+			goto exit;
+		usleep(10000);
+	}
+
+	long long first = test_bitswap_session_asked_at(&peers[0]);
+	long long second = test_bitswap_session_asked_at(&peers[1]);
+	long long provider = test_bitswap_session_asked_at(&peers[2]);
+	if (first < 0 || second < 0 || first >= TEST_BITSWAP_SESSION_DELAY || second >= TEST_BITSWAP_SESSION_DELAY) {
+		fprintf(stderr, "The session peers were asked after %lld and %lldms\n", first, second);
+		goto exit;
+	}
+	if (test_bitswap_session_asked.routing < TEST_BITSWAP_SESSION_DELAY) {
+		fprintf(stderr, "The routing was asked after %lldms, before the delay of %dms\n", test_bitswap_session_asked.routing, TEST_BITSWAP_SESSION_DELAY);
+		goto exit;
+	}
+	if (provider < test_bitswap_session_asked.routing) {
+		fprintf(stderr, "The provider was asked after %lldms\n", provider);
+		goto exit;
+	}
+	// each peer was asked once
+	if (test_bitswap_session_asked.total != 3) {
+		fprintf(stderr, "Expected 3 peers to be asked, but there were %d\n", test_bitswap_session_asked.total);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (peer_requests != NULL)
+		libp2p_utils_vector_free(peer_requests);
+	if (cid != NULL) {
+		if (context.localWantlist != NULL)
+			ipfs_bitswap_wantlist_queue_remove(context.localWantlist, cid, &wantlist_session);
+		ipfs_cid_free(cid);
+	}
+	if (context.localWantlist != NULL)
+		ipfs_bitswap_wantlist_queue_free(context.localWantlist);
+	if (context.peerRequestQueue != NULL)
+		ipfs_bitswap_peer_request_queue_free(context.peerRequestQueue);
+	ipfs_bitswap_session_free(session);
+	return retVal;
+}
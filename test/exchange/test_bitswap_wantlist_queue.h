@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipfs/exchange/bitswap/wantlist_queue.h"
+
+/***
+ * Add many Cids, find them, and make sure they are popped in order
+ */
+int test_bitswap_wantlist_queue() {
+	int retVal = 0;
+	int total = 1000;
+	struct WantListQueue* wantlist = NULL;
+	struct Cid** cids = NULL;
+	struct WantListSession session;
+	session.type = WANTLIST_SESSION_TYPE_LOCAL;
+	session.context = NULL;
+	session.bitswap_session = NULL;
+
+	wantlist = ipfs_bitswap_wantlist_queue_new();
+	cids = (struct Cid**)calloc(total, sizeof(struct Cid*));
+	if (wantlist == NULL || cids == NULL)
+		goto exit;
+
+	for(int i = 0; i < total; i++) {
+		unsigned char hash[34];
+		memset(hash, 0, sizeof(hash));
+		hash[0] = 0x12;
+		hash[1] = 32;
+		memcpy(&hash[2], &i, sizeof(int));
+		cids[i] = ipfs_cid_new(0, hash, sizeof(hash), CID_PROTOBUF);
+		if (cids[i] == NULL || ipfs_bitswap_wantlist_queue_add(wantlist, cids[i], &session) == NULL)
+			goto exit;
+	}
+	// adding again finds the same entry
+	if (ipfs_bitswap_wantlist_queue_add(wantlist, cids[10], &session) == NULL || wantlist->total != total)
+		goto exit;
+
+	for(int i = 0; i < total; i++) {
+		struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_find(wantlist, cids[i]);
+		if (entry == NULL || ipfs_cid_compare(entry->cid, cids[i]) != 0)
+			goto exit;
+	}
+
+	// the first one added comes out first. One that failed goes after the rest.
+	struct WantListQueueEntry* entry = ipfs_bitswap_wantlist_queue_pop(wantlist);
+	if (entry == NULL || ipfs_cid_compare(entry->cid, cids[0]) != 0)
+		goto exit;
+	entry->attempts++;
+	ipfs_bitswap_wantlist_queue_release(wantlist, entry);
+	for(int i = 1; i < total; i++) {
+		entry = ipfs_bitswap_wantlist_queue_pop(wantlist);
+		if (entry == NULL || ipfs_cid_compare(entry->cid, cids[i]) != 0)
+			goto exit;
+		entry->asked_network = 1;
+		ipfs_bitswap_wantlist_queue_release(wantlist, entry);
+	}
+	entry = ipfs_bitswap_wantlist_queue_pop(wantlist);
+	if (entry == NULL || ipfs_cid_compare(entry->cid, cids[0]) != 0)
+		goto exit;
+	ipfs_bitswap_wantlist_queue_release(wantlist, entry);
+
+	// removing it (twice for cids[10]) frees it
+	ipfs_bitswap_wantlist_queue_remove(wantlist, cids[10], &session);
+	if (ipfs_bitswap_wantlist_queue_find(wantlist, cids[10]) == NULL)
+		goto exit;
+	for(int i = 0; i < total; i++)
+		ipfs_bitswap_wantlist_queue_remove(wantlist, cids[i], &session);
+	if (wantlist->total != 0 || ipfs_bitswap_wantlist_queue_find(wantlist, cids[10]) != NULL)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (cids != NULL) {
+		for(int i = 0; i < total; i++)
+			if (cids[i] != NULL)
+				ipfs_cid_free(cids[i]);
+		free(cids);
+	}
+	ipfs_bitswap_wantlist_queue_free(wantlist);
+	return retVal;
+}
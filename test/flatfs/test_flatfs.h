@@ -78,3 +78,130 @@ int test_flatfs_get_full_filename() {
 
 	return 1;
 }
+
+int test_flatfs_shard_directory() {
+	struct FlatfsShard shard;
+	char results[256];
+	char* key = "CIQABCDEFGH";
+
+	// parse with and without the prefix
+	if (!ipfs_flatfs_shard_parse(FLATFS_DEFAULT_SHARD, &shard))
+		return 0;
+	if (shard.type != FLATFS_SHARD_NEXT_TO_LAST || shard.length != 2)
+		return 0;
+	if (!ipfs_flatfs_shard_parse("prefix/4\n", &shard))
+		return 0;
+	if (shard.type != FLATFS_SHARD_PREFIX || shard.length != 4)
+		return 0;
+	if (ipfs_flatfs_shard_parse("sideways/2", &shard))
+		return 0;
+	if (ipfs_flatfs_shard_parse("suffix/0", &shard))
+		return 0;
+
+	// back to a string
+	shard.type = FLATFS_SHARD_SUFFIX;
+	shard.length = 3;
+	if (!ipfs_flatfs_shard_to_string(&shard, results, 256))
+		return 0;
+	if (strcmp(results, "/repo/flatfs/shard/v1/suffix/3") != 0)
+		return 0;
+
+	// the directory names
+	shard.type = FLATFS_SHARD_PREFIX;
+	shard.length = 2;
+	if (!ipfs_flatfs_shard_directory_name(&shard, key, results, 256) || strcmp(results, "CI") != 0)
+		return 0;
+	shard.type = FLATFS_SHARD_SUFFIX;
+	if (!ipfs_flatfs_shard_directory_name(&shard, key, results, 256) || strcmp(results, "GH") != 0)
+		return 0;
+	shard.type = FLATFS_SHARD_NEXT_TO_LAST;
+	if (!ipfs_flatfs_shard_directory_name(&shard, key, results, 256) || strcmp(results, "FG") != 0)
+		return 0;
+	// short keys are padded
+	if (!ipfs_flatfs_shard_directory_name(&shard, "A", results, 256) || strcmp(results, "__") != 0)
+		return 0;
+	shard.length = 3;
+	if (!ipfs_flatfs_shard_directory_name(&shard, "ABC", results, 256) || strcmp(results, "_AB") != 0)
+		return 0;
+
+	// full filenames
+	shard.length = 2;
+	if (!ipfs_flatfs_get_sharded_full_filename("/tmp/", &shard, "/CIQABCDEFGH", results, 256))
+		return 0;
+	if (strcmp(results, "/tmp/FG/CIQABCDEFGH.data") != 0)
+		return 0;
+	shard.type = FLATFS_SHARD_NONE;
+	if (!ipfs_flatfs_get_sharded_full_filename("/tmp/", &shard, "/CIQABCDEFGH", results, 256))
+		return 0;
+	if (strcmp(results, "/tmp/CIQABCDEFGH") != 0)
+		return 0;
+
+	return 1;
+}
+
+/***
+ * Move a flat directory into shards and back again
+ */
+int test_flatfs_reshard() {
+	int retVal = 0;
+	char* datastore_path = "/tmp/test_flatfs_reshard";
+	char* keys[] = { "CIQAAAAAAA", "CIQBBBBBBB", "CIQCCCCCCB" };
+	struct FlatfsShard shard;
+	char filename[256];
+	unsigned char bytes[10];
+	size_t files_moved = 0;
+
+	drop_repository(datastore_path);
+	if (!ipfs_flatfs_create_directory(datastore_path))
+		goto exit;
+
+	// the old layout
+	shard.type = FLATFS_SHARD_NONE;
+	shard.length = 0;
+	create_bytes(bytes, 10);
+	for(int i = 0; i < 3; i++) {
+		ipfs_flatfs_get_sharded_full_filename(datastore_path, &shard, keys[i], filename, 256);
+		if (!create_file(filename, bytes, 10))
+			goto exit;
+	}
+
+	// into shards
+	ipfs_flatfs_shard_parse(FLATFS_DEFAULT_SHARD, &shard);
+	if (!ipfs_flatfs_reshard(datastore_path, &shard, &files_moved) || files_moved != 3)
+		goto exit;
+	if (!os_utils_file_exists("/tmp/test_flatfs_reshard/AA/CIQAAAAAAA.data"))
+		goto exit;
+	if (!os_utils_file_exists("/tmp/test_flatfs_reshard/CC/CIQCCCCCCB.data"))
+		goto exit;
+	struct FlatfsShard read_shard;
+	if (!ipfs_flatfs_shard_read(datastore_path, &read_shard)
+			|| read_shard.type != shard.type || read_shard.length != shard.length)
+		goto exit;
+
+	// running it again changes nothing
+	if (!ipfs_flatfs_reshard(datastore_path, &shard, &files_moved) || files_moved != 0)
+		goto exit;
+
+	// to a different shard function
+	ipfs_flatfs_shard_parse("prefix/4", &shard);
+	if (!ipfs_flatfs_reshard(datastore_path, &shard, &files_moved) || files_moved != 3)
+		goto exit;
+	if (!os_utils_file_exists("/tmp/test_flatfs_reshard/CIQB/CIQBBBBBBB.data"))
+		goto exit;
+	if (os_utils_file_exists("/tmp/test_flatfs_reshard/BB"))
+		goto exit;
+
+	// back to the old layout
+	shard.type = FLATFS_SHARD_NONE;
+	if (!ipfs_flatfs_reshard(datastore_path, &shard, &files_moved) || files_moved != 3)
+		goto exit;
+	if (!os_utils_file_exists("/tmp/test_flatfs_reshard/CIQCCCCCCB"))
+		goto exit;
+	if (os_utils_file_exists("/tmp/test_flatfs_reshard/SHARDING"))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	drop_repository(datastore_path);
+	return retVal;
+}
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ipfs/importer/chunker.h"
+
+/***
+ * Fill a buffer with bytes that do not repeat (content defined chunkers find nothing in a repeating pattern)
+ */
+void test_chunker_random_bytes(unsigned char* buffer, size_t size, uint64_t seed) {
+	uint64_t x = seed | 1;
+	for(size_t i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buffer[i] = (unsigned char)(x >> 24);
+	}
+}
+
+/***
+ * A quick hash to recognize chunks that were seen before
+ */
+uint64_t test_chunker_fnv(const unsigned char* data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash ^ size;
+}
+
+/***
+ * Chunk a buffer
+ * @param spec the chunker
+ * @param data the bytes to chunk
+ * @param data_size the number of bytes
+ * @param hashes where to put the hash of each chunk (allocated here, the caller must free it)
+ * @param sizes where to put the size of each chunk (allocated here, the caller must free it)
+ * @param count the number of chunks
+ * @returns true(1) if the chunks put back together are the original bytes, and are within the sizes of the spec
+ */
+int test_chunker_run(const struct ChunkerSpec* spec, const unsigned char* data, size_t data_size, uint64_t** hashes, size_t** sizes, size_t* count) {
+	int retVal = 0;
+	FILE* file = tmpfile();
+	struct Chunker* chunker = NULL;
+	unsigned char* chunk = (unsigned char*)malloc(spec->max_size);
+	size_t position = 0;
+	size_t chunk_size = 0;
+	size_t allocated = data_size / spec->min_size + 2;
+
+	*count = 0;
+	*hashes = (uint64_t*)malloc(sizeof(uint64_t) * allocated);
+	*sizes = (size_t*)malloc(sizeof(size_t) * allocated);
+	if (file == NULL || chunk == NULL || *hashes == NULL || *sizes == NULL)
+		goto exit;
+	fwrite(data, 1, data_size, file);
+	rewind(file);
+	chunker = ipfs_chunker_new(spec, file);
+	if (chunker == NULL)
+		goto exit;
+	while (ipfs_chunker_next(chunker, chunk, &chunk_size) && chunk_size > 0) {
+		if (chunk_size > spec->max_size || (chunk_size < spec->min_size && position + chunk_size != data_size)) {
+			printf("Chunk %lu is %lu bytes, outside of %lu to %lu\n", *count, chunk_size, spec->min_size, spec->max_size);
+			goto exit;
+		}
+		if (position + chunk_size > data_size || memcmp(&data[position], chunk, chunk_size) != 0) {
+			printf("Chunk %lu does not match the original\n", *count);
+			goto exit;
+		}
+		(*hashes)[*count] = test_chunker_fnv(chunk, chunk_size);
+		(*sizes)[*count] = chunk_size;
+		(*count)++;
+		position += chunk_size;
+	}
+	if (position != data_size) {
+		printf("Chunked %lu bytes, but there were %lu\n", position, data_size);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (chunker != NULL)
+		ipfs_chunker_free(chunker);
+	if (file != NULL)
+		fclose(file);
+	if (chunk != NULL)
+		free(chunk);
+	return retVal;
+}
+
+/***
+ * The number of bytes in the chunks of b that are also chunks of a
+ */
+size_t test_chunker_shared_bytes(const uint64_t* a_hashes, size_t a_count, const uint64_t* b_hashes, const size_t* b_sizes, size_t b_count) {
+	size_t shared = 0;
+	for(size_t i = 0; i < b_count; i++) {
+		for(size_t j = 0; j < a_count; j++) {
+			if (b_hashes[i] == a_hashes[j]) {
+				shared += b_sizes[i];
+				break;
+			}
+		}
+	}
+	return shared;
+}
+
+int test_chunker_spec_parse() {
+	struct ChunkerSpec spec;
+
+	if (!ipfs_chunker_spec_parse("size-1000", &spec) || spec.type != CHUNKER_FIXED || spec.max_size != 1000)
+		return 0;
+	if (!ipfs_chunker_spec_parse("size", &spec) || spec.max_size != 262144)
+		return 0;
+	if (!ipfs_chunker_spec_parse("rabin", &spec) || spec.type != CHUNKER_RABIN || spec.avg_size != 262144)
+		return 0;
+	if (!ipfs_chunker_spec_parse("rabin-65536", &spec) || spec.min_size != 16384 || spec.max_size != 131072)
+		return 0;
+	if (!ipfs_chunker_spec_parse("buzhash-1024-4096-8192", &spec) || spec.type != CHUNKER_BUZHASH
+			|| spec.min_size != 1024 || spec.avg_size != 4096 || spec.max_size != 8192)
+		return 0;
+	// things that should fail
+	if (ipfs_chunker_spec_parse("rabin-4096-1024-8192", &spec)) // min bigger than avg
+		return 0;
+	if (ipfs_chunker_spec_parse("size-2000000", &spec)) // too big for a block
+		return 0;
+	if (ipfs_chunker_spec_parse("rabin-16-32-64", &spec)) // smaller than the window
+		return 0;
+	if (ipfs_chunker_spec_parse("rabin-1-2", &spec))
+		return 0;
+	if (ipfs_chunker_spec_parse("fastcdc", &spec))
+		return 0;
+	if (ipfs_chunker_spec_parse("size-abc", &spec))
+		return 0;
+	return 1;
+}
+
+/***
+ * After one byte is inserted near the start, most chunks of a content defined chunker
+ * should be the same. With a fixed chunker, almost none are.
+ */
+int test_chunker_content_defined() {
+	int retVal = 0;
+	size_t data_size = 4 * 1024 * 1024;
+	unsigned char* original = (unsigned char*)malloc(data_size);
+	unsigned char* edited = (unsigned char*)malloc(data_size + 1);
+	const char* chunkers[] = { "rabin-8192-32768-65536", "buzhash-8192-32768-65536", "size-32768" };
+	uint64_t* a_hashes = NULL;
+	size_t* a_sizes = NULL;
+	uint64_t* b_hashes = NULL;
+	size_t* b_sizes = NULL;
+	size_t a_count = 0;
+	size_t b_count = 0;
+
+	if (original == NULL || edited == NULL)
+		goto exit;
+	test_chunker_random_bytes(original, data_size, 42);
+	edited[0] = original[0];
+	edited[1] = 0x55;
+	memcpy(&edited[2], &original[1], data_size - 1);
+
+	for(int i = 0; i < 3; i++) {
+		struct ChunkerSpec spec;
+		if (!ipfs_chunker_spec_parse(chunkers[i], &spec))
+			goto exit;
+		if (!test_chunker_run(&spec, original, data_size, &a_hashes, &a_sizes, &a_count))
+			goto exit;
+		if (!test_chunker_run(&spec, edited, data_size + 1, &b_hashes, &b_sizes, &b_count))
+			goto exit;
+		// chunking must not depend on anything but the bytes
+		size_t shared = test_chunker_shared_bytes(a_hashes, a_count, b_hashes, b_sizes, b_count);
+		if (spec.type == CHUNKER_FIXED && shared > data_size / 10) {
+			printf("%s should not survive an insert, but shared %lu bytes\n", chunkers[i], shared);
+			goto exit;
+		}
+		if (spec.type != CHUNKER_FIXED && shared < data_size * 9 / 10) {
+			printf("%s only shared %lu of %lu bytes after an insert\n", chunkers[i], shared, data_size);
+			goto exit;
+		}
+		free(a_hashes);
+		free(a_sizes);
+		free(b_hashes);
+		free(b_sizes);
+		a_hashes = b_hashes = NULL;
+		a_sizes = b_sizes = NULL;
+	}
+
+	retVal = 1;
+	exit:
+	if (original != NULL)
+		free(original);
+	if (edited != NULL)
+		free(edited);
+	if (a_hashes != NULL)
+		free(a_hashes);
+	if (a_sizes != NULL)
+		free(a_sizes);
+	if (b_hashes != NULL)
+		free(b_hashes);
+	if (b_sizes != NULL)
+		free(b_sizes);
+	return retVal;
+}
+
+/***
+ * Not a pass/fail test, so it is run by benchmark_ipfs rather than test_ipfs. Prints the speed
+ * of each chunker, and how well it deduplicates a series of snapshots where each one is the
+ * last with a few small edits.
+ */
+int test_chunker_benchmark() {
+	int retVal = 0;
+	size_t data_size = 16 * 1024 * 1024;
+	int num_snapshots = 8;
+	const char* chunkers[] = { "size-262144", "rabin", "buzhash" };
+	unsigned char* snapshot = (unsigned char*)malloc(data_size + num_snapshots * 64);
+	unsigned char* chunk = (unsigned char*)malloc(IPFS_CHUNKER_SIZE_LIMIT);
+	uint64_t* seen = NULL;
+	size_t seen_count = 0;
+	size_t seen_allocated = 0;
+
+	if (snapshot == NULL || chunk == NULL)
+		goto exit;
+
+	for(int c = 0; c < 3; c++) {
+		struct ChunkerSpec spec;
+		if (!ipfs_chunker_spec_parse(chunkers[c], &spec))
+			goto exit;
+		size_t snapshot_size = data_size;
+		test_chunker_random_bytes(snapshot, snapshot_size, 7);
+		uint64_t edit_seed = 99;
+		size_t total_bytes = 0;
+		size_t unique_bytes = 0;
+		double seconds = 0;
+		seen_count = 0;
+
+		for(int s = 0; s < num_snapshots; s++) {
+			if (s > 0) {
+				// insert a few bytes at a few places
+				for(int e = 0; e < 4; e++) {
+					edit_seed = edit_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+					size_t at = (size_t)(edit_seed >> 16) % snapshot_size;
+					memmove(&snapshot[at + 8], &snapshot[at], snapshot_size - at);
+					memset(&snapshot[at], e, 8);
+					snapshot_size += 8;
+				}
+			}
+			FILE* file = tmpfile();
+			if (file == NULL)
+				goto exit;
+			fwrite(snapshot, 1, snapshot_size, file);
+			rewind(file);
+			struct Chunker* chunker = ipfs_chunker_new(&spec, file);
+			if (chunker == NULL) {
+				fclose(file);
+				goto exit;
+			}
+			size_t chunk_size = 0;
+			clock_t start = clock();
+			while (ipfs_chunker_next(chunker, chunk, &chunk_size) && chunk_size > 0) {
+				seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+				total_bytes += chunk_size;
+				uint64_t hash = test_chunker_fnv(chunk, chunk_size);
+				int found = 0;
+				for(size_t i = 0; i < seen_count && !found; i++)
+					found = (seen[i] == hash);
+				if (!found) {
+					if (seen_count == seen_allocated) {
+						seen_allocated = (seen_allocated == 0 ? 1024 : seen_allocated * 2);
+						uint64_t* new_seen = (uint64_t*)realloc(seen, sizeof(uint64_t) * seen_allocated);
+						if (new_seen == NULL) {
+							ipfs_chunker_free(chunker);
+							fclose(file);
+							goto exit;
+						}
+						seen = new_seen;
+					}
+					seen[seen_count++] = hash;
+					unique_bytes += chunk_size;
+				}
+				start = clock();
+			}
+			seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+			ipfs_chunker_free(chunker);
+			fclose(file);
+		}
+		printf("%-12s %8.1f MB/s, %lu chunks, dedup ratio %.2f\n", chunkers[c],
+				seconds > 0 ? (double)total_bytes / (1024 * 1024) / seconds : 0.0,
+				seen_count, unique_bytes > 0 ? (double)total_bytes / unique_bytes : 0.0);
+	}
+
+	retVal = 1;
+	exit:
+	if (snapshot != NULL)
+		free(snapshot);
+	if (chunk != NULL)
+		free(chunk);
+	if (seen != NULL)
+		free(seen);
+	return retVal;
+}
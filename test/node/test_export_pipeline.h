@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../test_helper.h"
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/importer/export_pipeline.h"
+#include "ipfs/merkledag/merkledag.h"
+#include "ipfs/unixfs/unixfs.h"
+
+#define TEST_EXPORT_PIPELINE_BLOCKS 8
+#define TEST_EXPORT_PIPELINE_BLOCK_SIZE 1000
+
+int ipfs_export_pipeline_push_links(struct ExportPipeline* pipeline, const struct HashtableNode* node);
+int ipfs_export_pipeline_fill(struct ExportPipeline* pipeline);
+
+/***
+ * A routing that never finds anything
+ */
+int test_export_pipeline_get_value(struct IpfsRouting* routing, const unsigned char* key, size_t key_size, void** value, size_t* value_size) {
+	return 0;
+}
+
+/***
+ * Store a file block, and link to it from a root
+ * @param fs_repo where to store it
+ * @param fill what each byte of the file is
+ * @param root the node to link it from
+ * @returns true(1) on success
+ */
+int test_export_pipeline_add_block(struct FSRepo* fs_repo, unsigned char fill, struct HashtableNode* root) {
+	int retVal = 0;
+	struct UnixFS* unix_fs = NULL;
+	struct HashtableNode* node = NULL;
+	struct NodeLink* link = NULL;
+	unsigned char* protobuf = NULL;
+	size_t bytes_written = 0;
+
+	if (!ipfs_unixfs_new(&unix_fs))
+		return 0;
+	unix_fs->data_type = UNIXFS_FILE;
+	unix_fs->bytes = (unsigned char*)malloc(TEST_EXPORT_PIPELINE_BLOCK_SIZE);
+	if (unix_fs->bytes == NULL)
+		goto exit;
+	memset(unix_fs->bytes, fill, TEST_EXPORT_PIPELINE_BLOCK_SIZE);
+	unix_fs->bytes_size = TEST_EXPORT_PIPELINE_BLOCK_SIZE;
+	unix_fs->file_size = TEST_EXPORT_PIPELINE_BLOCK_SIZE;
+	size_t protobuf_size = ipfs_unixfs_protobuf_encode_size(unix_fs);
+	protobuf = (unsigned char*)malloc(protobuf_size);
+	if (protobuf == NULL || !ipfs_unixfs_protobuf_encode(unix_fs, protobuf, protobuf_size, &protobuf_size))
+		goto exit;
+	if (!ipfs_hashtable_node_new_from_data(protobuf, protobuf_size, &node) || !ipfs_merkledag_add(node, fs_repo, &bytes_written))
+		goto exit;
+	if (!ipfs_node_link_create(NULL, node->hash, node->hash_size, &link))
+		goto exit;
+	link->t_size = bytes_written;
+	ipfs_hashtable_node_add_link(root, link);
+	retVal = 1;
+	exit:
+	free(protobuf);
+	if (unix_fs != NULL)
+		ipfs_unixfs_free(unix_fs);
+	if (node != NULL)
+		ipfs_hashtable_node_free(node);
+	return retVal;
+}
+
+/***
+ * A file written through the pipeline comes out in order. The bytes being fetched or
+ * waiting to be written stay under the limit, and a block that cannot be found fails the file.
+ */
+int test_export_pipeline() {
+	int retVal = 0;
+	struct FSRepo* fs_repo = NULL;
+	struct IpfsNode local_node;
+	struct IpfsRouting routing;
+	struct HashtableNode* root = NULL;
+	struct HashtableNode* broken = NULL;
+	struct ExportPipeline* pipeline = NULL;
+	struct NodeLink* link = NULL;
+	FILE* file = NULL;
+	unsigned char buffer[TEST_EXPORT_PIPELINE_BLOCK_SIZE];
+	unsigned char missing_hash[32];
+
+	memset(&local_node, 0, sizeof(struct IpfsNode));
+	pthread_mutex_init(&local_node.export_pool_lock, NULL);
+	pthread_mutex_init(&local_node.routing_lock, NULL);
+	memset(&routing, 0, sizeof(struct IpfsRouting));
+	routing.local_node = &local_node;
+	routing.GetValue = test_export_pipeline_get_value;
+	local_node.routing = &routing;
+
+	if (!drop_build_and_open_repo("/tmp/.ipfs", &fs_repo))
+		goto exit;
+	local_node.repo = fs_repo;
+	if (!ipfs_hashtable_node_new(&root))
+		goto exit;
+	for(int i = 0; i < TEST_EXPORT_PIPELINE_BLOCKS; i++) {
+		if (!test_export_pipeline_add_block(fs_repo, 'a' + i, root))
+			goto exit;
+	}
+
+	// the blocks come out in the order of the links
+	pipeline = ipfs_export_pipeline_new(&local_node, 4, 1024 * 1024);
+	file = tmpfile();
+	if (pipeline == NULL || file == NULL || !ipfs_export_pipeline_write(pipeline, root, file))
+		goto exit;
+	ipfs_export_pipeline_free(pipeline);
+	pipeline = NULL;
+	rewind(file);
+	for(int i = 0; i < TEST_EXPORT_PIPELINE_BLOCKS; i++) {
+		if (fread(buffer, 1, sizeof(buffer), file) != sizeof(buffer)) {
+			fprintf(stderr, "The file is short at block %d\n", i);
+			goto exit;
+		}
+		for(int j = 0; j < TEST_EXPORT_PIPELINE_BLOCK_SIZE; j++) {
+			if (buffer[j] != 'a' + i) {
+				fprintf(stderr, "Block %d is out of order\n", i);
+				goto exit;
+			}
+		}
+	}
+	if (fread(buffer, 1, 1, file) != 0) {
+		fprintf(stderr, "The file is too long\n");
+		goto exit;
+	}
+
+	// room for two and a half blocks: only two fetches start, however many are allowed
+	pipeline = ipfs_export_pipeline_new(&local_node, TEST_EXPORT_PIPELINE_BLOCKS, 5 * TEST_EXPORT_PIPELINE_BLOCK_SIZE / 2 + 50);
+	if (pipeline == NULL || !ipfs_export_pipeline_push_links(pipeline, root) || !ipfs_export_pipeline_fill(pipeline))
+		goto exit;
+	pthread_mutex_lock(&pipeline->lock);
+	int started = 0;
+	for(struct ExportBlock* block = pipeline->head; block != NULL; block = block->next) {
+		if (block->state != EXPORT_BLOCK_WAITING)
+			started++;
+	}
+	size_t fetched_bytes = pipeline->fetched_bytes;
+	pthread_mutex_unlock(&pipeline->lock);
+	if (started != 2 || fetched_bytes > pipeline->max_bytes) {
+		fprintf(stderr, "%d fetches started, holding %lu bytes\n", started, (unsigned long)fetched_bytes);
+		goto exit;
+	}
+	ipfs_export_pipeline_free(pipeline);
+	pipeline = NULL;
+
+	// a block that is nowhere fails the file
+	memset(missing_hash, 0x5a, sizeof(missing_hash));
+	if (!ipfs_hashtable_node_new(&broken) || !ipfs_node_link_create(NULL, missing_hash, sizeof(missing_hash), &link))
+		goto exit;
+	ipfs_hashtable_node_add_link(broken, link);
+	pipeline = ipfs_export_pipeline_new(&local_node, 4, 1024 * 1024);
+	if (pipeline == NULL)
+		goto exit;
+	rewind(file);
+	if (ipfs_export_pipeline_write(pipeline, broken, file)) {
+		fprintf(stderr, "A missing block did not fail the file\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (pipeline != NULL)
+		ipfs_export_pipeline_free(pipeline);
+	if (file != NULL)
+		fclose(file);
+	if (root != NULL)
+		ipfs_hashtable_node_free(root);
+	if (broken != NULL)
+		ipfs_hashtable_node_free(broken);
+	if (local_node.export_pool != NULL) {
+		thpool_wait(local_node.export_pool);
+		thpool_destroy(local_node.export_pool);
+	}
+	pthread_mutex_destroy(&local_node.export_pool_lock);
+	pthread_mutex_destroy(&local_node.routing_lock);
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	return retVal;
+}
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include "../test_helper.h"
 #include "ipfs/importer/importer.h"
 #include "ipfs/importer/exporter.h"
+#include "ipfs/importer/dag_reader.h"
 #include "ipfs/merkledag/merkledag.h"
 #include "mh/hashes.h"
 #include "mh/multihash.h"
@@ -213,3 +215,426 @@ int test_import_small_file() {
 
 	return 1;
 }
+
+/***
+ * Import a file with a small fan-out, so the DAG is several levels deep, then export it again
+ */
+int test_import_deep_file() {
+	size_t bytes_size = 262144 * 5 + 1000; // 6 chunks
+	unsigned char* file_bytes = NULL;
+	const char* fileName = "/tmp/test_import_deep.tmp";
+	const char* exportName = "/tmp/test_import_deep_file.rsl";
+	const char* repo_dir = "/tmp/.ipfs";
+	struct IpfsNode* local_node = NULL;
+	struct HashtableNode* write_node = NULL;
+	struct HashtableNode* read_node = NULL;
+	struct UnixFS* unix_fs = NULL;
+	unsigned char* exported = NULL;
+	size_t bytes_written = 0;
+	size_t base58_size = 55;
+	unsigned char base58[base58_size];
+	int retVal = 0;
+
+	file_bytes = (unsigned char*)malloc(bytes_size);
+	if (file_bytes == NULL)
+		goto exit;
+	create_bytes(file_bytes, bytes_size);
+	create_file(fileName, file_bytes, bytes_size);
+
+	if (!drop_and_build_repository(repo_dir, 4001, NULL, NULL)) {
+		fprintf(stderr, "Unable to drop and build test repository at %s\n", repo_dir);
+		goto exit;
+	}
+	if (!ipfs_node_online_new(repo_dir, &local_node)) {
+		fprintf(stderr, "Unable to create new IpfsNode\n");
+		goto exit;
+	}
+	// 2 links per node gives a tree 3 levels deep for 6 chunks
+	local_node->repo->config->importer.max_links = 2;
+
+	if (ipfs_import_file("/tmp", fileName, &write_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+
+	// the root should know the full size of the file
+	if (ipfs_merkledag_get(write_node->hash, write_node->hash_size, &read_node, local_node->repo) == 0)
+		goto exit;
+	if (!ipfs_unixfs_protobuf_decode(read_node->data, read_node->data_size, &unix_fs))
+		goto exit;
+	if (unix_fs->file_size != bytes_size) {
+		printf("Root file size should be %lu but is %lu\n", bytes_size, unix_fs->file_size);
+		goto exit;
+	}
+	if (read_node->head_link == NULL || read_node->head_link->next == NULL || read_node->head_link->next->next != NULL) {
+		printf("Root should have exactly 2 links\n");
+		goto exit;
+	}
+
+	// export it, and compare
+	if (ipfs_cid_hash_to_base58(write_node->hash, write_node->hash_size, base58, base58_size) == 0)
+		goto exit;
+	if (ipfs_exporter_to_file(base58, exportName, local_node) == 0) {
+		printf("Unable to write file.\n");
+		goto exit;
+	}
+	if (os_utils_file_size(exportName) != bytes_size) {
+		printf("File sizes are different. Should be %lu but the new one is %lu\n", bytes_size, os_utils_file_size(exportName));
+		goto exit;
+	}
+	exported = (unsigned char*)malloc(bytes_size);
+	if (exported == NULL)
+		goto exit;
+	FILE* f = fopen(exportName, "rb");
+	if (f == NULL)
+		goto exit;
+	size_t bytes_read = fread(exported, 1, bytes_size, f);
+	fclose(f);
+	if (bytes_read != bytes_size || memcmp(file_bytes, exported, bytes_size) != 0) {
+		printf("The bytes between the files are different\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (local_node != NULL)
+		ipfs_node_free(local_node);
+	if (write_node != NULL)
+		ipfs_hashtable_node_free(write_node);
+	if (read_node != NULL)
+		ipfs_hashtable_node_free(read_node);
+	if (unix_fs != NULL)
+		ipfs_unixfs_free(unix_fs);
+	if (file_bytes != NULL)
+		free(file_bytes);
+	if (exported != NULL)
+		free(exported);
+	return retVal;
+}
+
+/***
+ * A file imported by several workers should have the same hash as one imported on a single thread
+ */
+int test_import_parallel_file() {
+	size_t bytes_size = 262144 * 9 + 500;
+	unsigned char* file_bytes = NULL;
+	const char* fileName = "/tmp/test_import_parallel.tmp";
+	const char* repo_dir = "/tmp/.ipfs";
+	struct IpfsNode* local_node = NULL;
+	struct HashtableNode* single_node = NULL;
+	struct HashtableNode* parallel_node = NULL;
+	size_t bytes_written = 0;
+	int retVal = 0;
+
+	file_bytes = (unsigned char*)malloc(bytes_size);
+	if (file_bytes == NULL)
+		goto exit;
+	create_bytes(file_bytes, bytes_size);
+	create_file(fileName, file_bytes, bytes_size);
+
+	if (!drop_and_build_repository(repo_dir, 4001, NULL, NULL)) {
+		fprintf(stderr, "Unable to drop and build test repository at %s\n", repo_dir);
+		goto exit;
+	}
+	if (!ipfs_node_online_new(repo_dir, &local_node)) {
+		fprintf(stderr, "Unable to create new IpfsNode\n");
+		goto exit;
+	}
+	// a small fan-out, so that parents are built while workers are still busy
+	local_node->repo->config->importer.max_links = 3;
+
+	local_node->repo->config->importer.workers = 1;
+	if (ipfs_import_file("/tmp", fileName, &single_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+
+	local_node->repo->config->importer.workers = 4;
+	bytes_written = 0;
+	if (ipfs_import_file("/tmp", fileName, &parallel_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+
+	if (single_node->hash_size != parallel_node->hash_size || memcmp(single_node->hash, parallel_node->hash, single_node->hash_size) != 0) {
+		printf("The parallel import produced a different hash\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (local_node != NULL)
+		ipfs_node_free(local_node);
+	if (single_node != NULL)
+		ipfs_hashtable_node_free(single_node);
+	if (parallel_node != NULL)
+		ipfs_hashtable_node_free(parallel_node);
+	if (file_bytes != NULL)
+		free(file_bytes);
+	return retVal;
+}
+
+/***
+ * A directory tree imported by several workers should have the same hash as one imported on a single thread
+ */
+int test_import_parallel_directory() {
+	const char* top_dir = "/tmp/test_import_parallel_dir";
+	const char* repo_dir = "/tmp/.ipfs";
+	struct IpfsNode* local_node = NULL;
+	struct HashtableNode* single_node = NULL;
+	struct HashtableNode* parallel_node = NULL;
+	unsigned char file_bytes[1000];
+	char path[256];
+	size_t bytes_written = 0;
+	int retVal = 0;
+
+	// a few directories, each with files and an empty directory
+	drop_repository(top_dir);
+	mkdir(top_dir, S_IRWXU);
+	create_bytes(file_bytes, 1000);
+	for(int i = 0; i < 4; i++) {
+		sprintf(path, "%s/dir%d", top_dir, i);
+		mkdir(path, S_IRWXU);
+		sprintf(path, "%s/dir%d/empty", top_dir, i);
+		mkdir(path, S_IRWXU);
+		for(int j = 0; j < 10; j++) {
+			sprintf(path, "%s/dir%d/file%d", top_dir, i, j);
+			create_file(path, &file_bytes[j], 1000 - j * 50 - i);
+		}
+	}
+	sprintf(path, "%s/top.txt", top_dir);
+	create_file(path, file_bytes, 10);
+
+	if (!drop_and_build_repository(repo_dir, 4001, NULL, NULL)) {
+		fprintf(stderr, "Unable to drop and build test repository at %s\n", repo_dir);
+		goto exit;
+	}
+	if (!ipfs_node_online_new(repo_dir, &local_node)) {
+		fprintf(stderr, "Unable to create new IpfsNode\n");
+		goto exit;
+	}
+
+	local_node->repo->config->importer.workers = 1;
+	if (ipfs_import_file("/tmp", top_dir, &single_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+
+	local_node->repo->config->importer.workers = 4;
+	bytes_written = 0;
+	if (ipfs_import_file("/tmp", top_dir, &parallel_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+
+	if (single_node->hash_size != parallel_node->hash_size || memcmp(single_node->hash, parallel_node->hash, single_node->hash_size) != 0) {
+		printf("The parallel import produced a different hash\n");
+		goto exit;
+	}
+	int num_links = 0;
+	for(struct NodeLink* link = parallel_node->head_link; link != NULL; link = link->next)
+		num_links++;
+	if (num_links != 5) {
+		printf("The top directory should have 5 links, but has %d\n", num_links);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (local_node != NULL)
+		ipfs_node_free(local_node);
+	if (single_node != NULL)
+		ipfs_hashtable_node_free(single_node);
+	if (parallel_node != NULL)
+		ipfs_hashtable_node_free(parallel_node);
+	drop_repository(top_dir);
+	return retVal;
+}
+
+/***
+ * Read parts of a file that is several levels deep, including parts that cross chunks
+ */
+int test_import_ranged_read() {
+	size_t bytes_size = 10000 * 9 + 123;
+	unsigned char* file_bytes = NULL;
+	unsigned char* buffer = NULL;
+	const char* fileName = "/tmp/test_import_ranged.tmp";
+	const char* repo_dir = "/tmp/.ipfs";
+	struct IpfsNode* local_node = NULL;
+	struct HashtableNode* write_node = NULL;
+	struct DagReader* reader = NULL;
+	size_t bytes_written = 0;
+	size_t bytes_read = 0;
+	size_t ranges[][2] = { {0, 10}, {9990, 20}, {25000, 30000}, {bytes_size - 5, 100}, {0, bytes_size}, {bytes_size, 10} };
+	int retVal = 0;
+
+	file_bytes = (unsigned char*)malloc(bytes_size);
+	buffer = (unsigned char*)malloc(bytes_size);
+	if (file_bytes == NULL || buffer == NULL)
+		goto exit;
+	create_bytes(file_bytes, bytes_size);
+	create_file(fileName, file_bytes, bytes_size);
+
+	if (!drop_and_build_repository(repo_dir, 4001, NULL, NULL)) {
+		fprintf(stderr, "Unable to drop and build test repository at %s\n", repo_dir);
+		goto exit;
+	}
+	if (!ipfs_node_online_new(repo_dir, &local_node)) {
+		fprintf(stderr, "Unable to create new IpfsNode\n");
+		goto exit;
+	}
+	// 10 chunks, 3 links per node gives a tree 3 levels deep
+	local_node->repo->config->importer.max_links = 3;
+	free(local_node->repo->config->importer.chunker);
+	local_node->repo->config->importer.chunker = malloc(11);
+	strcpy(local_node->repo->config->importer.chunker, "size-10000");
+
+	if (ipfs_import_file("/tmp", fileName, &write_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+	if (!ipfs_dag_reader_new(local_node, write_node->hash, write_node->hash_size, &reader))
+		goto exit;
+	if (reader->size != bytes_size) {
+		printf("The reader should see %lu bytes, but sees %lu\n", bytes_size, reader->size);
+		goto exit;
+	}
+
+	for(int i = 0; i < 6; i++) {
+		size_t offset = ranges[i][0];
+		size_t expected = (offset + ranges[i][1] > bytes_size ? bytes_size - offset : ranges[i][1]);
+		if (!ipfs_dag_reader_read_at(reader, offset, buffer, ranges[i][1], &bytes_read))
+			goto exit;
+		if (bytes_read != expected || memcmp(buffer, &file_bytes[offset], bytes_read) != 0) {
+			printf("Reading %lu bytes at %lu did not match the file\n", ranges[i][1], offset);
+			goto exit;
+		}
+	}
+	if (ipfs_dag_reader_seek(reader, bytes_size + 1)) {
+		printf("Should not be able to seek past the end\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (reader != NULL)
+		ipfs_dag_reader_free(reader);
+	if (local_node != NULL)
+		ipfs_node_free(local_node);
+	if (write_node != NULL)
+		ipfs_hashtable_node_free(write_node);
+	if (file_bytes != NULL)
+		free(file_bytes);
+	if (buffer != NULL)
+		free(buffer);
+	return retVal;
+}
+
+/***
+ * Count the blocks of a DAG
+ * @param fs_repo where the blocks are
+ * @param node the top node
+ * @param count incremented for the node and each block below it
+ * @returns true(1) on success
+ */
+int test_import_count_blocks(const struct FSRepo* fs_repo, const struct HashtableNode* node, size_t* count) {
+	(*count)++;
+	for(struct NodeLink* link = node->head_link; link != NULL; link = link->next) {
+		struct HashtableNode* child = NULL;
+		if (!ipfs_merkledag_get(link->hash, link->hash_size, &child, fs_repo))
+			return 0;
+		int retVal = test_import_count_blocks(fs_repo, child, count);
+		ipfs_hashtable_node_free(child);
+		if (!retVal)
+			return 0;
+	}
+	return 1;
+}
+
+/***
+ * A read fetches only the blocks on the way to its bytes, and the next read in the
+ * same leaf fetches nothing. Reading the whole file a little at a time fetches each block once.
+ */
+int test_import_ranged_read_fetches() {
+	size_t bytes_size = 10000 * 9 + 123;
+	unsigned char* file_bytes = NULL;
+	unsigned char* buffer = NULL;
+	const char* fileName = "/tmp/test_import_ranged.tmp";
+	const char* repo_dir = "/tmp/.ipfs";
+	struct IpfsNode* local_node = NULL;
+	struct HashtableNode* write_node = NULL;
+	struct DagReader* reader = NULL;
+	size_t bytes_written = 0;
+	size_t bytes_read = 0;
+	size_t blocks = 0;
+	int retVal = 0;
+
+	file_bytes = (unsigned char*)malloc(bytes_size);
+	buffer = (unsigned char*)malloc(bytes_size);
+	if (file_bytes == NULL || buffer == NULL)
+		goto exit;
+	create_bytes(file_bytes, bytes_size);
+	create_file(fileName, file_bytes, bytes_size);
+
+	if (!drop_and_build_repository(repo_dir, 4001, NULL, NULL)) {
+		fprintf(stderr, "Unable to drop and build test repository at %s\n", repo_dir);
+		goto exit;
+	}
+	if (!ipfs_node_online_new(repo_dir, &local_node)) {
+		fprintf(stderr, "Unable to create new IpfsNode\n");
+		goto exit;
+	}
+	// 10 chunks, 3 links per node gives a tree 3 levels deep
+	local_node->repo->config->importer.max_links = 3;
+	free(local_node->repo->config->importer.chunker);
+	local_node->repo->config->importer.chunker = malloc(11);
+	strcpy(local_node->repo->config->importer.chunker, "size-10000");
+
+	if (ipfs_import_file("/tmp", fileName, &write_node, local_node, &bytes_written, 1) == 0)
+		goto exit;
+	if (!test_import_count_blocks(local_node->repo, write_node, &blocks))
+		goto exit;
+	if (!ipfs_dag_reader_new(local_node, write_node->hash, write_node->hash_size, &reader))
+		goto exit;
+
+	// only the blocks from the root to the leaf
+	unsigned long fetches = reader->fetches;
+	if (!ipfs_dag_reader_read_at(reader, 25000, buffer, 10, &bytes_read) || bytes_read != 10
+			|| memcmp(buffer, &file_bytes[25000], 10) != 0)
+		goto exit;
+	if (reader->depth < 3 || reader->fetches - fetches != reader->depth - 1) {
+		printf("Reading 10 bytes fetched %lu blocks, for a path of %d\n", reader->fetches - fetches, reader->depth);
+		goto exit;
+	}
+	// the same leaf is still there
+	fetches = reader->fetches;
+	if (!ipfs_dag_reader_read_at(reader, 25010, buffer, 10, &bytes_read) || bytes_read != 10
+			|| memcmp(buffer, &file_bytes[25010], 10) != 0)
+		goto exit;
+	if (reader->fetches != fetches) {
+		printf("Reading more of the same leaf fetched %lu blocks\n", reader->fetches - fetches);
+		goto exit;
+	}
+	ipfs_dag_reader_free(reader);
+	reader = NULL;
+
+	// all of it, 1000 bytes at a time
+	if (!ipfs_dag_reader_new(local_node, write_node->hash, write_node->hash_size, &reader))
+		goto exit;
+	size_t total = 0;
+	while (total < bytes_size) {
+		if (!ipfs_dag_reader_read(reader, &buffer[total], 1000, &bytes_read) || bytes_read == 0)
+			goto exit;
+		total += bytes_read;
+	}
+	if (memcmp(buffer, file_bytes, bytes_size) != 0) {
+		printf("Reading the file in pieces did not match the file\n");
+		goto exit;
+	}
+	if (reader->fetches != blocks) {
+		printf("Reading a file of %lu blocks fetched %lu\n", (unsigned long)blocks, reader->fetches);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (reader != NULL)
+		ipfs_dag_reader_free(reader);
+	if (local_node != NULL)
+		ipfs_node_free(local_node);
+	if (write_node != NULL)
+		ipfs_hashtable_node_free(write_node);
+	if (file_bytes != NULL)
+		free(file_bytes);
+	if (buffer != NULL)
+		free(buffer);
+	return retVal;
+}
@@ -0,0 +1,280 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libp2p/peer/peerstore.h"
+#include "libp2p/utils/linked_list.h"
+#include "ipfs/core/ipfs_node.h"
+#include "ipfs/routing/routing.h"
+#include "ipfs/routing/provider_query.h"
+
+#define TEST_PROVIDER_QUERY_PEERS 3
+
+long long ipfs_routing_provider_query_now();
+
+/***
+ * How each stand-in peer answers. The session context of a peer is its number, plus one.
+ */
+int test_provider_query_delay[TEST_PROVIDER_QUERY_PEERS]; // milliseconds before it answers
+int test_provider_query_answers[TEST_PROVIDER_QUERY_PEERS]; // true(1) if it knows a provider
+int test_provider_query_asked[TEST_PROVIDER_QUERY_PEERS];
+pthread_mutex_t test_provider_query_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***
+ * Stands in for the network. The key of the answer is the number of the peer that sent it.
+ */
+struct Libp2pMessage* test_provider_query_send_receive(struct SessionContext* sessionContext, struct Libp2pMessage* message) {
+	int number = (int)(intptr_t)sessionContext - 1;
+	pthread_mutex_lock(&test_provider_query_lock);
+	test_provider_query_asked[number]++;
+	pthread_mutex_unlock(&test_provider_query_lock);
+	usleep(test_provider_query_delay[number] * 1000);
+	if (!test_provider_query_answers[number])
+		return NULL;
+	struct Libp2pMessage* answer = libp2p_message_new();
+	if (answer == NULL)
+		return NULL;
+	answer->message_type = MESSAGE_TYPE_GET_PROVIDERS;
+	answer->key = malloc(1);
+	answer->provider_peer_head = libp2p_utils_linked_list_new();
+	if (answer->key == NULL || answer->provider_peer_head == NULL) {
+		libp2p_message_free(answer);
+		return NULL;
+	}
+	answer->key[0] = number;
+	answer->key_size = 1;
+	answer->provider_peer_head->item = libp2p_peer_new();
+	return answer;
+}
+
+/***
+ * The peers of a stand-in node, all connected
+ */
+struct TestProviderQuery {
+	struct Libp2pPeer peers[TEST_PROVIDER_QUERY_PEERS];
+	struct PeerEntry entries[TEST_PROVIDER_QUERY_PEERS];
+	struct Libp2pLinkedList links[TEST_PROVIDER_QUERY_PEERS];
+	struct Peerstore peerstore;
+	struct IpfsNode local_node;
+	struct IpfsRouting routing;
+};
+
+/***
+ * Set up the stand-in node
+ * @param test where to put it
+ * @returns true(1) on success
+ */
+int test_provider_query_setup(struct TestProviderQuery* test) {
+	memset(test, 0, sizeof(struct TestProviderQuery));
+	for(int i = 0; i < TEST_PROVIDER_QUERY_PEERS; i++) {
+		test->peers[i].connection_type = CONNECTION_TYPE_CONNECTED;
+		test->peers[i].sessionContext = (struct SessionContext*)(intptr_t)(i + 1);
+		test->entries[i].peer = &test->peers[i];
+		test->links[i].item = &test->entries[i];
+		test->links[i].next = (i + 1 < TEST_PROVIDER_QUERY_PEERS ? &test->links[i + 1] : NULL);
+		test_provider_query_delay[i] = 0;
+		test_provider_query_answers[i] = 0;
+		test_provider_query_asked[i] = 0;
+	}
+	test->peerstore.head_entry = &test->links[0];
+	test->peerstore.last_entry = &test->links[TEST_PROVIDER_QUERY_PEERS - 1];
+	test->local_node.peerstore = &test->peerstore;
+	test->routing.local_node = &test->local_node;
+	test->routing.peer_times = ipfs_routing_peer_times_new();
+	if (test->routing.peer_times == NULL)
+		return 0;
+	test->routing.peer_times->send_receive = test_provider_query_send_receive;
+	return 1;
+}
+
+/***
+ * The number of the peer that sent an answer
+ * @param answer the answer
+ * @returns the number, or -1
+ */
+int test_provider_query_from(struct Libp2pMessage* answer) {
+	if (answer == NULL || answer->key == NULL || answer->key_size != 1)
+		return -1;
+	return answer->key[0];
+}
+
+/***
+ * The fastest peers are asked first, and a peer is only asked one question at a time
+ */
+int test_routing_peer_times() {
+	int retVal = 0;
+	struct TestProviderQuery test;
+	struct Libp2pVector* peers = NULL;
+
+	if (!test_provider_query_setup(&test))
+		goto exit;
+	struct RoutingPeerTimes* times = test.routing.peer_times;
+	// the peer that was never asked is put between the slow one and the fast one
+	ipfs_routing_peer_times_record(times, &test.peers[0], ROUTING_PEER_TIME_FAILED);
+	ipfs_routing_peer_times_record(times, &test.peers[2], 20);
+	peers = ipfs_routing_provider_query_peers(&test.routing);
+	if (peers == NULL || peers->total != TEST_PROVIDER_QUERY_PEERS
+			|| libp2p_utils_vector_get(peers, 0) != &test.peers[2]
+			|| libp2p_utils_vector_get(peers, 1) != &test.peers[1]
+			|| libp2p_utils_vector_get(peers, 2) != &test.peers[0]) {
+		fprintf(stderr, "The peers were not put in order of how fast they answer\n");
+		goto exit;
+	}
+
+	if (!ipfs_routing_peer_times_claim(times, &test.peers[1])) {
+		fprintf(stderr, "A free peer could not be claimed\n");
+		goto exit;
+	}
+	if (ipfs_routing_peer_times_claim(times, &test.peers[1])) {
+		fprintf(stderr, "A peer was claimed twice\n");
+		goto exit;
+	}
+	ipfs_routing_peer_times_release(times, &test.peers[1], 100);
+	if (!ipfs_routing_peer_times_claim(times, &test.peers[1])) {
+		fprintf(stderr, "A released peer could not be claimed again\n");
+		goto exit;
+	}
+	ipfs_routing_peer_times_release(times, &test.peers[1], 300);
+	// the latest answer counts the most
+	if (ipfs_routing_peer_times_get(times, &test.peers[1]) != 150) {
+		fprintf(stderr, "The average time is %lld, not 150\n", ipfs_routing_peer_times_get(times, &test.peers[1]));
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (peers != NULL)
+		libp2p_utils_vector_free(peers);
+	ipfs_routing_peer_times_free(test.routing.peer_times);
+	return retVal;
+}
+
+/***
+ * Asks for providers in a thread
+ */
+void* test_provider_query_ask(void* arg) {
+	struct TestProviderQuery* test = (struct TestProviderQuery*)arg;
+	return ipfs_routing_provider_query(&test->routing, (unsigned char*)"key", 3);
+}
+
+/***
+ * The first answer is used without waiting for the slow peers, and a peer that is busy
+ * with another query is still asked once it is free
+ */
+int test_routing_provider_query() {
+	int retVal = 0;
+	struct TestProviderQuery test;
+	struct Libp2pMessage* answer = NULL;
+	pthread_t thread;
+	int thread_started = 0;
+
+	if (!test_provider_query_setup(&test))
+		goto exit;
+
+	// the first answer wins
+	test_provider_query_delay[0] = 500;
+	test_provider_query_answers[0] = 1;
+	test_provider_query_delay[1] = 20;
+	test_provider_query_answers[1] = 1;
+	long long start = ipfs_routing_provider_query_now();
+	answer = ipfs_routing_provider_query(&test.routing, (unsigned char*)"key", 3);
+	long long elapsed = ipfs_routing_provider_query_now() - start;
+	if (test_provider_query_from(answer) != 1 || elapsed >= 500) {
+		fprintf(stderr, "The answer came from peer %d after %lldms\n", test_provider_query_from(answer), elapsed);
+		goto exit;
+	}
+	libp2p_message_free(answer);
+	answer = NULL;
+	// the slow peer is let go before the next question
+	ipfs_routing_peer_times_free(test.routing.peer_times);
+	test.routing.peer_times = NULL;
+
+	// only the peer that knows is busy, so the query waits for it
+	if (!test_provider_query_setup(&test))
+		goto exit;
+	test_provider_query_answers[2] = 1;
+	if (!ipfs_routing_peer_times_claim(test.routing.peer_times, &test.peers[2]))
+		goto exit;
+	if (pthread_create(&thread, NULL, test_provider_query_ask, &test) != 0)
+		goto exit;
+	thread_started = 1;
+	usleep(200 * 1000);
+	ipfs_routing_peer_times_release(test.routing.peer_times, &test.peers[2], 10);
+	pthread_join(thread, (void**)&answer);
+	thread_started = 0;
+	if (test_provider_query_from(answer) != 2 || test_provider_query_asked[2] != 1) {
+		fprintf(stderr, "The busy peer was asked %d times, and the answer came from peer %d\n",
+				test_provider_query_asked[2], test_provider_query_from(answer));
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (thread_started) {
+		ipfs_routing_peer_times_release(test.routing.peer_times, &test.peers[2], 10);
+		pthread_join(thread, (void**)&answer);
+	}
+	if (answer != NULL)
+		libp2p_message_free(answer);
+	if (test.routing.peer_times != NULL)
+		ipfs_routing_peer_times_free(test.routing.peer_times);
+	return retVal;
+}
+
+/***
+ * An answer that comes after its query ended is used by the next query for the same key,
+ * without asking that peer again
+ */
+int test_routing_provider_query_late() {
+	int retVal = 0;
+	struct TestProviderQuery test;
+	struct Libp2pMessage* answer = NULL;
+
+	if (!test_provider_query_setup(&test))
+		goto exit;
+
+	// the slow peer is still asking when the fast one answers
+	test_provider_query_delay[0] = 300;
+	test_provider_query_answers[0] = 1;
+	test_provider_query_delay[1] = 20;
+	test_provider_query_answers[1] = 1;
+	answer = ipfs_routing_provider_query(&test.routing, (unsigned char*)"key", 3);
+	if (test_provider_query_from(answer) != 1)
+		goto exit;
+	libp2p_message_free(answer);
+	answer = NULL;
+	// the pool lives on, and the slow peer's answer is kept
+	thpool_wait(test.routing.peer_times->pool);
+
+	// now only the slow peer knows, and it is slow to answer again
+	test_provider_query_answers[1] = 0;
+	test_provider_query_delay[0] = 1000;
+	long long start = ipfs_routing_provider_query_now();
+	answer = ipfs_routing_provider_query(&test.routing, (unsigned char*)"key", 3);
+	long long elapsed = ipfs_routing_provider_query_now() - start;
+	if (test_provider_query_from(answer) != 0 || test_provider_query_asked[0] != 1 || elapsed >= 1000) {
+		fprintf(stderr, "The late answer was not used: it came from peer %d after %lldms, and the slow peer was asked %d times\n",
+				test_provider_query_from(answer), elapsed, test_provider_query_asked[0]);
+		goto exit;
+	}
+	libp2p_message_free(answer);
+	answer = NULL;
+
+	// it is only used once
+	test_provider_query_delay[0] = 0;
+	answer = ipfs_routing_provider_query(&test.routing, (unsigned char*)"key", 3);
+	if (test_provider_query_from(answer) != 0 || test_provider_query_asked[0] != 2) {
+		fprintf(stderr, "The slow peer was asked %d times\n", test_provider_query_asked[0]);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (answer != NULL)
+		libp2p_message_free(answer);
+	if (test.routing.peer_times != NULL)
+		ipfs_routing_peer_times_free(test.routing.peer_times);
+	return retVal;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "ipfs/blocks/block_cache.h"
+
+/***
+ * Blocks that are read again stay in the cache while a scan goes by
+ */
+int test_block_cache_scan() {
+	int retVal = 0;
+	char key[32];
+	unsigned char data[1000];
+	unsigned char* bytes = NULL;
+	size_t bytes_size = 0;
+	unsigned long long hits = 0, misses = 0;
+	size_t cached = 0;
+	// room for about 1000 blocks
+	struct BlockCache* cache = ipfs_block_cache_new(1024 * 1024);
+	if (cache == NULL)
+		return 0;
+	memset(data, 'x', sizeof(data));
+
+	// read the "directories" twice, so they are used more than once
+	for(int round = 0; round < 2; round++) {
+		for(int i = 0; i < 20; i++) {
+			sprintf(key, "dir%d", i);
+			if (!ipfs_block_cache_get(cache, key, &bytes, &bytes_size))
+				ipfs_block_cache_put(cache, key, data, sizeof(data));
+			free(bytes);
+			bytes = NULL;
+		}
+		// fill the cache, which pushes them out of the fifo before the second read
+		for(int i = 0; i < 1500; i++) {
+			sprintf(key, "warm%d-%d", round, i);
+			ipfs_block_cache_put(cache, key, data, sizeof(data));
+		}
+	}
+	// now read a big file once
+	for(int i = 0; i < 2000; i++) {
+		sprintf(key, "scan%d", i);
+		if (!ipfs_block_cache_get(cache, key, &bytes, &bytes_size))
+			ipfs_block_cache_put(cache, key, data, sizeof(data));
+		free(bytes);
+		bytes = NULL;
+	}
+	ipfs_block_cache_stats(cache, &hits, &misses, &cached);
+	if (hits != 0 || misses != 2040) {
+		fprintf(stderr, "Expected 0 hits and 2040 misses, but got %llu and %llu\n", hits, misses);
+		goto exit;
+	}
+	if (cached > 1024 * 1024) {
+		fprintf(stderr, "The cache holds %lu bytes, more than it should\n", (unsigned long)cached);
+		goto exit;
+	}
+
+	// the directories should still be there
+	for(int i = 0; i < 20; i++) {
+		sprintf(key, "dir%d", i);
+		if (!ipfs_block_cache_get(cache, key, &bytes, &bytes_size)) {
+			fprintf(stderr, "%s was pushed out by the scan\n", key);
+			goto exit;
+		}
+		if (bytes_size != sizeof(data) || memcmp(bytes, data, bytes_size) != 0) {
+			fprintf(stderr, "%s came back different\n", key);
+			goto exit;
+		}
+		free(bytes);
+		bytes = NULL;
+	}
+
+	// and can be forgotten
+	ipfs_block_cache_remove(cache, "dir0");
+	if (ipfs_block_cache_has(cache, "dir0"))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	free(bytes);
+	ipfs_block_cache_free(cache);
+	return retVal;
+}
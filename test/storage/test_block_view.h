@@ -0,0 +1,93 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipfs/blocks/block_view.h"
+#include "ipfs/merkledag/node.h"
+#include "ipfs/unixfs/unixfs.h"
+
+/***
+ * A large block is mapped, and a node and its UnixFS point into the mapping
+ */
+int test_block_view_node() {
+	int retVal = 0;
+	char* filename = "/tmp/test_block_view.data";
+	size_t data_size = 2 * BLOCK_VIEW_MAP_MIN;
+	unsigned char* data = (unsigned char*)malloc(data_size);
+	struct UnixFS* unix_fs = NULL;
+	struct HashtableNode* node = NULL;
+	unsigned char* unix_fs_protobuf = NULL;
+	unsigned char* node_protobuf = NULL;
+	struct BlockView view;
+	int have_view = 0;
+	int fd = -1;
+
+	if (data == NULL)
+		return 0;
+	for(size_t i = 0; i < data_size; i++)
+		data[i] = i % 251;
+
+	// a file block, as the importer writes it
+	if (!ipfs_unixfs_new(&unix_fs))
+		goto exit;
+	unix_fs->data_type = UNIXFS_FILE;
+	unix_fs->file_size = data_size;
+	unix_fs->bytes = data;
+	unix_fs->bytes_size = data_size;
+	size_t unix_fs_size = ipfs_unixfs_protobuf_encode_size(unix_fs);
+	unix_fs_protobuf = (unsigned char*)malloc(unix_fs_size);
+	if (unix_fs_protobuf == NULL || !ipfs_unixfs_protobuf_encode(unix_fs, unix_fs_protobuf, unix_fs_size, &unix_fs_size))
+		goto exit;
+	unix_fs->bytes = NULL;
+	ipfs_unixfs_free(unix_fs);
+	unix_fs = NULL;
+	if (!ipfs_hashtable_node_new_from_data(unix_fs_protobuf, unix_fs_size, &node))
+		goto exit;
+	size_t node_size = ipfs_hashtable_node_protobuf_encode_size(node);
+	node_protobuf = (unsigned char*)malloc(node_size);
+	if (node_protobuf == NULL || !ipfs_hashtable_node_protobuf_encode(node, node_protobuf, node_size, &node_size))
+		goto exit;
+	ipfs_hashtable_node_free(node);
+	node = NULL;
+	if (!create_file(filename, node_protobuf, node_size))
+		goto exit;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || !ipfs_block_view_load(fd, 0, node_size, &view))
+		goto exit;
+	have_view = 1;
+	if (view.mapping == NULL) {
+		fprintf(stderr, "A block of %lu bytes was not mapped\n", (unsigned long)node_size);
+		goto exit;
+	}
+
+	if (!ipfs_hashtable_node_protobuf_decode_view(view.data, view.size, &node))
+		goto exit;
+	if (node->data < view.data || node->data + node->data_size > view.data + view.size) {
+		fprintf(stderr, "The data of the node was copied\n");
+		goto exit;
+	}
+	if (!ipfs_unixfs_protobuf_decode_view(node->data, node->data_size, &unix_fs))
+		goto exit;
+	if (unix_fs->bytes < node->data || unix_fs->bytes_size != data_size || memcmp(unix_fs->bytes, data, data_size) != 0) {
+		fprintf(stderr, "The bytes of the file were copied or changed\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (unix_fs != NULL)
+		ipfs_unixfs_view_free(unix_fs);
+	if (node != NULL)
+		ipfs_hashtable_node_view_free(node);
+	if (have_view)
+		ipfs_block_view_release(&view);
+	if (fd >= 0)
+		close(fd);
+	unlink(filename);
+	free(node_protobuf);
+	free(unix_fs_protobuf);
+	free(data);
+	return retVal;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ipfs/blocks/blockstore.h"
+#include "ipfs/blocks/blockstore_filter.h"
+#include "ipfs/flatfs/flatfs.h"
+#include "ipfs/merkledag/node.h"
+#include "ipfs/repo/fsrepo/fs_repo.h"
+#include "libp2p/os/utils.h"
+
+/***
+ * Build a filter from a sharded blockstore, save it and read it back
+ */
+int test_blockstore_filter() {
+	int retVal = 0;
+	char* blockstore_path = "/tmp/test_blockstore_filter";
+	char* filter_filename = "/tmp/test_blockstore_filter.filter";
+	char* keys[] = { "CIQAAAAAAA", "CIQBBBBBBB", "CIQCCCCCCB" };
+	struct FlatfsShard shard;
+	char filename[256];
+	unsigned char bytes[10];
+	struct BlockstoreFilter* filter = NULL;
+	struct BlockstoreFilter* loaded = NULL;
+	int false_positives = 0;
+
+	drop_repository(blockstore_path);
+	unlink(filter_filename);
+	if (!ipfs_flatfs_create_directory(blockstore_path))
+		goto exit;
+	ipfs_flatfs_shard_parse(FLATFS_DEFAULT_SHARD, &shard);
+	if (!ipfs_flatfs_shard_write(blockstore_path, &shard))
+		goto exit;
+	create_bytes(bytes, 10);
+	for(int i = 0; i < 3; i++) {
+		ipfs_flatfs_get_sharded_directory(blockstore_path, &shard, keys[i], filename, 256);
+		ipfs_flatfs_create_directory(filename);
+		ipfs_flatfs_get_sharded_full_filename(blockstore_path, &shard, keys[i], filename, 256);
+		if (!create_file(filename, bytes, 10))
+			goto exit;
+	}
+
+	filter = ipfs_blockstore_filter_new(64 * 1024);
+	if (filter == NULL || !ipfs_blockstore_filter_fill(filter, blockstore_path))
+		goto exit;
+	for(int i = 0; i < 3; i++) {
+		if (!ipfs_blockstore_filter_contains(filter, keys[i])) {
+			fprintf(stderr, "%s is in the blockstore, but not the filter\n", keys[i]);
+			goto exit;
+		}
+	}
+	// the SHARDING file is not a block
+	if (ipfs_blockstore_filter_contains(filter, FLATFS_SHARDING_FILENAME))
+		false_positives++;
+	for(int i = 0; i < 1000; i++) {
+		sprintf(filename, "CIQMISSING%d", i);
+		if (ipfs_blockstore_filter_contains(filter, filename))
+			false_positives++;
+	}
+	if (false_positives > 10) {
+		fprintf(stderr, "%d false positives out of 1001\n", false_positives);
+		goto exit;
+	}
+
+	// taking one out leaves the others
+	ipfs_blockstore_filter_remove(filter, keys[0]);
+	if (ipfs_blockstore_filter_contains(filter, keys[0]) || !ipfs_blockstore_filter_contains(filter, keys[1]))
+		goto exit;
+
+	// save and read back
+	if (!ipfs_blockstore_filter_save(filter, filter_filename))
+		goto exit;
+	loaded = ipfs_blockstore_filter_new(64 * 1024);
+	if (loaded == NULL || !ipfs_blockstore_filter_load(loaded, filter_filename))
+		goto exit;
+	if (memcmp(loaded->counters, filter->counters, filter->size) != 0)
+		goto exit;
+	// the counters of both are added up, and stop at 255
+	filter->counters[0] = 100;
+	filter->counters[1] = 1;
+	unlink(filter_filename);
+	if (!ipfs_blockstore_filter_save(filter, filter_filename))
+		goto exit;
+	memset(loaded->counters, 0, loaded->size);
+	loaded->counters[0] = 200;
+	loaded->counters[1] = 1;
+	if (!ipfs_blockstore_filter_load(loaded, filter_filename) || loaded->counters[0] != 255 || loaded->counters[1] != 2) {
+		fprintf(stderr, "Reading a filter made counters of %d and %d\n", loaded->counters[0], loaded->counters[1]);
+		goto exit;
+	}
+	// a filter of another size is not read
+	ipfs_blockstore_filter_free(loaded);
+	loaded = ipfs_blockstore_filter_new(128 * 1024);
+	if (loaded == NULL || ipfs_blockstore_filter_load(loaded, filter_filename))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	ipfs_blockstore_filter_free(filter);
+	ipfs_blockstore_filter_free(loaded);
+	unlink(filter_filename);
+	return retVal;
+}
+
+/***
+ * A block written by another process is found, though it was not in this process' filter
+ */
+int test_blockstore_filter_shared() {
+	int retVal = 0;
+	const char* repo_path = "/tmp/.ipfs";
+	struct FSRepo* fs_repo = NULL;
+	struct HashtableNode* node = NULL;
+	struct HashtableNode* found = NULL;
+	unsigned char* key = NULL;
+	unsigned char data[100];
+	int status = 0;
+
+	if (!drop_build_and_open_repo(repo_path, &fs_repo))
+		goto exit;
+	if (fs_repo->blockstore_filter == NULL || ipfs_repo_fsrepo_shared(fs_repo)) {
+		fprintf(stderr, "The repo should have a filter, and nobody else should have it open\n");
+		goto exit;
+	}
+	memset(data, 'x', sizeof(data));
+	if (!ipfs_hashtable_node_new_from_data(data, sizeof(data), &node))
+		goto exit;
+	node->hash_size = 32;
+	node->hash = (unsigned char*)malloc(node->hash_size);
+	if (node->hash == NULL)
+		goto exit;
+	memset(node->hash, 0x42, node->hash_size);
+
+	pid_t child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		struct FSRepo* other = NULL;
+		size_t bytes_written = 0;
+		int written = (ipfs_repo_fsrepo_new(repo_path, NULL, &other) && ipfs_repo_fsrepo_open(other)
+				&& ipfs_repo_fsrepo_shared(other) && ipfs_blockstore_put_node(node, other, &bytes_written));
+		if (other != NULL)
+			ipfs_repo_fsrepo_free(other);
+		_exit(written ? 0 : 1);
+	}
+	if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "The other process could not write the block\n");
+		goto exit;
+	}
+
+	if (!ipfs_repo_fsrepo_shared(fs_repo)) {
+		fprintf(stderr, "The other process was not noticed\n");
+		goto exit;
+	}
+	if (!ipfs_blockstore_get_node(node->hash, node->hash_size, &found, fs_repo)) {
+		fprintf(stderr, "The block the other process wrote was not found\n");
+		goto exit;
+	}
+	// the filter learned the key from the log, and still keeps out what nobody wrote
+	key = ipfs_blockstore_hash_to_base32(node->hash, node->hash_size);
+	if (key == NULL)
+		goto exit;
+	if (!ipfs_blockstore_filter_contains(fs_repo->blockstore_filter, (char*)key)) {
+		fprintf(stderr, "The key the other process wrote is not in the filter\n");
+		goto exit;
+	}
+	if (ipfs_blockstore_filter_contains_logged(fs_repo->blockstore_filter, "CIQNOBODYWROTETHIS")) {
+		fprintf(stderr, "The filter lets everything through\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	if (node != NULL)
+		ipfs_hashtable_node_free(node);
+	if (found != NULL)
+		ipfs_hashtable_node_free(found);
+	free(key);
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	return retVal;
+}
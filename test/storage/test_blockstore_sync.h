@@ -0,0 +1,197 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipfs/blocks/blockstore.h"
+#include "ipfs/blocks/blockstore_sync.h"
+#include "ipfs/flatfs/flatfs.h"
+#include "ipfs/merkledag/merkledag.h"
+#include "ipfs/repo/fsrepo/fs_repo.h"
+
+#define TEST_BLOCKSTORE_SYNC_THREADS 8
+#define TEST_BLOCKSTORE_SYNC_FILES 25
+
+struct TestBlockstoreSyncWriter {
+	struct BlockstoreSync* sync;
+	const char* directory;
+	int number;
+	int result;
+};
+
+/***
+ * Write files through a BlockstoreSync, as a thread
+ * @param arg the TestBlockstoreSyncWriter
+ * @returns NULL
+ */
+void* test_blockstore_sync_writer(void* arg) {
+	struct TestBlockstoreSyncWriter* writer = (struct TestBlockstoreSyncWriter*)arg;
+	char temporary[100];
+	char filename[100];
+	writer->result = 1;
+	for(int i = 0; i < TEST_BLOCKSTORE_SYNC_FILES && writer->result; i++) {
+		sprintf(filename, "%s/%d-%d.data", writer->directory, writer->number, i);
+		sprintf(temporary, "%s.tmp", filename);
+		int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		writer->result = (fd >= 0 && write(fd, filename, strlen(filename)) == (ssize_t)strlen(filename)
+				&& ipfs_blockstore_sync_commit(writer->sync, fd, temporary, filename));
+	}
+	return NULL;
+}
+
+/***
+ * Many writers commit at once, and every file ends up complete under its own name
+ */
+int test_blockstore_sync() {
+	int retVal = 0;
+	const char* directory = "/tmp/test_blockstore_sync";
+	struct TestBlockstoreSyncWriter writers[TEST_BLOCKSTORE_SYNC_THREADS];
+	pthread_t threads[TEST_BLOCKSTORE_SYNC_THREADS];
+	unsigned long long batches = 0, files = 0, syncs = 0;
+	char filename[100];
+	char contents[100];
+
+	drop_repository(directory);
+	if (!ipfs_flatfs_create_directory(directory))
+		return 0;
+	struct BlockstoreSync* sync = ipfs_blockstore_sync_new(0);
+	if (sync == NULL)
+		return 0;
+
+	for(int i = 0; i < TEST_BLOCKSTORE_SYNC_THREADS; i++) {
+		writers[i].sync = sync;
+		writers[i].directory = directory;
+		writers[i].number = i;
+		pthread_create(&threads[i], NULL, test_blockstore_sync_writer, &writers[i]);
+	}
+	for(int i = 0; i < TEST_BLOCKSTORE_SYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	for(int i = 0; i < TEST_BLOCKSTORE_SYNC_THREADS; i++) {
+		if (!writers[i].result) {
+			fprintf(stderr, "Writer %d could not commit a file\n", i);
+			goto exit;
+		}
+	}
+
+	// each file has its own name as its contents, and no temporary file is left
+	for(int i = 0; i < TEST_BLOCKSTORE_SYNC_THREADS; i++) {
+		for(int j = 0; j < TEST_BLOCKSTORE_SYNC_FILES; j++) {
+			sprintf(filename, "%s/%d-%d.data", directory, i, j);
+			FILE* file = fopen(filename, "rb");
+			if (file == NULL) {
+				fprintf(stderr, "%s is not there\n", filename);
+				goto exit;
+			}
+			size_t bytes_read = fread(contents, 1, sizeof(contents), file);
+			fclose(file);
+			if (bytes_read != strlen(filename) || memcmp(contents, filename, bytes_read) != 0) {
+				fprintf(stderr, "%s came back different\n", filename);
+				goto exit;
+			}
+			strcat(filename, ".tmp");
+			if (os_utils_file_exists(filename)) {
+				fprintf(stderr, "%s was left behind\n", filename);
+				goto exit;
+			}
+		}
+	}
+	ipfs_blockstore_sync_stats(sync, &batches, &files, &syncs);
+	if (files != TEST_BLOCKSTORE_SYNC_THREADS * TEST_BLOCKSTORE_SYNC_FILES || batches == 0 || batches > files) {
+		fprintf(stderr, "%llu files were committed in %llu batches\n", files, batches);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	ipfs_blockstore_sync_free(sync);
+	drop_repository(directory);
+	return retVal;
+}
+
+/***
+ * After a crash, the records of blocks that are missing or empty are dropped when the repo
+ * is opened again, along with any unfinished file, even if another process had it open and
+ * closed it after the crash
+ */
+int test_blockstore_scrub() {
+	int retVal = 0;
+	const char* repo_path = "/tmp/.ipfs";
+	struct FSRepo* fs_repo = NULL;
+	struct HashtableNode* nodes[3] = { NULL, NULL, NULL };
+	unsigned char data[100];
+	size_t bytes_written = 0;
+	char* filename = NULL;
+	char temporary[200];
+	char marker[200];
+
+	if (!drop_build_and_open_repo(repo_path, &fs_repo))
+		goto exit;
+	for(int i = 0; i < 3; i++) {
+		memset(data, 'a' + i, sizeof(data));
+		if (!ipfs_hashtable_node_new_from_data(data, sizeof(data), &nodes[i])
+				|| !ipfs_merkledag_add(nodes[i], fs_repo, &bytes_written))
+			goto exit;
+	}
+	// the first block goes missing, the second is empty, and a write never finished
+	for(int i = 0; i < 2; i++) {
+		unsigned char* key = ipfs_blockstore_hash_to_base32(nodes[i]->hash, nodes[i]->hash_size);
+		if (key == NULL)
+			goto exit;
+		filename = ipfs_blockstore_path_get(fs_repo, (char*)key);
+		free(key);
+		if (filename == NULL)
+			goto exit;
+		if (i == 0) {
+			unlink(filename);
+		} else {
+			create_file(filename, data, 0);
+			sprintf(temporary, "%s.a1b2c3.tmp", filename);
+			create_file(temporary, data, sizeof(data));
+		}
+		free(filename);
+		filename = NULL;
+	}
+	ipfs_repo_fsrepo_free(fs_repo);
+	fs_repo = NULL;
+
+	// as if a process died with the repo open, while another had it open and then closed it
+	if (!ipfs_repo_fsrepo_new(repo_path, NULL, &fs_repo) || !ipfs_repo_fsrepo_open(fs_repo))
+		goto exit;
+	sprintf(marker, "%s/%s/died", repo_path, FS_REPO_OPEN_DIRECTORY);
+	if (!create_file(marker, (unsigned char*)"", 0))
+		goto exit;
+	ipfs_repo_fsrepo_free(fs_repo);
+	fs_repo = NULL;
+	if (!ipfs_repo_fsrepo_new(repo_path, NULL, &fs_repo) || !ipfs_repo_fsrepo_open(fs_repo))
+		goto exit;
+
+	if (ipfs_repo_fsrepo_datastore_has(nodes[0]->hash, nodes[0]->hash_size, fs_repo)
+			|| ipfs_repo_fsrepo_datastore_has(nodes[1]->hash, nodes[1]->hash_size, fs_repo)) {
+		fprintf(stderr, "The records of lost blocks were not dropped\n");
+		goto exit;
+	}
+	if (!ipfs_repo_fsrepo_datastore_has(nodes[2]->hash, nodes[2]->hash_size, fs_repo)) {
+		fprintf(stderr, "The record of a good block was dropped\n");
+		goto exit;
+	}
+	if (os_utils_file_exists(temporary)) {
+		fprintf(stderr, "An unfinished file was left behind\n");
+		goto exit;
+	}
+	if (os_utils_file_exists(marker)) {
+		fprintf(stderr, "The process that died is still taken to have the repo open\n");
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	free(filename);
+	for(int i = 0; i < 3; i++) {
+		if (nodes[i] != NULL)
+			ipfs_hashtable_node_free(nodes[i]);
+	}
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	return retVal;
+}
@@ -3,11 +3,13 @@
 #include "ipfs/blocks/block.h"
 #include "ipfs/repo/config/config.h"
 #include "ipfs/repo/fsrepo/fs_repo.h"
+#include "ipfs/repo/fsrepo/lmdb_datastore.h"
 
 #include "../test_helper.h"
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * create a repository and put a record in the datastore and a block in the blockstore
@@ -71,3 +73,145 @@ int test_ipfs_datastore_put() {
 
 	return 1;
 }
+
+/***
+ * Put a record in the datastore, then read it back both with and without a copy
+ */
+int test_ipfs_datastore_get_view() {
+	int retVal = 0;
+	struct FSRepo* fs_repo = NULL;
+	const unsigned char* key = (unsigned char*)"TestKey";
+	unsigned char* value = (unsigned char*)"TestValue";
+	struct LmdbView view;
+	unsigned char buffer[100];
+	size_t buffer_length = 0;
+
+	if (!drop_build_and_open_repo("/tmp/.ipfs", &fs_repo))
+		goto exit;
+
+	struct Datastore* datastore = fs_repo->config->datastore;
+	if (!datastore->datastore_put(key, 7, value, 9, datastore))
+		goto exit;
+
+	// zero copy
+	if (!repo_fsrepo_lmdb_get_view(key, 7, &view, datastore))
+		goto exit;
+	if (view.data_size != 9 || memcmp(view.data, value, 9) != 0) {
+		repo_fsrepo_lmdb_release_view(&view, datastore);
+		goto exit;
+	}
+	repo_fsrepo_lmdb_release_view(&view, datastore);
+
+	// a copy, which reuses the read transaction from above
+	if (!datastore->datastore_get((const char*)key, 7, buffer, 100, &buffer_length, datastore))
+		goto exit;
+	if (buffer_length != 9 || memcmp(buffer, value, 9) != 0)
+		goto exit;
+
+	// not there
+	if (repo_fsrepo_lmdb_get_view((unsigned char*)"NotThere", 8, &view, datastore))
+		goto exit;
+	if (ipfs_repo_fsrepo_datastore_has((unsigned char*)"NotThere", 8, fs_repo))
+		goto exit;
+	if (!ipfs_repo_fsrepo_datastore_has(key, 7, fs_repo))
+		goto exit;
+
+	// the cursor only reads, so a put does not wait for it to close
+	if (!datastore->datastore_cursor_open(datastore))
+		goto exit;
+	int put = datastore->datastore_put((unsigned char*)"OtherKey", 8, value, 9, datastore);
+	unsigned char* cursor_key = NULL;
+	int cursor_key_length = 0;
+	int found = 0;
+	enum DatastoreCursorOp op = CURSOR_FIRST;
+	while (datastore->datastore_cursor_get(&cursor_key, &cursor_key_length, NULL, NULL, op, datastore)) {
+		op = CURSOR_NEXT;
+		if (cursor_key_length == 7 && memcmp(cursor_key, key, 7) == 0)
+			found = 1;
+		free(cursor_key);
+	}
+	datastore->datastore_cursor_close(datastore);
+	if (!put || !found)
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	return retVal;
+}
+
+/***
+ * Hold several puts in a batch, and make sure they can be seen
+ */
+int test_ipfs_datastore_batch() {
+	int retVal = 0;
+	struct FSRepo* fs_repo = NULL;
+	unsigned char* keys[] = { (unsigned char*)"Key1", (unsigned char*)"Key2", (unsigned char*)"Key3" };
+	size_t key_sizes[] = { 4, 4, 4 };
+	unsigned char* values[] = { (unsigned char*)"Value1", (unsigned char*)"Value2", (unsigned char*)"Value3" };
+	size_t value_sizes[] = { 6, 6, 6 };
+	unsigned char buffer[100];
+	size_t buffer_length = 0;
+	struct LmdbView view;
+
+	if (!drop_build_and_open_repo("/tmp/.ipfs", &fs_repo))
+		goto exit;
+	struct Datastore* datastore = fs_repo->config->datastore;
+
+	// nested batches
+	if (!ipfs_repo_fsrepo_batch_begin(fs_repo))
+		goto exit;
+	if (!ipfs_repo_fsrepo_batch_begin(fs_repo))
+		goto exit;
+	for(int i = 0; i < 2; i++) {
+		if (!datastore->datastore_put(keys[i], key_sizes[i], values[i], value_sizes[i], datastore))
+			goto exit;
+	}
+	if (!ipfs_repo_fsrepo_batch_commit(fs_repo))
+		goto exit;
+	// a read sees what is pending
+	if (!datastore->datastore_get((char*)keys[1], key_sizes[1], buffer, 100, &buffer_length, datastore))
+		goto exit;
+	if (buffer_length != 6 || memcmp(buffer, values[1], 6) != 0)
+		goto exit;
+	if (!ipfs_repo_fsrepo_batch_commit(fs_repo))
+		goto exit;
+
+	// reading does not write the batch, but the timer does
+	if (!repo_fsrepo_lmdb_batch_begin(0, 1, datastore))
+		goto exit;
+	if (!datastore->datastore_put((unsigned char*)"Key4", 4, values[0], value_sizes[0], datastore))
+		goto exit;
+	if (!repo_fsrepo_lmdb_get_view((unsigned char*)"Key4", 4, &view, datastore))
+		goto exit;
+	int pending = (view.copy != NULL);
+	repo_fsrepo_lmdb_release_view(&view, datastore);
+	if (!pending) {
+		fprintf(stderr, "Reading a record wrote the batch\n");
+		goto exit;
+	}
+	sleep(2);
+	if (!repo_fsrepo_lmdb_get_view((unsigned char*)"Key4", 4, &view, datastore))
+		goto exit;
+	pending = (view.copy != NULL);
+	repo_fsrepo_lmdb_release_view(&view, datastore);
+	if (pending) {
+		fprintf(stderr, "The batch was not written when it got old\n");
+		goto exit;
+	}
+	if (!repo_fsrepo_lmdb_batch_commit(datastore))
+		goto exit;
+
+	// many at once
+	if (!repo_fsrepo_lmdb_put_many(keys, key_sizes, values, value_sizes, 3, datastore))
+		goto exit;
+	if (!ipfs_repo_fsrepo_datastore_has(keys[2], key_sizes[2], fs_repo))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	if (fs_repo != NULL)
+		ipfs_repo_fsrepo_free(fs_repo);
+	return retVal;
+}
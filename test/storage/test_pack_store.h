@@ -0,0 +1,294 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ipfs/blocks/pack_store.h"
+#include "ipfs/flatfs/flatfs.h"
+#include "libp2p/os/utils.h"
+
+// the key length and data length in front of each record
+#define TEST_PACK_STORE_HEADER_LENGTH 8
+
+void ipfs_pack_store_put_uint32(unsigned char* buffer, uint32_t value);
+
+/***
+ * Make sure a block of a pack store has what was written
+ * @param store the PackStore
+ * @param i the number of the block
+ * @param fill what each byte should be
+ * @returns true(1) if it does
+ */
+int test_pack_store_check(struct PackStore* store, int i, unsigned char fill) {
+	char key[32];
+	unsigned char* bytes = NULL;
+	size_t bytes_size = 0;
+	sprintf(key, "CIQKEY%d", i);
+	if (!ipfs_pack_store_get(store, key, &bytes, &bytes_size)) {
+		fprintf(stderr, "%s is not in the pack store\n", key);
+		return 0;
+	}
+	int retVal = (bytes_size == 200);
+	for(size_t j = 0; retVal && j < bytes_size; j++)
+		retVal = (bytes[j] == fill);
+	if (!retVal)
+		fprintf(stderr, "%s came back different\n", key);
+	free(bytes);
+	return retVal;
+}
+
+/***
+ * Write, replace and delete blocks, open the store again, then compact it
+ */
+int test_pack_store() {
+	int retVal = 0;
+	char* repo_path = "/tmp/test_pack_store";
+	char key[32];
+	unsigned char data[200];
+	struct PackStore* store = NULL;
+	struct BlockstoreSync* sync = NULL;
+	uint64_t bytes_freed = 0;
+	unsigned long long files = 0;
+
+	drop_repository(repo_path);
+	if (!ipfs_flatfs_create_directory(repo_path))
+		goto exit;
+	// small segments, so there are many of them
+	if (!ipfs_pack_store_open(repo_path, 4096, &store))
+		goto exit;
+	sync = ipfs_blockstore_sync_new(0);
+	if (sync == NULL)
+		goto exit;
+	store->sync = sync;
+	memset(data, 'a', sizeof(data));
+	for(int i = 0; i < 100; i++) {
+		sprintf(key, "CIQKEY%d", i);
+		if (!ipfs_pack_store_put(store, key, data, sizeof(data)))
+			goto exit;
+	}
+	// each put waited for its record to be on the disk
+	ipfs_blockstore_sync_stats(sync, NULL, &files, NULL);
+	if (files != 100) {
+		fprintf(stderr, "%llu of 100 puts were synced\n", files);
+		goto exit;
+	}
+	// replace the first half, and delete a quarter
+	memset(data, 'b', sizeof(data));
+	for(int i = 0; i < 50; i++) {
+		sprintf(key, "CIQKEY%d", i);
+		if (!ipfs_pack_store_put(store, key, data, sizeof(data)))
+			goto exit;
+	}
+	for(int i = 75; i < 100; i++) {
+		sprintf(key, "CIQKEY%d", i);
+		if (!ipfs_pack_store_delete(store, key))
+			goto exit;
+	}
+	if (ipfs_pack_store_delete(store, "CIQKEY75") || ipfs_pack_store_has(store, "CIQKEY80"))
+		goto exit;
+	ipfs_pack_store_close(store);
+
+	// everything should be found again
+	if (!ipfs_pack_store_open(repo_path, 4096, &store))
+		goto exit;
+	for(int i = 0; i < 75; i++) {
+		if (!test_pack_store_check(store, i, i < 50 ? 'b' : 'a'))
+			goto exit;
+	}
+	if (ipfs_pack_store_has(store, "CIQKEY99"))
+		goto exit;
+
+	if (!ipfs_pack_store_compact(store, PACK_STORE_COMPACT_PERCENT, &bytes_freed))
+		goto exit;
+	if (bytes_freed == 0) {
+		fprintf(stderr, "Compaction did not free anything\n");
+		goto exit;
+	}
+	for(int i = 0; i < 75; i++) {
+		if (!test_pack_store_check(store, i, i < 50 ? 'b' : 'a'))
+			goto exit;
+	}
+	if (ipfs_pack_store_has(store, "CIQKEY99"))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	ipfs_pack_store_close(store);
+	ipfs_blockstore_sync_free(sync);
+	return retVal;
+}
+
+/***
+ * A process that wrote blocks and died without closing the store, in the middle of a
+ * record, loses nothing it finished. The torn record is cut off on the next open.
+ */
+int test_pack_store_torn() {
+	int retVal = 0;
+	char* repo_path = "/tmp/test_pack_store";
+	char segment_filename[100];
+	char key[32];
+	unsigned char data[200];
+	unsigned char torn[TEST_PACK_STORE_HEADER_LENGTH + 10];
+	struct PackStore* store = NULL;
+	uint64_t whole_size = 0;
+	int status = 0;
+
+	drop_repository(repo_path);
+	if (!ipfs_flatfs_create_directory(repo_path))
+		goto exit;
+	for(int i = 0; i < 20; i++) {
+		sprintf(key, "CIQKEY%d", i);
+		whole_size += TEST_PACK_STORE_HEADER_LENGTH + strlen(key) + sizeof(data);
+	}
+
+	pid_t child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		// what the process writes is only in memory when it dies
+		int written = ipfs_pack_store_open(repo_path, 0, &store);
+		memset(data, 'a', sizeof(data));
+		for(int i = 0; written && i < 20; i++) {
+			sprintf(key, "CIQKEY%d", i);
+			written = ipfs_pack_store_put(store, key, data, sizeof(data));
+		}
+		_exit(written ? 0 : 1);
+	}
+	if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "The other process could not write the blocks\n");
+		goto exit;
+	}
+
+	// half of a record
+	sprintf(segment_filename, "%s/%s/00000000.pack", repo_path, PACK_STORE_DIRECTORY);
+	int fd = open(segment_filename, O_WRONLY | O_APPEND);
+	if (fd < 0)
+		goto exit;
+	memset(torn, 'z', sizeof(torn));
+	ipfs_pack_store_put_uint32(&torn[0], 8);
+	ipfs_pack_store_put_uint32(&torn[4], sizeof(data));
+	int appended = (write(fd, torn, sizeof(torn)) == sizeof(torn));
+	close(fd);
+	if (!appended)
+		goto exit;
+
+	if (!ipfs_pack_store_open(repo_path, 0, &store))
+		goto exit;
+	for(int i = 0; i < 20; i++) {
+		if (!test_pack_store_check(store, i, 'a'))
+			goto exit;
+	}
+	if (os_utils_file_size(segment_filename) != whole_size) {
+		fprintf(stderr, "The segment is %lu bytes, not %lu\n", (unsigned long)os_utils_file_size(segment_filename), (unsigned long)whole_size);
+		goto exit;
+	}
+	// what comes next goes where the torn record was
+	memset(data, 'b', sizeof(data));
+	if (!ipfs_pack_store_put(store, "CIQKEY20", data, sizeof(data)) || !test_pack_store_check(store, 20, 'b'))
+		goto exit;
+
+	retVal = 1;
+	exit:
+	ipfs_pack_store_close(store);
+	return retVal;
+}
+
+/***
+ * Count the keys of a walk
+ * @param key the key
+ * @param arg the count
+ * @returns true(1)
+ */
+int test_pack_store_count(const char* key, void* arg) {
+	(*(int*)arg)++;
+	return 1;
+}
+
+/***
+ * A process that still appends to a segment another process sealed, and dies, loses
+ * nothing it finished, though the segment is not the newest when the store is opened again
+ */
+int test_pack_store_segments() {
+	int retVal = 0;
+	char* repo_path = "/tmp/test_pack_store";
+	char key[32];
+	unsigned char data[200];
+	struct PackStore* store = NULL;
+	int ready[2] = { -1, -1 };
+	int go[2] = { -1, -1 };
+	int status = 0;
+	int keys = 0;
+	char c = 0;
+
+	drop_repository(repo_path);
+	if (!ipfs_flatfs_create_directory(repo_path) || pipe(ready) != 0 || pipe(go) != 0)
+		goto exit;
+	pid_t child = fork();
+	if (child < 0)
+		goto exit;
+	if (child == 0) {
+		// opens the store while the first segment is the newest, and keeps appending to it
+		int written = ipfs_pack_store_open(repo_path, 0, &store);
+		written = (write(ready[1], "r", 1) == 1 && read(go[0], &c, 1) == 1 && written);
+		memset(data, 'l', sizeof(data));
+		for(int i = 0; written && i < 5; i++) {
+			sprintf(key, "CIQLATE%d", i);
+			written = ipfs_pack_store_put(store, key, data, sizeof(data));
+		}
+		_exit(written ? 0 : 1);
+	}
+	if (read(ready[0], &c, 1) != 1)
+		goto exit;
+	// small segments, so this process starts new ones
+	if (!ipfs_pack_store_open(repo_path, 2048, &store))
+		goto exit;
+	memset(data, 'a', sizeof(data));
+	for(int i = 0; i < 20; i++) {
+		sprintf(key, "CIQKEY%d", i);
+		if (!ipfs_pack_store_put(store, key, data, sizeof(data)))
+			goto exit;
+	}
+	if (store->current == 0) {
+		fprintf(stderr, "No new segment was started\n");
+		goto exit;
+	}
+	ipfs_pack_store_close(store);
+	store = NULL;
+	if (write(go[1], "g", 1) != 1)
+		goto exit;
+	if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "The other process could not write the blocks\n");
+		goto exit;
+	}
+
+	if (!ipfs_pack_store_open(repo_path, 2048, &store))
+		goto exit;
+	for(int i = 0; i < 20; i++) {
+		if (!test_pack_store_check(store, i, 'a'))
+			goto exit;
+	}
+	for(int i = 0; i < 5; i++) {
+		sprintf(key, "CIQLATE%d", i);
+		if (!ipfs_pack_store_has(store, key)) {
+			fprintf(stderr, "%s was lost\n", key);
+			goto exit;
+		}
+	}
+	// how far each segment is indexed is not a block
+	if (!ipfs_pack_store_walk(store, test_pack_store_count, &keys) || keys != 25) {
+		fprintf(stderr, "The walk found %d blocks, not 25\n", keys);
+		goto exit;
+	}
+
+	retVal = 1;
+	exit:
+	for(int i = 0; i < 2; i++) {
+		if (ready[i] >= 0)
+			close(ready[i]);
+		if (go[i] >= 0)
+			close(go[i]);
+	}
+	ipfs_pack_store_close(store);
+	return retVal;
+}
@@ -2,20 +2,30 @@
 #include "cmd/ipfs/test_init.h"
 #include "exchange/test_bitswap.h"
 #include "exchange/test_bitswap_request_queue.h"
+#include "exchange/test_bitswap_wantlist_queue.h"
+#include "exchange/test_bitswap_session.h"
 #include "flatfs/test_flatfs.h"
 #include "merkledag/test_merkledag.h"
 #include "node/test_node.h"
 #include "node/test_importer.h"
+#include "node/test_chunker.h"
+#include "node/test_export_pipeline.h"
 #include "node/test_resolver.h"
 #include "repo/test_repo_bootstrap_peers.h"
 #include "repo/test_repo_config.h"
 #include "repo/test_repo_fsrepo.h"
 #include "repo/test_repo_identity.h"
 #include "routing/test_routing.h"
+#include "routing/test_provider_query.h"
 #include "routing/test_supernode.h"
 #include "storage/test_ds_helper.h"
 #include "storage/test_datastore.h"
 #include "storage/test_blocks.h"
+#include "storage/test_block_cache.h"
+#include "storage/test_blockstore_filter.h"
+#include "storage/test_pack_store.h"
+#include "storage/test_block_view.h"
+#include "storage/test_blockstore_sync.h"
 #include "storage/test_unixfs.h"
 #include "core/test_ping.h"
 #include "core/test_null.h"
@@ -35,8 +45,21 @@ int testit(const char* name, int (*func)(void)) {
 
 const char* names[] = {
 		"test_bitswap_new_free",
+		"test_bitswap_protobuf_payload",
+		"test_bitswap_verify_block",
+		"test_bitswap_verify_queue",
 		"test_bitswap_peer_request_queue_new",
+		"test_bitswap_peer_request_queue_fair",
+		"test_bitswap_peer_request_queue_find",
+		"test_bitswap_peer_request_coalesce",
+		"test_bitswap_peer_request_not_here",
+		"test_bitswap_wantlist_queue",
+		"test_bitswap_session",
+		"test_bitswap_session_provider_delay",
 		"test_bitswap_retrieve_file",
+		"test_bitswap_retrieve_blocks",
+		"test_bitswap_get_block_wait",
+		"test_bitswap_retrieve_blocks_arrive",
 		"test_bitswap_retrieve_file_known_remote",
 		"test_bitswap_retrieve_file_remote",
 		"test_bitswap_retrieve_file_third_party",
@@ -56,14 +79,35 @@ const char* names[] = {
 		"test_get_init_command",
 		"test_import_small_file",
 		"test_import_large_file",
+		"test_import_deep_file",
+		"test_import_parallel_file",
+		"test_import_parallel_directory",
+		"test_import_ranged_read",
+		"test_import_ranged_read_fetches",
+		"test_chunker_spec_parse",
+		"test_chunker_content_defined",
+		"test_export_pipeline",
 		"test_repo_fsrepo_open_config",
 		"test_flatfs_get_directory",
 		"test_flatfs_get_filename",
 		"test_flatfs_get_full_filename",
+		"test_flatfs_shard_directory",
+		"test_flatfs_reshard",
 		"test_ds_key_from_binary",
 		"test_blocks_new",
+		"test_block_cache_scan",
+		"test_blockstore_filter",
+		"test_blockstore_filter_shared",
+		"test_pack_store",
+		"test_pack_store_torn",
+		"test_pack_store_segments",
+		"test_block_view_node",
+		"test_blockstore_sync",
+		"test_blockstore_scrub",
 		"test_repo_bootstrap_peers_init",
 		"test_ipfs_datastore_put",
+		"test_ipfs_datastore_get_view",
+		"test_ipfs_datastore_batch",
 		"test_node",
 		"test_node_link_encode_decode",
 		"test_node_encode_decode",
@@ -73,6 +117,9 @@ const char* names[] = {
 		"test_merkledag_add_node",
 		"test_merkledag_add_node_with_links",
 		"test_resolver_get",
+		"test_routing_peer_times",
+		"test_routing_provider_query",
+		"test_routing_provider_query_late",
 		"test_routing_find_peer",
 		"test_routing_provide" /*,
 		"test_routing_find_providers",
@@ -84,15 +131,30 @@ const char* names[] = {
 		"test_unixfs_encode_smallfile",
 		"test_ping",
 		"test_ping_remote",
+		"test_null_frames_burst",
 		"test_null_add_provider",
+		"test_null_many_connections",
 		"test_resolver_remote_get"
 		*/
 };
 
 int (*funcs[])(void) = {
 		test_bitswap_new_free,
+		test_bitswap_protobuf_payload,
+		test_bitswap_verify_block,
+		test_bitswap_verify_queue,
 		test_bitswap_peer_request_queue_new,
+		test_bitswap_peer_request_queue_fair,
+		test_bitswap_peer_request_queue_find,
+		test_bitswap_peer_request_coalesce,
+		test_bitswap_peer_request_not_here,
+		test_bitswap_wantlist_queue,
+		test_bitswap_session,
+		test_bitswap_session_provider_delay,
 		test_bitswap_retrieve_file,
+		test_bitswap_retrieve_blocks,
+		test_bitswap_get_block_wait,
+		test_bitswap_retrieve_blocks_arrive,
 		test_bitswap_retrieve_file_known_remote,
 		test_bitswap_retrieve_file_remote,
 		test_bitswap_retrieve_file_third_party,
@@ -112,14 +174,35 @@ int (*funcs[])(void) = {
 		test_get_init_command,
 		test_import_small_file,
 		test_import_large_file,
+		test_import_deep_file,
+		test_import_parallel_file,
+		test_import_parallel_directory,
+		test_import_ranged_read,
+		test_import_ranged_read_fetches,
+		test_chunker_spec_parse,
+		test_chunker_content_defined,
+		test_export_pipeline,
 		test_repo_fsrepo_open_config,
 		test_flatfs_get_directory,
 		test_flatfs_get_filename,
 		test_flatfs_get_full_filename,
+		test_flatfs_shard_directory,
+		test_flatfs_reshard,
 		test_ds_key_from_binary,
 		test_blocks_new,
+		test_block_cache_scan,
+		test_blockstore_filter,
+		test_blockstore_filter_shared,
+		test_pack_store,
+		test_pack_store_torn,
+		test_pack_store_segments,
+		test_block_view_node,
+		test_blockstore_sync,
+		test_blockstore_scrub,
 		test_repo_bootstrap_peers_init,
 		test_ipfs_datastore_put,
+		test_ipfs_datastore_get_view,
+		test_ipfs_datastore_batch,
 		test_node,
 		test_node_link_encode_decode,
 		test_node_encode_decode,
@@ -129,6 +212,9 @@ int (*funcs[])(void) = {
 		test_merkledag_add_node,
 		test_merkledag_add_node_with_links,
 		test_resolver_get,
+		test_routing_peer_times,
+		test_routing_provider_query,
+		test_routing_provider_query_late,
 		test_routing_find_peer,
 		test_routing_provide /*,
 		test_routing_find_providers,
@@ -141,7 +227,9 @@ int (*funcs[])(void) = {
 		test_unixfs_encode_smallfile,
 		test_ping,
 		test_ping_remote,
+		test_null_frames_burst,
 		test_null_add_provider,
+		test_null_many_connections,
 		test_resolver_remote_get
 		*/
 };
@@ -86,6 +86,20 @@ int ipfs_unixfs_remove_blocksize(struct UnixFS* obj, struct UnixFSBlockSizeNode*
 	return 1;
 }
 
+/***
+ * Free a UnixFS struct from ipfs_unixfs_protobuf_decode_view. Its bytes are left alone.
+ * @param obj the struct to free
+ * @returns true(1)
+ */
+int ipfs_unixfs_view_free(struct UnixFS* obj) {
+	if (obj != NULL) {
+		// the bytes belong to the array the object was decoded from
+		obj->bytes = NULL;
+		obj->bytes_size = 0;
+	}
+	return ipfs_unixfs_free(obj);
+}
+
 int ipfs_unixfs_free(struct UnixFS* obj) {
 	if (obj != NULL) {
 		if (obj->hash != NULL) {
@@ -241,7 +255,7 @@ int ipfs_unixfs_protobuf_encode(const struct UnixFS* incoming, unsigned char* ou
  * @param incoming_size the length of the array
  * @param outgoing the UnixFS object
  */
-int ipfs_unixfs_protobuf_decode(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing) {
+int ipfs_unixfs_protobuf_decode_internal(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing, int borrow) {
 	// short cut for nulls
 	if (incoming_size == 0) {
 		*outgoing = NULL;
@@ -270,6 +284,16 @@ int ipfs_unixfs_protobuf_decode(unsigned char* incoming, size_t incoming_size, s
 				pos += bytes_read;
 				break;
 			case (2): // bytes (length delimited)
+				if (borrow) {
+					// point into the buffer rather than copying it
+					size_t bytes_size = varint_decode(&incoming[pos], incoming_size - pos, &bytes_read);
+					if (bytes_read == 0 || bytes_size > incoming_size - pos - bytes_read)
+						return 0;
+					result->bytes = &incoming[pos + bytes_read];
+					result->bytes_size = bytes_size;
+					pos += bytes_read + bytes_size;
+					break;
+				}
 				retVal = protobuf_decode_length_delimited(&incoming[pos], incoming_size - pos, (char**)&(result->bytes), &(result->bytes_size), &bytes_read);
 				if (retVal == 0)
 					return 0;
@@ -293,3 +317,26 @@ int ipfs_unixfs_protobuf_decode(unsigned char* incoming, size_t incoming_size, s
 
 	return 1;
 }
+
+/***
+ * Decodes a protobuf array of bytes into a UnixFS object
+ * @param incoming the array of bytes
+ * @param incoming_size the length of the array
+ * @param outgoing the UnixFS object
+ */
+int ipfs_unixfs_protobuf_decode(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing) {
+	return ipfs_unixfs_protobuf_decode_internal(incoming, incoming_size, outgoing, 0);
+}
+
+/***
+ * Decodes a protobuf array of bytes into a UnixFS object, with its bytes
+ * pointing into the array rather than copied
+ * NOTE: the array must outlive the object, which is freed with ipfs_unixfs_view_free
+ * @param incoming the array of bytes
+ * @param incoming_size the length of the array
+ * @param outgoing the UnixFS object
+ * @returns true(1) on success
+ */
+int ipfs_unixfs_protobuf_decode_view(unsigned char* incoming, size_t incoming_size, struct UnixFS** outgoing) {
+	return ipfs_unixfs_protobuf_decode_internal(incoming, incoming_size, outgoing, 1);
+}